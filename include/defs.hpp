@@ -22,7 +22,22 @@ enum class ControlType {RE, IM, LAB};
 /* Linear solver */
 enum class LinearSolverType{
   GMRES,   // uses Petsc's GMRES solver
-  NEUMANN   // uses Neuman power iterations 
+  NEUMANN,  // uses Neuman power iterations 
+  NEUMANN_MIXED  // Neumann iterations in single precision, with iterative refinement in double precision
+};
+
+/* Initial guess of the GMRES solver for the stage of a time step */
+enum class InitialGuessType{
+  ZERO,         // Start from zero
+  PREVIOUS,     // Start from the stage of the previous time step
+  EXTRAPOLATE   // Linear extrapolation from the stages of the previous two time steps
+};
+
+/* Time-stepping scheme */
+enum class TimeStepperType{
+  IMPLMIDPOINT,  // Implicit midpoint rule, 2nd order, one linear solve per time step
+  CFMAGNUS4,     // Commutator-free Magnus integrator, 4th order, two Krylov matrix exponentials per time step
+  LAWSON         // Implicit midpoint rule in integrating factor form, 2nd order, the diagonal drift is propagated exactly
 };
 
 /* Solver run type */
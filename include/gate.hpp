@@ -24,9 +24,8 @@ class Gate {
     std::vector<double> gate_rot_freq; /* Frequencies of gate rotation (rad/time). Often same as rotational frequencies. */
 
   private:
-    Mat VxV_re, VxV_im;     /* Real and imaginary part of vectorized Gate G=\bar V \kron V */
-    Vec x;                  /* auxiliary */
-    IS isu, isv;            /* Vector strides for accessing real and imaginary part of the state */
+    Mat VxV;                /* Vectorized Gate G=\bar V \kron V, stored in 2x2 blocks [Re(G) -Im(G); Im(G) Re(G)] per complex entry */
+    Mat Vfull;              /* Full-dimension gate V (not vectorized), same 2x2 blocks, for state vectors of Schroedinger's equation */
 
   public:
     Gate();
@@ -35,10 +34,11 @@ class Gate {
 
     int getDimRho() { return dim_rho; };
 
-    /* Assemble VxV_re = Re(\bar V \kron V) and VxV_im = Im(\bar V \kron V) */
+    /* Assemble the 2x2-block vectorized gate VxV = \bar V \kron V */
     void assembleGate();
 
-    /* apply the gate transformation  VrhoV =  V \rho V^\dagger. The output vector VrhoV must be allocated! */
+    /* apply the gate transformation  VrhoV =  V \rho V^\dagger. The output vector VrhoV must be allocated! 
+     * If the state is a vector psi of Schroedinger's equation (size 2N), this applies V psi instead. */
     void applyGate(const Vec state, Vec VrhoV);
 };
 
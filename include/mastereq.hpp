@@ -3,29 +3,72 @@
 #include "util.hpp"
 #include <petscts.h>
 #include <vector>
+#include <algorithm>
 #include <assert.h>
 #include <iostream> 
 #include "gate.hpp"
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #pragma once
 
 
+/* CSR matrix with a coefficient slot per entry, as it is assembled row by row, see storeCSR() */
+typedef struct {
+  std::vector<int> rowptr;     // Row pointers, local rows
+  std::vector<int> col;        // Global column indices
+  std::vector<int> slot;       // Coefficient slot of each entry
+  std::vector<double> val;     // Values of each entry
+} CSRBuffer;
+
+/* Sparse-matrix solver: constant building blocks of the RHS fused into one CSR matrix over the locally owned rows. Each entry carries the slot of its coefficient. 
+ * The arrays are read-only once stored (except for remapping the columns with parallel Petsc). They either live in mem, or in an MPI-3 shared-memory window that all processes of a node with the same rows read from. */
+typedef struct {
+  int nrows = 0;               // Number of local rows
+  int* rowptr = NULL;          // Row pointers, local rows
+  int* col = NULL;             // Column indices: global, or into the local copy of x with parallel Petsc (see MasterEq::initHalo)
+  int* slot = NULL;            // Coefficient slot of each entry
+  double* val = NULL;          // Values of each entry
+  std::vector<char> mem;       // Storage of the arrays, if not shared
+  MPI_Win win = MPI_WIN_NULL;  // Shared-memory window holding the arrays, if shared
+} FusedCSR;
+
+/* Sparse-matrix solver: one Kronecker-structured term of a time-varying building block (control or Jaynes-Cummings coupling), applied on the fly: 
+ *   y[it] += val(i_k, i_l) * x[it + shift], 
+ * where i_k, i_l are the levels of oscillators k and l in the row index i of rho (or in the column index i', if primed), and the column index is the row index with the levels shifted by dk, dl. 
+ * Only the small table of values per level is stored, instead of an assembled N^2 x N^2 matrix. */
+typedef struct {
+  int slot;                  // Coefficient slot, see sparsemat_getCoeffs()
+  bool primed;               // Acts on the column index i' of rho, otherwise on the row index i
+  int k, l;                  // Oscillators, l = -1 for single-oscillator terms
+  int dk, dl;                // Level shifts (-1, 0, +1) of the column
+  int shift;                 // Column offset in the vectorized density matrix
+  int xshift;                // Column offset in the local copy of x: shift, or remapped into the halo buffer with parallel Petsc
+  int nl;                    // Number of levels of oscillator l (1 if l = -1)
+  std::vector<double> val;   // Value per level combination, val[i_k * nl + i_l]. Zero where the shifted levels are out of range.
+} KronTerm;
+
 /* Define a matshell context containing pointers to data needed for applying the RHS matrix to a vector */
 typedef struct {
   std::vector<int> nlevels;
-  IS *isu, *isv;
   Oscillator** oscil_vec;
   std::vector<double> crosskerr;
   std::vector<double> Jkl;
   std::vector<double> eta;
   bool addT1, addT2;
   std::vector<double> control_Re, control_Im;
-  Mat** Ac_vec;
-  Mat** Bc_vec;
   Mat *Ad, *Bd;
-  Mat** Ad_vec;
-  Mat** Bd_vec;
-  Vec *aux;
+  FusedCSR *fused, *fusedT;        // Fused constant building blocks of RHS and RHS^T (sparse-matrix solver)
+  std::vector<KronTerm> *kron, *kronT;  // Kronecker terms of the time-varying building blocks of RHS and RHS^T (sparse-matrix solver)
+  std::vector<double> diag;        // Time-independent diagonal of RHS, see matfree_getDiag() (matrix-free solvers)
+  std::vector<double> diag_params; // Oscillator parameters the diagonal was computed from
   double time;
+  int ilow, iupp;                  // Locally owned rows (complex vector index) of the matrix-free solver
+  VecScatter* halo;                // Scatter for the remote x entries needed by the local rows, if Petsc runs in parallel (NULL otherwise)
+  Vec* xhalo;                      // Remote x entries, in the order of halo_idx
+  std::vector<int> halo_idx;       // Global (complex) indices of the remote x entries, sorted
+  int nbelow;                      // Number of remote x entries below the local rows
+  std::vector<double> xloc;        // Local copy of x: the owned entries and the remote ones needed by the local rows, sorted by global index
 } MatShellCtx;
 
 
@@ -38,8 +81,20 @@ int myMatMult_matfree_4Osc(Mat RHS, Vec x, Vec y);              // Matrix free s
 int myMatMultTranspose_matfree_4Osc(Mat RHS, Vec x, Vec y);
 int myMatMult_matfree_5Osc(Mat RHS, Vec x, Vec y);              // Matrix free solver for 5 oscillators 
 int myMatMultTranspose_matfree_5Osc(Mat RHS, Vec x, Vec y);
+int myMatMult_matfree_simd(Mat RHS, Vec x, Vec y);              // Vectorized matrix free solver for any number of oscillators (runs over the last oscillator)
+int myMatMultTranspose_matfree_simd(Mat RHS, Vec x, Vec y);
+int myMatMult_matfree_mpi(Mat RHS, Vec x, Vec y);               // Matrix free solver for parallel Petsc: local rows after a halo exchange
+int myMatMultTranspose_matfree_mpi(Mat RHS, Vec x, Vec y);
+bool matfree_isSpecialized(const std::vector<int>& nlevels);   // True if a compile-time kernel exists for these levels (see MATFREE_LEVELS in the Makefile)
 int myMatMult_sparsemat(Mat RHS, Vec x, Vec y);                 // Sparse matrix solver
 int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y);
+int myMatGetDiagonal(Mat RHS, Vec d);                           // Diagonal of the RHS of Lindblad's equation in full storage (matrix-free or sparse-matrix solver), for Jacobi preconditioning
+int myMatMult_matfree_packed(Mat RHS, Vec x, Vec y);            // Matrix free solver on the upper triangle of rho (Hermitian storage)
+int myMatMultTranspose_matfree_packed(Mat RHS, Vec x, Vec y);
+int myMatMult_batch(Mat RHS, Vec x, Vec y);                     // Batched multi-vector apply of the Lindblad RHS (sparse-matrix solver), see MasterEq::initBatch
+int myMatMultTranspose_batch(Mat RHS, Vec x, Vec y);
+int myMatMult_schroedinger(Mat RHS, Vec x, Vec y);              // Matrix free solver for Schroedinger's equation, state vector psi instead of rho
+int myMatMultTranspose_schroedinger(Mat RHS, Vec x, Vec y);
 
 
 /* 
@@ -48,20 +103,21 @@ int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y);
 class MasterEq{
 
   protected:
-    int dim;                   // Dimension of full vectorized system = N^2
+    int dim;                   // Dimension of full vectorized system = N^2, or N for Schroedinger's equation
     int dim_rho;               // Dimension of full system = N
     int dim_ess;               // Dimension of system of essential levels = N_e
     int noscillators;          // Number of oscillators
     Oscillator** oscil_vec;    // Vector storing pointers to the oscillators
 
     Mat RHS;                // Realvalued, vectorized systemmatrix (2N^2 x 2N^2)
+    Mat RHS_batch;          // Block-diagonal RHS acting on nbatch states at once (2N^2 nbatch x 2N^2 nbatch), or NULL
     MatShellCtx RHSctx;     // MatShell context that contains data needed to apply the RHS
 
-    Mat* Ac_vec;  // Vector of constant mats for time-varying control term (real)
-    Mat* Bc_vec;  // Vector of constant mats for time-varying control term (imag)
     Mat  Ad, Bd;  // Real and imaginary part of constant system matrix
-    Mat* Ad_vec;  // Vector of constant mats for Jaynes-Cummings coupling term in drift Hamiltonian (real)
-    Mat* Bd_vec;  // Vector of constant mats for Jaynes-Cummings coupling term in drift Hamiltonian (imag)
+    FusedCSR RHSfused;   // Ad and Bd in one CSR matrix, with coefficient slots
+    FusedCSR RHSfusedT;  // Same for the transpose
+    std::vector<KronTerm> RHSkron;   // Time-varying control terms Ac_k, Bc_k and Jaynes-Cummings coupling terms Ad_kl, Bd_kl, in Kronecker form
+    std::vector<KronTerm> RHSkronT;  // Same for the transpose
 
     std::vector<double> crosskerr;    // Cross ker coefficients (rad/time) $\xi_{kl} for zz-coupling ak^d ak al^d al
     std::vector<double> Jkl;          // Jaynes-Cummings coupling coefficient (rad/time), multiplies ak^d al + ak al^d
@@ -71,12 +127,14 @@ class MasterEq{
     /* Auxiliary stuff */
     int mpirank_petsc;   // Rank of Petsc's communicator
     int mpirank_world;   // Rank of global communicator
+    MPI_Comm comm_shared; // Processes on this node with the same Petsc rank, that share the constant operator storage (MPI_COMM_NULL: no sharing)
+    int mpirank_shared;  // Rank in comm_shared, the process with rank 0 assembles the shared storage
     int nparams_max;     // Maximum number of design parameters per oscilator 
-    IS isu, isv;         // Vector strides for accessing u=Re(x), v=Im(x) 
+    VecScatter halo;     // Halo exchange for the matrix-free solver with parallel Petsc
+    Vec xhalo;           // Remote entries received by the halo exchange
 
     double *dRedp;
     double *dImdp;
-    Vec aux;              // auxiliary vector 
     PetscInt* cols;           // holding columns when evaluating dRHSdp
     PetscScalar* vals;   // holding values when evaluating dRHSdp
  
@@ -84,24 +142,42 @@ class MasterEq{
     std::vector<int> nlevels;  // Number of levels per oscillator
     std::vector<int> nessential; // Number of essential levels per oscillator
     bool usematfree;  // Flag for using matrix free solver
+    bool schroedinger;  // Flag for solving Schroedinger's equation for the state vector psi instead of Lindblad's equation for rho
+    bool hermitian_storage;  // Flag for propagating only the upper triangle of the Hermitian rho, N(N+1)/2 elements instead of N^2
+    int nbatch;  // Number of initial conditions that are propagated together as one multi-vector (1: no batching)
 
   public:
     MasterEq();
-    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_);
+    MasterEq(std::vector<int> nlevels, std::vector<int> nessential, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype_, bool usematfree_, bool schroedinger_, bool hermitian_storage_, bool shared_operators_);
     ~MasterEq();
 
     /* initialize matrices needed for applying sparse-mat solver */
     void initSparseMatSolver();
 
+    /* Fuse the constant building blocks of the sparse-mat solver into one CSR matrix, and set up the transposed Kronecker terms, for applying the RHS in one pass */
+    void initFusedSparseMat();
+
+    /* Initialize the halo exchange for the sparse-matrix solver with parallel Petsc, and remap the columns into the local copy of x */
+    void initSparseMatHalo();
+
+    /* Initialize the halo exchange for the matrix-free solver with parallel Petsc */
+    void initMatfreeHalo();
+
+    /* Set up the scatter of the remote entries halo_idx (sorted) of x into the local copy of x */
+    void initHalo(const std::vector<int>& halo_idx);
+
     /* Return the i-th oscillator */
     Oscillator* getOscillator(const int i);
 
     /* Return number of oscillators */
     int getNOscillators();
 
-    /* Return dimension of vectorized system N^2 */
+    /* Return dimension of vectorized system N^2 (N for Schroedinger's equation) */
     int getDim();
 
+    /* Return dimension of the propagated state vector: N^2, N(N+1)/2 with Hermitian storage, or N for Schroedinger's equation */
+    int getDimState();
+
     /* Return dimension of essential level system: N_e */
     int getDimEss();
     
@@ -114,9 +190,27 @@ class MasterEq{
      */
     int assemble_RHS(const double t);
 
+    /* Set up the weighted mean of the RHS at two times, (w1 RHS(t1) + w2 RHS(t2)) / (w1 + w2). The RHS is affine in the control values, so this takes the weighted mean of the controls. 
+     * Returns false, without changing the RHS, if a Jaynes-Cummings coupling in the rotating frame makes the RHS time-dependent beyond the controls. */
+    bool assemble_RHS_mean(const double t1, const double w1, const double t2, const double w2);
+
     /* Access the right-hand-side matrix */
     Mat getRHS();
 
+    /* Time-independent diagonal of the RHS (drift Hamiltonian, decay and dephasing) on the locally owned elements i of the state, RHS_ii x_i = (d[2i] + i d[2i+1]) x_i in complex form.
+     * Lindblad's equation in full storage only. */
+    const double* getDiagonal();
+
+    /* Batched time stepping: Create RHS_batch, which applies the RHS to nbatch states stored as a dense multi-vector with entry i of state b at 2*i*nbatch + b (real part) and 2*i*nbatch + nbatch + b (imaginary part), see setBatchColumn. 
+     * Each row of RHS (or RHS^T, for the adjoint) is applied to all states at once. Sparse-matrix solver (usematfree = false), Lindblad's equation in full storage and serial Petsc only. */
+    void initBatch(const int nbatch_);
+
+    /* Access the batched right-hand-side matrix */
+    Mat getRHS_batch();
+
+    /* Apply the right-hand-side matrix (or its transpose) to a single-precision vector in the same interleaved layout, y = RHS x. Serial Petsc only. */
+    void applyRHS_single(const float* x, float* y, const bool transpose);
+
     /* 
      * Compute gradient of RHS wrt control parameters:
      * grad += alpha * RHS(x)^T * x_bar  
@@ -131,122 +225,104 @@ class MasterEq{
     /* Set the oscillators control function parameters from global design vector x */
     void setControlAmplitudes(const Vec x);
 
+    /* Monte Carlo wavefunction method and low-rank solver: jump rates ||L_j psi||^2 of the collapse operators L_2k = sqrt(gamma1_k) a_k (decay) and L_2k+1 = sqrt(gamma2_k) a_k^d a_k (dephasing) of each oscillator k */
+    void getCollapseRates(const Vec psi, std::vector<double>& rates);
+
+    /* Monte Carlo wavefunction method and low-rank solver: apply the collapse operator psi = L_j psi, see getCollapseRates. Does not normalize psi. */
+    void applyCollapse(Vec psi, const int j);
+
+    /* Hermitian storage: Pack the Hermitian part of the vectorized rho into its upper triangle x, element (i,j), i<=j, is stored at j(j+1)/2 + i. Serial Petsc only. */
+    void packHermitian(const Vec rho, Vec x);
+
+    /* Hermitian storage: Unpack the upper triangle x into the full vectorized rho, rho_ji = conj(rho_ij) */
+    void unpackHermitian(const Vec x, Vec rho);
+
+    /* Hermitian storage: Derivative of unpackHermitian, xbar += d rho / d x ^T rhobar */
+    void unpackHermitian_diff(const Vec rhobar, Vec xbar);
+
     /* Set initial conditions 
      * In:   iinit -- index in processors range [rank * ninit_local .. (rank+1) * ninit_local - 1]
      *       ninit -- number of initial conditions 
      *       initcond_type -- type of initial condition (pure, fromfile, diagona, basis)
      *       oscilIDs -- ID of oscillators defining the subsystem for the initial conditions  
      * Out: initID -- Idenifyier for this initial condition: Element number in matrix vectorization. 
-     *       rho0 -- Vector for setting initial condition 
+     *       rho0 -- Vector for setting initial condition. For Schroedinger's equation, this is the state vector psi0 with rho(0) = psi0 psi0^\dagger.
      */
     int getRhoT0(const int iinit, const int ninit, const InitialConditionType initcond_type, const std::vector<int>& oscilIDs, Vec rho0);
 
 };
 
 
-// Mat-free solver inlines for 2 oscillator
-inline double H_detune(const double detuning0, const double detuning1, const int a, const int b) {
-  return detuning0*a + detuning1*b;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const int a, const int b) {
-  return - xi0 / 2.0 * a * (a-1) - xi1 / 2.0 * b * (b-1);
-};
-inline double H_crosskerr(const double xi01, const int a, const int b) {
-  return - xi01 * a * b;
-};
-inline double L2(const double dephase0, const double dephase1, const int i0, const int i1, const int i0p, const int i1p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) );
-};
-inline double L1diag(const double decay0, const double decay1, const int i0, const int i1, const int i0p, const int i1p){
-  return - decay0 / 2.0 * ( i0 + i0p ) - decay1 / 2.0 * ( i1 + i1p );
-};
+// Mat-free solver inline for 2 oscillator
 inline int TensorGetIndex(const int nlevels0, const int nlevels1,const  int i0, const int i1, const int i0p, const int i1p){
   return i0*nlevels1 + i1 + (nlevels0 * nlevels1) * ( i0p * nlevels1 + i1p);
 };
 
 
-// Matfree solver inlines for 3 oscillator
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const int i0, const int i1, const int i2) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const int i0, const int i1, const int i2) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi12, const int i0, const int i1, const int i2) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2 - xi12 * i1 * i2;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p );
-};
+// Matfree solver inline for 3 oscillator
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const  int i0, const int i1, const int i2, const int i0p, const int i1p, const int i2p){
   return i0*nlevels1*nlevels2 + i1*nlevels2 + i2 + (nlevels0 * nlevels1 * nlevels2) * ( i0p * nlevels1*nlevels2 + i1p*nlevels2 + i2p);
 };
 
 
-// Matfree solver inlines for 4 oscillators
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const double detuning3, const int i0, const int i1, const int i2, const int i3) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2 + detuning3*i3;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const double xi3, const int i0, const int i1, const int i2, const int i3) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1) - xi3/2.0 * i3 * (i3-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi03, const double xi12, const double xi13, const double xi23, const int i0, const int i1, const int i2, const int i3) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2  - xi03*i0*i3 - xi12 * i1 * i2 - xi13*i1*i3 - xi23*i2*i3;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const double dephase3, const int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) )
-       + dephase3 * ( i3*i3p - 1./2. * (i3*i3 + i3p*i3p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const double decay3, const int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p )
-         - decay3 / 2.0 * ( i3 + i3p );
-};
+// Matfree solver inline for 4 oscillators
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const int nlevels3, const  int i0, const int i1, const int i2, const int i3, const int i0p, const int i1p, const int i2p, const int i3p){
   return i0*nlevels1*nlevels2*nlevels3 + i1*nlevels2*nlevels3 + i2*nlevels3 + i3 + (nlevels0 * nlevels1 * nlevels2 * nlevels3) * ( i0p * nlevels1*nlevels2*nlevels3 + i1p*nlevels2*nlevels3 + i2p*nlevels3 + i3p);
 }
 
-// Matfree solver inlines for 5 oscillators
-inline double H_detune(const double detuning0, const double detuning1, const double detuning2, const double detuning3, const double detuning4, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return detuning0*i0 + detuning1*i1 + detuning2*i2 + detuning3*i3 + detuning4*i4;
-};
-inline double H_selfkerr(const double xi0, const double xi1, const double xi2, const double xi3, const double xi4, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return - xi0 / 2.0 * i0 * (i0-1) - xi1 / 2.0 * i1 * (i1-1) - xi2 / 2.0 * i2 * (i2-1) - xi3/2.0 * i3 * (i3-1) - xi4/2.0 * i4 * (i4-1);
-};
-inline double H_crosskerr(const double xi01, const double xi02, const double xi03, const double xi04, const double xi12, const double xi13, const double xi14, const double xi23, const double xi24, const double xi34, const int i0, const int i1, const int i2, const int i3, const int i4) {
-  return - xi01 * i0 * i1 - xi02 * i0 * i2  - xi03*i0*i3 - xi04*i0*i4 - xi12 * i1 * i2 - xi13*i1*i3 - xi14*i1*i4 - xi23*i2*i3 - xi24*i2*i4 - xi34*i3*i4;
-};
-inline double L2(const double dephase0, const double dephase1, const double dephase2, const double dephase3, const double dephase4, const int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
-  return dephase0 * ( i0*i0p - 1./2. * (i0*i0 + i0p*i0p) ) 
-       + dephase1 * ( i1*i1p - 1./2. * (i1*i1 + i1p*i1p) )
-       + dephase2 * ( i2*i2p - 1./2. * (i2*i2 + i2p*i2p) )
-       + dephase3 * ( i3*i3p - 1./2. * (i3*i3 + i3p*i3p) )
-       + dephase4 * ( i3*i3p - 1./2. * (i4*i4 + i4p*i4p) );
-};
-inline double L1diag(const double decay0, const double decay1, const double decay2, const double decay3, const double decay4, const int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
-  return - decay0 / 2.0 * ( i0 + i0p ) 
-         - decay1 / 2.0 * ( i1 + i1p )
-         - decay2 / 2.0 * ( i2 + i2p )
-         - decay3 / 2.0 * ( i3 + i3p )
-         - decay4 / 2.0 * ( i4 + i4p );
-};
+// Matfree solver inline for 5 oscillators
 inline int TensorGetIndex(const int nlevels0, const int nlevels1, const int nlevels2, const int nlevels3, const int nlevels4, const  int i0, const int i1, const int i2, const int i3, const int i4, const int i0p, const int i1p, const int i2p, const int i3p, const int i4p){
   return i0*nlevels1*nlevels2*nlevels3*nlevels4 + i1*nlevels2*nlevels3*nlevels4 + i2*nlevels3*nlevels4 + i3*nlevels4 + i4 + (nlevels0 * nlevels1 * nlevels2 * nlevels3*nlevels4) * ( i0p * nlevels1*nlevels2*nlevels3*nlevels4 + i1p*nlevels2*nlevels3*nlevels4 + i2p*nlevels3*nlevels4+ i3p*nlevels4 + i4p);
 }
 
+// Matfree solver inline for any number of oscillators: Advance the tensor index (i0,...,i_{Q-1}, i0',...,i_{Q-1}') to the next element in the vectorized density matrix. i_{Q-1} runs fastest, i0' slowest.
+inline void TensorIncrementIndex(const int noscillators, const int* nlevels, int* i, int* ip){
+  int k = noscillators-1;
+  while (k >= 0 && ++i[k] == nlevels[k]) {
+    i[k] = 0;
+    k--;
+  }
+  if (k >= 0) return;
+  k = noscillators-1;
+  while (k >= 0 && ++ip[k] == nlevels[k]) {
+    ip[k] = 0;
+    k--;
+  }
+}
 
-// Mat-free solver inline for gradient updates for oscillator i
-inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
+// Matfree solver inline for Hermitian storage: Get element (r,c) of rho from its upper triangle, where rho_rc = conj(rho_cr) for r > c. Off-diagonal elements are scaled by woff.
+template <typename T>
+inline void hermGet(const T* xptr, const int r, const int c, const double woff, double* xre, double* xim){
+  if (r == c) {
+    int itx = c*(c+1)/2 + r;
+    *xre = xptr[2 * itx];
+    *xim = 0.0;
+  } else if (r < c) {
+    int itx = c*(c+1)/2 + r;
+    *xre = woff * xptr[2 * itx];
+    *xim = woff * xptr[2 * itx + 1];
+  } else {
+    int itx = r*(r+1)/2 + c;
+    *xre =   woff * xptr[2 * itx];
+    *xim = - woff * xptr[2 * itx + 1];
+  }
+}
+
+// Matfree solver inline for any number of oscillators: Set the tensor index (i0,...,i_{Q-1}, i0',...,i_{Q-1}') of element it in the vectorized density matrix.
+inline void TensorSetIndex(const int noscillators, const int* nlevels, int it, int* i, int* ip){
+  for (int k = noscillators-1; k >= 0; k--) {
+    i[k] = it % nlevels[k];
+    it /= nlevels[k];
+  }
+  for (int k = noscillators-1; k >= 0; k--) {
+    ip[k] = it % nlevels[k];
+    it /= nlevels[k];
+  }
+}
+
+
+// Mat-free solver inline for gradient updates for oscillator i, reading x at it + offi, it + offim, it + offip, it + offipm for ik+1, ik-1, ik'+1, ik'-1
+inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int ip, const int offi, const int offim, const int offip, const int offipm, const double* xptr, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
 
   *res_p_re = 0.0;
   *res_p_im = 0.0;
@@ -255,7 +331,7 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
 
   /* ik+1..,ik'.. term */
   if (i < n-1) {
-    int itx = it + stridei;
+    int itx = it + offi;
     double xre = xptr[2 * itx];
     double xim = xptr[2 * itx + 1];
     double sq = sqrt(i + 1);
@@ -266,7 +342,7 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   }
   /* \rho(ik..,ik'+1..) */
   if (ip < n-1) {
-    int itx = it + strideip;
+    int itx = it + offip;
     double xre = xptr[2 * itx];
     double xim = xptr[2 * itx + 1];
     double sq = sqrt(ip + 1);
@@ -277,7 +353,7 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   }
   /* \rho(ik-1..,ik'..) */
   if (i > 0) {
-    int itx = it - stridei;
+    int itx = it + offim;
     double xre = xptr[2 * itx];
     double xim = xptr[2 * itx + 1];
     double sq = sqrt(i);
@@ -288,7 +364,7 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   }
   /* \rho(ik..,ik'-1..) */
   if (ip > 0) {
-    int itx = it - strideip;
+    int itx = it + offipm;
     double xre = xptr[2 * itx];
     double xim = xptr[2 * itx + 1];
     double sq = sqrt(ip);
@@ -299,6 +375,11 @@ inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int i
   }
 }
 
+// Same, for the strides of oscillator i in the vectorized density matrix
+inline void dRHSdp_getcoeffs(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, double* res_p_re, double* res_p_im, double* res_q_re, double* res_q_im) {
+  dRHSdp_getcoeffs(it, n, i, ip, stridei, -stridei, strideip, -strideip, xptr, res_p_re, res_p_im, res_q_re, res_q_im);
+}
+
 // Mat-free solver inline for Jkl coupling between oscillator i and oscillator j
 inline void Jkl_coupling(const int it, const int ni, const int nj, const int i, const int ip, const int j, const int jp, const int stridei, const int strideip, const int stridej, const int stridejp, const double* xptr, const double Jij, const double cosij, const double sinij, double* yre, double* yim) {
   if (fabs(Jij)>1e-10) {
@@ -404,7 +485,7 @@ inline void L1decay(const int it, const int n, const int i, const int ip, const
 
 
 // Transpose of offdiagonal L1decay
-inline void L1decay_T(const int it, const int n, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double decayi, double* yre, double* yim){
+inline void L1decay_T(const int it, const int i, const int ip, const int stridei, const int strideip, const double* xptr, const double decayi, double* yre, double* yim){
   if (fabs(decayi) > 1e-12) {
       if (i > 0 && ip > 0) {
         double l1off = decayi * sqrt(i*ip);
@@ -496,4 +577,244 @@ inline void control_T(const int it, const int n, const int i, const int ip, cons
     *yre += sq * (+ pt * xim - qt * xre);
     *yim += sq * (- pt * xre - qt * xim);
   }
-}
\ No newline at end of file
+}
+
+
+// Vectorized matfree solver inlines: complex arithmetic on runs of n interleaved (re,im) elements. 
+// Use AVX-512 / AVX2 if the compiler targets it (see SIMD option in the Makefile), scalar loop for the remainder.
+// y[j] = d[j] * x[j]
+inline void cvec_mult(const int n, const double* d, const double* x, double* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  for (; j+4 <= n; j+=4) {
+    __m512d xv = _mm512_loadu_pd(x + 2*j);
+    __m512d dv = _mm512_loadu_pd(d + 2*j);
+    __m512d dre = _mm512_movedup_pd(dv);
+    __m512d dim = _mm512_permute_pd(dv, 0xFF);
+    __m512d xswap = _mm512_permute_pd(xv, 0x55);
+    _mm512_storeu_pd(y + 2*j, _mm512_fmaddsub_pd(dre, xv, _mm512_mul_pd(dim, xswap)));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  for (; j+2 <= n; j+=2) {
+    __m256d xv = _mm256_loadu_pd(x + 2*j);
+    __m256d dv = _mm256_loadu_pd(d + 2*j);
+    __m256d dre = _mm256_movedup_pd(dv);
+    __m256d dim = _mm256_permute_pd(dv, 0xF);
+    __m256d xswap = _mm256_permute_pd(xv, 0x5);
+    _mm256_storeu_pd(y + 2*j, _mm256_fmaddsub_pd(dre, xv, _mm256_mul_pd(dim, xswap)));
+  }
+#endif
+  for (; j < n; j++) {
+    double xre = x[2*j];
+    double xim = x[2*j+1];
+    y[2*j]   = d[2*j] * xre - d[2*j+1] * xim;
+    y[2*j+1] = d[2*j] * xim + d[2*j+1] * xre;
+  }
+}
+// y[j] = conj(d[j]) * x[j]
+inline void cvec_mult_conj(const int n, const double* d, const double* x, double* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  for (; j+4 <= n; j+=4) {
+    __m512d xv = _mm512_loadu_pd(x + 2*j);
+    __m512d dv = _mm512_loadu_pd(d + 2*j);
+    __m512d dre = _mm512_movedup_pd(dv);
+    __m512d dim = _mm512_permute_pd(dv, 0xFF);
+    __m512d xswap = _mm512_permute_pd(xv, 0x55);
+    _mm512_storeu_pd(y + 2*j, _mm512_fmsubadd_pd(dre, xv, _mm512_mul_pd(dim, xswap)));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  for (; j+2 <= n; j+=2) {
+    __m256d xv = _mm256_loadu_pd(x + 2*j);
+    __m256d dv = _mm256_loadu_pd(d + 2*j);
+    __m256d dre = _mm256_movedup_pd(dv);
+    __m256d dim = _mm256_permute_pd(dv, 0xF);
+    __m256d xswap = _mm256_permute_pd(xv, 0x5);
+    _mm256_storeu_pd(y + 2*j, _mm256_fmsubadd_pd(dre, xv, _mm256_mul_pd(dim, xswap)));
+  }
+#endif
+  for (; j < n; j++) {
+    double xre = x[2*j];
+    double xim = x[2*j+1];
+    y[2*j]   = d[2*j] * xre + d[2*j+1] * xim;
+    y[2*j+1] = d[2*j] * xim - d[2*j+1] * xre;
+  }
+}
+// y[j] += z * x[j] for complex scalar z = zre + i zim
+inline void cvec_axpy(const int n, const double zre, const double zim, const double* x, double* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  __m512d zre8 = _mm512_set1_pd(zre);
+  __m512d zim8 = _mm512_set_pd(zim, -zim, zim, -zim, zim, -zim, zim, -zim);
+  for (; j+4 <= n; j+=4) {
+    __m512d xv = _mm512_loadu_pd(x + 2*j);
+    __m512d yv = _mm512_loadu_pd(y + 2*j);
+    yv = _mm512_fmadd_pd(zre8, xv, yv);
+    yv = _mm512_fmadd_pd(zim8, _mm512_permute_pd(xv, 0x55), yv);
+    _mm512_storeu_pd(y + 2*j, yv);
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256d zre4 = _mm256_set1_pd(zre);
+  __m256d zim4 = _mm256_set_pd(zim, -zim, zim, -zim);
+  for (; j+2 <= n; j+=2) {
+    __m256d xv = _mm256_loadu_pd(x + 2*j);
+    __m256d yv = _mm256_loadu_pd(y + 2*j);
+    yv = _mm256_fmadd_pd(zre4, xv, yv);
+    yv = _mm256_fmadd_pd(zim4, _mm256_permute_pd(xv, 0x5), yv);
+    _mm256_storeu_pd(y + 2*j, yv);
+  }
+#endif
+  for (; j < n; j++) {
+    double xre = x[2*j];
+    double xim = x[2*j+1];
+    y[2*j]   += zre * xre - zim * xim;
+    y[2*j+1] += zre * xim + zim * xre;
+  }
+}
+// y[j] += c[j] * z * x[j] for real c[j] and complex scalar z = zre + i zim
+inline void cvec_axpy_scaled(const int n, const double* c, const double zre, const double zim, const double* x, double* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  __m512d zre8 = _mm512_set1_pd(zre);
+  __m512d zim8 = _mm512_set_pd(zim, -zim, zim, -zim, zim, -zim, zim, -zim);
+  __m512i dup  = _mm512_set_epi64(3, 3, 2, 2, 1, 1, 0, 0);
+  for (; j+4 <= n; j+=4) {
+    __m512d cv = _mm512_permutexvar_pd(dup, _mm512_castpd256_pd512(_mm256_loadu_pd(c + j)));
+    __m512d xv = _mm512_mul_pd(cv, _mm512_loadu_pd(x + 2*j));
+    __m512d yv = _mm512_loadu_pd(y + 2*j);
+    yv = _mm512_fmadd_pd(zre8, xv, yv);
+    yv = _mm512_fmadd_pd(zim8, _mm512_permute_pd(xv, 0x55), yv);
+    _mm512_storeu_pd(y + 2*j, yv);
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256d zre4 = _mm256_set1_pd(zre);
+  __m256d zim4 = _mm256_set_pd(zim, -zim, zim, -zim);
+  for (; j+2 <= n; j+=2) {
+    __m256d cv = _mm256_permute4x64_pd(_mm256_castpd128_pd256(_mm_loadu_pd(c + j)), 0x50);
+    __m256d xv = _mm256_mul_pd(cv, _mm256_loadu_pd(x + 2*j));
+    __m256d yv = _mm256_loadu_pd(y + 2*j);
+    yv = _mm256_fmadd_pd(zre4, xv, yv);
+    yv = _mm256_fmadd_pd(zim4, _mm256_permute_pd(xv, 0x5), yv);
+    _mm256_storeu_pd(y + 2*j, yv);
+  }
+#endif
+  for (; j < n; j++) {
+    double xre = c[j] * x[2*j];
+    double xim = c[j] * x[2*j+1];
+    y[2*j]   += zre * xre - zim * xim;
+    y[2*j+1] += zre * xim + zim * xre;
+  }
+}
+// Single-precision versions of the above, for the mixed-precision linear solver
+inline void cvec_mult(const int n, const float* d, const float* x, float* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  for (; j+8 <= n; j+=8) {
+    __m512 xv = _mm512_loadu_ps(x + 2*j);
+    __m512 dv = _mm512_loadu_ps(d + 2*j);
+    __m512 xswap = _mm512_permute_ps(xv, 0xB1);
+    _mm512_storeu_ps(y + 2*j, _mm512_fmaddsub_ps(_mm512_moveldup_ps(dv), xv, _mm512_mul_ps(_mm512_movehdup_ps(dv), xswap)));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  for (; j+4 <= n; j+=4) {
+    __m256 xv = _mm256_loadu_ps(x + 2*j);
+    __m256 dv = _mm256_loadu_ps(d + 2*j);
+    __m256 xswap = _mm256_permute_ps(xv, 0xB1);
+    _mm256_storeu_ps(y + 2*j, _mm256_fmaddsub_ps(_mm256_moveldup_ps(dv), xv, _mm256_mul_ps(_mm256_movehdup_ps(dv), xswap)));
+  }
+#endif
+  for (; j < n; j++) {
+    float xre = x[2*j];
+    float xim = x[2*j+1];
+    y[2*j]   = d[2*j] * xre - d[2*j+1] * xim;
+    y[2*j+1] = d[2*j] * xim + d[2*j+1] * xre;
+  }
+}
+inline void cvec_mult_conj(const int n, const float* d, const float* x, float* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  for (; j+8 <= n; j+=8) {
+    __m512 xv = _mm512_loadu_ps(x + 2*j);
+    __m512 dv = _mm512_loadu_ps(d + 2*j);
+    __m512 xswap = _mm512_permute_ps(xv, 0xB1);
+    _mm512_storeu_ps(y + 2*j, _mm512_fmsubadd_ps(_mm512_moveldup_ps(dv), xv, _mm512_mul_ps(_mm512_movehdup_ps(dv), xswap)));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  for (; j+4 <= n; j+=4) {
+    __m256 xv = _mm256_loadu_ps(x + 2*j);
+    __m256 dv = _mm256_loadu_ps(d + 2*j);
+    __m256 xswap = _mm256_permute_ps(xv, 0xB1);
+    _mm256_storeu_ps(y + 2*j, _mm256_fmsubadd_ps(_mm256_moveldup_ps(dv), xv, _mm256_mul_ps(_mm256_movehdup_ps(dv), xswap)));
+  }
+#endif
+  for (; j < n; j++) {
+    float xre = x[2*j];
+    float xim = x[2*j+1];
+    y[2*j]   = d[2*j] * xre + d[2*j+1] * xim;
+    y[2*j+1] = d[2*j] * xim - d[2*j+1] * xre;
+  }
+}
+inline void cvec_axpy(const int n, const float zre, const float zim, const float* x, float* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  __m512 zre16 = _mm512_set1_ps(zre);
+  __m512 zim16 = _mm512_set1_ps(zim);
+  for (; j+8 <= n; j+=8) {
+    __m512 xv = _mm512_loadu_ps(x + 2*j);
+    __m512 zx = _mm512_fmaddsub_ps(zre16, xv, _mm512_mul_ps(zim16, _mm512_permute_ps(xv, 0xB1)));
+    _mm512_storeu_ps(y + 2*j, _mm512_add_ps(_mm512_loadu_ps(y + 2*j), zx));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 zre8 = _mm256_set1_ps(zre);
+  __m256 zim8 = _mm256_set1_ps(zim);
+  for (; j+4 <= n; j+=4) {
+    __m256 xv = _mm256_loadu_ps(x + 2*j);
+    __m256 zx = _mm256_fmaddsub_ps(zre8, xv, _mm256_mul_ps(zim8, _mm256_permute_ps(xv, 0xB1)));
+    _mm256_storeu_ps(y + 2*j, _mm256_add_ps(_mm256_loadu_ps(y + 2*j), zx));
+  }
+#endif
+  for (; j < n; j++) {
+    float xre = x[2*j];
+    float xim = x[2*j+1];
+    y[2*j]   += zre * xre - zim * xim;
+    y[2*j+1] += zre * xim + zim * xre;
+  }
+}
+inline void cvec_axpy_scaled(const int n, const float* c, const float zre, const float zim, const float* x, float* y){
+  int j = 0;
+#if defined(__AVX512F__)
+  __m512 zre16 = _mm512_set1_ps(zre);
+  __m512 zim16 = _mm512_set1_ps(zim);
+  __m512i dup16 = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1, 0, 0);
+  for (; j+8 <= n; j+=8) {
+    __m512 cv = _mm512_permutexvar_ps(dup16, _mm512_castps256_ps512(_mm256_loadu_ps(c + j)));
+    __m512 xv = _mm512_mul_ps(cv, _mm512_loadu_ps(x + 2*j));
+    __m512 zx = _mm512_fmaddsub_ps(zre16, xv, _mm512_mul_ps(zim16, _mm512_permute_ps(xv, 0xB1)));
+    _mm512_storeu_ps(y + 2*j, _mm512_add_ps(_mm512_loadu_ps(y + 2*j), zx));
+  }
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 zre8 = _mm256_set1_ps(zre);
+  __m256 zim8 = _mm256_set1_ps(zim);
+  __m256i dup8 = _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0);
+  for (; j+4 <= n; j+=4) {
+    __m256 cv = _mm256_permutevar8x32_ps(_mm256_castps128_ps256(_mm_loadu_ps(c + j)), dup8);
+    __m256 xv = _mm256_mul_ps(cv, _mm256_loadu_ps(x + 2*j));
+    __m256 zx = _mm256_fmaddsub_ps(zre8, xv, _mm256_mul_ps(zim8, _mm256_permute_ps(xv, 0xB1)));
+    _mm256_storeu_ps(y + 2*j, _mm256_add_ps(_mm256_loadu_ps(y + 2*j), zx));
+  }
+#endif
+  for (; j < n; j++) {
+    float xre = c[j] * x[2*j];
+    float xim = c[j] * x[2*j+1];
+    y[2*j]   += zre * xre - zim * xim;
+    y[2*j+1] += zre * xim + zim * xre;
+  }
+}
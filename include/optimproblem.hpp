@@ -22,6 +22,7 @@ class OptimProblem {
   int ninit_local;                      /* Local number of initial conditions on this processor */
   Vec rho_t0;                            /* Storage for initial condition of the ODE */
   Vec rho_t0_bar;                        /* Adjoint of ODE initial condition */
+  std::vector<Vec> factor_t0;            /* Low-rank solver: columns of the factor of the ensemble initial condition */
   InitialConditionType initcond_type;    /* Type of initial conditions */
   std::vector<int> initcond_IDs;         /* Integer list for pure-state initialization */
 
@@ -46,6 +47,7 @@ class OptimProblem {
   double gamma_tik;                /* Parameter for tikhonov regularization */
   double gamma_penalty;            /* Parameter multiplying integral penalty term */
   double penalty_param;            /* Parameter inside integral penalty term w(t) (Gaussian variance) */
+  bool basis_symmetry;             /* Basis initial conditions: reconstruct the basis elements from the unit matrices E_kj, k<=j, if possible */
   double gatol;                    /* Stopping criterion based on absolute gradient norm */
   double grtol;                    /* Stopping criterion based on relative gradient norm */
   int maxiter;                     /* Stopping criterion based on maximum number of iterations */
@@ -53,6 +55,13 @@ class OptimProblem {
   std::string initguess_type;      /* Type of initial guess */
   std::vector<double> initguess_amplitudes; /* Initial amplitudes of controles, or NULL */
   double* mygrad;  /* Auxiliary */
+
+  /* Basis initial conditions: Returns true if basis_symmetry is set and the trajectories of the basis elements can be reconstructed from those of the unit matrices E_kj, k<=j (serial, no penalty term, uniform time steps if data files are written) */
+  bool useBasisSymmetry();
+  /* Basis initial conditions: Propagates the unit matrices E_kj, k<=j, and adds the final-time cost and fidelity of all basis elements to obj_cost and fidelity. If G != NULL, also adds their gradient to G. Data files of the basis elements are reconstructed from the unit matrices at each output time step. */
+  void evalBasisSymmetric(Vec G);
+  /* Batched time stepping: Propagates the initial conditions in groups of mastereq->nbatch, and adds their final-time cost, fidelity and penalty to obj_cost, fidelity and obj_penal. If G != NULL, also solves their adjoint equations together and adds their gradient to G. */
+  void evalBatch(Vec G);
   
   public: 
     Output* output;                 /* Store a reference to the output */
@@ -12,13 +12,18 @@ class OptimTarget{
     std::string target_filename;   /* If a target is read from file, this holds it's filename. */
     Vec targetstate;   	           /* Holds the target state (unless its a pure one in which case this is NULL). 
                                       If target is a gate, this holds the transformed state VrhoV^\dagger.
-                                      If target is read from file, this holds the target density matrix from that file. */
+                                      If target is read from file, this holds the target density matrix from that file. 
+                                      For Schroedinger's equation, this holds the target state vector phi, either V psi(0) or e_m. */
+    Vec targetstate_i;             /* For Schroedinger's equation: i*phi, for the imaginary part of the overlap phi^\dagger psi */
+    bool schroedinger;             /* Flag for Schroedinger's equation: states are vectors psi, with rho = psi psi^\dagger */
 
     Vec aux;      /* auxiliary vector needed when computing the objective for gate optimization */
 
+    std::vector<Vec> batchtargets;  /* Batched propagation: prepared target states (and i*phi) of the batch members, two per slot */
+
   public:
 
-    OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_);
+    OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_, bool schroedinger_);
     ~OptimTarget();
 
     /* Get information on the type of optimization target */
@@ -27,6 +32,9 @@ class OptimTarget{
     /* If gate optimization, this routine prepares the rotated target state VrhoV for a given initial state rho */
     void prepare(const Vec rho);
 
+    /* Batched propagation: swap the prepared target state with the one stored in the given slot (allocated on first use). Swapping twice restores it. Only gate targets depend on the initial state, otherwise this does nothing. */
+    void swapTargetState(int slot);
+
     /* Evaluate the objective J */
     /* Note that J depends on the target state which itself can depend on the initial state. Therefor, the targetstate should be computed within 'prepare' routine! */
     double evalJ(const Vec state);
@@ -34,6 +42,10 @@ class OptimTarget{
     /* Evaluate the fidelity Tr(rhotarget^\dagger rho) */
     double evalFidelity(const Vec state);
 
+    /* Low-rank solver: objective and fidelity of rho = sum_c v_c v_c^\dagger, given the columns v_c of its factor (Schroedinger's equation only) */
+    double evalJ_lowrank(const std::vector<Vec>& factor);
+    double evalFidelity_lowrank(const std::vector<Vec>& factor);
+
     /* Derivative of evalJ. This updates the adjoint initial condition statebar */
     void evalJ_diff(const Vec state, Vec statebar, const double Jbar);
 
@@ -44,5 +56,9 @@ class OptimTarget{
     /* Hilber-Schmidt overlap Tr(targetstate^\dagger * state), potentially scaled by purity of targetstate */
     double HilbertSchmidtOverlap(const Vec state, bool scalebypurity);
     void HilbertSchmidtOverlap_diff(const Vec state, Vec statebar, const double Jbar, bool scalebypurity);
+
+    /* Schroedinger's equation: squared overlap |phi^\dagger psi|^2 = Tr(targetstate^\dagger rho) of the state vector psi with the target state vector phi */
+    double Overlap(const Vec state);
+    void Overlap_diff(const Vec state, Vec statebar, const double Jbar);
 };
 
@@ -23,6 +23,10 @@ class Output{
   FILE *vfile;          /* File for writing imaginary part of solution vector */
   std::vector<FILE *>expectedfile;    /* Files for writing expected energy levels over time */
   std::vector<FILE *>populationfile;  /* Files for writing population over time */
+  FILE *lowrankfile;    /* File for writing rank and truncation error of the low-rank solver over time */
+  std::vector<std::vector<FILE *> > batchfiles;     /* Batched time stepping: data files of the initial conditions in each slot of the batch, see swapDataFiles */
+  std::vector<std::vector<double> > expected_sum;    /* Monte Carlo wavefunction method: sum of expected energy levels over quantum trajectories, per oscillator and output time step */
+  std::vector<std::vector<double> > population_sum;  /* Monte Carlo wavefunction method: sum of populations over quantum trajectories, per oscillator and output time step (times nlevels) */
 
   // VecScatter scat;    /* Petsc's scatter context to communicate a state across petsc's cores */
   // Vec xseq;           /* A sequential vector for IO. */
@@ -31,6 +35,15 @@ class Output{
     std::string datadir;
     int optim_iter;       /* Current optimization iteration */
     int optim_monitor_freq; /* Write output files every <num> optimization iterations */
+    bool writelowrank;    /* Flag to determine if the low-rank solver's rank and truncation error are written to file, set in main */
+
+    /* Basis symmetry, see OptimProblem::evalBasisSymmetric: If capture is set, writeDataFiles stores a copy of each state at an output time step, together with its time step index and time. 
+     * If nofiles is set, openDataFiles opens no files. */
+    bool capture;
+    bool nofiles;
+    std::vector<int> captured_steps;
+    std::vector<double> captured_times;
+    std::vector<Vec> captured_states;
 
   public:
     Output();
@@ -47,9 +60,26 @@ class Output{
     /* Write gradient for adjoint mode */
     void writeGradient(Vec grad);
 
+    /* Return true if data files are written in the current optimization iteration, i.e. every <optim_monitor_freq> iterations */
+    bool writeThisIter();
+
     /* Open, write and close files for fullstate and expected energy levels over time */
     void openDataFiles(std::string prefix, int initid);
     void writeDataFiles(int timestep, double time, const Vec state, MasterEq* mastereq);
     void closeDataFiles();
 
+    /* Batched time stepping: exchange the opened data files with those parked in the given slot. This keeps the data files of several initial conditions open at once. */
+    void swapDataFiles(int slot);
+
+    /* Write the full state only, see writeDataFiles */
+    void writeFullState(int timestep, double time, const Vec state, MasterEq* mastereq);
+
+    /* Monte Carlo wavefunction method: add expected energy levels and populations of one quantum trajectory, scaled by weight. 
+     * Their average over the ntraj trajectories on all processors of comm, at the output time steps up to ntime, is then written to the opened data files. Processors without a trajectory take part with zero sums. */
+    void addToDataFiles(int timestep, const Vec state, MasterEq* mastereq, double weight);
+    void writeAveragedDataFiles(MasterEq* mastereq, int ntime, double dt, int ntraj, MPI_Comm comm);
+
+    /* Low-rank solver: write the rank of the factor and the accumulated truncation error */
+    void writeLowRank(int timestep, double time, int rank, double truncerr);
+
 };
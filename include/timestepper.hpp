@@ -17,6 +17,13 @@ class TimeStepper{
     Vec x;               // auxiliary vector needed for time stepping
     bool storeFWD;       /* Flag that determines if primal states should be stored during forward evaluation */
     std::vector<Vec> store_states; /* Storage for primal states */
+    Vec xfull, xfull_bar;           /* Full density matrix and its adjoint at output and objective evaluations, if the state holds the upper triangle of rho (Hermitian storage) */
+    Vec xbatch;                     /* Batched time stepping: multi-vector of mastereq->nbatch states, see MasterEq::initBatch */
+    Vec xcol;                       /* Batched time stepping: auxiliary single state, one column of a multi-vector */
+    std::vector<Vec> store_batch;   /* Batched time stepping: storage for the primal multi-vectors, if storeFWD */
+    int order;                      /* Order of accuracy of the scheme, for the error estimate of adaptive time stepping */
+    std::vector<double> tgrid;      /* Adaptive time stepping: accepted time points of the last forward solve, replayed by the adjoint */
+    Vec xstep, xhalf, xend;         /* Adaptive time stepping: states after one full step, and after the first and second half step. Allocated on first use. */
 
   public:
     MasterEq* mastereq;  // Lindblad master equation
@@ -33,6 +40,24 @@ class TimeStepper{
     double gamma_penalty;
     OptimTarget* optim_target;
 
+    /* Monte Carlo wavefunction method, set in main */
+    int mcwf_ntrajectories;         // Number of quantum trajectories per initial condition, 0 if not used
+    MPI_Comm comm_mcwf;             // Communicator for distributing the trajectories
+
+    /* Low-rank solver, set in main */
+    int lowrank_maxrank;            // Maximum rank of the factor V of rho = V V^\dagger, 0 if not used
+    double lowrank_tol;             // Truncation tolerance, relative to the trace of rho
+    int lowrank_rank;               // output, rank of the factor at final time
+    double lowrank_truncerr;        // output, accumulated truncation error (trace norm) over all time steps
+
+    /* Adaptive time stepping, set in main */
+    double adaptive_tol;            // Tolerance of the estimated local error per time step, 0 if not used (uniform steps dt)
+    int adaptive_naccept;           // output, number of accepted steps over all forward solves
+    int adaptive_nreject;           // output, number of rejected steps over all forward solves
+
+    /* Batched time stepping, set in main */
+    bool batch_blockgmres;          // Solve for the stages of all states with block GMRES, instead of GMRES on the stacked system
+
     /* Output */
     Output* output;
 
@@ -43,21 +68,61 @@ class TimeStepper{
 
     /* Return the state at a certain time index */
     Vec getState(int tindex);
+    /* Batched time stepping: Return the multi-vector at a certain time index */
+    Vec getBatchState(int tindex);
+
+    /* Return the full vectorized density matrix of a state, unpacked into xfull with Hermitian storage */
+    Vec getFullState(const Vec state);
 
     /* Solve the ODE forward in time with initial condition rho_t0. Return state at final time step */
     Vec solveODE(int initid, Vec rho_t0);
 
+    /* Adaptive time stepping: Evolve x from 0 to total_time, with the step sizes chosen by step doubling. A step of size h is compared against two steps of size h/2, whose result is taken if the 
+     * estimated error |x_h/2 - x_h| / (2^order - 1) is below adaptive_tol. The half steps are recorded in tgrid, stored and written out like the uniform steps of solveODE. */
+    void solveODE_adaptive();
+
+    /* Batched time stepping: Solve the ODE forward in time for the initial conditions rho_t0[b], b < initids.size() <= mastereq->nbatch, together as one multi-vector. Writes the final states into rhoT[b]. 
+     * penalty_integral is summed over the initial conditions. For the penalty term, the target state of initial condition b must be prepared and parked in slot b of optim_target (swapTargetState). */
+    void solveODE_batch(const std::vector<int>& initids, const std::vector<Vec>& rho_t0, std::vector<Vec>& rhoT);
+
+    /* Monte Carlo wavefunction method: Solve Schroedinger's equation with the effective Hamiltonian and random quantum jumps for mcwf_ntrajectories trajectories from psi_t0. 
+     * Expected energy levels and populations averaged over the trajectories are written to the output files, the final-time cost and fidelity are averaged likewise. */
+    void solveODE_mcwf(int initid, Vec psi_t0, double* objective, double* fidelity);
+
+    /* Low-rank solver: Evolve the factor V of rho = V V^\dagger under Lindblad's equation, where the columns of V are state vectors of Schroedinger's equation, starting from the columns in factor_t0. 
+     * Each time step applies two half steps with the effective Hamiltonian, in between which V is extended by the single and double collapse terms sqrt(dt) L_k V and dt/sqrt(2) L_j L_k V and truncated back to at most lowrank_maxrank columns. 
+     * The collapse terms are formed one channel at a time and appended to their truncated factors right away, so that at most 5 lowrank_maxrank state vectors are stored. 
+     * Expected energy levels and populations of rho are written to the output files, the final-time cost and fidelity are evaluated from the final factor. */
+    void solveODE_lowrank(int initid, const std::vector<Vec>& factor_t0, double* objective, double* fidelity);
+
+    /* Low-rank solver: Truncate rho = W W^\dagger, given by the first ncols columns of W, to its dominant eigenvectors V (scaled by the square root of the eigenvalues) using an eigen-decomposition of W^\dagger W. 
+     * Keeps at most lowrank_maxrank columns, discarding eigenvalues that sum up to at most lowrank_tol * Tr(rho). Returns the number of columns of V and sets the discarded trace truncerr. */
+    int truncateFactor(const std::vector<Vec>& W, const int ncols, std::vector<Vec>& V, double* truncerr);
+
+    /* Low-rank solver: Append the nnew columns W[rank], ..., W[rank+nnew-1] to the factor V of rank columns, and truncate with truncateFactor(). Overwrites the first rank columns of W. 
+     * Adds the discarded trace to truncerr and returns the new number of columns of V. */
+    int appendToFactor(std::vector<Vec>& V, const int rank, std::vector<Vec>& W, const int nnew, double* truncerr);
+
     /* Solve the adjoint ODE backwards in time with terminal condition rho_t0_bar */
     void solveAdjointODE(int initid, Vec rho_t0_bar, double Jbar);
 
+    /* Batched time stepping: Solve the adjoint ODE backwards in time for the initial conditions of the last solveODE_batch together, with terminal conditions rho_t0_bar[b]. 
+     * The reduced gradient is summed over the initial conditions. As in solveODE_batch, the target states must be parked in the slots of optim_target. */
+    void solveAdjointODE_batch(const std::vector<Vec>& rho_t0_bar, double Jbar);
+
     /* evaluate the penalty integral term */
     double penaltyIntegral(double time, const Vec x);
+    double penaltyIntegral_lowrank(double time, const std::vector<Vec>& factor);
     void penaltyIntegral_diff(double time, const Vec x, Vec xbar, double Jbar);
 
     /* Evolve state forward from tstart to tstop */
     virtual void evolveFWD(const double tstart, const double tstop, Vec x) = 0;
     /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
     virtual void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+    /* Evolve the batched multi-vector X forward from tstart to tstop */
+    virtual void evolveFWD_batch(const double tstart, const double tstop, Vec X);
+    /* Evolve the batched adjoint multi-vector X_adj backward from tstop to tstart and add the gradient of all states to grad */
+    virtual void evolveBWD_batch(const double tstart, const double tstop, const Vec X_stop, Vec X_adj, Vec grad);
 };
 
 class ExplEuler : public TimeStepper {
@@ -84,6 +149,11 @@ class ImplMidpoint : public TimeStepper {
   Vec stage, stage_adj;  /* Intermediate stage vars */
   Vec rhs, rhs_adj;      /* right hand side */
   KSP ksp;               /* Petsc's linear solver context for running GMRES */
+  Vec stage_batch, rhs_batch;  /* Stage and right hand side of the batched time stepping */
+  Vec stage_adj_batch;         /* Adjoint stage of the batched time stepping */
+  KSP ksp_batch;               /* GMRES for the stacked system of all states */
+  std::vector<double> krylov_batch;  /* Block GMRES: Krylov basis, column-major (2N^2 x (m+1)nbatch), allocated on first use */
+  Vec krylov_in, krylov_out;         /* Block GMRES: operator input and output, batched layout */
   PC  preconditioner;    /* Preconditioner for linear solver */
   LinearSolverType linsolve_type;  // Either GMRES or NEUMANN
   int linsolve_maxiter;            // Maximum number of linear solver iterations
@@ -93,9 +163,22 @@ class ImplMidpoint : public TimeStepper {
   double linsolve_error_avg;       // Computing the average error of linear solver 
   int linsolve_counter;            // Counting how often a linear solve is performed is called
   Vec tmp, err;                    /* Auxiliary vector for applying the neuman iterations */
+  int linsolve_maxrefine;          // Maximum number of iterative refinement steps of the mixed-precision Neumann solver
+  std::vector<float> rf, yf, tmpf; /* Single-precision residual, correction and auxiliary vector of the mixed-precision Neumann solver */
+  bool linsolve_precond;           // Precondition GMRES with the exact inverse of I - dt/2 D, where D is the time-independent diagonal of the RHS
+  const double* diag;              /* Diagonal D of the RHS, see MasterEq::getDiagonal() */
+  std::vector<double> precond_inv; /* Inverse of I - precond_alpha D on the locally owned elements, interleaved complex */
+  double precond_alpha;            /* alpha of precond_inv */
+  InitialGuessType linsolve_initguess;  // Initial guess of GMRES for the stage
+  Vec guess_hist[2][2];            /* Stages of the previous two time steps, most recent first, for the forward [0] and adjoint [1] solves. Allocated if used. */
+  double guess_time[2][2];         /* Midpoints of these time steps */
+  double guess_tend[2];            /* End of the last time step in its direction of time */
+  int guess_n[2];                  /* Number of stages in the history */
 
   public:
-    ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
+    double stage_alpha;              /* alpha = dt/2 of the current linear system I - alpha A */
+
+    ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, int linsolve_maxrefine_, bool linsolve_precond_, InitialGuessType linsolve_initguess_, Output* output_, bool storeFWD_);
     ~ImplMidpoint();
 
 
@@ -103,11 +186,110 @@ class ImplMidpoint : public TimeStepper {
     void evolveFWD(const double tstart, const double tstop, Vec x);
     /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
     void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+    /* Evolve the batched multi-vector X forward from tstart to tstop. One GMRES solve for the stacked system of all states, or one block GMRES solve if batch_blockgmres. */
+    void evolveFWD_batch(const double tstart, const double tstop, Vec X);
+    /* Evolve the batched adjoint multi-vector backward from tstop to tstart and update the reduced gradient, with the same linear solver as evolveFWD_batch */
+    void evolveBWD_batch(const double tstart, const double tstop, const Vec X_stop, Vec X_adj, Vec grad);
 
     /* Solve (I-alpha*A) * x = b using Neumann iterations */
     // bool transpose=true solves the transposed system (I-alpha A^T)x = b
     // Return residual norm ||y-yprev||
     int NeumannSolve(Mat A, Vec b, Vec x, double alpha, bool transpose);
+
+    /* Solve (I-alpha*A) * x = b by iterative refinement: The residual and the update of x are computed in double precision, 
+     * the correction is computed by Neumann iterations in single precision. Returns the total number of Neumann iterations. */
+    int NeumannSolveMixed(Mat A, Vec b, Vec x, double alpha, bool transpose);
+
+    /* Solve (I-alpha*A) X = B for the nbatch columns of the batched multi-vectors X and B (see setBatchColumn) using restarted block GMRES: 
+     * all columns share one block Krylov space, which grows by nbatch vectors per iteration, with one batched apply of A. Starts from X = 0. Returns the number of block iterations. 
+     * bool transpose=true solves the transposed system (I-alpha A^T) X = B */
+    int BlockGMRESSolve(Mat A, Vec B, Vec X, double alpha, bool transpose);
+
+    /* Diagonal preconditioner: z = (I - stage_alpha D)^{-1} r, or its transpose. Operations of the PCSHELL. */
+    void applyPrecond(const Vec r, Vec z, const bool transpose);
+
+  private:
+    /* Set the initial guess for the stage of the time step from tfrom to tto with midpoint tmid, forward (dir = 0) or adjoint (dir = 1), from the stages of the previous time steps. 
+     * Zero if the previous time step didn't end at tfrom. */
+    void setInitialGuess(const int dir, const double tfrom, const double tmid, Vec guess);
+    /* Append the stage of the time step to tto with midpoint tmid to the history */
+    void storeInitialGuess(const int dir, const double tto, const double tmid, const Vec stage_);
+};
+
+
+/* Implements the commutator-free Magnus integrator of 4th order with two exponentials (Blanes & Moan 2006, Alvermann & Fehske 2011):
+ *   x_{n+1} = exp(dt (a2 A(t1) + a1 A(t2))) exp(dt (a1 A(t1) + a2 A(t2))) x_n,
+ * with the Gauss points t1,2 = t_n + (1/2 -+ sqrt(3)/6) dt and a1,2 = 1/4 +- sqrt(3)/6.
+ * The exponentials are applied to the state by a Krylov (Arnoldi) approximation that only needs the action of RHS, with substeps if the Krylov space doesn't resolve the full step.
+ * The adjoint evaluates the derivative of each exponential by 2-point Gauss quadrature. The gradient is therefore consistent with the discrete objective only up to O(dt^4), it is not the exact discrete adjoint. */
+class CFMagnus4 : public TimeStepper {
+
+  std::vector<Vec> krylov;        /* Arnoldi basis, krylov_maxdim + 1 vectors */
+  std::vector<double> hessenberg; /* Upper Hessenberg matrix of the Arnoldi process, column-major (krylov_maxdim+1 x krylov_maxdim) */
+  Vec xmid, tmp;                  /* State after the first exponential, auxiliary vector */
+  Vec gauss_states[4];            /* Adjoint: states at the Gauss points of the two exponentials */
+  Vec lambda1, lambda2;           /* Adjoint: adjoints at the Gauss points of one exponential */
+  int krylov_maxdim;              /* Maximum dimension of the Krylov space per substep */
+  double krylov_tol;              /* Tolerance of the Krylov approximation, relative to the norm of the state */
+  double t1, c1, t2, c2;          /* Current exponent M = c1 A(t1) + c2 A(t2) */
+  bool combined;                  /* Flag whether the RHS holds the combination of the current exponential, see MasterEq::assemble_RHS_mean() */
+  double tau_sub;                 /* Substep of the last Krylov approximation, initial guess for the next one */
+  int expv_counter;               /* Number of Krylov approximations */
+  int expv_applies;               /* Total number of RHS applies in the Krylov approximations */
+
+  public:
+    CFMagnus4(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, bool storeFWD_);
+    ~CFMagnus4();
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+
+  private:
+    /* Set up the exponent M = c1 A(t1) + c2 A(t2) */
+    void setExponent(const double t1, const double c1, const double t2, const double c2);
+    /* Apply y = M x, or y = M^T x */
+    void applyExponent(const Vec x, Vec y, const bool transpose);
+    /* Krylov approximation of y = exp(tau M) x, or y = exp(tau M^T) x. x and y may be the same vector. Returns the number of applies of M. */
+    int expv(const double tau, const Vec x, Vec y, const bool transpose);
+};
+
+
+/* Implements the implicit midpoint rule in the integrating factor (Lawson) form. 2nd order.
+ * The time-independent diagonal D of the RHS (drift Hamiltonian, decay and dephasing), which carries the fastest frequencies, is propagated exactly, the remainder N(t) = A(t) - D by the implicit midpoint rule:
+ *   x_{n+1} = E (I - dt/2 N(t_n+1/2))^{-1} (I + dt/2 N(t_n+1/2)) E x_n,  with E = exp(dt/2 D).
+ * E is applied with precomputed per-element complex exponentials. The linear systems are solved with GMRES on a MatShell applying I - dt/2 N.
+ * Lindblad's equation in full storage only. */
+class LawsonMidpoint : public TimeStepper {
+
+  Vec stage, stage_adj;  /* Intermediate stage vars */
+  Vec rhs, y;            /* Right hand side, state after the first half step of E */
+  Mat Nop;               /* MatShell applying I - alpha N, or its transpose */
+  KSP ksp;               /* Petsc's linear solver context for running GMRES */
+  const double* diag;    /* Diagonal D of the RHS, see MasterEq::getDiagonal() */
+  std::vector<double> expdiag;  /* Complex exponentials exp(h D) on the locally owned elements, interleaved */
+  double expdiag_h;             /* Step size h of expdiag */
+  int linsolve_iterstaken_avg;  // Computing the average number of linear solver iterations
+  int linsolve_counter;         // Counting how often a linear solve is performed is called
+
+  public:
+    double alpha;        /* Current scaling of the MatShell, I - alpha N */
+
+    LawsonMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, int linsolve_maxiter_, Output* output_, bool storeFWD_);
+    ~LawsonMidpoint();
+
+    /* Evolve state forward from tstart to tstop */
+    void evolveFWD(const double tstart, const double tstop, Vec x);
+    /* Evolve adjoint backward from tstop to tstart and update reduced gradient */
+    void evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient);
+
+    /* Apply yout = shift x + scale N x, or yout = shift x + scale N^T x, with the remainder N = A - D of the currently assembled RHS A. The MatShell Nop applies it with shift 1 and scale -alpha. */
+    void applyRemainder(const Vec x, Vec yout, const bool transpose, const double shift, const double scale);
+
+  private:
+    /* Apply the integrating factor in place, x = exp(h D) x, or x = exp(h D)^T x */
+    void applyExpDiag(const double h, Vec x, const bool transpose);
 };
 
 
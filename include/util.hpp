@@ -17,6 +17,24 @@ int mapEssToFull(const int i, const std::vector<int> &nlevels, const std::vector
 /* Map an index i in full dimension to the corresponding index in essential dimensions */
 int mapFullToEss(const int i, const std::vector<int> &nlevels, const std::vector<int> &nessential);
 
+/* Population rho_ii = |psi_i|^2 of a state vector psi of Schroedinger's equation, if psi_i is in the local range [ilow, iupp) of x, zero otherwise */
+double getPopulation(const Vec x, const int i, const PetscInt ilow, const PetscInt iupp);
+/* Derivative of getPopulation: xbar += popbar * 2 psi_i */
+void getPopulation_diff(const Vec x, Vec xbar, const int i, const PetscInt ilow, const PetscInt iupp, const double popbar);
+
+/* y += alpha X + beta X^\dagger for the vectorized N x N matrix X in x, with complex alpha = are + i aim and beta = bre + i bim. Serial vectors only. */
+void addMatrixAndAdjoint(Vec y, const double are, const double aim, const double bre, const double bim, const Vec x, const int dim);
+
+/* Batched multi-vector X of nbatch states: entry i of state b is stored at 2*i*nbatch + b (real part) and 2*i*nbatch + nbatch + b (imaginary part), i.e. the real and the imaginary parts of one entry are contiguous over the states. Copy state x into column b of X, or column b of X into x. Serial vectors only. */
+void setBatchColumn(Vec X, const int nbatch, const int b, const Vec x);
+void getBatchColumn(const Vec X, const int nbatch, const int b, Vec x);
+
+/* Gram matrix G_cd = v_c^\dagger v_d of the first ncols state vectors in V. G is complex (interleaved real and imaginary parts), stored column-wise */
+void getGramMatrix(const std::vector<Vec>& V, const int ncols, std::vector<double>& G);
+
+/* Eigenvalues (ascending) and eigenvectors of the complex Hermitian n x n matrix A, using Lapack. A is stored as in getGramMatrix and is overwritten by the eigenvectors. Returns Lapack's info. */
+int getEigHermitian(const int n, std::vector<double>& A, std::vector<double>& eigvals);
+
 /* Test if a certain row/column i of the full density matrix corresponds to an essential level */
 int isEssential(const int i, const std::vector<int> &nlevels, const std::vector<int> &nessential);
 
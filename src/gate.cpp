@@ -40,40 +40,42 @@ Gate::Gate(std::vector<int> nlevels_, std::vector<int> nessential_, double time_
   MatAssemblyEnd(V_im, MAT_FINAL_ASSEMBLY);
 
   /* Allocate vectorized Gate in full dimensions G = VxV, where V is the full-dimension gate (inserting zero rows and colums for all non-essential levels) */ 
+  /* G is stored as a real 2N^2 x 2N^2 matrix of 2x2 blocks [re -im; im re] matching the co-located real and imaginary parts of the state, so it applies directly to the state vector. */
   // parallel matrix, essential levels dimension TODO: Preallocate!
-  MatCreate(PETSC_COMM_WORLD, &VxV_re);
-  MatCreate(PETSC_COMM_WORLD, &VxV_im);
-  MatSetSizes(VxV_re, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
-  MatSetSizes(VxV_im, PETSC_DECIDE, PETSC_DECIDE, dim_rho*dim_rho, dim_rho*dim_rho);
-  MatSetUp(VxV_re);
-  MatSetUp(VxV_im);
-  MatAssemblyBegin(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyBegin(VxV_im, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_im, MAT_FINAL_ASSEMBLY);
-
-  /* Allocate auxiliare vectors */
-  MatCreateVecs(VxV_re, &x, NULL);
-
-
-  /* Create vector strides for accessing real and imaginary part of co-located state */
-  PetscInt ilow, iupp;
-  MatGetOwnershipRange(VxV_re, &ilow, &iupp);
-  PetscInt dimis = iupp - ilow;
-  ISCreateStride(PETSC_COMM_WORLD, dimis, 2*ilow, 2, &isu);
-  ISCreateStride(PETSC_COMM_WORLD, dimis, 2*ilow+1, 2, &isv);
- 
+  MatCreate(PETSC_COMM_WORLD, &VxV);
+  MatSetSizes(VxV, PETSC_DECIDE, PETSC_DECIDE, 2*dim_rho*dim_rho, 2*dim_rho*dim_rho);
+  MatSetType(VxV, MATBAIJ);
+  MatSetBlockSize(VxV, 2);
+  MatSetUp(VxV);
+  MatAssemblyBegin(VxV, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(VxV, MAT_FINAL_ASSEMBLY);
+
+  /* Allocate the full-dimension gate V, for applying it to state vectors */
+  MatCreate(PETSC_COMM_WORLD, &Vfull);
+  MatSetSizes(Vfull, PETSC_DECIDE, PETSC_DECIDE, 2*dim_rho, 2*dim_rho);
+  MatSetType(Vfull, MATBAIJ);
+  MatSetBlockSize(Vfull, 2);
+  MatSetUp(Vfull);
+  MatAssemblyBegin(Vfull, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(Vfull, MAT_FINAL_ASSEMBLY);
 }
 
 Gate::~Gate(){
   if (dim_rho == 0) return;
-  MatDestroy(&VxV_re);
-  MatDestroy(&VxV_im);
+  MatDestroy(&VxV);
+  MatDestroy(&Vfull);
   MatDestroy(&V_re);
   MatDestroy(&V_im);
-  VecDestroy(&x);
-  ISDestroy(&isu);
-  ISDestroy(&isv);
+}
+
+/* Set real or imaginary part of the complex entry G[row,col] inside its 2x2 block */
+static void setGateRe(Mat G, PetscInt row, PetscInt col, double val) {
+  MatSetValue(G, 2*row,   2*col,   val, INSERT_VALUES);
+  MatSetValue(G, 2*row+1, 2*col+1, val, INSERT_VALUES);
+}
+static void setGateIm(Mat G, PetscInt row, PetscInt col, double val) {
+  MatSetValue(G, 2*row,   2*col+1, -val, INSERT_VALUES);
+  MatSetValue(G, 2*row+1, 2*col,    val, INSERT_VALUES);
 }
 
 void Gate::assembleGate(){
@@ -139,7 +141,9 @@ void Gate::assembleGate(){
   /* Assemble vectorized gate G=V\kron V where V = PV_eP^T for essential dimension gate V_e (user input) and projection P lifting V_e to the full dimension by inserting identity blocks for non-essential levels. */
   // Each element in V\kron V is a product V(i,j)*V(r,c), for rows and columns i,j,r,c!
   PetscInt ilow, iupp;
-  MatGetOwnershipRange(VxV_re, &ilow, &iupp);
+  MatGetOwnershipRange(VxV, &ilow, &iupp);
+  ilow /= 2;
+  iupp /= 2;
   double val;
   double vre_ij, vim_ij;
   double vre_rc, vim_rc;
@@ -169,16 +173,16 @@ void Gate::assembleGate(){
                   MatGetValues(V_re, 1, &re, 1, &ce, &vre_rc);
                   MatGetValues(V_im, 1, &re, 1, &ce, &vim_rc);
                   val = vre_ij*vre_rc + vim_ij*vim_rc;
-                  if (fabs(val) > 1e-14) MatSetValue(VxV_re, rowout, colout, val, INSERT_VALUES);
+                  if (fabs(val) > 1e-14) setGateRe(VxV, rowout, colout, val);
                   val = vre_ij*vim_rc - vim_ij*vre_rc;
-                  if (fabs(val) > 1e-14) MatSetValue(VxV_im, rowout, colout, val, INSERT_VALUES);
+                  if (fabs(val) > 1e-14) setGateIm(VxV, rowout, colout, val);
                 }  
               } else { // place ve_ij*1.0 at G[a+row, a+row]
               PetscInt colout = b + r;
                   val = vre_ij;
-                  if (fabs(val) > 1e-14) MatSetValue(VxV_re, rowout, colout, val, INSERT_VALUES);
+                  if (fabs(val) > 1e-14) setGateRe(VxV, rowout, colout, val);
                   val = vim_rc;
-                  if (fabs(val) > 1e-14) MatSetValue(VxV_im, rowout, colout, val, INSERT_VALUES);
+                  if (fabs(val) > 1e-14) setGateIm(VxV, rowout, colout, val);
               }              
             }
           }
@@ -198,24 +202,42 @@ void Gate::assembleGate(){
               MatGetValues(V_re, 1, &re, 1, &ce, &vre_rc);
               MatGetValues(V_im, 1, &re, 1, &ce, &vim_rc);
               val = vre_rc;
-              if (fabs(val) > 1e-14) MatSetValue(VxV_re, rowout, colout, val, INSERT_VALUES);
+              if (fabs(val) > 1e-14) setGateRe(VxV, rowout, colout, val);
               val = vim_rc;
-              if (fabs(val) > 1e-14) MatSetValue(VxV_im, rowout, colout, val, INSERT_VALUES);
+              if (fabs(val) > 1e-14) setGateIm(VxV, rowout, colout, val);
             }  
           } else { // place 1.0 at G[a+r, a+r]
               PetscInt colout = a + r;
               val = 1.0;
-              if (fabs(val) > 1e-14) MatSetValue(VxV_re, rowout, colout, val, INSERT_VALUES);
+              if (fabs(val) > 1e-14) setGateRe(VxV, rowout, colout, val);
           }              
         }
       }
     }
   }
 
-  MatAssemblyBegin(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_re, MAT_FINAL_ASSEMBLY);
-  MatAssemblyBegin(VxV_im, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(VxV_im, MAT_FINAL_ASSEMBLY);
+  MatAssemblyBegin(VxV, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(VxV, MAT_FINAL_ASSEMBLY);
+
+  /* Assemble the full-dimension gate V = PV_eP^T, with identity for non-essential levels */
+  MatGetOwnershipRange(Vfull, &ilow, &iupp);
+  ilow /= 2;
+  iupp /= 2;
+  for (PetscInt row_f=ilow; row_f<iupp; row_f++) {
+    if (isEssential(row_f, nlevels, nessential)) {
+      PetscInt row_e = mapFullToEss(row_f, nlevels, nessential);
+      for (PetscInt col_e=0; col_e<dim_ess; col_e++) {
+        PetscInt col_f = mapEssToFull(col_e, nlevels, nessential);
+        vre_ij = 0.0; vim_ij = 0.0;
+        MatGetValues(V_re, 1, &row_e, 1, &col_e, &vre_ij);
+        MatGetValues(V_im, 1, &row_e, 1, &col_e, &vim_ij);
+        if (fabs(vre_ij) > 1e-14) setGateRe(Vfull, row_f, col_f, vre_ij);
+        if (fabs(vim_ij) > 1e-14) setGateIm(Vfull, row_f, col_f, vim_ij);
+      }
+    } else setGateRe(Vfull, row_f, row_f, 1.0);
+  }
+  MatAssemblyBegin(Vfull, MAT_FINAL_ASSEMBLY);
+  MatAssemblyEnd(Vfull, MAT_FINAL_ASSEMBLY);
 
 }
 
@@ -225,25 +247,11 @@ void Gate::applyGate(const Vec state, Vec VrhoV){
   /* Exit, if this is a dummy gate */
   if (dim_rho == 0) return;
 
-  /* Get real and imag part of the state q = u + iv */
-  Vec u, v;
-  VecGetSubVector(state, isu, &u);
-  VecGetSubVector(state, isv, &v);
-
-  /* (a) Real part Re(VxV q) = VxV_re u - VxV_im v */
-  MatMult(VxV_im, v, x);            // 
-  VecScale(x, -1.0);                // x = -VxV_im * v 
-  MatMultAdd(VxV_re, u, x, x);      // x += VxV_re * u
-  VecISCopy(VrhoV, isu, SCATTER_FORWARD, x); 
-
-  /* (b) Imaginary part Im(VxV q) = VxV_re v + VxV_im u */
-  MatMult(VxV_re, v, x);            // x  = VxV_re * v
-  MatMultAdd(VxV_im, u, x, x);      // x += VxV_im * u
-  VecISCopy(VrhoV, isv, SCATTER_FORWARD, x); 
-
-  /* Restore state from index set */
-  VecRestoreSubVector(state, isu, &u);
-  VecRestoreSubVector(state, isv, &v);
+  /* Apply the block gate directly to the co-located state: V psi for a state vector, otherwise the vectorized gate */
+  PetscInt dim;
+  VecGetSize(state, &dim);
+  if (dim == 2*dim_rho) MatMult(Vfull, state, VrhoV);
+  else                  MatMult(VxV, state, VrhoV);
 }
 
 
@@ -13,6 +13,9 @@
 #ifdef WITH_SLEPC
 #include <slepceps.h>
 #endif
+#ifdef WITH_OPENMP
+#include <omp.h>
+#endif
 
 
 #define TEST_FD_GRAD 0    // Run Finite Differences gradient test
@@ -169,8 +172,10 @@ int main(int argc,char **argv)
 #endif
   std::cout<< std::endl;
 
-  /* Initialize Petsc using petsc's communicator */
+  /* Initialize Petsc using petsc's communicator. For the Monte Carlo wavefunction method, its processors instead run independent quantum trajectories with serial Petsc. */
+  int mcwf_ntrajectories = config.GetIntParam("mcwf_ntrajectories", 0);
   PETSC_COMM_WORLD = comm_petsc;
+  if (mcwf_ntrajectories > 0) PETSC_COMM_WORLD = MPI_COMM_SELF;
 #ifdef WITH_SLEPC
   ierr = SlepcInitialize(&argc, &argv, (char*)0, NULL);if (ierr) return ierr;
 #else
@@ -267,17 +272,41 @@ int main(int argc,char **argv)
   int noscillators = nlevels.size();
   for (int i = crosskerr.size(); i < (noscillators-1) * noscillators / 2; i++)  crosskerr.push_back(0.0);
   for (int i = Jkl.size(); i < (noscillators-1) * noscillators / 2; i++) Jkl.push_back(0.0);
-  // Sanity check for matrix free solver
   bool usematfree = config.GetBoolParam("usematfree", false);
-  if ( (usematfree && nlevels.size() < 2) ||   
-       (usematfree && nlevels.size() > 5)   ){
-        printf("Warning: Matrix free solver is only implemented for systems with 2, 3, 4, or 5 oscillators. Switching to sparse-matrix solver now.\n");
-        usematfree = false;
+  // Propagate only the upper triangle of the Hermitian density matrix
+  bool hermitian_storage = config.GetBoolParam("hermitian_storage", false);
+  // Keep one copy per node of the constant operator storage, shared by the processes with the same Petsc rank
+  bool shared_operators = config.GetBoolParam("shared_operators", false);
+#ifdef WITH_BRAID
+  if (hermitian_storage) {
+    printf("\n\n ERROR: Hermitian storage (hermitian_storage = true) is not implemented for XBraid. Compile without Braid.\n");
+    exit(1);
+  }
+#endif
+  // Solve Schroedinger's equation for the state vector instead of Lindblad's equation for the density matrix
+  bool schroedinger = config.GetBoolParam("schroedinger", false);
+  // Low-rank solver: maximum rank of the factor of rho, and relative truncation tolerance
+  int lowrank_maxrank = config.GetIntParam("lowrank_maxrank", 0);
+  double lowrank_tol = config.GetDoubleParam("lowrank_tol", 1e-8);
+  if (schroedinger && lindbladtype != LindbladType::NONE && mcwf_ntrajectories == 0 && lowrank_maxrank == 0) {
+    printf("\n\n ERROR: Schroedinger's equation can include Lindblad collapse operators only with quantum trajectories (mcwf_ntrajectories > 0) or the low-rank solver (lowrank_maxrank > 0). Otherwise set collapse_type = none.\n");
+    exit(1);
+  }
+  if (mcwf_ntrajectories > 0 && (!schroedinger || runtype != RunType::SIMULATION)) {
+    printf("\n\n ERROR: Quantum trajectories (mcwf_ntrajectories > 0) require schroedinger = true and runtype = simulation.\n");
+    exit(1);
   }
-  if (usematfree && mpisize_petsc > 1) {
-    printf("ERROR: No Petsc-parallel version for the matrix free solver available!");
+  if (lowrank_maxrank > 0 && (!schroedinger || runtype != RunType::SIMULATION || mcwf_ntrajectories > 0)) {
+    printf("\n\n ERROR: The low-rank solver (lowrank_maxrank > 0) requires schroedinger = true and runtype = simulation, and can not be combined with quantum trajectories.\n");
     exit(1);
   }
+  // Number of threads for applying the matrix free RHS
+  int matfree_nthreads = config.GetIntParam("matfree_nthreads", 1);
+#ifdef WITH_OPENMP
+  omp_set_num_threads(max(1, matfree_nthreads));
+#else
+  if (matfree_nthreads > 1 && mpirank_world == 0) printf("\n\n WARNING: Compiled without OpenMP (WITH_OPENMP = false in the Makefile), ignoring matfree_nthreads = %d.\n\n", matfree_nthreads);
+#endif
   // Compute coupling rotation frequencies eta_ij = w^r_i - w^r_j
   std::vector<double> eta(nlevels.size()*(nlevels.size()-1)/2.);
   int idx = 0;
@@ -287,7 +316,20 @@ int main(int argc,char **argv)
       idx++;
     }
   }
-  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree);
+  MasterEq* mastereq = new MasterEq(nlevels, nessential, oscil_vec, crosskerr, Jkl, eta, lindbladtype, usematfree, schroedinger, hermitian_storage, shared_operators);
+  // Batched time stepping: number of initial conditions that are propagated together
+  int batch_size = config.GetIntParam("batch_size", 1);
+  if (batch_size > 1 && usematfree) {
+    printf("\n\n ERROR: Batched time stepping (batch_size > 1) is implemented for the sparse-matrix solver only. Set usematfree = false, or batch_size = 1.\n");
+    exit(1);
+  }
+  if (batch_size > 1) {
+#ifdef WITH_BRAID
+    printf("\n\n ERROR: Batched time stepping (batch_size > 1) is not implemented for XBraid. Compile without Braid.\n");
+    exit(1);
+#endif
+    mastereq->initBatch(batch_size);
+  }
 
 
   /* Output */
@@ -296,6 +338,7 @@ int main(int argc,char **argv)
 #else 
   Output* output = new Output(config, comm_petsc, comm_init, noscillators);
 #endif
+  output->writelowrank = (lowrank_maxrank > 0);
 
   // Some screen output 
   if (mpirank_world == 0) {
@@ -318,12 +361,39 @@ int main(int argc,char **argv)
   LinearSolverType linsolvetype;
   std::string linsolvestr = config.GetStrParam("linearsolver_type", "gmres");
   int linsolve_maxiter = config.GetIntParam("linearsolver_maxiter", 10);
+  int linsolve_maxrefine = config.GetIntParam("linearsolver_maxrefine", 5);
+  bool linsolve_precond = config.GetBoolParam("linearsolver_precond", false);
   if      (linsolvestr.compare("gmres")   == 0) linsolvetype = LinearSolverType::GMRES;
   else if (linsolvestr.compare("neumann") == 0) linsolvetype = LinearSolverType::NEUMANN;
+  else if (linsolvestr.compare("neumann_mixed") == 0) linsolvetype = LinearSolverType::NEUMANN_MIXED;
   else {
     printf("\n\n ERROR: Unknown linear solver type: %s.\n\n", linsolvestr.c_str());
     exit(1);
   }
+  if (linsolve_precond && linsolvetype != LinearSolverType::GMRES) {
+    printf("\n\n ERROR: The preconditioner (linearsolver_precond = true) needs linearsolver_type = gmres.\n\n");
+    exit(1);
+  }
+  InitialGuessType linsolve_initguess;
+  std::string initguessstr = config.GetStrParam("linearsolver_initguess", "zero");
+  if      (initguessstr.compare("zero")        == 0) linsolve_initguess = InitialGuessType::ZERO;
+  else if (initguessstr.compare("previous")    == 0) linsolve_initguess = InitialGuessType::PREVIOUS;
+  else if (initguessstr.compare("extrapolate") == 0) linsolve_initguess = InitialGuessType::EXTRAPOLATE;
+  else {
+    printf("\n\n ERROR: Unknown initial guess for the linear solver: %s.\n\n", initguessstr.c_str());
+    exit(1);
+  }
+  TimeStepperType timesteppertype;
+  std::string timestepperstr = config.GetStrParam("timestepper", "implmidpoint");
+  if      (timestepperstr.compare("implmidpoint") == 0) timesteppertype = TimeStepperType::IMPLMIDPOINT;
+  else if (timestepperstr.compare("cfmagnus4")    == 0) timesteppertype = TimeStepperType::CFMAGNUS4;
+  else if (timestepperstr.compare("lawson")       == 0) timesteppertype = TimeStepperType::LAWSON;
+  else {
+    printf("\n\n ERROR: Unknown time stepper: %s.\n\n", timestepperstr.c_str());
+    exit(1);
+  }
+  int expv_krylovdim = config.GetIntParam("expv_krylovdim", 30);
+  double expv_tol = config.GetDoubleParam("expv_tol", 1e-10);
   /* My time stepper */
   bool storeFWD = false;
   if (runtype == RunType::GRADIENT || runtype == RunType::OPTIMIZATION) storeFWD = true;
@@ -333,7 +403,22 @@ int main(int argc,char **argv)
 #if TEST_FD_HESS
   storeFWD = true;
 #endif
-  TimeStepper *mytimestepper = new ImplMidpoint(mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, output, storeFWD);
+  TimeStepper *mytimestepper;
+  if (timesteppertype == TimeStepperType::CFMAGNUS4) mytimestepper = new CFMagnus4(mastereq, ntime, total_time, expv_krylovdim, expv_tol, output, storeFWD);
+  else if (timesteppertype == TimeStepperType::LAWSON) mytimestepper = new LawsonMidpoint(mastereq, ntime, total_time, linsolve_maxiter, output, storeFWD);
+  else mytimestepper = new ImplMidpoint(mastereq, ntime, total_time, linsolvetype, linsolve_maxiter, linsolve_maxrefine, linsolve_precond, linsolve_initguess, output, storeFWD);
+  mytimestepper->mcwf_ntrajectories = mcwf_ntrajectories;
+  mytimestepper->comm_mcwf = comm_petsc;
+  mytimestepper->lowrank_maxrank = lowrank_maxrank;
+  mytimestepper->lowrank_tol = lowrank_tol;
+  mytimestepper->batch_blockgmres = config.GetBoolParam("batch_blockgmres", false);
+  mytimestepper->adaptive_tol = config.GetDoubleParam("adaptive_tol", 0.0);
+#ifdef WITH_BRAID
+  if (mytimestepper->adaptive_tol > 0.0) {
+    printf("\n\n ERROR: Adaptive time stepping (adaptive_tol > 0) is not implemented for XBraid. Compile without Braid.\n");
+    exit(1);
+  }
+#endif
   // TimeStepper *mytimestepper = new ExplEuler(mastereq, ntime, total_time, output, storeFWD);
 
   // /* Petsc's Time-stepper */
@@ -458,6 +543,7 @@ int main(int argc,char **argv)
     printf(" Used Time:        %.2f seconds\n", UsedTime);
     printf(" Global Memory:    %.2f MB\n", globalMB);
     printf(" Processors used:  %d\n", mpisize_world);
+    if (mytimestepper->adaptive_tol > 0.0) printf(" Adaptive steps:   %d accepted, %d rejected\n", mytimestepper->adaptive_naccept, mytimestepper->adaptive_nreject);
     printf("\n");
   }
   // printf("Rank %d: %.2fMB\n", mpirank_world, myMB );
@@ -1,5 +1,14 @@
 #include "mastereq.hpp"
 
+/* Halo exchange for the RHS with parallel Petsc, defined below */
+static void appendRemoteSegments(std::vector<std::pair<int,int>>& segments, const int ilow, const int iupp, std::vector<int>& halo_idx);
+static const double* fillHalo(MatShellCtx* shellctx, Vec x);
+static int haloIndex(const MatShellCtx* shellctx, const int it);
+static int haloOffset(const MatShellCtx* shellctx, const int offset);
+static void sparsemat_dRHSdp(MatShellCtx* shellctx, Vec x, Vec xbar, std::vector<double>& gA, std::vector<double>& gB);
+static void schroedinger_dRHSdp(MatShellCtx* shellctx, Vec x, Vec xbar, std::vector<double>& gA, std::vector<double>& gB);
+static void matfree_packed_dRHSdp(MatShellCtx* shellctx, const double* xptr, const double* xbarptr, double* coeff_p, double* coeff_q);
+
 
 
 
@@ -9,15 +18,19 @@ MasterEq::MasterEq(){
   RHS = NULL;
   Ad     = NULL;
   Bd     = NULL;
-  Ac_vec = NULL;
-  Bc_vec = NULL;
   dRedp = NULL;
   dImdp = NULL;
   usematfree = false;
+  schroedinger = false;
+  hermitian_storage = false;
+  nbatch = 1;
+  RHS_batch = NULL;
+  comm_shared = MPI_COMM_NULL;
+  mpirank_shared = 0;
 }
 
 
-MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype, bool usematfree_) {
+MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Oscillator** oscil_vec_, const std::vector<double> crosskerr_, const std::vector<double> Jkl_, const std::vector<double> eta_, LindbladType lindbladtype, bool usematfree_, bool schroedinger_, bool hermitian_storage_, bool shared_operators_) {
   int ierr;
 
   nlevels = nlevels_;
@@ -28,6 +41,10 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   Jkl = Jkl_;
   eta = eta_;
   usematfree = usematfree_;
+  schroedinger = schroedinger_;
+  hermitian_storage = hermitian_storage_;
+  nbatch = 1;
+  RHS_batch = NULL;
 
   for (int i=0; i<crosskerr.size(); i++){
     crosskerr[i] *= 2.*M_PI;
@@ -44,6 +61,17 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   MPI_Comm_rank(PETSC_COMM_WORLD, &mpirank_petsc);
   MPI_Comm_rank(MPI_COMM_WORLD, &mpirank_world);
 
+  /* Share the constant operator storage among the processes of a node that own the same rows, i.e. that have the same rank in Petsc's communicator (different initial conditions or time slices) */
+  comm_shared = MPI_COMM_NULL;
+  mpirank_shared = 0;
+  if (shared_operators_) {
+    MPI_Comm comm_node;
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &comm_node);
+    MPI_Comm_split(comm_node, mpirank_petsc, mpirank_world, &comm_shared);
+    MPI_Comm_free(&comm_node);
+    MPI_Comm_rank(comm_shared, &mpirank_shared);
+  }
+
   /* Get dimensions */
   dim_rho = 1;
   dim_ess = 1;
@@ -52,7 +80,29 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     dim_ess *= nessential[iosc];
   }
   dim = dim_rho*dim_rho; // density matrix: N \times N -> vectorized: N^2
-  if (mpirank_world == 0) printf("System dimension (complex) N^2 = %d\n",dim);
+  if (schroedinger) dim = dim_rho; // state vector psi: N
+  if (mpirank_world == 0) {
+    if (schroedinger)           printf("System dimension (complex) N = %d, Schroedinger's equation\n",dim);
+    else if (hermitian_storage) printf("System dimension (complex) N^2 = %d, Hermitian storage N(N+1)/2 = %d\n",dim, getDimState());
+    else                        printf("System dimension (complex) N^2 = %d\n",dim);
+  }
+
+  /* Sanity check for Schroedinger's equation. It is always solved matrix-free. Lindblad collapse operators enter as the anti-hermitian part of the effective Hamiltonian of the quantum trajectories (Monte Carlo wavefunction method). */
+  if (schroedinger) {
+    if (mpisize_petsc > 1) {
+      printf("\n ERROR: Schroedinger's equation runs with serial Petsc only (np_petsc = 1). Distribute the initial conditions instead (np_init).\n");
+      exit(1);
+    }
+    usematfree = true;
+  }
+
+  /* Sanity check for Hermitian storage. The upper triangle of rho is propagated by its own matrix-free kernel. */
+  if (hermitian_storage) {
+    if (schroedinger || !usematfree || mpisize_petsc > 1) {
+      printf("\n ERROR: Hermitian storage of rho requires the matrix-free solver (usematfree = true) with serial Petsc (np_petsc = 1), and Lindblad's equation (schroedinger = false).\n");
+      exit(1);
+    }
+  }
 
   /* Sanity check for parallel petsc */
   if (dim % mpisize_petsc != 0) {
@@ -61,8 +111,8 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   }
 
   /* Create matrix shell for applying system matrix (RHS), */
-  /* dimension: 2*dim x 2*dim for the real-valued system */
-  MatCreateShell(PETSC_COMM_WORLD, PETSC_DECIDE, PETSC_DECIDE, 2*dim, 2*dim, (void**) &RHSctx, &RHS);
+  /* dimension: 2*dim x 2*dim for the real-valued system (dim = N(N+1)/2 with Hermitian storage) */
+  MatCreateShell(PETSC_COMM_WORLD, PETSC_DECIDE, PETSC_DECIDE, 2*getDimState(), 2*getDimState(), (void**) &RHSctx, &RHS);
   MatSetOptionsPrefix(RHS, "system");
   MatSetFromOptions(RHS); MatSetUp(RHS);
   MatAssemblyBegin(RHS,MAT_FINAL_ASSEMBLY); MatAssemblyEnd(RHS,MAT_FINAL_ASSEMBLY);
@@ -70,6 +120,8 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   /* Check Lindblad collapse operator configuration */
   switch (lindbladtype)  {
     case LindbladType::NONE:
+      addT1 = false;
+      addT2 = false;
       break;
     case LindbladType::DECAY: 
       addT1 = true;
@@ -92,12 +144,9 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     initSparseMatSolver();
   }
 
-  /* Create vector strides for accessing Re and Im part in x */
+  /* Get locally owned rows */
   PetscInt ilow, iupp;
   MatGetOwnershipRange(RHS, &ilow, &iupp);
-  int dimis = (iupp - ilow)/2;
-  ISCreateStride(PETSC_COMM_WORLD, dimis, ilow, 2, &isu);
-  ISCreateStride(PETSC_COMM_WORLD, dimis, ilow+1, 2, &isv);
 
   /* Compute maximum number of design parameters over all oscillators */
   nparams_max = 0;
@@ -113,33 +162,51 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
   vals = new PetscScalar[nparams_max];
 
   /* Allocate MatShell context for applying RHS */
-  RHSctx.isu = &isu;
-  RHSctx.isv = &isv;
   RHSctx.crosskerr = crosskerr;
   RHSctx.Jkl = Jkl;
   RHSctx.eta = eta;
   RHSctx.addT1 = addT1;
   RHSctx.addT2 = addT2;
   if (!usematfree){
-    RHSctx.Ac_vec = &Ac_vec;
-    RHSctx.Bc_vec = &Bc_vec;
-    RHSctx.Ad_vec = &Ad_vec;
-    RHSctx.Bd_vec = &Bd_vec;
     RHSctx.Ad = &Ad;
     RHSctx.Bd = &Bd;
-    RHSctx.aux = &aux;
   }
   RHSctx.nlevels = nlevels;
   RHSctx.oscil_vec = oscil_vec;
   RHSctx.time = 0.0;
+  RHSctx.ilow = ilow/2;
+  RHSctx.iupp = iupp/2;
+  RHSctx.halo = NULL;
+  RHSctx.xhalo = NULL;
+  RHSctx.fused = NULL;
+  RHSctx.fusedT = NULL;
+  RHSctx.kron = NULL;
+  RHSctx.kronT = NULL;
   for (int iosc = 0; iosc < noscillators; iosc++) {
     RHSctx.control_Re.push_back(0.0);
     RHSctx.control_Im.push_back(0.0);
   }
 
   /* Set the MatMult routine for applying the RHS to a vector x */
-  if (usematfree) { // matrix-free solver
-    if (noscillators == 2) {
+  if (schroedinger) { // Schroedinger's equation, matrix-free
+    MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_schroedinger);
+    MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_schroedinger);
+  }
+  else if (hermitian_storage) { // matrix-free solver on the upper triangle of rho
+    MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_packed);
+    MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_packed);
+  }
+  else if (usematfree && mpisize_petsc > 1) { // matrix-free solver, distributed over Petsc's processes
+    initMatfreeHalo();
+    MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_mpi);
+    MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_mpi);
+  }
+  else if (usematfree) { // matrix-free solver
+    /* The vectorized kernel works on runs over the last oscillator's levels, which pays off for >= 4 levels. Below that, the compile-time kernels are faster. */
+    if (nlevels[noscillators-1] >= 4 || !matfree_isSpecialized(nlevels)) {
+      MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_simd);
+      MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_simd);
+    } else if (noscillators == 2) {
       MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_2Osc);
       MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_2Osc);
     } else if (noscillators == 3) {
@@ -151,15 +218,14 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
     } else if (noscillators == 5) {
       MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_matfree_5Osc);
       MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_matfree_5Osc);
-    } else {
-      printf("ERROR. Matfree solver only for 2, 3 or 4 oscillators. This should never happen!\n");
-      exit(1);
     }
   }
   else { // sparse-matrix solver
+    initFusedSparseMat();
     MatShellSetOperation(RHS, MATOP_MULT, (void(*)(void)) myMatMult_sparsemat);
     MatShellSetOperation(RHS, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_sparsemat);
   }
+  if (!schroedinger && !hermitian_storage) MatShellSetOperation(RHS, MATOP_GET_DIAGONAL, (void(*)(void)) myMatGetDiagonal);
 
 }
 
@@ -167,375 +233,505 @@ MasterEq::MasterEq(std::vector<int> nlevels_, std::vector<int> nessential_, Osci
 MasterEq::~MasterEq(){
   if (dim > 0){
     MatDestroy(&RHS);
+    if (RHS_batch != NULL) MatDestroy(&RHS_batch);
     if (!usematfree){
       MatDestroy(&Ad);
       MatDestroy(&Bd);
-      for (int iosc = 0; iosc < noscillators; iosc++) {
-        MatDestroy(&Ac_vec[iosc]);
-        MatDestroy(&Bc_vec[iosc]);
-      }
-      for (int i= 0; i < noscillators*(noscillators-1)/2; i++) {
-        if (fabs(Jkl[i]) > 1e-12 )  {
-          MatDestroy(&Ad_vec[i]);
-          MatDestroy(&Bd_vec[i]);
-        }
-      }
-      VecDestroy(&aux);
-      delete [] Ac_vec;
-      delete [] Bc_vec;
-      delete [] Ad_vec;
-      delete [] Bd_vec;
     }
     delete [] dRedp;
     delete [] dImdp;
     delete [] vals;
     delete [] cols;
+    if (RHSctx.halo != NULL) {
+      VecScatterDestroy(&halo);
+      VecDestroy(&xhalo);
+    }
+    if (RHSfused.win != MPI_WIN_NULL)  MPI_Win_free(&RHSfused.win);
+    if (RHSfusedT.win != MPI_WIN_NULL) MPI_Win_free(&RHSfusedT.win);
+    if (comm_shared != MPI_COMM_NULL)  MPI_Comm_free(&comm_shared);
+  }
+}
+
+
+void MasterEq::initMatfreeHalo(){
+
+  /* Strides of the oscillator levels in the vectorized density matrix */
+  std::vector<int> stridei(noscillators), strideip(noscillators);
+  int stride = 1;
+  for (int k=noscillators-1; k>=0; k--){
+    stridei[k]  = stride;
+    strideip[k] = stride * dim_rho;
+    stride *= nlevels[k];
+  }
+
+  /* Collect the offsets it -> it+offset at which the RHS and RHS^T read x: ladder operators, decay, and Jaynes-Cummings coupling */
+  std::vector<int> offsets;
+  for (int k=0; k<noscillators; k++){
+    offsets.push_back(stridei[k]);
+    offsets.push_back(-stridei[k]);
+    offsets.push_back(strideip[k]);
+    offsets.push_back(-strideip[k]);
+    if (addT1) {
+      offsets.push_back(stridei[k] + strideip[k]);
+      offsets.push_back(-stridei[k] - strideip[k]);
+    }
+  }
+  int id = 0;
+  for (int k=0; k<noscillators; k++){
+    for (int l=k+1; l<noscillators; l++){
+      if (fabs(Jkl[id]) > 1e-10) {
+        offsets.push_back(stridei[k] - stridei[l]);
+        offsets.push_back(-stridei[k] + stridei[l]);
+        offsets.push_back(strideip[k] - strideip[l]);
+        offsets.push_back(-strideip[k] + strideip[l]);
+      }
+      id++;
+    }
+  }
 
-    ISDestroy(&isu);
-    ISDestroy(&isv);
+  /* The local rows are applied in whole runs over the last oscillator's levels, see myMatMult_matfree_mpi(). Each offset reads a shifted copy of these rows. */
+  int ilow = RHSctx.ilow;
+  int iupp = RHSctx.iupp;
+  int nl = nlevels[noscillators-1];
+  int alow = ilow - ilow % nl;
+  int aupp = iupp + (nl - iupp % nl) % nl;
+  std::vector<std::pair<int,int>> segments;
+  segments.push_back(std::make_pair(alow, aupp));
+  for (int i=0; i<offsets.size(); i++){
+    segments.push_back(std::make_pair(std::max(0, alow + offsets[i]), std::min(dim, aupp + offsets[i])));
   }
+  std::vector<int> halo_idx;
+  appendRemoteSegments(segments, ilow, iupp, halo_idx);
+  initHalo(halo_idx);
 }
 
 
-void MasterEq::initSparseMatSolver(){
+/* Append the indices of the union of the segments [first, last) that lie outside of the local rows [ilow, iupp) to halo_idx, in increasing order */
+static void appendRemoteSegments(std::vector<std::pair<int,int>>& segments, const int ilow, const int iupp, std::vector<int>& halo_idx){
+  std::sort(segments.begin(), segments.end());
+  int next = 0;  // first index not yet appended
+  for (int i=0; i<segments.size(); i++){
+    for (int j = std::max(next, segments[i].first); j < segments[i].second; j++) {
+      if (j < ilow || j >= iupp) halo_idx.push_back(j);
+    }
+    next = std::max(next, segments[i].second);
+  }
+}
+
+
+void MasterEq::initHalo(const std::vector<int>& halo_idx){
+
+  RHSctx.halo_idx = halo_idx;
+  RHSctx.nbelow = std::lower_bound(halo_idx.begin(), halo_idx.end(), RHSctx.ilow) - halo_idx.begin();
+  RHSctx.xloc.assign(2*(halo_idx.size() + RHSctx.iupp - RHSctx.ilow), 0.0);
+
+  /* Create the scatter from the global x into a sequential vector of the remote entries (real and imaginary part) */
+  int nhalo = halo_idx.size();
+  PetscInt* idx = new PetscInt[2*nhalo];
+  for (int i=0; i<nhalo; i++){
+    idx[2*i]   = 2*halo_idx[i];
+    idx[2*i+1] = 2*halo_idx[i] + 1;
+  }
+  IS isfrom;
+  ISCreateGeneral(PETSC_COMM_SELF, 2*nhalo, idx, PETSC_COPY_VALUES, &isfrom);
+  delete [] idx;
+  Vec x;
+  MatCreateVecs(RHS, &x, NULL);
+  VecCreateSeq(PETSC_COMM_SELF, 2*nhalo, &xhalo);
+  VecScatterCreate(x, isfrom, xhalo, NULL, &halo);
+  ISDestroy(&isfrom);
+  VecDestroy(&x);
+
+  RHSctx.halo = &halo;
+  RHSctx.xhalo = &xhalo;
+}
+
+
+/* Append the locally owned rows of the building blocks to the fused matrix A. Entries of one row are sorted by column. */
+static void fuseBlocks(const std::vector<Mat>& blocks, const std::vector<int>& slots, CSRBuffer* A){
+
+  PetscInt ilow, iupp;
+  MatGetOwnershipRange(blocks[0], &ilow, &iupp);
+
+  A->rowptr.assign(1, 0);
+  A->col.clear();
+  A->slot.clear();
+  A->val.clear();
+  std::vector<std::pair<int,int> > row;   // (column, entry) of the current row
+  std::vector<int> rowslot;
+  std::vector<double> rowval;
+  for (int irow = ilow; irow < iupp; irow++){
+    row.clear();
+    rowslot.clear();
+    rowval.clear();
+    for (int ib = 0; ib < blocks.size(); ib++){
+      PetscInt ncol;
+      const PetscInt* cols;
+      const PetscScalar* vals;
+      MatGetRow(blocks[ib], irow, &ncol, &cols, &vals);
+      for (int j = 0; j < ncol; j++){
+        if (vals[j] == 0.0) continue;
+        row.push_back(std::make_pair((int)cols[j], (int)rowval.size()));
+        rowslot.push_back(slots[ib]);
+        rowval.push_back(vals[j]);
+      }
+      MatRestoreRow(blocks[ib], irow, &ncol, &cols, &vals);
+    }
+    std::sort(row.begin(), row.end());
+    for (int j = 0; j < row.size(); j++){
+      A->col.push_back(row[j].first);
+      A->slot.push_back(rowslot[row[j].second]);
+      A->val.push_back(rowval[row[j].second]);
+    }
+    A->rowptr.push_back(A->col.size());
+  }
+}
+
+
+/* Store the assembled matrix buf in A. With comm = MPI_COMM_NULL, A owns a copy. Otherwise, buf is only given on rank 0 of comm, which copies it into a shared-memory window that all processes of comm read from. */
+static void storeCSR(const CSRBuffer& buf, FusedCSR* A, MPI_Comm comm){
+
+  int rank = 0;
+  if (comm != MPI_COMM_NULL) MPI_Comm_rank(comm, &rank);
+
+  /* Sizes, layout: values first, then row pointers, columns and slots */
+  long sizes[2];
+  sizes[0] = (long) buf.rowptr.size() - 1;
+  sizes[1] = buf.col.size();
+  if (comm != MPI_COMM_NULL) MPI_Bcast(sizes, 2, MPI_LONG, 0, comm);
+  A->nrows = sizes[0];
+  long nnz = sizes[1];
+  MPI_Aint bytes = nnz * sizeof(double) + (A->nrows + 1 + 2*nnz) * sizeof(int);
+
+  char* mem;
+  if (comm == MPI_COMM_NULL) {
+    A->mem.resize(bytes);
+    mem = A->mem.data();
+  } else {
+    MPI_Win_allocate_shared(rank == 0 ? bytes : 0, 1, MPI_INFO_NULL, comm, &mem, &A->win);
+    if (rank != 0) {
+      MPI_Aint size;
+      int disp_unit;
+      MPI_Win_shared_query(A->win, 0, &size, &disp_unit, &mem);
+    }
+  }
+  A->val    = (double*) mem;
+  A->rowptr = (int*) (A->val + nnz);
+  A->col    = A->rowptr + A->nrows + 1;
+  A->slot   = A->col + nnz;
+
+  if (rank == 0) {
+    std::copy(buf.val.begin(),    buf.val.end(),    A->val);
+    std::copy(buf.rowptr.begin(), buf.rowptr.end(), A->rowptr);
+    std::copy(buf.col.begin(),    buf.col.end(),    A->col);
+    std::copy(buf.slot.begin(),   buf.slot.end(),   A->slot);
+  }
+  if (comm != MPI_COMM_NULL) MPI_Win_fence(0, A->win);
+}
+
+
+/* Sparse-matrix solver: Transpose of a Kronecker term. The column of row it is it + shift, so the transposed term has the negated shift, and its value at the levels of row it is the value of the original term at the levels of it - shift. */
+static KronTerm kronTranspose(const KronTerm& term, const std::vector<int>& nlevels){
+  KronTerm termT = term;
+  termT.dk = -term.dk;
+  termT.dl = -term.dl;
+  termT.shift = -term.shift;
+  termT.xshift = termT.shift;
+  int nk = nlevels[term.k];
+  for (int ik = 0; ik < nk; ik++) {
+    for (int il = 0; il < term.nl; il++) {
+      int jk = ik - term.dk;
+      int jl = il - term.dl;
+      bool inrange = jk >= 0 && jk < nk && jl >= 0 && jl < term.nl;
+      termT.val[ik * term.nl + il] = inrange ? term.val[jk * term.nl + jl] : 0.0;
+    }
+  }
+  return termT;
+}
+
+
+void MasterEq::initFusedSparseMat(){
+
+  /* Collect the constant building blocks together with the slot of their coefficient, see sparsemat_getCoeffs(). The time-varying ones are kept as Kronecker terms. */
+  std::vector<Mat> blocks;
+  std::vector<int> slots;
+  blocks.push_back(Ad);
+  slots.push_back(0);
+  blocks.push_back(Bd);
+  slots.push_back(1);
+
+  /* Fuse the blocks, and their transposes. With shared storage, only rank 0 of comm_shared assembles. */
+  CSRBuffer buf;
+  if (mpirank_shared == 0) fuseBlocks(blocks, slots, &buf);
+  storeCSR(buf, &RHSfused, comm_shared);
+  std::vector<Mat> blocksT(blocks.size());
+  for (int ib = 0; ib < blocks.size(); ib++) MatTranspose(blocks[ib], MAT_INITIAL_MATRIX, &blocksT[ib]);
+  CSRBuffer bufT;
+  if (mpirank_shared == 0) fuseBlocks(blocksT, slots, &bufT);
+  storeCSR(bufT, &RHSfusedT, comm_shared);
+  for (int ib = 0; ib < blocks.size(); ib++) MatDestroy(&blocksT[ib]);
+
+  /* The blocks are not needed anymore, only keep the shared copy */
+  if (comm_shared != MPI_COMM_NULL) {
+    MatDestroy(&Ad);
+    MatDestroy(&Bd);
+  }
+
+  /* Transposed Kronecker terms */
+  RHSkronT.clear();
+  for (int i = 0; i < RHSkron.size(); i++) RHSkronT.push_back(kronTranspose(RHSkron[i], nlevels));
+
+  RHSctx.fused = &RHSfused;
+  RHSctx.fusedT = &RHSfusedT;
+  RHSctx.kron = &RHSkron;
+  RHSctx.kronT = &RHSkronT;
+
+  /* With parallel Petsc, gather the remote columns of the local rows */
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  if (mpisize_petsc > 1) initSparseMatHalo();
+}
+
+
+void MasterEq::initSparseMatHalo(){
+
+  /* Remote columns of the local rows: the columns of the fused matrices, and the shifted local rows of each Kronecker term */
+  int ilow = RHSctx.ilow;
+  int iupp = RHSctx.iupp;
+  std::vector<std::pair<int,int>> segments;
+  for (int iterm = 0; iterm < RHSkron.size(); iterm++) {
+    int shift = RHSkron[iterm].shift;
+    segments.push_back(std::make_pair(std::max(0, ilow + shift), std::min(dim, iupp + shift)));
+    segments.push_back(std::make_pair(std::max(0, ilow - shift), std::min(dim, iupp - shift)));
+  }
+  std::vector<int> halo_idx;
+  appendRemoteSegments(segments, ilow, iupp, halo_idx);
+  for (int i = 0; i < RHSfused.rowptr[RHSfused.nrows]; i++)  
+    if (RHSfused.col[i] < ilow || RHSfused.col[i] >= iupp) halo_idx.push_back(RHSfused.col[i]);
+  for (int i = 0; i < RHSfusedT.rowptr[RHSfusedT.nrows]; i++) 
+    if (RHSfusedT.col[i] < ilow || RHSfusedT.col[i] >= iupp) halo_idx.push_back(RHSfusedT.col[i]);
+  std::sort(halo_idx.begin(), halo_idx.end());
+  halo_idx.erase(std::unique(halo_idx.begin(), halo_idx.end()), halo_idx.end());
+  initHalo(halo_idx);
+
+  /* Remap the columns into the local copy of x. Shared storage is remapped once, after all processes of comm_shared have read the global columns. */
+  for (int iterm = 0; iterm < RHSkron.size(); iterm++) {
+    RHSkron[iterm].xshift  = haloOffset(&RHSctx, RHSkron[iterm].shift);
+    RHSkronT[iterm].xshift = haloOffset(&RHSctx, RHSkronT[iterm].shift);
+  }
+  if (comm_shared != MPI_COMM_NULL) MPI_Barrier(comm_shared);
+  if (mpirank_shared == 0) {
+    for (int i = 0; i < RHSfused.rowptr[RHSfused.nrows]; i++)   RHSfused.col[i]  = haloIndex(&RHSctx, RHSfused.col[i]);
+    for (int i = 0; i < RHSfusedT.rowptr[RHSfusedT.nrows]; i++) RHSfusedT.col[i] = haloIndex(&RHSctx, RHSfusedT.col[i]);
+  }
+  if (comm_shared != MPI_COMM_NULL) {
+    MPI_Win_fence(0, RHSfused.win);
+    MPI_Win_fence(0, RHSfusedT.win);
+  }
+}
+
+
+/* Sparse-matrix solver: New Kronecker term on oscillators k and l (l = -1 for none), shifting their levels by dk and dl in the row (or, if primed, the column) index of rho. Values are set by the caller. */
+static KronTerm kronTerm(const std::vector<int>& nlevels, const int dimmat, const int slot, const bool primed, const int k, const int dk, const int l, const int dl){
+  int nosc = nlevels.size();
+  int postk = 1;
+  int postl = 1;
+  for (int j = k+1; j < nosc; j++) postk *= nlevels[j];
+  if (l >= 0) for (int j = l+1; j < nosc; j++) postl *= nlevels[j];
+
+  KronTerm term;
+  term.slot = slot;
+  term.primed = primed;
+  term.k = k;
+  term.l = l;
+  term.dk = dk;
+  term.dl = l >= 0 ? dl : 0;
+  term.shift = (dk * postk + term.dl * postl) * (primed ? dimmat : 1);
+  term.xshift = term.shift;
+  term.nl = l >= 0 ? nlevels[l] : 1;
+  term.val.assign(nlevels[k] * term.nl, 0.0);
+  return term;
+}
+
 
-  /* Allocate time-varying building blocks */
-  // control terms
-  Ac_vec = new Mat[noscillators];
-  Bc_vec = new Mat[noscillators];
-  // coupling terms
-  Ad_vec = new Mat[noscillators*(noscillators-1)/2];
-  Bd_vec = new Mat[noscillators*(noscillators-1)/2];
+void MasterEq::initSparseMatSolver(){
 
   int dimmat = (int) sqrt(dim);
 
-  int id_kl=0;  // index for accessing Ad_kl in Ad_vec
+  int id_kl=0;  // index of the coupling k<->l
   PetscInt ilow, iupp;
-  int r1,r2, r1a, r2a, r1b, r2b;
-  int col, col1, col2;
-  double val;
-  // double val1, val2;
 
-  /* Set up control Hamiltonian building blocks Ac, Bc */
+  /* Set up control Hamiltonian building blocks Ac, Bc, and Jaynes-Cummings coupling building blocks Ad_kl, Bd_kl. 
+   * They are not assembled, but stored as Kronecker terms that only hold their values per level of the oscillators they act on. 
+   * Each side of rho (row index i: primed = false, column index i': primed = true) gives one term per level shift. */
+  RHSkron.clear();
   for (int iosc = 0; iosc < noscillators; iosc++) {
 
-    /* Get dimensions */
-    int nk     = oscil_vec[iosc]->getNLevels();
-    int nprek  = oscil_vec[iosc]->dim_preOsc;
-    int npostk = oscil_vec[iosc]->dim_postOsc;
-
-    /* Compute Ac = I_N \kron (a - a^T) - (a - a^T)^T \kron I_N */
-    MatCreate(PETSC_COMM_WORLD, &Ac_vec[iosc]);
-    MatSetType(Ac_vec[iosc], MATMPIAIJ);
-    MatSetSizes(Ac_vec[iosc], PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-    MatMPIAIJSetPreallocation(Ac_vec[iosc], 4, NULL, 4, NULL);
-    MatSetUp(Ac_vec[iosc]);
-    MatSetFromOptions(Ac_vec[iosc]);
-    MatGetOwnershipRange(Ac_vec[iosc], &ilow, &iupp);
-
-    /* Iterate over local rows of Ac_vec */
-    for (int row = ilow; row<iupp; row++){
-      // I_n \kron A_c 
-      col1 = row + npostk;
-      col2 = row - npostk;
-      r1 = row % dimmat;
-      r1 = r1 % (nk*npostk);
-      r1 = r1 / npostk;
-      if (r1 < nk-1) {
-        val = sqrt(r1+1);
-        if (fabs(val)>1e-14) MatSetValue(Ac_vec[iosc], row, col1, val, ADD_VALUES);
-      }
-      if (r1 > 0) {
-        val = -sqrt(r1);
-        if (fabs(val)>1e-14) MatSetValue(Ac_vec[iosc], row, col2, val, ADD_VALUES);
-      } 
-      //- A_c \kron I_N
-      col1 = row + npostk*dimmat;
-      col2 = row - npostk*dimmat;
-      r1 = row % (dimmat * nk * npostk);
-      r1 = r1 / (dimmat * npostk);
-      if (r1 < nk-1) {
-        val =  sqrt(r1+1);
-        if (fabs(val)>1e-14) MatSetValue(Ac_vec[iosc], row, col1, val, ADD_VALUES);
-      }
-      if (r1 > 0) {
-        val = -sqrt(r1);
-        if (fabs(val)>1e-14) MatSetValue(Ac_vec[iosc], row, col2, val, ADD_VALUES);
-      }   
-    }
-    MatAssemblyBegin(Ac_vec[iosc], MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(Ac_vec[iosc], MAT_FINAL_ASSEMBLY);
-
-    /* Compute Bc = - I_N \kron (a + a^T) + (a + a^T)^T \kron I_N */
-    MatCreate(PETSC_COMM_WORLD, &Bc_vec[iosc]);
-    MatSetType(Bc_vec[iosc], MATMPIAIJ);
-    MatSetSizes(Bc_vec[iosc], PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-    MatMPIAIJSetPreallocation(Bc_vec[iosc], 4, NULL, 4, NULL);
-    MatSetUp(Bc_vec[iosc]);
-    MatSetFromOptions(Bc_vec[iosc]);
-    MatGetOwnershipRange(Bc_vec[iosc], &ilow, &iupp);
-    /* Iterate over local rows of Bc_vec */
-    for (int row = ilow; row<iupp; row++){
-      // - I_n \kron B_c 
-      col1 = row + npostk;
-      col2 = row - npostk;
-      r1 = row % dimmat;
-      r1 = r1 % (nk*npostk);
-      r1 = r1 / npostk;
-      if (r1 < nk-1) {
-        val = -sqrt(r1+1);
-        if (fabs(val)>1e-14) MatSetValue(Bc_vec[iosc], row, col1, val, ADD_VALUES);
-      }
-      if (r1 > 0) {
-        val = -sqrt(r1);
-        if (fabs(val)>1e-14) MatSetValue(Bc_vec[iosc], row, col2, val, ADD_VALUES);
-      } 
-      //+ B_c \kron I_N
-      col1 = row + npostk*dimmat;
-      col2 = row - npostk*dimmat;
-      r1 = row % (dimmat * nk * npostk);
-      r1 = r1 / (dimmat * npostk);
-      if (r1 < nk-1) {
-        val =  sqrt(r1+1);
-        if (fabs(val)>1e-14) MatSetValue(Bc_vec[iosc], row, col1, val, ADD_VALUES);
+    int nk = oscil_vec[iosc]->getNLevels();
+
+    for (int side = 0; side < 2; side++) {
+      bool primed = side == 1;
+
+      /* Ac = I_N \kron (a - a^T) - (a - a^T)^T \kron I_N */
+      KronTerm Acup   = kronTerm(nlevels, dimmat, 2 + 2*iosc, primed, iosc, +1, -1, 0);
+      KronTerm Acdown = kronTerm(nlevels, dimmat, 2 + 2*iosc, primed, iosc, -1, -1, 0);
+      /* Bc = - I_N \kron (a + a^T) + (a + a^T)^T \kron I_N */
+      KronTerm Bcup   = kronTerm(nlevels, dimmat, 3 + 2*iosc, primed, iosc, +1, -1, 0);
+      KronTerm Bcdown = kronTerm(nlevels, dimmat, 3 + 2*iosc, primed, iosc, -1, -1, 0);
+      double sign = primed ? 1.0 : -1.0;
+      for (int r = 0; r < nk; r++) {
+        if (r < nk-1) {
+          Acup.val[r] = sqrt(r+1);
+          Bcup.val[r] = sign * sqrt(r+1);
+        }
+        if (r > 0) {
+          Acdown.val[r] = -sqrt(r);
+          Bcdown.val[r] = sign * sqrt(r);
+        }
       }
-      if (r1 > 0) {
-        val = sqrt(r1);
-        if (fabs(val)>1e-14) MatSetValue(Bc_vec[iosc], row, col2, val, ADD_VALUES);
-      }   
+      RHSkron.push_back(Acup);
+      RHSkron.push_back(Acdown);
+      RHSkron.push_back(Bcup);
+      RHSkron.push_back(Bcdown);
     }
-    MatAssemblyBegin(Bc_vec[iosc], MAT_FINAL_ASSEMBLY);
-    MatAssemblyEnd(Bc_vec[iosc], MAT_FINAL_ASSEMBLY);
-
 
     /* Compute Jaynes-Cummings coupling building blocks */
     /* Ad_kl(t) =  I_N \kron (ak^Tal − akal^T) − (al^Tak − alak^T) \kron IN */
     /* Bd_kl(t) = -I_N \kron (ak^Tal + akal^T) + (al^Tak + alak_T) \kron IN */
     for (int josc=iosc+1; josc<noscillators; josc++){
 
-      if (fabs(Jkl[id_kl]) > 1e-12) { // only allocate if coefficient is non-zero to save memory.
-
-        /* Allocate Ad_kl, Bd_kl matrices, 4 nonzeros per kl-coupling per row. */
-        MatCreate(PETSC_COMM_WORLD, &Ad_vec[id_kl]);
-        MatCreate(PETSC_COMM_WORLD, &Bd_vec[id_kl]);
-        MatSetType(Ad_vec[id_kl], MATMPIAIJ);
-        MatSetType(Bd_vec[id_kl], MATMPIAIJ);
-        MatSetSizes(Ad_vec[id_kl], PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-        MatSetSizes(Bd_vec[id_kl], PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-        MatMPIAIJSetPreallocation(Ad_vec[id_kl], 4, NULL, 4, NULL);
-        MatMPIAIJSetPreallocation(Bd_vec[id_kl], 4, NULL, 4, NULL);
-        MatSetUp(Ad_vec[id_kl]);
-        MatSetUp(Bd_vec[id_kl]);
-        MatSetFromOptions(Ad_vec[id_kl]);
-        MatSetFromOptions(Bd_vec[id_kl]);
-        MatGetOwnershipRange(Ad_vec[id_kl], &ilow, &iupp);
-
-        // Dimensions of joscillator
-        int nj     = oscil_vec[josc]->getNLevels();
-        int nprej  = oscil_vec[josc]->dim_preOsc;
-        int npostj = oscil_vec[josc]->dim_postOsc;
-
-
-        /* Iterate over local rows of Ad_vec / Bd_vec */
-        for (int row = ilow; row<iupp; row++){
-          // Add +/- I_N \kron (ak^Tal -/+ akal^T)
-          r1 = row % (dimmat / nprek);
-          r1a = (int) r1 / npostk;
-          r1b = r1 % (nj*npostj);
-          r1b = r1b % (nj*npostj);
-          r1b = (int) r1b / npostj;
-          if (r1a > 0 && r1b < nj-1) {
-            val = sqrt(r1a * (r1b+1));
-            col = row - npostk + npostj;
-             if (fabs(val)>1e-14) MatSetValue(Ad_vec[id_kl], row, col,  val, ADD_VALUES);
-             if (fabs(val)>1e-14) MatSetValue(Bd_vec[id_kl], row, col, -val, ADD_VALUES);
-          }
-          if (r1a < nk-1  && r1b > 0) {
-            val = sqrt((r1a+1) * r1b);
-            col = row + npostk - npostj;
-            if (fabs(val)>1e-14) MatSetValue(Ad_vec[id_kl], row, col, -val, ADD_VALUES);
-            if (fabs(val)>1e-14) MatSetValue(Bd_vec[id_kl], row, col, -val, ADD_VALUES);
-          }
-
-          // Add -/+ (al^Tak -/+ alak^T) \kron I
-          r1 = row % (dimmat * dimmat / nprek );
-          r1a = (int) r1 / (npostk*dimmat);
-          r1b = r1 % (npostk*dimmat);
-          r1b = r1b % (nj*npostj*dimmat);
-          r1b = (int) r1b / (npostj*dimmat);
-          if (r1a < nk-1 && r1b > 0) {
-            val = sqrt((r1a+1) * r1b);
-            col = row + npostk*dimmat - npostj*dimmat;
-            if (fabs(val)>1e-14) MatSetValue(Ad_vec[id_kl], row, col, -val, ADD_VALUES);
-            if (fabs(val)>1e-14) MatSetValue(Bd_vec[id_kl], row, col, +val, ADD_VALUES);
-          }
-          if (r1a > 0 && r1b < nj-1) {
-            val = sqrt(r1a * (r1b+1));
-            col = row - npostk*dimmat + npostj*dimmat;
-            if (fabs(val)>1e-14) MatSetValue(Ad_vec[id_kl], row, col, val, ADD_VALUES);
-            if (fabs(val)>1e-14) MatSetValue(Bd_vec[id_kl], row, col, val, ADD_VALUES);
+      if (fabs(Jkl[id_kl]) > 1e-12) { // only add if coefficient is non-zero
+
+        int nj = oscil_vec[josc]->getNLevels();
+        int slotA = 2 + 2*noscillators + 2*id_kl;
+        int slotB = 3 + 2*noscillators + 2*id_kl;
+
+        for (int side = 0; side < 2; side++) {
+          bool primed = side == 1;
+          double sign = primed ? 1.0 : -1.0;
+          KronTerm Adkl_dn = kronTerm(nlevels, dimmat, slotA, primed, iosc, -1, josc, +1);  // lowers k, raises l
+          KronTerm Adkl_up = kronTerm(nlevels, dimmat, slotA, primed, iosc, +1, josc, -1);  // raises k, lowers l
+          KronTerm Bdkl_dn = kronTerm(nlevels, dimmat, slotB, primed, iosc, -1, josc, +1);
+          KronTerm Bdkl_up = kronTerm(nlevels, dimmat, slotB, primed, iosc, +1, josc, -1);
+          for (int rk = 0; rk < nk; rk++) {
+            for (int rl = 0; rl < nj; rl++) {
+              if (rk > 0 && rl < nj-1) {
+                double v = sqrt(rk * (rl+1));
+                Adkl_dn.val[rk*nj + rl] = v;
+                Bdkl_dn.val[rk*nj + rl] = sign * v;
+              }
+              if (rk < nk-1 && rl > 0) {
+                double v = sqrt((rk+1) * rl);
+                Adkl_up.val[rk*nj + rl] = -v;
+                Bdkl_up.val[rk*nj + rl] = sign * v;
+              }
+            }
           }
+          RHSkron.push_back(Adkl_dn);
+          RHSkron.push_back(Adkl_up);
+          RHSkron.push_back(Bdkl_dn);
+          RHSkron.push_back(Bdkl_up);
         }
-        MatAssemblyBegin(Ad_vec[id_kl], MAT_FINAL_ASSEMBLY);
-        MatAssemblyBegin(Bd_vec[id_kl], MAT_FINAL_ASSEMBLY);
-        MatAssemblyEnd(Ad_vec[id_kl], MAT_FINAL_ASSEMBLY);
-        MatAssemblyEnd(Bd_vec[id_kl], MAT_FINAL_ASSEMBLY);
       }
       id_kl++;
     }
   }
 
-  /* Allocate and compute imag drift part Bd = Hd */
-  MatCreate(PETSC_COMM_WORLD, &Bd);
-  MatSetType(Bd, MATMPIAIJ);
-  MatSetSizes(Bd, PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-  MatMPIAIJSetPreallocation(Bd, 1, NULL, 1, NULL);
-  MatSetUp(Bd);
-  MatSetFromOptions(Bd);
-  MatGetOwnershipRange(Bd, &ilow, &iupp);
-  int coupling_id = 0;
+  /* Constant drift parts Bd = Hd (imaginary part) and Ad = Lindblad (real part). On row it of the vectorized rho, with levels i of its row and i' of its column index: 
+   *   Bd: diagonal -(hd(i) - hd(i')), with the drift Hamiltonian hd (detuning, self-kerr and cross-kerr)
+   *   Ad: diagonal sum_k -gamma1_k/2 (i_k + i_k') + gamma2_k (i_k i_k' - 1/2 (i_k^2 + i_k'^2)), and the T1-decay term gamma1_k sqrt((i_k+1)(i_k'+1)) in column it + stride_k + stride_k'.
+   * The local rows are assembled directly as CSR arrays with exact row counts: The first pass computes the diagonals and counts the entries, the second one fills in the columns. */
+  MatGetOwnershipRange(RHS, &ilow, &iupp);
+  ilow /= 2;
+  iupp /= 2;
+  int nrows = iupp - ilow;
+  std::vector<double> detune(noscillators), xi(noscillators), gamma1(noscillators, 0.0), gamma2(noscillators, 0.0);
+  std::vector<int> stride(noscillators);
   for (int iosc = 0; iosc < noscillators; iosc++) {
+    detune[iosc] = oscil_vec[iosc]->getDetuning();
+    xi[iosc]     = oscil_vec[iosc]->getSelfkerr();
+    if (addT1 && oscil_vec[iosc]->getDecayTime()   > 1e-14) gamma1[iosc] = 1./(oscil_vec[iosc]->getDecayTime());
+    if (addT2 && oscil_vec[iosc]->getDephaseTime() > 1e-14) gamma2[iosc] = 1./(oscil_vec[iosc]->getDephaseTime());
+    stride[iosc] = oscil_vec[iosc]->dim_postOsc;
+  }
 
-    int nk     = oscil_vec[iosc]->getNLevels();
-    int nprek  = oscil_vec[iosc]->dim_preOsc;
-    int npostk = oscil_vec[iosc]->dim_postOsc;
-    double xik = oscil_vec[iosc]->getSelfkerr();
-    double detunek = oscil_vec[iosc]->getDetuning();
-
-    /* Diagonal: detuning and anharmonicity  */
-    /* Iterate over local rows of Bd */
-    for (int row = ilow; row<iupp; row++){
-
-      // Indices for -I_N \kron B_d
-      r1 = row % dimmat;
-      r1 = r1 % (nk * npostk);
-      r1 = (int) r1 / npostk;
-      // Indices for B_d \kron I_N
-      r2 = (int) row / dimmat;
-      r2 = r2 % (nk * npostk);
-      r2 = (int) r2 / npostk;
-
-      // -I_N \kron B_d + B_d \kron I_N
-      val  = - ( detunek * r1 - xik / 2. * (r1*r1 - r1) );
-      val +=     detunek * r2 - xik / 2. * (r2*r2 - r2)  ;
-      if (fabs(val)>1e-14) MatSetValue(Bd, row, row, val, ADD_VALUES);
+  /* First pass: diagonals and row counts */
+  std::vector<double> diagA(nrows), diagB(nrows);
+  std::vector<PetscInt> rowptrA(nrows+1, 0), rowptrB(nrows+1, 0);
+  std::vector<int> i(noscillators, 0), ip(noscillators, 0);
+  int itnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, itnext)
+  for (int it = ilow; it < iupp; it++) {
+    if (it != itnext) TensorSetIndex(noscillators, nlevels.data(), it, i.data(), ip.data());
+    double hd = 0.0, hdp = 0.0, ld = 0.0;
+    int nT1 = 0;
+    for (int k = 0; k < noscillators; k++) {
+      hd  += detune[k] * i[k]  - xi[k] / 2. * i[k] * (i[k]-1);
+      hdp += detune[k] * ip[k] - xi[k] / 2. * ip[k] * (ip[k]-1);
+      ld  += - gamma1[k] / 2. * (i[k] + ip[k]) + gamma2[k] * ( i[k]*ip[k] - 1./2. * (i[k]*i[k] + ip[k]*ip[k]) );
+      if (gamma1[k] > 0.0 && i[k] < nlevels[k]-1 && ip[k] < nlevels[k]-1) nT1++;
     }
-
-    /* zz-coupling term  -xi_ij * 2 * PI * (N_i*N_j) for j > i */
-    for (int josc = iosc+1; josc < noscillators; josc++) {
-      int nj     = oscil_vec[josc]->getNLevels();
-      int npostj = oscil_vec[josc]->dim_postOsc;
-      double xikj = crosskerr[coupling_id];
-      coupling_id++;
-        
-      for (int row = ilow; row<iupp; row++){
-        r1 = row % dimmat;
-        r1 = r1 % (nk * npostk);
-        r1a = r1 / npostk;
-        r1b = r1 % npostk;
-        r1b = r1b % (nj*npostj);
-        r1b = r1b / npostj;
-
-        r2 = (int) row / dimmat;
-        r2 = r2 % (nk * npostk);
-        r2a = r2 / npostk;
-        r2b = r2 % npostk;
-        r2b = r2b % (nj*npostj);
-        r2b = r2b / npostj;
-
-        // -I_N \kron B_d + B_d \kron I_N
-        val =  xikj * r1a * r1b  - xikj * r2a * r2b;
-        if (fabs(val)>1e-14) MatSetValue(Bd, row, row, val, ADD_VALUES);
+    int id = 0;
+    for (int k = 0; k < noscillators; k++) {
+      for (int l = k+1; l < noscillators; l++) {
+        hd  -= crosskerr[id] * i[k] * i[l];
+        hdp -= crosskerr[id] * ip[k] * ip[l];
+        id++;
       }
     }
-
+    diagA[it-ilow] = ld;
+    diagB[it-ilow] = -(hd - hdp);
+    rowptrA[it-ilow+1] = nT1 + (fabs(ld) > 1e-14 ? 1 : 0);
+    rowptrB[it-ilow+1] = fabs(hd - hdp) > 1e-14 ? 1 : 0;
+    TensorIncrementIndex(noscillators, nlevels.data(), i.data(), ip.data());
+    itnext = it+1;
+  }
+  for (int r = 0; r < nrows; r++) {
+    rowptrA[r+1] += rowptrA[r];
+    rowptrB[r+1] += rowptrB[r];
   }
-  MatAssemblyBegin(Bd, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(Bd, MAT_FINAL_ASSEMBLY);
-
-  /* Allocate and compute real drift part Ad = Lindblad */
-  MatCreate(PETSC_COMM_WORLD, &Ad);
-  MatSetSizes(Ad, PETSC_DECIDE, PETSC_DECIDE, dim, dim);
-  if (addT1 || addT2) { // if Lindblad terms, preallocate matrix. Otherwise, leave zero matrix
-    MatSetType(Ad, MATMPIAIJ);
-    MatMPIAIJSetPreallocation(Ad, noscillators+5, NULL, noscillators+5, NULL);
-  }
-  MatSetFromOptions(Ad);
-  MatSetUp(Ad);
-  MatGetOwnershipRange(Ad, &ilow, &iupp);
-
-  if (addT1 || addT2) {  // leave matrix empty if no T1 or T2 decay
-    for (int iosc = 0; iosc < noscillators; iosc++) {
-
-      /* Get T1, T2 times */
-      double gammaT1 = 0.0;
-      double gammaT2 = 0.0;
-      if (oscil_vec[iosc]->getDecayTime()   > 1e-14) gammaT1 = 1./(oscil_vec[iosc]->getDecayTime());
-      if (oscil_vec[iosc]->getDephaseTime() > 1e-14) gammaT2 = 1./(oscil_vec[iosc]->getDephaseTime());
-
-      // Dimensions 
-      int nk     = oscil_vec[iosc]->getNLevels();
-      int nprek  = oscil_vec[iosc]->dim_preOsc;
-      int npostk = oscil_vec[iosc]->dim_postOsc;
-
-      /* Iterate over local rows of Ad */
-      for (int row = ilow; row<iupp; row++){
-
-        /* Add Ad += gamma_j * L \kron L */
-        r1 = row % (dimmat*nk*npostk);
-        r1a = r1 / (dimmat*npostk);
-        r1b = r1 % (npostk*dimmat);
-        r1b = r1b % (nk*npostk);
-        r1b = r1b / npostk;
-        // T1  decay (L1 = a_j)
-        if (addT1) { 
-          if (r1a < nk-1 && r1b < nk-1) {
-            val = gammaT1 * sqrt( (r1a+1) * (r1b+1) );
-            col1 = row + npostk * dimmat + npostk;
-            if (fabs(val)>1e-14) MatSetValue(Ad, row, col1, val, ADD_VALUES);
-          }
-        }
-        // T2  dephasing (L1 = a_j^Ta_j)
-        if (addT2) { 
-          val = gammaT2 * r1a * r1b ;
-          if (fabs(val)>1e-14) MatSetValue(Ad, row, row, val, ADD_VALUES);
-        }
-
-        /* Add Ad += - gamma_j/2  I_n  \kron L^TL  */
-        r1 = row % (nk*npostk);
-        r1 = r1 / npostk;
-        if (addT1) {
-          val = - gammaT1/2. * r1;
-          if (fabs(val)>1e-14) MatSetValue(Ad, row, row, val, ADD_VALUES);
-        }
-        if (addT2) {
-          val = -gammaT2/2. * r1*r1;
-          if (fabs(val)>1e-14) MatSetValue(Ad, row, row, val, ADD_VALUES);
-        }
 
-        /* Add Ad += - gamma_j/2  L^TL \kron I_n */
-        r1 = row % (nk*npostk*dimmat);
-        r1 = r1 / (npostk*dimmat);
-        if (addT1) {
-          val = -gammaT1/2. * r1;
-          if (fabs(val)>1e-14) MatSetValue(Ad, row, row, val, ADD_VALUES);
-        }
-        if (addT2) {
-          val = -gammaT2/2. * r1*r1;
-          if (fabs(val)>1e-14) MatSetValue(Ad, row, row, val, ADD_VALUES);
-        }
+  /* Second pass: columns and values, in ascending column order */
+  std::vector<PetscInt> colA(rowptrA[nrows]), colB(rowptrB[nrows]);
+  std::vector<PetscScalar> valA(rowptrA[nrows]), valB(rowptrB[nrows]);
+  itnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, itnext)
+  for (int it = ilow; it < iupp; it++) {
+    if (it != itnext) TensorSetIndex(noscillators, nlevels.data(), it, i.data(), ip.data());
+    int r = it - ilow;
+    if (rowptrB[r+1] > rowptrB[r]) {
+      colB[rowptrB[r]] = it;
+      valB[rowptrB[r]] = diagB[r];
+    }
+    int j = rowptrA[r];
+    if (fabs(diagA[r]) > 1e-14) {
+      colA[j] = it;
+      valA[j] = diagA[r];
+      j++;
+    }
+    for (int k = noscillators-1; k >= 0; k--) {
+      if (gamma1[k] > 0.0 && i[k] < nlevels[k]-1 && ip[k] < nlevels[k]-1) {
+        colA[j] = it + stride[k] + stride[k] * dimmat;
+        valA[j] = gamma1[k] * sqrt( (i[k]+1) * (ip[k]+1) );
+        j++;
       }
     }
+    TensorIncrementIndex(noscillators, nlevels.data(), i.data(), ip.data());
+    itnext = it+1;
   }
-  MatAssemblyBegin(Ad, MAT_FINAL_ASSEMBLY);
-  MatAssemblyEnd(Ad, MAT_FINAL_ASSEMBLY);
 
-  /* Allocate some auxiliary vectors */
-  MatCreateVecs(Ac_vec[0], &aux, NULL);
+  /* Create the Petsc matrices from the local CSR arrays */
+  MatCreateMPIAIJWithArrays(PETSC_COMM_WORLD, nrows, PETSC_DECIDE, dim, dim, rowptrB.data(), colB.data(), valB.data(), &Bd);
+  MatCreateMPIAIJWithArrays(PETSC_COMM_WORLD, nrows, PETSC_DECIDE, dim, dim, rowptrA.data(), colA.data(), valA.data(), &Ad);
 }
 
 int MasterEq::getDim(){ return dim; }
 
+int MasterEq::getDimState(){ 
+  if (hermitian_storage) return dim_rho*(dim_rho+1)/2;
+  return dim;
+}
+
 int MasterEq::getDimEss(){ return dim_ess; }
 
 int MasterEq::getDimRho(){ return dim_rho; }
@@ -561,9 +757,46 @@ int MasterEq::assemble_RHS(const double t){
 }
 
 
+bool MasterEq::assemble_RHS_mean(const double t1, const double w1, const double t2, const double w2){
+
+  /* Coupling terms J_kl cos(eta_kl t), J_kl sin(eta_kl t) can't be averaged through the controls */
+  for (int i = 0; i < Jkl.size(); i++) {
+    if (fabs(Jkl[i]) > 1e-12 && fabs(eta[i]) > 1e-12) return false;
+  }
+
+  RHSctx.time = t1;
+  for (int iosc = 0; iosc < noscillators; iosc++) {
+    double p1, q1, p2, q2;
+    oscil_vec[iosc]->evalControl(t1, &p1, &q1);
+    oscil_vec[iosc]->evalControl(t2, &p2, &q2);
+    RHSctx.control_Re[iosc] = (w1 * p1 + w2 * p2) / (w1 + w2);
+    RHSctx.control_Im[iosc] = (w1 * q1 + w2 * q2) / (w1 + w2);
+  }
+
+  return true;
+}
 
 Mat MasterEq::getRHS() { return RHS; }
 
+void MasterEq::initBatch(const int nbatch_){
+  int mpisize_petsc;
+  MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+  if (schroedinger || hermitian_storage || RHSctx.fused == NULL || mpisize_petsc > 1) {
+    printf("ERROR: Batched time stepping requires the sparse-matrix solver (usematfree = false), Lindblad's equation in full storage (schroedinger = false, hermitian_storage = false) and serial Petsc.\n");
+    exit(1);
+  }
+  nbatch = nbatch_;
+
+  MatCreateShell(PETSC_COMM_WORLD, PETSC_DECIDE, PETSC_DECIDE, 2*dim*nbatch, 2*dim*nbatch, (void**) &RHSctx, &RHS_batch);
+  MatSetOptionsPrefix(RHS_batch, "batch");
+  MatSetFromOptions(RHS_batch); MatSetUp(RHS_batch);
+  MatAssemblyBegin(RHS_batch,MAT_FINAL_ASSEMBLY); MatAssemblyEnd(RHS_batch,MAT_FINAL_ASSEMBLY);
+  MatShellSetOperation(RHS_batch, MATOP_MULT, (void(*)(void)) myMatMult_batch);
+  MatShellSetOperation(RHS_batch, MATOP_MULT_TRANSPOSE, (void(*)(void)) myMatMultTranspose_batch);
+}
+
+Mat MasterEq::getRHS_batch() { return RHS_batch; }
+
 
 // void MasterEq::createReducedDensity(const Vec rho, Vec *reduced, const std::vector<int>& oscilIDs) {
 
@@ -713,12 +946,16 @@ Mat MasterEq::getRHS() { return RHS; }
 void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const double alpha, Vec grad) {
 
 
-  if (usematfree) {  // Matrix-free solver
+  if (usematfree && !schroedinger) {  // Matrix-free solver
     double res_p_re,  res_p_im, res_q_re, res_q_im;
 
+    /* With parallel Petsc, each process sums over its own rows and reads x through its local copy, see fillHalo() */
+    bool distributed = (RHSctx.halo != NULL);
     const double* xptr, *xbarptr;
-    VecGetArrayRead(x, &xptr);
+    if (distributed) xptr = fillHalo(&RHSctx, x);
+    else VecGetArrayRead(x, &xptr);
     VecGetArrayRead(xbar, &xbarptr);
+    xbarptr -= 2*RHSctx.ilow;
 
     double* coeff_p = new double [noscillators];
     double* coeff_q = new double [noscillators];
@@ -727,7 +964,10 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
       coeff_q[i] = 0.0;
     }
 
-    if (noscillators == 2) {
+    if (hermitian_storage) {
+      /* Sum over the upper triangle of rho */
+      matfree_packed_dRHSdp(&RHSctx, xptr, xbarptr, coeff_p, coeff_q);
+    } else if (!distributed && noscillators == 2) {
     /* compute strides for accessing x at i0+1, i0-1, i0p+1, i0p-1, i1+1, i1-1, i1p+1, i1p-1: */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -761,7 +1001,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 3) {
+    } else if (!distributed && noscillators == 3) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -806,7 +1046,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 4) {
+    } else if (!distributed && noscillators == 4) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -862,7 +1102,7 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else if (noscillators == 5) {
+    } else if (!distributed && noscillators == 5) {
       /* compute strides for accessing x */
       int n0 = nlevels[0];
       int n1 = nlevels[1];
@@ -929,13 +1169,55 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
           }
         }
       }
-    } else { 
-      printf("This should never happen!\n"); 
-      exit(1);
+    } else {
+      /* compute strides for accessing x */
+      int dim_rho = 1;
+      for (int k=0; k<noscillators; k++) dim_rho *= nlevels[k];
+      std::vector<int> stridei(noscillators), strideip(noscillators);
+      int stride = 1;
+      for (int k=noscillators-1; k>=0; k--){
+        stridei[k]  = stride;
+        strideip[k] = stride * dim_rho;
+        stride *= nlevels[k];
+      }
+      /* offsets for reading x at ik+-1, ik'+-1, in the local copy of x with parallel Petsc */
+      std::vector<int> offi(noscillators), offim(noscillators), offip(noscillators), offipm(noscillators);
+      for (int k=0; k<noscillators; k++){
+        offi[k]   = haloOffset(&RHSctx, stridei[k]);
+        offim[k]  = haloOffset(&RHSctx, -stridei[k]);
+        offip[k]  = haloOffset(&RHSctx, strideip[k]);
+        offipm[k] = haloOffset(&RHSctx, -strideip[k]);
+      }
+
+      /* --- Collect coefficients for gradient --- */
+      std::vector<int> i(noscillators, 0), ip(noscillators, 0);
+      TensorSetIndex(noscillators, nlevels.data(), RHSctx.ilow, i.data(), ip.data());
+      // Iterate over (local) indices of xbar
+      for (int it = RHSctx.ilow; it < RHSctx.iupp; it++) {
+        /* Get xbar */
+        double xbarre = xbarptr[2*it];
+        double xbarim = xbarptr[2*it+1];
+
+        /* --- Oscillator k --- */
+        for (int k=0; k<noscillators; k++){
+          dRHSdp_getcoeffs(it, nlevels[k], i[k], ip[k], offi[k], offim[k], offip[k], offipm[k], xptr, &res_p_re, &res_p_im, &res_q_re, &res_q_im);
+          coeff_p[k] += res_p_re * xbarre + res_p_im * xbarim;
+          coeff_q[k] += res_q_re * xbarre + res_q_im * xbarim;
+        }
+
+        TensorIncrementIndex(noscillators, nlevels.data(), i.data(), ip.data());
+      }
     }
-    VecRestoreArrayRead(x, &xptr);
+    if (!distributed) VecRestoreArrayRead(x, &xptr);
+    xbarptr += 2*RHSctx.ilow;
     VecRestoreArrayRead(xbar, &xbarptr);
 
+    /* Sum up the contributions of all processes */
+    if (distributed) {
+      MPI_Allreduce(MPI_IN_PLACE, coeff_p, noscillators, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+      MPI_Allreduce(MPI_IN_PLACE, coeff_q, noscillators, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+    }
+
     /* Set the gradient values */
     int shift = 0;
     for (int iosc = 0; iosc < noscillators; iosc++){
@@ -961,14 +1243,12 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
 
     delete [] coeff_p;
     delete [] coeff_q;
-  } else {  // sparse matrix solver
+  } else {  // sparse matrix solver, or Schroedinger's equation
 
-  /* Get real and imaginary part from x and x_bar */
-  Vec u, v, ubar, vbar;
-  VecGetSubVector(x, isu, &u);
-  VecGetSubVector(x, isv, &v);
-  VecGetSubVector(xbar, isu, &ubar);
-  VecGetSubVector(xbar, isv, &vbar);
+  /* Contract xbar with the control building blocks applied to x, in one pass over the fused matrix (or the state vector) */
+  std::vector<double> gA, gB;
+  if (schroedinger) schroedinger_dRHSdp(&RHSctx, x, xbar, gA, gB);
+  else              sparsemat_dRHSdp(&RHSctx, x, xbar, gA, gB);
 
   /* Loop over oscillators */
   int col_shift = 0;
@@ -981,23 +1261,12 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
     }
     oscil_vec[iosc]->evalControl_diff(t, dRedp, dImdp);
 
-    /* Compute terms in RHS(x)^T xbar */
-    double uAubar, vAvbar, vBubar, uBvbar;
-    MatMult(Ac_vec[iosc], u, aux);
-    VecDot(aux, ubar, &uAubar);
-    MatMult(Ac_vec[iosc], v, aux);
-    VecDot(aux, vbar, &vAvbar);
-    MatMult(Bc_vec[iosc], u, aux);
-    VecDot(aux, vbar, &uBvbar);
-    MatMult(Bc_vec[iosc], v, aux);
-    VecDot(aux, ubar, &vBubar);
-
     /* Number of parameters for this oscillator */
     int nparams_iosc = getOscillator(iosc)->getNParams();
 
     /* Set gradient terms for each control parameter */
     for (int iparam=0; iparam < nparams_iosc; iparam++) {
-      vals[iparam] = alpha * ((uAubar + vAvbar) * dImdp[iparam] + ( -vBubar + uBvbar) * dRedp[iparam]);
+      vals[iparam] = alpha * (gA[iosc] * dImdp[iparam] + gB[iosc] * dRedp[iparam]);
       cols[iparam] = col_shift + iparam;
     }
     VecSetValues(grad, nparams_iosc, cols, vals, ADD_VALUES);
@@ -1005,12 +1274,6 @@ void MasterEq::computedRHSdp(const double t, const Vec x, const Vec xbar, const
   }
   VecAssemblyBegin(grad);
   VecAssemblyEnd(grad);
-
-  /* Restore x */
-  VecRestoreSubVector(x, isu, &u);
-  VecRestoreSubVector(x, isv, &v);
-  VecRestoreSubVector(xbar, isu, &ubar);
-  VecRestoreSubVector(xbar, isv, &vbar);
   }
 
 }
@@ -1031,6 +1294,123 @@ void MasterEq::setControlAmplitudes(const Vec x) {
 }
 
 
+void MasterEq::getCollapseRates(const Vec psi, std::vector<double>& rates){
+  assert(schroedinger);
+  rates.assign(2*noscillators, 0.0);
+
+  /* Collapse rates gamma1 = 1/T1 and gamma2 = 1/T2 */
+  std::vector<double> gamma1(noscillators, 0.0), gamma2(noscillators, 0.0);
+  for (int k = 0; k < noscillators; k++) {
+    if (addT1 && oscil_vec[k]->getDecayTime()   > 1e-14) gamma1[k] = 1./oscil_vec[k]->getDecayTime();
+    if (addT2 && oscil_vec[k]->getDephaseTime() > 1e-14) gamma2[k] = 1./oscil_vec[k]->getDephaseTime();
+  }
+
+  /* ||sqrt(gamma1) a_k psi||^2 = gamma1 sum_i i_k |psi_i|^2 and ||sqrt(gamma2) a_k^d a_k psi||^2 = gamma2 sum_i i_k^2 |psi_i|^2 */
+  const double* xptr;
+  VecGetArrayRead(psi, &xptr);
+  std::vector<int> i(noscillators, 0), ip(noscillators, 0);
+  for (int it = 0; it < dim_rho; it++) {
+    double pop = xptr[2*it] * xptr[2*it] + xptr[2*it+1] * xptr[2*it+1];
+    for (int k = 0; k < noscillators; k++) {
+      rates[2*k]   += gamma1[k] * i[k] * pop;
+      rates[2*k+1] += gamma2[k] * i[k] * i[k] * pop;
+    }
+    TensorIncrementIndex(noscillators, nlevels.data(), i.data(), ip.data());
+  }
+  VecRestoreArrayRead(psi, &xptr);
+}
+
+void MasterEq::applyCollapse(Vec psi, const int j){
+  assert(schroedinger);
+  int k = j / 2;
+  int nk = nlevels[k];
+  int stride = oscil_vec[k]->dim_postOsc;
+
+  /* Collapse rate gamma1 = 1/T1 or gamma2 = 1/T2 */
+  double gamma = 0.0;
+  if (j % 2 == 0 && addT1 && oscil_vec[k]->getDecayTime()   > 1e-14) gamma = 1./oscil_vec[k]->getDecayTime();
+  if (j % 2 == 1 && addT2 && oscil_vec[k]->getDephaseTime() > 1e-14) gamma = 1./oscil_vec[k]->getDephaseTime();
+  double sqrtgamma = sqrt(gamma);
+
+  double* xptr;
+  VecGetArray(psi, &xptr);
+  for (int it = 0; it < dim_rho; it++) {
+    int ik = (it / stride) % nk;
+    double val;
+    if (j % 2 == 0) { // decay: (a_k psi)_i = sqrt(i_k+1) psi_{i + e_k}. Reads ahead of it only, so it can be done in place.
+      if (ik < nk-1) {
+        val = sqrtgamma * sqrt(ik + 1);
+        xptr[2*it]   = val * xptr[2*(it + stride)];
+        xptr[2*it+1] = val * xptr[2*(it + stride)+1];
+      } else {
+        xptr[2*it]   = 0.0;
+        xptr[2*it+1] = 0.0;
+      }
+    } else { // dephasing: (a_k^d a_k psi)_i = i_k psi_i
+      xptr[2*it]   *= sqrtgamma * ik;
+      xptr[2*it+1] *= sqrtgamma * ik;
+    }
+  }
+  VecRestoreArray(psi, &xptr);
+}
+
+
+void MasterEq::packHermitian(const Vec rho, Vec x){
+  const double* rhoptr;
+  double* xptr;
+  VecGetArrayRead(rho, &rhoptr);
+  VecGetArray(x, &xptr);
+  for (int j=0; j<dim_rho; j++){
+    for (int i=0; i<=j; i++){
+      int it  = j*(j+1)/2 + i;
+      int iij = getVecID(i, j, dim_rho);
+      int iji = getVecID(j, i, dim_rho);
+      xptr[2*it]   = 0.5 * (rhoptr[getIndexReal(iij)] + rhoptr[getIndexReal(iji)]);
+      xptr[2*it+1] = 0.5 * (rhoptr[getIndexImag(iij)] - rhoptr[getIndexImag(iji)]);
+    }
+  }
+  VecRestoreArrayRead(rho, &rhoptr);
+  VecRestoreArray(x, &xptr);
+}
+
+void MasterEq::unpackHermitian(const Vec x, Vec rho){
+  const double* xptr;
+  double* rhoptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(rho, &rhoptr);
+  for (int j=0; j<dim_rho; j++){
+    for (int i=0; i<dim_rho; i++){
+      int iij = getVecID(i, j, dim_rho);
+      hermGet(xptr, i, j, 1.0, &rhoptr[getIndexReal(iij)], &rhoptr[getIndexImag(iij)]);
+    }
+  }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(rho, &rhoptr);
+}
+
+void MasterEq::unpackHermitian_diff(const Vec rhobar, Vec xbar){
+  const double* rhobarptr;
+  double* xbarptr;
+  VecGetArrayRead(rhobar, &rhobarptr);
+  VecGetArray(xbar, &xbarptr);
+  for (int j=0; j<dim_rho; j++){
+    for (int i=0; i<=j; i++){
+      int it  = j*(j+1)/2 + i;
+      int iij = getVecID(i, j, dim_rho);
+      int iji = getVecID(j, i, dim_rho);
+      if (i == j) {
+        xbarptr[2*it] += rhobarptr[getIndexReal(iij)];
+      } else {
+        xbarptr[2*it]   += rhobarptr[getIndexReal(iij)] + rhobarptr[getIndexReal(iji)];
+        xbarptr[2*it+1] += rhobarptr[getIndexImag(iij)] - rhobarptr[getIndexImag(iji)];
+      }
+    }
+  }
+  VecRestoreArrayRead(rhobar, &rhobarptr);
+  VecRestoreArray(xbar, &xbarptr);
+}
+
+
 int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionType initcond_type, const std::vector<int>& oscilIDs, Vec rho0){
 
   PetscInt ilow, iupp; 
@@ -1038,7 +1418,6 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
   double val;
   int dim_post;
   int initID = 1;    // Output: ID for this initial condition */
-  int dim_rho = (int) sqrt(dim); // N
 
   /* Switch over type of initial condition */
   switch (initcond_type) {
@@ -1110,7 +1489,17 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
     case InitialConditionType::NPLUSONE:
       VecGetOwnershipRange(rho0, &ilow, &iupp);
 
-      if (iinit < dim_rho) {// Diagonal e_j e_j^\dag
+      if (schroedinger) { // psi = e_j, or the fully rotated 1/sqrt(d)*Ones(d)
+        VecZeroEntries(rho0);
+        for (int i=0; i<dim_rho; i++){
+          elemID = getIndexReal(i);
+          if (iinit < dim_rho) val = (i == iinit) ? 1.0 : 0.0;
+          else                 val = 1.0 / sqrt(dim_rho);
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        }
+        VecAssemblyBegin(rho0); VecAssemblyEnd(rho0);
+      }
+      else if (iinit < dim_rho) {// Diagonal e_j e_j^\dag
         VecZeroEntries(rho0);
         elemID = getIndexReal(getVecID(iinit, iinit, dim_rho));
         val = 1.0;
@@ -1155,6 +1544,7 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
 
       /* Set B_{mm} */
       elemID = getIndexReal(getVecID(diagelem, diagelem, dim_rho)); // real part in vectorized system
+      if (schroedinger) elemID = getIndexReal(diagelem);            // psi = e_m
       val = 1.0;
       VecGetOwnershipRange(rho0, &ilow, &iupp);
       if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
@@ -1195,7 +1585,21 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
         j = mapEssToFull(j, nlevels, nessential);
       }
 
-      if (k == j) {
+      if (schroedinger) {
+        /* B_{kj} = psi psi^\dagger with psi = e_k (k==j), 1/sqrt(2)(e_k + e_j) (k<j), or 1/sqrt(2)(e_k + i e_j) (k>j) */
+        if (k == j) {
+          elemID = getIndexReal(k);
+          val = 1.0;
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        } else {
+          elemID = getIndexReal(k);
+          val = 1.0 / sqrt(2.0);
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+          elemID = k < j ? getIndexReal(j) : getIndexImag(j);
+          if (ilow <= elemID && elemID < iupp) VecSetValues(rho0, 1, &elemID, &val, INSERT_VALUES);
+        }
+      }
+      else if (k == j) {
         /* B_{kk} = E_{kk} -> set only one element at (k,k) */
         elemID = getIndexReal(getVecID(k, k, dim_rho)); // real part in vectorized system
         double val = 1.0;
@@ -1251,21 +1655,152 @@ int MasterEq::getRhoT0(const int iinit, const int ninit, const InitialConditionT
 }
 
 
-/* Sparse matrix solver: Define the action of RHS on a vector x */
+/* Sparse-matrix solver: Coefficients of the fused building blocks at the current time and controls, as complex numbers z = zre + i zim. 
+ * Slots: 0: Ad, 1: Bd, 2+2k: Ac_k, 3+2k: Bc_k, 2+2Q+2kl: Ad_kl, 3+2Q+2kl: Bd_kl. A-blocks contribute to the real part, B-blocks to the imaginary part of the RHS. */
+static void sparsemat_getCoeffs(MatShellCtx* shellctx, std::vector<double>& zre, std::vector<double>& zim){
+  int nosc = shellctx->nlevels.size();
+  int npairs = nosc*(nosc-1)/2;
+  zre.assign(2 + 2*nosc + 2*npairs, 0.0);
+  zim.assign(2 + 2*nosc + 2*npairs, 0.0);
+  zre[0] = 1.0;
+  zim[1] = 1.0;
+  for (int iosc = 0; iosc < nosc; iosc++) {
+    zre[2 + 2*iosc] = shellctx->control_Im[iosc];  // q_k A_k
+    zim[3 + 2*iosc] = shellctx->control_Re[iosc];  // p_k B_k
+  }
+  for (int id_kl = 0; id_kl < npairs; id_kl++) {
+    double Jkl = shellctx->Jkl[id_kl];
+    double etakl = shellctx->eta[id_kl];
+    zre[2 + 2*nosc + 2*id_kl] = Jkl * sin(etakl * shellctx->time);  // J_kl sin(eta_kl t) Ad_kl
+    zim[3 + 2*nosc + 2*id_kl] = Jkl * cos(etakl * shellctx->time);  // J_kl cos(eta_kl t) Bd_kl
+  }
+}
+
+
+/* Sparse-matrix solver: y = A x in complex form for the local rows ilow <= it < ilow + nrows of the fused matrix A plus the Kronecker terms, with entry coefficients z = zre + i zim per slot. 
+ * x is indexed by the column (remapped into the local copy of x with parallel Petsc, see fillHalo()), y by the local row. Both are stored in double or single precision (T), the rows are accumulated in double. */
+template <typename T>
+static void sparsemat_apply_rows(const FusedCSR* A, const std::vector<KronTerm>* kron, const std::vector<int>& nlevels, const int ilow, const std::vector<double>& zre, const std::vector<double>& zim, const T* xptr, T* yptr){
+  int nrows = A->nrows;
+  int nosc = nlevels.size();
+  int nterms = kron->size();
+
+  /* Each OpenMP thread sets the tensor index at the start of its block of rows and increments it from there */
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int itnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, itnext)
+  for (int irow = 0; irow < nrows; irow++) {
+    int it = ilow + irow;
+    if (it != itnext) TensorSetIndex(nosc, nlevels.data(), it, i.data(), ip.data());
+    double yre = 0.0;
+    double yim = 0.0;
+    for (int j = A->rowptr[irow]; j < A->rowptr[irow+1]; j++) {
+      int col = A->col[j];
+      double a = A->val[j] * zre[A->slot[j]];
+      double b = A->val[j] * zim[A->slot[j]];
+      yre += a * xptr[2*col] - b * xptr[2*col+1];
+      yim += b * xptr[2*col] + a * xptr[2*col+1];
+    }
+    for (int iterm = 0; iterm < nterms; iterm++) {
+      const KronTerm& term = (*kron)[iterm];
+      const int* lvl = term.primed ? ip.data() : i.data();
+      double val = term.val[lvl[term.k] * term.nl + (term.l >= 0 ? lvl[term.l] : 0)];
+      if (val == 0.0) continue;
+      int col = it + term.xshift;
+      double a = val * zre[term.slot];
+      double b = val * zim[term.slot];
+      yre += a * xptr[2*col] - b * xptr[2*col+1];
+      yim += b * xptr[2*col] + a * xptr[2*col+1];
+    }
+    yptr[2*irow]   = yre;
+    yptr[2*irow+1] = yim;
+    TensorIncrementIndex(nosc, nlevels.data(), i.data(), ip.data());
+    itnext = it + 1;
+  }
+}
+
+
+/* Sparse-matrix solver: y = A x in complex form for the fused matrix A plus the Kronecker terms, scaling each entry by the coefficient of its slot (or its conjugate) on the fly */
+static void sparsemat_apply(MatShellCtx* shellctx, const FusedCSR* A, const std::vector<KronTerm>* kron, const bool conjugate, Vec x, Vec y){
+
+  /* Get coefficients */
+  std::vector<double> zre, zim;
+  sparsemat_getCoeffs(shellctx, zre, zim);
+  if (conjugate) for (int i = 0; i < zim.size(); i++) zim[i] = -zim[i];
+
+  /* Get access to x (indexed by the global column) and y (local rows) */
+  const double* xptr;
+  double* yptr;
+  if (shellctx->halo != NULL) xptr = fillHalo(shellctx, x);
+  else VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+
+  /* Single pass over the rows */
+  sparsemat_apply_rows(A, kron, shellctx->nlevels, shellctx->ilow, zre, zim, xptr, yptr);
+
+  /* Restore */
+  if (shellctx->halo == NULL) VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+}
+
+
+/* Sparse-matrix solver: Contractions of xbar with the control blocks applied to x, for the gradient. With z = u + iv and zbar = ubar + i vbar, per oscillator k:
+ *   gA[k] =  Re(zbar^H A_k z) = ubar^T A_k u + vbar^T A_k v
+ *   gB[k] = -Im(zbar^H B_k z) = vbar^T B_k u - ubar^T B_k v  */
+static void sparsemat_dRHSdp(MatShellCtx* shellctx, Vec x, Vec xbar, std::vector<double>& gA, std::vector<double>& gB){
+
+  int nosc = shellctx->nlevels.size();
+  const int* n = shellctx->nlevels.data();
+  const std::vector<KronTerm>& kron = *shellctx->kron;
+  gA.assign(nosc, 0.0);
+  gB.assign(nosc, 0.0);
+
+  /* Get access to x (indexed by the global column) and xbar (local rows) */
+  const double* xptr;
+  const double* xbarptr;
+  if (shellctx->halo != NULL) xptr = fillHalo(shellctx, x);
+  else VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(xbar, &xbarptr);
+
+  /* Single pass over the local rows and the Kronecker terms of the control slots */
+  std::vector<int> i(nosc), ip(nosc);
+  TensorSetIndex(nosc, n, shellctx->ilow, i.data(), ip.data());
+  for (int it = shellctx->ilow; it < shellctx->iupp; it++) {
+    int irow = it - shellctx->ilow;
+    double ubar = xbarptr[2*irow];
+    double vbar = xbarptr[2*irow+1];
+    for (int iterm = 0; iterm < kron.size(); iterm++) {
+      const KronTerm& term = kron[iterm];
+      int slot = term.slot - 2;
+      if (slot >= 2*nosc) continue;
+      const int* lvl = term.primed ? ip.data() : i.data();
+      double val = term.val[lvl[term.k] * term.nl + (term.l >= 0 ? lvl[term.l] : 0)];
+      if (val == 0.0) continue;
+      double u = xptr[2*(it + term.xshift)];
+      double v = xptr[2*(it + term.xshift)+1];
+      if (slot % 2 == 0) gA[slot/2] += val * (ubar*u + vbar*v);
+      else               gB[slot/2] += val * (vbar*u - ubar*v);
+    }
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
+  }
+
+  /* Restore */
+  if (shellctx->halo == NULL) VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(xbar, &xbarptr);
+
+  /* Sum over Petsc's processes */
+  MPI_Allreduce(MPI_IN_PLACE, gA.data(), nosc, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+  MPI_Allreduce(MPI_IN_PLACE, gB.data(), nosc, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+}
+
+
+/* Sparse-matrix solver: Define the action of RHS on a vector x */
 int myMatMult_sparsemat(Mat RHS, Vec x, Vec y){
 
   /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
 
-/* Get u, v from x and y  */
-  Vec u, v;
-  Vec uout, vout;
-  VecGetSubVector(x, *shellctx->isu, &u);
-  VecGetSubVector(x, *shellctx->isv, &v);
-  VecGetSubVector(y, *shellctx->isu, &uout);
-  VecGetSubVector(y, *shellctx->isv, &vout);
-
   // uout = Re*u - Im*v
   //      = (Ad +  sum_k q_kA_k)*u - (Bd + sum_k p_kB_k)*v
           // + sum_kl J_kl*sin(eta_kl*t) * Ad_kl * u
@@ -1274,68 +1809,8 @@ int myMatMult_sparsemat(Mat RHS, Vec x, Vec y){
   //      = (Bd + sum_k p_kB_k)*u + (Ad + sum_k q_kA_k)*v
         // + sum_kl J_kl*cos(eta_kl*t) * Bd_kl * u
         //        + J_kl*sin(eta_kl*t) * Ad_kl * v  ]   cross terms
-
-  // Constant part uout = Adu - Bdv
-  MatMult(*shellctx->Bd, v, uout);
-  VecScale(uout, -1.0);
-  MatMultAdd(*shellctx->Ad, u, uout, uout);
-  // Constant part vout = Adv + Bdu
-  MatMult(*shellctx->Ad, v, vout);
-  MatMultAdd(*shellctx->Bd, u, vout, vout);
-
-
-  /* Control terms and Jaynes-Cummings coupling terms */
-  int id_kl = 0; // index for accessing Ad_kl inside Ad_vec
-  for (int iosc = 0; iosc < shellctx->nlevels.size(); iosc++) {
-
-    /* Get controls */
-    double p = shellctx->control_Re[iosc];
-    double q = shellctx->control_Im[iosc];
-
-    // uout += q^k*Acu
-    MatMult((*(shellctx->Ac_vec))[iosc], u, *shellctx->aux);
-    VecAXPY(uout, q, *shellctx->aux);
-    // uout -= p^kBcv
-    MatMult((*(shellctx->Bc_vec))[iosc], v, *shellctx->aux);
-    VecAXPY(uout, -1.*p, *shellctx->aux);
-    // vout += q^kAcv
-    MatMult((*(shellctx->Ac_vec))[iosc], v, *shellctx->aux);
-    VecAXPY(vout, q, *shellctx->aux);
-    // vout += p^kBcu
-    MatMult((*(shellctx->Bc_vec))[iosc], u, *shellctx->aux);
-    VecAXPY(vout, p, *shellctx->aux);
-
-    // Coupling terms
-    for (int josc=iosc+1; josc<shellctx->nlevels.size(); josc++){
-
-      double Jkl = shellctx->Jkl[id_kl]; 
-      if (fabs(Jkl) > 1e-12) {
-
-        double etakl = shellctx->eta[id_kl];
-        double coskl = cos(etakl * shellctx->time);
-        double sinkl = sin(etakl * shellctx->time);
-        // uout += J_kl*sin*Adklu
-        MatMult((*(shellctx->Ad_vec))[id_kl], u, *shellctx->aux);
-        VecAXPY(uout, Jkl*sinkl, *shellctx->aux);
-        // uout += -Jkl*cos*Bdklv
-        MatMult((*(shellctx->Bd_vec))[id_kl], v, *shellctx->aux);
-        VecAXPY(uout, -Jkl*coskl, *shellctx->aux);
-        // vout += Jkl*cos*Bdklu
-        MatMult((*(shellctx->Bd_vec))[id_kl], u, *shellctx->aux);
-        VecAXPY(vout, Jkl*coskl, *shellctx->aux);
-        //vout += Jkl*sin*Adklv
-        MatMult((*(shellctx->Ad_vec))[id_kl], v, *shellctx->aux);
-        VecAXPY(vout, Jkl*sinkl, *shellctx->aux);
-      }
-      id_kl++;
-    }
-  }
-
-  /* Restore */
-  VecRestoreSubVector(x, *shellctx->isu, &u);
-  VecRestoreSubVector(x, *shellctx->isv, &v);
-  VecRestoreSubVector(y, *shellctx->isu, &uout);
-  VecRestoreSubVector(y, *shellctx->isv, &vout);
+  // i.e. uout + i vout = (Re + i Im) * (u + i v), applied in one pass over the fused building blocks.
+  sparsemat_apply(shellctx, shellctx->fused, shellctx->kron, false, x, y);
 
   return 0;
 }
@@ -1344,18 +1819,10 @@ int myMatMult_sparsemat(Mat RHS, Vec x, Vec y){
 /* Sparse-matrix solver: Define the action of RHS^T on a vector x */
 int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y) {
 
-  /* Get time from shell context */
+  /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
 
-  /* Get u, v from x and y  */
-  Vec u, v;
-  Vec uout, vout;
-  VecGetSubVector(x, *shellctx->isu, &u);
-  VecGetSubVector(x, *shellctx->isv, &v);
-  VecGetSubVector(y, *shellctx->isu, &uout);
-  VecGetSubVector(y, *shellctx->isv, &vout);
-
   // uout = Re^T*u + Im^T*v
   //      = (Ad + sum_k q_kA_k)^T*u + (Bd + sum_k p_kB_k)^T*v
           // + sum_kl J_kl*sin(eta_kl*t) * Ad_kl^T * u
@@ -1364,69 +1831,106 @@ int myMatMultTranspose_sparsemat(Mat RHS, Vec x, Vec y) {
   //      = -(Bd + sum_k p_kB_k)^T*u + (Ad + sum_k q_kA_k)^T*v
         // + sum_kl - J_kl*cos(eta_kl*t) * Bd_kl^T * u
         //          + J_kl*sin(eta_kl*t) * Ad_kl^T * v  ]   cross terms
+  // i.e. uout + i vout = (Re - i Im)^T * (u + i v), applied in one pass over the fused transposed building blocks.
+  sparsemat_apply(shellctx, shellctx->fusedT, shellctx->kronT, true, x, y);
+
+  return 0;
+}
+
+
 
-  // Constant part uout = Ad^Tu + Bd^Tv
-  MatMultTranspose(*shellctx->Bd, v, uout);
-  MatMultTransposeAdd(*shellctx->Ad, u, uout, uout);
-  // Constant part vout = -Bd^Tu + Ad^Tv
-  MatMultTranspose(*shellctx->Bd, u, vout);
-  VecScale(vout, -1.0);
-  MatMultTransposeAdd(*shellctx->Ad, v, vout, vout);
-
-  /* Control and coupling term */
-  int id_kl = 0; // index for accessing Ad_kl inside Ad_vec
-  for (int iosc = 0; iosc < shellctx->nlevels.size(); iosc++) {
-    /* Get controls */
-    double p = shellctx->control_Re[iosc];
-    double q = shellctx->control_Im[iosc];
-
-    // uout += q^k*Ac^Tu
-    MatMultTranspose((*(shellctx->Ac_vec))[iosc], u, *shellctx->aux);
-    VecAXPY(uout, q, *shellctx->aux);
-    // uout += p^kBc^Tv
-    MatMultTranspose((*(shellctx->Bc_vec))[iosc], v, *shellctx->aux);
-    VecAXPY(uout, p, *shellctx->aux);
-    // vout += q^kAc^Tv
-    MatMultTranspose((*(shellctx->Ac_vec))[iosc], v, *shellctx->aux);
-    VecAXPY(vout, q, *shellctx->aux);
-    // vout -= p^kBc^Tu
-    MatMultTranspose((*(shellctx->Bc_vec))[iosc], u, *shellctx->aux);
-    VecAXPY(vout, -1.*p, *shellctx->aux);
-
-    // Coupling terms
-    for (int josc=iosc+1; josc<shellctx->nlevels.size(); josc++){
-      double Jkl = shellctx->Jkl[id_kl]; 
-
-      if (fabs(Jkl) > 1e-12) {
-        double etakl = shellctx->eta[id_kl];
-        double coskl = cos(etakl * shellctx->time);
-        double sinkl = sin(etakl * shellctx->time);
-        // uout += J_kl*sin*Adklu^T
-        MatMultTranspose((*(shellctx->Ad_vec))[id_kl], u, *shellctx->aux);
-        VecAXPY(uout, Jkl*sinkl, *shellctx->aux);
-        // uout += +Jkl*cos*Bdklv^T
-        MatMultTranspose((*(shellctx->Bd_vec))[id_kl], v, *shellctx->aux);
-        VecAXPY(uout,  Jkl*coskl, *shellctx->aux);
-        // vout += - Jkl*cos*Bdklu^T
-        MatMultTranspose((*(shellctx->Bd_vec))[id_kl], u, *shellctx->aux);
-        VecAXPY(vout, - Jkl*coskl, *shellctx->aux);
-        //vout += Jkl*sin*Adklv^T
-        MatMultTranspose((*(shellctx->Ad_vec))[id_kl], v, *shellctx->aux);
-        VecAXPY(vout, Jkl*sinkl, *shellctx->aux);
+/* Matrix-free solvers: Diagonal of RHS, interleaved as (ld, dh) per element of the vectorized rho, such that the diagonal part of RHS x is (ld + i dh) * x. Here 
+ *   ld = L1diag + L2 (decay and dephasing), and dh = -(hd(i) - hd(i')) with the drift Hamiltonian hd (detuning, self-kerr and cross-kerr). 
+ * The diagonal only depends on the tensor index and the oscillator parameters. It is computed on the first call for the locally owned rows (all rows of rho in serial), 
+ * and recomputed only if the parameters change. Returns a pointer that is indexed by the global vector index it. */
+static const double* matfree_getDiag(MatShellCtx* shellctx){
+  const int* n = shellctx->nlevels.data();
+  int nosc = shellctx->nlevels.size();
+
+  /* Parameters */
+  std::vector<double> params;
+  for (int k=0; k<nosc; k++){
+    double decay = 0.0, dephase = 0.0;
+    if (shellctx->oscil_vec[k]->getDecayTime() > 1e-14 && shellctx->addT1)   decay = 1./shellctx->oscil_vec[k]->getDecayTime();
+    if (shellctx->oscil_vec[k]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase = 1./shellctx->oscil_vec[k]->getDephaseTime();
+    params.push_back(shellctx->oscil_vec[k]->getDetuning());
+    params.push_back(shellctx->oscil_vec[k]->getSelfkerr());
+    params.push_back(decay);
+    params.push_back(dephase);
+  }
+  params.insert(params.end(), shellctx->crosskerr.begin(), shellctx->crosskerr.end());
+
+  /* Rows: the locally owned rows of the distributed solver, extended to whole runs over the last oscillator, otherwise all elements of rho */
+  int dim_rho = 1;
+  for (int k=0; k<nosc; k++) dim_rho *= n[k];
+  int itlo = 0, ithi = dim_rho*dim_rho;
+  if (shellctx->halo != NULL) {
+    itlo = shellctx->ilow - shellctx->ilow % n[nosc-1];
+    ithi = shellctx->iupp + (n[nosc-1] - shellctx->iupp % n[nosc-1]) % n[nosc-1];
+  }
+  if (params == shellctx->diag_params && shellctx->diag.size() == 2*(ithi - itlo)) return shellctx->diag.data() - 2*itlo;
+
+  /* Compute the diagonal */
+  shellctx->diag.resize(2*(ithi - itlo));
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  TensorSetIndex(nosc, n, itlo, i.data(), ip.data());
+  for (int it = itlo; it < ithi; it++) {
+    double hd = 0.0, hdp = 0.0, ld = 0.0;
+    for (int k=0; k<nosc; k++){
+      double detune = params[4*k], xi = params[4*k+1], decay = params[4*k+2], dephase = params[4*k+3];
+      hd  += detune * i[k]  - xi / 2.0 * i[k] * (i[k]-1);
+      hdp += detune * ip[k] - xi / 2.0 * ip[k] * (ip[k]-1);
+      ld  += - decay / 2.0 * ( i[k] + ip[k] ) + dephase * ( i[k]*ip[k] - 1./2. * (i[k]*i[k] + ip[k]*ip[k]) );
+    }
+    int id = 0;
+    for (int k=0; k<nosc; k++){
+      for (int l=k+1; l<nosc; l++){
+        hd  -= shellctx->crosskerr[id] * i[k] * i[l];
+        hdp -= shellctx->crosskerr[id] * ip[k] * ip[l];
+        id++;
       }
-      id_kl++;
     }
+    shellctx->diag[2*(it-itlo)]   = ld;
+    shellctx->diag[2*(it-itlo)+1] = -(hd - hdp);
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
   }
+  shellctx->diag_params = params;
 
-  /* Restore */
-  VecRestoreSubVector(x, *shellctx->isu, &u);
-  VecRestoreSubVector(x, *shellctx->isv, &v);
-  VecRestoreSubVector(y, *shellctx->isu, &uout);
-  VecRestoreSubVector(y, *shellctx->isv, &vout);
+  return shellctx->diag.data() - 2*itlo;
+}
+
+const double* MasterEq::getDiagonal(){
+  if (schroedinger || hermitian_storage) {
+    printf("ERROR: The diagonal of the RHS is only available for Lindblad's equation in full storage (schroedinger = false, hermitian_storage = false).\n");
+    exit(1);
+  }
+  /* Same for the sparse-matrix solver, whose diagonal entries of Ad and Bd hold ld and dh */
+  return matfree_getDiag(&RHSctx) + 2*RHSctx.ilow;
+}
+
+int myMatGetDiagonal(Mat RHS, Vec d){
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* The control and coupling terms are off-diagonal. The real and imaginary part of element i have the same diagonal entry, the real part of (ld + i dh). */
+  const double* diag = matfree_getDiag(shellctx);
+  PetscScalar* dptr;
+  VecGetArray(d, &dptr);
+  for (int it = shellctx->ilow; it < shellctx->iupp; it++) {
+    dptr[2*(it - shellctx->ilow)]   = diag[2*it];
+    dptr[2*(it - shellctx->ilow)+1] = diag[2*it];
+  }
+  VecRestoreArray(d, &dptr);
 
   return 0;
 }
 
+/* Diagonal coefficients of one run of nl elements for the vectorized kernels: the cached diagonal itself, or converted into d for the single-precision kernels */
+static inline const double* matfree_diagRun(const double* diag, double* /*d*/, const int /*nl*/){ return diag; }
+static inline const float* matfree_diagRun(const double* diag, float* d, const int nl){
+  for (int j = 0; j < 2*nl; j++) d[j] = diag[j];
+  return d;
+}
 
 
 /* Matfree-solver for 2 Oscillators: Define the action of RHS on a vector x */
@@ -1445,25 +1949,15 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1478,9 +1972,10 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei1p = TensorGetIndex(n0,n1, 0,0,0,1);
 
   /* Iterate over indices of output vector y */
-  int it = 0;
+  #pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p*stridei0p + i1p*stridei1p;
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
 
@@ -1488,22 +1983,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
           //Get input x values
           double xre = xptr[2 * it];
           double xim = xptr[2 * it + 1];
-          // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-          //                    vout = (-hd(ik) + hd(ik'))*uin
-          double hd  = H_detune(detuning_freq0, detuning_freq1, i0, i1)
-                     + H_selfkerr(xi0, xi1, i0, i1)
-                     + H_crosskerr(xi01, i0, i1);
-          double hdp = H_detune(detuning_freq0, detuning_freq1, i0p, i1p)
-                     + H_selfkerr(xi0, xi1, i0p, i1p)
-                     + H_crosskerr(xi01, i0p, i1p);
-          double yre = ( hd - hdp ) * xim;
-          double yim = (-hd + hdp ) * xre;
-          // Decay l1, diagonal part: xout += l1diag xin
-          // Dephasing l2: xout += l2(ik, ikp) xin
-          double l1diag = L1diag(decay0, decay1, i0, i1, i0p, i1p);
-          double l2 = L2(dephase0, dephase1, i0, i1, i0p, i1p);
-          yre += (l2 + l1diag) * xre;
-          yim += (l2 + l1diag) * xim;
+          // drift Hamiltonian, decay and dephasing: yout = (ld + i dh) xin, see matfree_getDiag()
+          double ld = diag[2*it];
+          double dh = diag[2*it+1];
+          double yre = ld * xre - dh * xim;
+          double yim = ld * xim + dh * xre;
 
 
           /* --- Offdiagonal: Jkl coupling term --- */
@@ -1555,25 +2039,15 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArray(y, &yptr);
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling 
+  const double* diag = matfree_getDiag(shellctx);
   double J01 = shellctx->Jkl[0];   // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)
     decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2)
-    dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1589,9 +2063,10 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
 
   /* Iterate over indices of output vector y */
-  int it = 0;
+  #pragma omp parallel for collapse(2)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
+      int it = i0p*stridei0p + i1p*stridei1p;
       for (int i0 = 0; i0 < n0; i0++)  {
         for (int i1 = 0; i1 < n1; i1++)  {
 
@@ -1599,22 +2074,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
           //Get input x values
           double xre = xptr[2 * it];
           double xim = xptr[2 * it + 1];
-          // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-          //                         vout = (-hd(ik) + hd(ik'))*uin
-          double hd  = H_detune(detuning_freq0, detuning_freq1, i0, i1)
-                     + H_selfkerr(xi0, xi1, i0, i1)
-                     + H_crosskerr(xi01, i0, i1);
-          double hdp = H_detune(detuning_freq0, detuning_freq1, i0p, i1p)
-                     + H_selfkerr(xi0, xi1, i0p, i1p)
-                     + H_crosskerr(xi01, i0p, i1p);
-          double yre = (-hd + hdp ) * xim;
-          double yim = ( hd - hdp ) * xre;
-          // Decay l1^T, diagonal part: xout += l1diag xin
-          // Dephasing l2^T: xout += l2(ik, ikp) xin
-          double l1diag = L1diag(decay0, decay1, i0, i1, i0p, i1p);
-          double l2 = L2(dephase0, dephase1, i0, i1, i0p, i1p);
-          yre += (l2 + l1diag) * xre;
-          yim += (l2 + l1diag) * xim;
+          // drift Hamiltonian, decay and dephasing, conjugate diagonal: yout = (ld - i dh) xin, see matfree_getDiag()
+          double ld = diag[2*it];
+          double dh = diag[2*it+1];
+          double yre = ld * xre + dh * xim;
+          double yim = ld * xim - dh * xre;
 
           /* --- Offdiagonal coupling term J_kl --- */
           // oscillator 0<->1
@@ -1622,9 +2086,9 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
  
           /* --- Offdiagonal part of decay L1^T */
           // Oscillators 0
-          L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+          L1decay_T(it, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
           // Oscillator 1
-          L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+          L1decay_T(it, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
 
           /* --- Control hamiltonian  --- */
           // Oscillator 0
@@ -1666,33 +2130,19 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   VecGetArrayRead(x, &xptr);
   VecGetArray(y, &yptr); 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi12 = shellctx->crosskerr[2];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J12  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
   double eta02 = shellctx->eta[1];
   double eta12 = shellctx->eta[2];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1714,11 +2164,12 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei1p = TensorGetIndex(n0,n1,n2, 0,0,0,0,1,0);
   int stridei2p = TensorGetIndex(n0,n1,n2, 0,0,0,0,0,1);
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(3)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
+        int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p;
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
             for (int i2 = 0; i2 < n2; i2++)  {
@@ -1727,22 +2178,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
               //Get input x values
               double xre = xptr[2 * it];
               double xim = xptr[2 * it + 1];
-              // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-              //                    vout = (-hd(ik) + hd(ik'))*uin
-              double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0, i1, i2)
-                         + H_selfkerr(xi0, xi1, xi2, i0, i1, i2)
-                         + H_crosskerr(xi01, xi02, xi12, i0, i1, i2);
-              double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0p, i1p, i2p)
-                         + H_selfkerr(xi0, xi1, xi2, i0p, i1p, i2p)
-                         + H_crosskerr(xi01, xi02, xi12, i0p, i1p, i2p);
-              double yre = ( hd - hdp ) * xim;
-              double yim = (-hd + hdp ) * xre;
-              // Decay l1, diagonal part: xout += l1diag xin
-              // Dephasing l2: xout += l2(ik, ikp) xin
-              double l1diag = L1diag(decay0, decay1, decay2, i0, i1, i2, i0p, i1p, i2p);
-              double l2 = L2(dephase0, dephase1, dephase2, i0, i1, i2, i0p, i1p, i2p);
-              yre += (l2 + l1diag) * xre;
-              yim += (l2 + l1diag) * xim;
+              // drift Hamiltonian, decay and dephasing: yout = (ld + i dh) xin, see matfree_getDiag()
+              double ld = diag[2*it];
+              double dh = diag[2*it+1];
+              double yre = ld * xre - dh * xim;
+              double yim = ld * xim + dh * xre;
 
 
               /* --- Offdiagonal: Jkl coupling  --- */
@@ -1804,33 +2244,19 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi12 = shellctx->crosskerr[2];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J12  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
   double eta01 = shellctx->eta[0];
   double eta02 = shellctx->eta[1];
   double eta12 = shellctx->eta[2];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -1852,11 +2278,12 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   int stridei1p = TensorGetIndex(n0,n1,n2, 0,0,0,0,1,0);
   int stridei2p = TensorGetIndex(n0,n1,n2, 0,0,0,0,0,1);
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(3)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
+        int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p;
         for (int i0 = 0; i0 < n0; i0++)  {
           for (int i1 = 0; i1 < n1; i1++)  {
             for (int i2 = 0; i2 < n2; i2++)  {
@@ -1865,22 +2292,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
               //Get input x values
               double xre = xptr[2 * it];
               double xim = xptr[2 * it + 1];
-              // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-              //                         vout = (-hd(ik) + hd(ik'))*uin
-              double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0, i1, i2)
-                         + H_selfkerr(xi0, xi1, xi2, i0, i1, i2)
-                         + H_crosskerr(xi01, xi02, xi12, i0, i1, i2);
-              double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, i0p, i1p, i2p)
-                         + H_selfkerr(xi0, xi1, xi2, i0p, i1p, i2p)
-                         + H_crosskerr(xi01, xi02, xi12, i0p, i1p, i2p);
-              double yre = (-hd + hdp ) * xim;
-              double yim = ( hd - hdp ) * xre;
-              // Decay l1^T, diagonal part: xout += l1diag xin
-              // Dephasing l2^T: xout += l2(ik, ikp) xin
-              double l1diag = L1diag(decay0, decay1, decay2, i0, i1, i2, i0p, i1p, i2p);
-              double l2 = L2(dephase0, dephase1, dephase2, i0, i1, i2, i0p, i1p, i2p);
-              yre += (l2 + l1diag) * xre;
-              yim += (l2 + l1diag) * xim;
+              // drift Hamiltonian, decay and dephasing, conjugate diagonal: yout = (ld - i dh) xin, see matfree_getDiag()
+              double ld = diag[2*it];
+              double dh = diag[2*it+1];
+              double yre = ld * xre + dh * xim;
+              double yim = ld * xim - dh * xre;
 
               /* --- Offdiagonal coupling term J_kl --- */
               // oscillator 0<->1
@@ -1893,11 +2309,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
               /* --- Offdiagonal part of decay L1^T */
               // Oscillators 0
-              L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+              L1decay_T(it, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
               // Oscillator 1
-              L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+              L1decay_T(it, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
              // Oscillator 2
-              L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+              L1decay_T(it, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
 
               /* --- Control hamiltonian  --- */
               // Oscillator 0
@@ -1942,16 +2358,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   VecGetArray(y, &yptr); 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi12 = shellctx->crosskerr[3];  // zz-coupling
-  double xi13 = shellctx->crosskerr[4];  // zz-coupling
-  double xi23 = shellctx->crosskerr[5];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -1964,26 +2371,14 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double eta12 = shellctx->eta[3];
   double eta13 = shellctx->eta[4];
   double eta23 = shellctx->eta[5];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2015,12 +2410,13 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei2p = TensorGetIndex(n0,n1,n2,n3, 0,0,0,0,0,0,1,0);
   int stridei3p = TensorGetIndex(n0,n1,n2,n3, 0,0,0,0,0,0,0,1);
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(4)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
+          int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p + i3p*stridei3p;
           for (int i0 = 0; i0 < n0; i0++)  {
             for (int i1 = 0; i1 < n1; i1++)  {
               for (int i2 = 0; i2 < n2; i2++)  {
@@ -2029,22 +2425,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                   /* --- Diagonal part ---*/
                   double xre = xptr[2 * it];
                   double xim = xptr[2 * it + 1];
-                  // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-                  //                    vout = (-hd(ik) + hd(ik'))*uin
-                  double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0, i1, i2, i3)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0, i1, i2, i3)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0, i1, i2, i3);
-                  double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0p, i1p, i2p, i3p)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0p, i1p, i2p, i3p)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0p, i1p, i2p, i3p);
-                  double yre = ( hd - hdp ) * xim;
-                  double yim = (-hd + hdp ) * xre;
-                  // Decay l1, diagonal part: xout += l1diag xin
-                  // Dephasing l2: xout += l2(ik, ikp) xin
-                  double l1diag = L1diag(decay0, decay1, decay2, decay3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  double l2 = L2(dephase0, dephase1, dephase2, dephase3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  yre += (l2 + l1diag) * xre;
-                  yim += (l2 + l1diag) * xim;
+                  // drift Hamiltonian, decay and dephasing: yout = (ld + i dh) xin, see matfree_getDiag()
+                  double ld = diag[2*it];
+                  double dh = diag[2*it+1];
+                  double yre = ld * xre - dh * xim;
+                  double yim = ld * xim + dh * xre;
 
 
                   /* --- Offdiagonal: Jkl coupling  --- */
@@ -2118,16 +2503,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArray(y, &yptr);
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi12 = shellctx->crosskerr[3];  // zz-coupling
-  double xi13 = shellctx->crosskerr[4];  // zz-coupling
-  double xi23 = shellctx->crosskerr[5];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2140,26 +2516,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double eta12 = shellctx->eta[3];
   double eta13 = shellctx->eta[4];
   double eta23 = shellctx->eta[5];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2192,12 +2556,13 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   int stridei3p = TensorGetIndex(n0,n1,n2,n3, 0,0,0,0,0,0,0,1);
 
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(4)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
+          int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p + i3p*stridei3p;
           for (int i0 = 0; i0 < n0; i0++)  {
             for (int i1 = 0; i1 < n1; i1++)  {
               for (int i2 = 0; i2 < n2; i2++)  {
@@ -2206,22 +2571,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                   double xim = xptr[2 * it + 1];
 
                   /* --- Diagonal part ---*/
-                  // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-                  //                         vout = (-hd(ik) + hd(ik'))*uin
-                  double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0, i1, i2, i3)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0, i1, i2, i3)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0, i1, i2, i3);
-                  double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, i0p, i1p, i2p, i3p)
-                             + H_selfkerr(xi0, xi1, xi2, xi3, i0p, i1p, i2p, i3p)
-                             + H_crosskerr(xi01, xi02, xi03, xi12, xi13, xi23, i0p, i1p, i2p, i3p);
-                  double yre = (-hd + hdp ) * xim;
-                  double yim = ( hd - hdp ) * xre;
-                  // Decay l1^T, diagonal part: xout += l1diag xin
-                  // Dephasing l2^T: xout += l2(ik, ikp) xin
-                  double l1diag = L1diag(decay0, decay1, decay2, decay3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  double l2 = L2(dephase0, dephase1, dephase2, dephase3, i0, i1, i2, i3, i0p, i1p, i2p, i3p);
-                  yre += (l2 + l1diag) * xre;
-                  yim += (l2 + l1diag) * xim;
+                  // drift Hamiltonian, decay and dephasing, conjugate diagonal: yout = (ld - i dh) xin, see matfree_getDiag()
+                  double ld = diag[2*it];
+                  double dh = diag[2*it+1];
+                  double yre = ld * xre + dh * xim;
+                  double yim = ld * xim - dh * xre;
 
                   /* --- Offdiagonal coupling term J_kl --- */
                   // oscillator 0<->1
@@ -2240,13 +2594,13 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
 
                   /* --- Offdiagonal part of decay L1^T */
                   // Oscillators 0
-                  L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                  L1decay_T(it, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
                   // Oscillator 1
-                  L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                  L1decay_T(it, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
                   // Oscillator 2
-                  L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                  L1decay_T(it, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
                   // Oscillator 3
-                  L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                  L1decay_T(it, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
 
                   /* --- Control hamiltonian  --- */
                   // Oscillator 0
@@ -2294,21 +2648,7 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   VecGetArray(y, &yptr); 
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi4  = shellctx->oscil_vec[4]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi04 = shellctx->crosskerr[3];  // zz-coupling
-  double xi12 = shellctx->crosskerr[4];  // zz-coupling
-  double xi13 = shellctx->crosskerr[5];  // zz-coupling
-  double xi14 = shellctx->crosskerr[6];  // zz-coupling
-  double xi23 = shellctx->crosskerr[7];  // zz-coupling
-  double xi24 = shellctx->crosskerr[8];  // zz-coupling
-  double xi34 = shellctx->crosskerr[9];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2329,31 +2669,16 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   double eta23 = shellctx->eta[7];
   double eta24 = shellctx->eta[8];
   double eta34 = shellctx->eta[9];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
-  double detuning_freq4 = shellctx->oscil_vec[4]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
   double decay4 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
-  double dephase4= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   if (shellctx->oscil_vec[4]->getDecayTime() > 1e-14 && shellctx->addT1)   decay4= 1./shellctx->oscil_vec[4]->getDecayTime();
-  if (shellctx->oscil_vec[4]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase4 = 1./shellctx->oscil_vec[4]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2397,13 +2722,14 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
   int stridei3p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,1,0);
   int stridei4p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,0,1);
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(5)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i4p = 0; i4p < n4; i4p++)  {
+            int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p + i3p*stridei3p + i4p*stridei4p;
             for (int i0 = 0; i0 < n0; i0++)  {
               for (int i1 = 0; i1 < n1; i1++)  {
                 for (int i2 = 0; i2 < n2; i2++)  {
@@ -2413,22 +2739,11 @@ int myMatMult_matfree(Mat RHS, Vec x, Vec y){
                       /* --- Diagonal part ---*/
                       double xre = xptr[2 * it];
                       double xim = xptr[2 * it + 1];
-                      // drift Hamiltonian: uout = ( hd(ik) - hd(ik'))*vin
-                      //                    vout = (-hd(ik) + hd(ik'))*uin
-                      double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0, i1, i2, i3, i4)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0, i1, i2, i3, i4)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0, i1, i2, i3, i4);
-                      double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0p, i1p, i2p, i3p, i4p);
-                      double yre = ( hd - hdp ) * xim;
-                      double yim = (-hd + hdp ) * xre;
-                      // Decay l1, diagonal part: xout += l1diag xin
-                      // Dephasing l2: xout += l2(ik, ikp) xin
-                      double l1diag = L1diag(decay0, decay1, decay2, decay3, decay4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      double l2 = L2(dephase0, dephase1, dephase2, dephase3, dephase4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      yre += (l2 + l1diag) * xre;
-                      yim += (l2 + l1diag) * xim;
+                      // drift Hamiltonian, decay and dephasing: yout = (ld + i dh) xin, see matfree_getDiag()
+                      double ld = diag[2*it];
+                      double dh = diag[2*it+1];
+                      double yre = ld * xre - dh * xim;
+                      double yim = ld * xim + dh * xre;
 
 
                       /* --- Offdiagonal: Jkl coupling  --- */
@@ -2516,21 +2831,7 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   VecGetArray(y, &yptr);
 
   /* Evaluate coefficients */
-  double xi0  = shellctx->oscil_vec[0]->getSelfkerr();
-  double xi1  = shellctx->oscil_vec[1]->getSelfkerr();   
-  double xi2  = shellctx->oscil_vec[2]->getSelfkerr();   
-  double xi3  = shellctx->oscil_vec[3]->getSelfkerr();   
-  double xi4  = shellctx->oscil_vec[4]->getSelfkerr();   
-  double xi01 = shellctx->crosskerr[0];  // zz-coupling
-  double xi02 = shellctx->crosskerr[1];  // zz-coupling
-  double xi03 = shellctx->crosskerr[2];  // zz-coupling
-  double xi04 = shellctx->crosskerr[3];  // zz-coupling
-  double xi12 = shellctx->crosskerr[4];  // zz-coupling
-  double xi13 = shellctx->crosskerr[5];  // zz-coupling
-  double xi14 = shellctx->crosskerr[6];  // zz-coupling
-  double xi23 = shellctx->crosskerr[7];  // zz-coupling
-  double xi24 = shellctx->crosskerr[8];  // zz-coupling
-  double xi34 = shellctx->crosskerr[9];  // zz-coupling
+  const double* diag = matfree_getDiag(shellctx);
   double J01  = shellctx->Jkl[0];  // Jaynes-Cummings coupling
   double J02  = shellctx->Jkl[1];  // Jaynes-Cummings coupling
   double J03  = shellctx->Jkl[2];  // Jaynes-Cummings coupling
@@ -2551,31 +2852,16 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   double eta23 = shellctx->eta[7];
   double eta24 = shellctx->eta[8];
   double eta34 = shellctx->eta[9];
-  double detuning_freq0 = shellctx->oscil_vec[0]->getDetuning();
-  double detuning_freq1 = shellctx->oscil_vec[1]->getDetuning();
-  double detuning_freq2 = shellctx->oscil_vec[2]->getDetuning();
-  double detuning_freq3 = shellctx->oscil_vec[3]->getDetuning();
-  double detuning_freq4 = shellctx->oscil_vec[4]->getDetuning();
   double decay0 = 0.0;
   double decay1 = 0.0;
   double decay2 = 0.0;
   double decay3 = 0.0;
   double decay4 = 0.0;
-  double dephase0= 0.0;
-  double dephase1= 0.0;
-  double dephase2= 0.0;
-  double dephase3= 0.0;
-  double dephase4= 0.0;
   if (shellctx->oscil_vec[0]->getDecayTime() > 1e-14 && shellctx->addT1)   decay0 = 1./shellctx->oscil_vec[0]->getDecayTime();
-  if (shellctx->oscil_vec[0]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase0 = 1./shellctx->oscil_vec[0]->getDephaseTime();
   if (shellctx->oscil_vec[1]->getDecayTime() > 1e-14 && shellctx->addT1)   decay1= 1./shellctx->oscil_vec[1]->getDecayTime();
-  if (shellctx->oscil_vec[1]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase1 = 1./shellctx->oscil_vec[1]->getDephaseTime();
   if (shellctx->oscil_vec[2]->getDecayTime() > 1e-14 && shellctx->addT1)   decay2= 1./shellctx->oscil_vec[2]->getDecayTime();
-  if (shellctx->oscil_vec[2]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase2 = 1./shellctx->oscil_vec[2]->getDephaseTime();
   if (shellctx->oscil_vec[3]->getDecayTime() > 1e-14 && shellctx->addT1)   decay3= 1./shellctx->oscil_vec[3]->getDecayTime();
-  if (shellctx->oscil_vec[3]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase3 = 1./shellctx->oscil_vec[3]->getDephaseTime();
   if (shellctx->oscil_vec[4]->getDecayTime() > 1e-14 && shellctx->addT1)   decay4= 1./shellctx->oscil_vec[4]->getDecayTime();
-  if (shellctx->oscil_vec[4]->getDephaseTime() > 1e-14 && shellctx->addT2) dephase4 = 1./shellctx->oscil_vec[4]->getDephaseTime();
   double pt0 = shellctx->control_Re[0];
   double qt0 = shellctx->control_Im[0];
   double pt1 = shellctx->control_Re[1];
@@ -2619,13 +2905,14 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   int stridei3p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,1,0);
   int stridei4p = TensorGetIndex(n0,n1,n2,n3,n4, 0,0,0,0,0,0,0,0,0,1);
 
-   /* Iterate over indices of output vector y */
-  int it = 0;
+  /* Iterate over indices of output vector y */
+  #pragma omp parallel for collapse(5)
   for (int i0p = 0; i0p < n0; i0p++)  {
     for (int i1p = 0; i1p < n1; i1p++)  {
       for (int i2p = 0; i2p < n2; i2p++)  {
         for (int i3p = 0; i3p < n3; i3p++)  {
           for (int i4p = 0; i4p < n4; i4p++)  {
+            int it = i0p*stridei0p + i1p*stridei1p + i2p*stridei2p + i3p*stridei3p + i4p*stridei4p;
             for (int i0 = 0; i0 < n0; i0++)  {
               for (int i1 = 0; i1 < n1; i1++)  {
                 for (int i2 = 0; i2 < n2; i2++)  {
@@ -2636,22 +2923,11 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
                       double xim = xptr[2 * it + 1];
 
                       /* --- Diagonal part ---*/
-                      // drift Hamiltonian Hd^T: uout = ( hd(ik) - hd(ik'))*vin
-                      //                         vout = (-hd(ik) + hd(ik'))*uin
-                      double hd  = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0, i1, i2, i3, i4)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0, i1, i2, i3, i4)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34,i0, i1, i2, i3, i4);
-                      double hdp = H_detune(detuning_freq0, detuning_freq1, detuning_freq2, detuning_freq3, detuning_freq4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_selfkerr(xi0, xi1, xi2, xi3, xi4, i0p, i1p, i2p, i3p, i4p)
-                                 + H_crosskerr(xi01, xi02, xi03, xi04, xi12, xi13, xi14, xi23, xi24, xi34, i0p, i1p, i2p, i3p, i4p);
-                      double yre = (-hd + hdp ) * xim;
-                      double yim = ( hd - hdp ) * xre;
-                      // Decay l1^T, diagonal part: xout += l1diag xin
-                      // Dephasing l2^T: xout += l2(ik, ikp) xin
-                      double l1diag = L1diag(decay0, decay1, decay2, decay3, decay4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      double l2 = L2(dephase0, dephase1, dephase2, dephase3, dephase4, i0, i1, i2, i3, i4, i0p, i1p, i2p, i3p, i4p);
-                      yre += (l2 + l1diag) * xre;
-                      yim += (l2 + l1diag) * xim;
+                      // drift Hamiltonian, decay and dephasing, conjugate diagonal: yout = (ld - i dh) xin, see matfree_getDiag()
+                      double ld = diag[2*it];
+                      double dh = diag[2*it+1];
+                      double yre = ld * xre + dh * xim;
+                      double yim = ld * xim - dh * xre;
 
                       /* --- Offdiagonal coupling term J_kl --- */
                       // oscillator 0<->1
@@ -2677,15 +2953,15 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
               
                       /* --- Offdiagonal part of decay L1^T */
                       // Oscillators 0
-                      L1decay_T(it, n0, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
+                      L1decay_T(it, i0, i0p, stridei0, stridei0p, xptr, decay0, &yre, &yim);
                       // Oscillator 1
-                      L1decay_T(it, n1, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
+                      L1decay_T(it, i1, i1p, stridei1, stridei1p, xptr, decay1, &yre, &yim);
                       // Oscillator 2
-                      L1decay_T(it, n2, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
+                      L1decay_T(it, i2, i2p, stridei2, stridei2p, xptr, decay2, &yre, &yim);
                       // Oscillator 3
-                      L1decay_T(it, n3, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
+                      L1decay_T(it, i3, i3p, stridei3, stridei3p, xptr, decay3, &yre, &yim);
                       // Oscillator 4
-                      L1decay_T(it, n4, i4, i4p, stridei4, stridei4p, xptr, decay4, &yre, &yim);
+                      L1decay_T(it, i4, i4p, stridei4, stridei4p, xptr, decay4, &yre, &yim);
 
                       /* --- Control hamiltonian  --- */
                       // Oscillator 0
@@ -2721,138 +2997,1015 @@ int myMatMultTranspose_matfree(Mat RHS, Vec x, Vec y){
   return 0;
 }
 
-/* --- 2 Oscillator cases --- */
-int myMatMult_matfree_2Osc(Mat RHS, Vec x, Vec y){
+/* Coefficients of the runtime-strided matfree kernels, evaluated from the shell context at the current time and control values */
+typedef struct {
+  int noscillators;
+  int dim_rho;
+  std::vector<double> xi, detuning_freq, decay, dephase, pt, qt;   // per oscillator
+  std::vector<int> stridei, strideip;                               // strides for accessing x at ik+-1, ik'+-1 
+  std::vector<int> zz_k, zz_l;                                      // oscillator pairs k<l with nonzero cross-kerr coupling
+  std::vector<double> zz_xi;
+  std::vector<int> jc_k, jc_l;                                      // oscillator pairs k<l with nonzero Jaynes-Cummings coupling
+  std::vector<double> jc_J, jc_cos, jc_sin;
+  std::vector<int> offi, offim, offip, offipm, offdecay, offdecaym;  // offsets for reading x at it+-stridei, it+-strideip, it+-(stridei+strideip) in the vectorized kernels, see haloOffset()
+  std::vector<int> jc_offi, jc_offim, jc_offip, jc_offipm;           // same for it+-(stridei[k]-stridei[l]), it+-(strideip[k]-strideip[l]) per Jaynes-Cummings pair
+} MatfreeCoeffs;
+
+static void matfree_getCoeffs(MatShellCtx* shellctx, MatfreeCoeffs* coeffs){
+  int nosc = shellctx->nlevels.size();
+  coeffs->noscillators = nosc;
+
+  /* Evaluate coefficients for each oscillator */
+  coeffs->xi.assign(nosc, 0.0);
+  coeffs->detuning_freq.assign(nosc, 0.0);
+  coeffs->decay.assign(nosc, 0.0);
+  coeffs->dephase.assign(nosc, 0.0);
+  coeffs->pt.assign(nosc, 0.0);
+  coeffs->qt.assign(nosc, 0.0);
+  for (int k=0; k<nosc; k++){
+    coeffs->xi[k] = shellctx->oscil_vec[k]->getSelfkerr();
+    coeffs->detuning_freq[k] = shellctx->oscil_vec[k]->getDetuning();
+    if (shellctx->oscil_vec[k]->getDecayTime() > 1e-14 && shellctx->addT1)
+      coeffs->decay[k] = 1./shellctx->oscil_vec[k]->getDecayTime();
+    if (shellctx->oscil_vec[k]->getDephaseTime() > 1e-14 && shellctx->addT2)
+      coeffs->dephase[k] = 1./shellctx->oscil_vec[k]->getDephaseTime();
+    coeffs->pt[k] = shellctx->control_Re[k];
+    coeffs->qt[k] = shellctx->control_Im[k];
+  }
+
+  /* Collect the oscillator pairs k<l that have nonzero zz- or Jaynes-Cummings coupling */
+  coeffs->zz_k.clear(); coeffs->zz_l.clear(); coeffs->zz_xi.clear();
+  coeffs->jc_k.clear(); coeffs->jc_l.clear(); coeffs->jc_J.clear(); coeffs->jc_cos.clear(); coeffs->jc_sin.clear();
+  int id = 0;
+  for (int k=0; k<nosc; k++){
+    for (int l=k+1; l<nosc; l++){
+      if (fabs(shellctx->crosskerr[id]) > 1e-14) {
+        coeffs->zz_k.push_back(k);
+        coeffs->zz_l.push_back(l);
+        coeffs->zz_xi.push_back(shellctx->crosskerr[id]);
+      }
+      if (fabs(shellctx->Jkl[id]) > 1e-10) {
+        coeffs->jc_k.push_back(k);
+        coeffs->jc_l.push_back(l);
+        coeffs->jc_J.push_back(shellctx->Jkl[id]);
+        coeffs->jc_cos.push_back(cos(shellctx->eta[id] * shellctx->time));
+        coeffs->jc_sin.push_back(sin(shellctx->eta[id] * shellctx->time));
+      }
+      id++;
+    }
+  }
+
+  /* compute strides for accessing x at ik+1, ik-1, ik'+1, ik'-1 */
+  coeffs->dim_rho = 1;
+  for (int k=0; k<nosc; k++) coeffs->dim_rho *= shellctx->nlevels[k];
+  coeffs->stridei.assign(nosc, 0);
+  coeffs->strideip.assign(nosc, 0);
+  int stride = 1;
+  for (int k=nosc-1; k>=0; k--){
+    coeffs->stridei[k]  = stride;
+    coeffs->strideip[k] = stride * coeffs->dim_rho;
+    stride *= shellctx->nlevels[k];
+  }
+
+  /* Offsets for reading x in the vectorized kernels. With parallel Petsc, they point into the local copy of x. */
+  coeffs->offi.resize(nosc); coeffs->offim.resize(nosc); coeffs->offip.resize(nosc); coeffs->offipm.resize(nosc); coeffs->offdecay.resize(nosc); coeffs->offdecaym.resize(nosc);
+  for (int k=0; k<nosc; k++){
+    int sk = coeffs->stridei[k], skp = coeffs->strideip[k];
+    coeffs->offi[k]      = haloOffset(shellctx, sk);
+    coeffs->offim[k]     = haloOffset(shellctx, -sk);
+    coeffs->offip[k]     = haloOffset(shellctx, skp);
+    coeffs->offipm[k]    = haloOffset(shellctx, -skp);
+    coeffs->offdecay[k]  = haloOffset(shellctx, sk + skp);
+    coeffs->offdecaym[k] = haloOffset(shellctx, -sk - skp);
+  }
+  int npairs = coeffs->jc_k.size();
+  coeffs->jc_offi.resize(npairs); coeffs->jc_offim.resize(npairs); coeffs->jc_offip.resize(npairs); coeffs->jc_offipm.resize(npairs);
+  for (int ipair=0; ipair<npairs; ipair++){
+    int k = coeffs->jc_k[ipair];
+    int l = coeffs->jc_l[ipair];
+    int dsi  = coeffs->stridei[k] - coeffs->stridei[l];
+    int dsip = coeffs->strideip[k] - coeffs->strideip[l];
+    coeffs->jc_offi[ipair]   = haloOffset(shellctx, dsi);
+    coeffs->jc_offim[ipair]  = haloOffset(shellctx, -dsi);
+    coeffs->jc_offip[ipair]  = haloOffset(shellctx, dsip);
+    coeffs->jc_offipm[ipair] = haloOffset(shellctx, -dsip);
+  }
+}
+
+
+/* Batched solver: y_b += (are + i aim) x_b for all nbatch states b, where x and y point to the real parts of all states at one row of the multi-vector, followed by the imaginary parts */
+static inline void batch_axpy(const int nbatch, const double are, const double aim, const double* __restrict x, double* __restrict y){
+  const double* xim = x + nbatch;
+  double* yim = y + nbatch;
+  for (int b = 0; b < nbatch; b++) {
+    y[b]   += are * x[b]   - aim * xim[b];
+    yim[b] += are * xim[b] + aim * x[b];
+  }
+}
+
+
+/* Batched sparse-matrix solver: Apply the fused matrix A plus the Kronecker terms to nbatch states, scaling each entry by the coefficient of its slot (or its conjugate), see sparsemat_apply and MasterEq::initBatch */
+static void sparsemat_batch_mult(MatShellCtx* shellctx, const FusedCSR* A, const std::vector<KronTerm>& kron, const bool conjugate, const double* xptr, double* yptr, const int nbatch){
+  const std::vector<int>& nlevels = shellctx->nlevels;
+  int nrows = A->nrows;
+  int nosc = nlevels.size();
+
+  /* Get coefficients */
+  std::vector<double> zre, zim;
+  sparsemat_getCoeffs(shellctx, zre, zim);
+  if (conjugate) for (int i = 0; i < zim.size(); i++) zim[i] = -zim[i];
+
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int itnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, itnext)
+  for (int it = 0; it < nrows; it++) {
+    if (it != itnext) TensorSetIndex(nosc, nlevels.data(), it, i.data(), ip.data());
+    double* y = yptr + 2*it*nbatch;
+    for (int b = 0; b < 2*nbatch; b++) y[b] = 0.0;
+    for (int j = A->rowptr[it]; j < A->rowptr[it+1]; j++) {
+      batch_axpy(nbatch, A->val[j] * zre[A->slot[j]], A->val[j] * zim[A->slot[j]], xptr + 2*A->col[j]*nbatch, y);
+    }
+    for (int iterm = 0; iterm < kron.size(); iterm++) {
+      const KronTerm& term = kron[iterm];
+      const int* lvl = term.primed ? ip.data() : i.data();
+      double val = term.val[lvl[term.k] * term.nl + (term.l >= 0 ? lvl[term.l] : 0)];
+      if (val == 0.0) continue;
+      batch_axpy(nbatch, val * zre[term.slot], val * zim[term.slot], xptr + 2*(it + term.shift)*nbatch, y);
+    }
+    TensorIncrementIndex(nosc, nlevels.data(), i.data(), ip.data());
+    itnext = it + 1;
+  }
+}
+
+
+/* Batched solver: Define the action of RHS on nbatch states x, see MasterEq::initBatch */
+int myMatMult_batch(Mat RHS, Vec x, Vec y){
+
   /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  if      (n0==3 && n1==20)  return myMatMult_matfree<3,20>(RHS, x, y);
-  else if (n0==3 && n1==10)  return myMatMult_matfree<3,10>(RHS, x, y);
-  else if (n0==4 && n1==4)   return myMatMult_matfree<4,4>(RHS, x, y);
-  else if (n0==1 && n1==1)   return myMatMult_matfree<1,1>(RHS, x, y);
-  else if (n0==2 && n1==2)   return myMatMult_matfree<2,2>(RHS, x, y);
-  else if (n0==3 && n1==3)   return myMatMult_matfree<3,3>(RHS, x, y);
-  else if (n0==20 && n1==20) return myMatMult_matfree<20,20>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
-  }
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  int nbatch = dim / (2 * (shellctx->iupp - shellctx->ilow));
+
+  /* Apply to all states */
+  sparsemat_batch_mult(shellctx, shellctx->fused, *shellctx->kron, false, xptr, yptr, nbatch);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
 }
-int myMatMultTranspose_matfree_2Osc(Mat RHS, Vec x, Vec y){
- /* Get the shell context */
+
+
+/* Batched solver: Define the action of RHS^T on nbatch states x, see myMatMultTranspose_sparsemat */
+int myMatMultTranspose_batch(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  if      (n0==3 && n1==20)  return myMatMultTranspose_matfree<3,20>(RHS, x, y);
-  else if (n0==3 && n1==10)  return myMatMultTranspose_matfree<3,10>(RHS, x, y);
-  else if (n0==4 && n1==4)   return myMatMultTranspose_matfree<4,4>(RHS, x, y);
-  else if (n0==1 && n1==1)   return myMatMultTranspose_matfree<1,1>(RHS, x, y);
-  else if (n0==2 && n1==2)   return myMatMultTranspose_matfree<2,2>(RHS, x, y);
-  else if (n0==3 && n1==3)   return myMatMultTranspose_matfree<3,3>(RHS, x, y);
-  else if (n0==20 && n1==20) return myMatMultTranspose_matfree<20,20>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  int nbatch = dim / (2 * (shellctx->iupp - shellctx->ilow));
+
+  /* Apply the transpose to all states */
+  sparsemat_batch_mult(shellctx, shellctx->fusedT, *shellctx->kronT, true, xptr, yptr, nbatch);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+/* Apply RHS (or RHS^T) to the upper triangle x of a Hermitian rho, see myMatMult_matfree_packed. 
+ * The real transpose of RHS is its adjoint RHS^\dagger(rho) = i[H,rho] + sum_k L_k^\dagger rho L_k - 1/2{L_k^\dagger L_k, rho}, which maps Hermitian matrices to Hermitian matrices as well: It has the Hamiltonian terms with opposite sign, and the decay term a^\dagger rho a instead of a rho a^\dagger. 
+ * On the upper triangle, the transpose then reads D RHS^\dagger D^{-1}, where D doubles the off-diagonal elements. T is double, or float for the single-precision apply of the mixed-precision linear solver. */
+template <typename T>
+static void matfree_packed_mult(MatShellCtx* shellctx, const T* xptr, T* yptr, const bool transpose){
+
+  const int* n = shellctx->nlevels.data();
+
+  /* Evaluate coefficients */
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+  const double* diag = matfree_getDiag(shellctx);
+  int dim_rho = c.dim_rho;
+  double hsign = transpose ? -1.0 : 1.0;  // sign of the Hamiltonian terms
+  double woff  = transpose ?  0.5 : 1.0;  // D^{-1} on the off-diagonal input elements
+  double xre, xim;
+
+  /* Iterate over the columns ic of rho, and the rows ir <= ic in the upper triangle. The columns get shorter towards the left, hence the dynamic schedule. */
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  #pragma omp parallel for schedule(dynamic, 16) firstprivate(i, ip) private(xre, xim)
+  for (int ic = 0; ic < dim_rho; ic++) {
+    TensorSetIndex(nosc, n, ic*dim_rho, i.data(), ip.data());
+    for (int ir = 0; ir <= ic; ir++) {
+
+      /* --- Diagonal part ---*/
+      hermGet(xptr, ir, ic, woff, &xre, &xim);
+      double ld = diag[2*(ic*dim_rho + ir)];
+      double dh = hsign * diag[2*(ic*dim_rho + ir)+1];
+      double yre = ld * xre - dh * xim;
+      double yim = ld * xim + dh * xre;
+
+      /* --- Offdiagonal: Jkl coupling terms, see Jkl_coupling() --- */
+      for (int ipair=0; ipair<c.jc_J.size(); ipair++){
+        int k = c.jc_k[ipair];
+        int l = c.jc_l[ipair];
+        int sk = c.stridei[k];
+        int sl = c.stridei[l];
+        double J = hsign * c.jc_J[ipair];
+        double cosij = c.jc_cos[ipair];
+        double sinij = c.jc_sin[ipair];
+        if (i[k] > 0 && i[l] < n[l]-1) {
+          hermGet(xptr, ir - sk + sl, ic, woff, &xre, &xim);
+          double sq = sqrt(i[k] * (i[l] + 1));
+          yre += J * sq * (   cosij * xim + sinij * xre);
+          yim += J * sq * ( - cosij * xre + sinij * xim);
+        }
+        if (i[k] < n[k]-1 && i[l] > 0) {
+          hermGet(xptr, ir + sk - sl, ic, woff, &xre, &xim);
+          double sq = sqrt(i[l] * (i[k] + 1));
+          yre += J * sq * (   cosij * xim - sinij * xre);
+          yim += J * sq * ( - cosij * xre - sinij * xim);
+        }
+        if (ip[k] > 0 && ip[l] < n[l]-1) {
+          hermGet(xptr, ir, ic - sk + sl, woff, &xre, &xim);
+          double sq = sqrt(ip[k] * (ip[l] + 1));
+          yre += J * sq * ( - cosij * xim + sinij * xre);
+          yim += J * sq * (   cosij * xre + sinij * xim);
+        }
+        if (ip[k] < n[k]-1 && ip[l] > 0) {
+          hermGet(xptr, ir, ic + sk - sl, woff, &xre, &xim);
+          double sq = sqrt(ip[l] * (ip[k] + 1));
+          yre += J * sq * ( - cosij * xim - sinij * xre);
+          yim += J * sq * (   cosij * xre - sinij * xim);
+        }
+      }
+
+      for (int k=0; k<nosc; k++){
+        int sk = c.stridei[k];
+        /* --- Offdiagonal part of decay L1: a rho a^\dagger, or a^\dagger rho a for the transpose --- */
+        if (c.decay[k] > 1e-12) {
+          if (!transpose && i[k] < n[k]-1 && ip[k] < n[k]-1) {
+            hermGet(xptr, ir + sk, ic + sk, woff, &xre, &xim);
+            double l1off = c.decay[k] * sqrt((i[k]+1)*(ip[k]+1));
+            yre += l1off * xre;
+            yim += l1off * xim;
+          }
+          if (transpose && i[k] > 0 && ip[k] > 0) {
+            hermGet(xptr, ir - sk, ic - sk, woff, &xre, &xim);
+            double l1off = c.decay[k] * sqrt(i[k]*ip[k]);
+            yre += l1off * xre;
+            yim += l1off * xim;
+          }
+        }
+        /* --- Control hamiltonian, see control() --- */
+        double pt = hsign * c.pt[k];
+        double qt = hsign * c.qt[k];
+        if (i[k] < n[k]-1) {
+          hermGet(xptr, ir + sk, ic, woff, &xre, &xim);
+          double sq = sqrt(i[k] + 1);
+          yre += sq * (   pt * xim + qt * xre);
+          yim += sq * ( - pt * xre + qt * xim);
+        }
+        if (ip[k] < n[k]-1) {
+          hermGet(xptr, ir, ic + sk, woff, &xre, &xim);
+          double sq = sqrt(ip[k] + 1);
+          yre += sq * ( - pt * xim + qt * xre);
+          yim += sq * (   pt * xre + qt * xim);
+        }
+        if (i[k] > 0) {
+          hermGet(xptr, ir - sk, ic, woff, &xre, &xim);
+          double sq = sqrt(i[k]);
+          yre += sq * (   pt * xim - qt * xre);
+          yim += sq * ( - pt * xre - qt * xim);
+        }
+        if (ip[k] > 0) {
+          hermGet(xptr, ir, ic - sk, woff, &xre, &xim);
+          double sq = sqrt(ip[k]);
+          yre += sq * ( - pt * xim - qt * xre);
+          yim += sq * (   pt * xre - qt * xim);
+        }
+      }
+
+      /* Update. The diagonal of a Hermitian matrix is real. D on the off-diagonal output elements for the transpose. */
+      int it = ic*(ic+1)/2 + ir;
+      if (ir == ic) {
+        yptr[2*it]   = yre;
+        yptr[2*it+1] = 0.0;
+      } else {
+        yptr[2*it]   = yre / woff;
+        yptr[2*it+1] = yim / woff;
+      }
+
+      /* Advance the row index */
+      TensorIncrementIndex(nosc, n, i.data(), ip.data());
+    }
   }
 }
 
 
-/* --- 3 Oscillator cases --- */
-int myMatMult_matfree_3Osc(Mat RHS, Vec x, Vec y){
+/* Matrix-free solver with Hermitian storage: Define the action of RHS on the upper triangle x of rho, stored column by column, element (i,j), i<=j, at j(j+1)/2 + i. 
+ * Same terms as myMatMult_matfree_simd, but only the N(N+1)/2 elements of the upper triangle are computed. Elements of the lower triangle are read as rho_ji = conj(rho_ij). */
+int myMatMult_matfree_packed(Mat RHS, Vec x, Vec y){
+
   /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  if      (n0==2 && n1==2 && n2==2) return myMatMult_matfree<2,2,2>(RHS, x, y);
-  else if (n0==2 && n1==3 && n2==4) return myMatMult_matfree<2,3,4>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+
+  /* Apply */
+  matfree_packed_mult(shellctx, xptr, yptr, false);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+/* Matrix-free solver with Hermitian storage: Define the action of RHS^T on the upper triangle x */
+int myMatMultTranspose_matfree_packed(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+
+  /* Apply */
+  matfree_packed_mult(shellctx, xptr, yptr, true);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+/* Matrix-free solver with Hermitian storage: Contract xbar with the derivative of RHS x wrt the control functions p_k, q_k, see dRHSdp_getcoeffs(). 
+ * xbar^T P dRHS/dp U x is summed over the upper triangle only, because the packing P picks the upper triangle of the full (Hermitian) matrix dRHS/dp U x. */
+static void matfree_packed_dRHSdp(MatShellCtx* shellctx, const double* xptr, const double* xbarptr, double* coeff_p, double* coeff_q){
+
+  const int* n = shellctx->nlevels.data();
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+  int dim_rho = c.dim_rho;
+  double xre, xim;
+
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int it = 0;
+  for (int ic = 0; ic < dim_rho; ic++) {
+    for (int ir = 0; ir <= ic; ir++) {
+      /* Get xbar */
+      double xbarre = xbarptr[2*it];
+      double xbarim = xbarptr[2*it+1];
+
+      /* --- Oscillator k --- */
+      for (int k=0; k<nosc; k++){
+        int sk = c.stridei[k];
+        double res_p_re = 0.0, res_p_im = 0.0, res_q_re = 0.0, res_q_im = 0.0;
+        if (i[k] < n[k]-1) {
+          hermGet(xptr, ir + sk, ic, 1.0, &xre, &xim);
+          double sq = sqrt(i[k] + 1);
+          res_p_re +=   sq * xim;
+          res_p_im += - sq * xre;
+          res_q_re +=   sq * xre;
+          res_q_im +=   sq * xim;
+        }
+        if (ip[k] < n[k]-1) {
+          hermGet(xptr, ir, ic + sk, 1.0, &xre, &xim);
+          double sq = sqrt(ip[k] + 1);
+          res_p_re += - sq * xim;
+          res_p_im += + sq * xre;
+          res_q_re +=   sq * xre;
+          res_q_im +=   sq * xim;
+        }
+        if (i[k] > 0) {
+          hermGet(xptr, ir - sk, ic, 1.0, &xre, &xim);
+          double sq = sqrt(i[k]);
+          res_p_re += + sq * xim;
+          res_p_im += - sq * xre;
+          res_q_re += - sq * xre;
+          res_q_im += - sq * xim;
+        }
+        if (ip[k] > 0) {
+          hermGet(xptr, ir, ic - sk, 1.0, &xre, &xim);
+          double sq = sqrt(ip[k]);
+          res_p_re += - sq * xim;
+          res_p_im += + sq * xre;
+          res_q_re += - sq * xre;
+          res_q_im += - sq * xim;
+        }
+        coeff_p[k] += res_p_re * xbarre + res_p_im * xbarim;
+        coeff_q[k] += res_q_re * xbarre + res_q_im * xbarim;
+      }
+
+      TensorIncrementIndex(nosc, n, i.data(), ip.data());
+      it++;
+    }
+    /* Skip the lower triangle of this column */
+    TensorSetIndex(nosc, n, (ic+1)*dim_rho, i.data(), ip.data());
   }
 }
-int myMatMultTranspose_matfree_3Osc(Mat RHS, Vec x, Vec y){
- /* Get the shell context */
+
+
+/* Apply rows itlo <= it < ithi of RHS, see myMatMult_matfree_simd. itlo and ithi must be multiples of the last oscillator's number of levels. x and y are indexed by the global vector index it. 
+ * T is double, or float for the single-precision apply of the mixed-precision linear solver. */
+template <typename T>
+static void matfree_simd_mult(MatShellCtx* shellctx, const T* xptr, T* yptr, const int itlo, const int ithi){
+
+  const int* n = shellctx->nlevels.data();
+
+  /* Evaluate coefficients */
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+  const double* diag = matfree_getDiag(shellctx);
+  int L  = nosc-1;     // last oscillator, its level index runs within a run
+  int nl = n[L];
+
+  /* Square roots of the level indices, and storage for the single-precision diagonal coefficients of one run */
+  int nmax = 0;
+  for (int k=0; k<nosc; k++) nmax = std::max(nmax, n[k]);
+  std::vector<T> sq(nmax+1), d(2*nl);
+  for (int m=0; m<=nmax; m++) sq[m] = sqrt(m);
+
+  /* Iterate over runs of the output vector y */
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int irunnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, irunnext, d)
+  for (int irun = itlo/nl; irun < ithi/nl; irun++) {
+    if (irun != irunnext) TensorSetIndex(nosc, n, irun * nl, i.data(), ip.data());
+    const T* xrun = xptr + 2 * irun * nl;
+    T* yrun       = yptr + 2 * irun * nl;
+
+    /* --- Diagonal part, see matfree_getDiag() --- */
+    cvec_mult(nl, matfree_diagRun(diag + 2 * irun * nl, d.data(), nl), xrun, yrun);
+
+    /* --- Offdiagonal: Jkl coupling terms --- */
+    for (int ipair=0; ipair<c.jc_J.size(); ipair++){
+      int k = c.jc_k[ipair];
+      int l = c.jc_l[ipair];
+      double Jcos = c.jc_J[ipair] * c.jc_cos[ipair];
+      double Jsin = c.jc_J[ipair] * c.jc_sin[ipair];
+      if (l < L) {
+        // 1) J_kl (-icos + sin) sqrt(ik*(il+1)) rho_{E-k+l i, i'}
+        if (i[k] > 0 && i[l] < n[l]-1) 
+          cvec_axpy(nl, sq[i[k]]*sq[i[l]+1] * Jsin, - sq[i[k]]*sq[i[l]+1] * Jcos, xrun + 2*c.jc_offim[ipair], yrun);
+        // 2) J_kl (-icos - sin) sqrt(il*(ik+1)) rho_{E+k-l i, i'}
+        if (i[k] < n[k]-1 && i[l] > 0) 
+          cvec_axpy(nl, - sq[i[l]]*sq[i[k]+1] * Jsin, - sq[i[l]]*sq[i[k]+1] * Jcos, xrun + 2*c.jc_offi[ipair], yrun);
+      } else {
+        // same terms, il = j runs within the run. 1) needs j < nl-1, 2) needs j > 0.
+        if (i[k] > 0)
+          cvec_axpy_scaled(nl-1, sq.data()+1, sq[i[k]] * Jsin, - sq[i[k]] * Jcos, xrun + 2*c.jc_offim[ipair], yrun);
+        if (i[k] < n[k]-1) 
+          cvec_axpy_scaled(nl-1, sq.data()+1, - sq[i[k]+1] * Jsin, - sq[i[k]+1] * Jcos, xrun + 2*(c.jc_offi[ipair]+1), yrun + 2);
+      }
+      // 3) J_kl (icos + sin) sqrt(ik'*(il'+1)) rho_{i, E-k+l i'}
+      if (ip[k] > 0 && ip[l] < n[l]-1)
+        cvec_axpy(nl, sq[ip[k]]*sq[ip[l]+1] * Jsin, sq[ip[k]]*sq[ip[l]+1] * Jcos, xrun + 2*c.jc_offipm[ipair], yrun);
+      // 4) J_kl (icos - sin) sqrt(il'*(ik'+1)) rho_{i, E+k-l i'}
+      if (ip[k] < n[k]-1 && ip[l] > 0)
+        cvec_axpy(nl, - sq[ip[l]]*sq[ip[k]+1] * Jsin, sq[ip[l]]*sq[ip[k]+1] * Jcos, xrun + 2*c.jc_offip[ipair], yrun);
+    }
+
+    for (int k=0; k<nosc; k++){
+      double pt = c.pt[k];
+      double qt = c.qt[k];
+
+      /* --- Offdiagonal part of decay L1 */
+      if (fabs(c.decay[k]) > 1e-12 && ip[k] < n[k]-1) {
+        if (k < L) {
+          if (i[k] < n[k]-1) cvec_axpy(nl, c.decay[k] * sq[i[k]+1]*sq[ip[k]+1], 0.0, xrun + 2*c.offdecay[k], yrun);
+        } 
+        else cvec_axpy_scaled(nl-1, sq.data()+1, c.decay[k] * sq[ip[k]+1], 0.0, xrun + 2*c.offdecay[k], yrun);
+      }
+
+      /* --- Control hamiltonian --- */
+      if (k < L) {
+        // rho(ik+1..,ik'..) and rho(ik-1..,ik'..)
+        if (i[k] < n[k]-1) cvec_axpy(nl,   sq[i[k]+1] * qt, - sq[i[k]+1] * pt, xrun + 2*c.offi[k], yrun);
+        if (i[k] > 0)      cvec_axpy(nl, - sq[i[k]] * qt,   - sq[i[k]] * pt,   xrun + 2*c.offim[k], yrun);
+      } else {
+        // same terms, ik = j runs within the run
+        cvec_axpy_scaled(nl-1, sq.data()+1,   qt, - pt, xrun + 2*c.offi[k], yrun);
+        cvec_axpy_scaled(nl-1, sq.data()+1, - qt, - pt, xrun + 2*(c.offim[k]+1), yrun + 2);
+      }
+      // rho(ik..,ik'+1..) and rho(ik..,ik'-1..)
+      if (ip[k] < n[k]-1) cvec_axpy(nl,   sq[ip[k]+1] * qt, sq[ip[k]+1] * pt, xrun + 2*c.offip[k], yrun);
+      if (ip[k] > 0)      cvec_axpy(nl, - sq[ip[k]] * qt,   sq[ip[k]] * pt,   xrun + 2*c.offipm[k], yrun);
+    }
+
+    /* Advance the tensor index to the next run */
+    i[L] = nl-1;
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
+    irunnext = irun+1;
+  }
+}
+
+
+/* Vectorized matrix-free solver for any number of oscillators: Define the action of RHS on a vector x.
+ * The vectorized density matrix is processed in contiguous runs over the last oscillator's level i_{Q-1}. Within one run, each term of the RHS is a complex coefficient times a shifted run of x, 
+ * which is applied by the branch-free SIMD inlines cvec_*. Level boundaries of the last oscillator are peeled off by shortening the run. */
+int myMatMult_matfree_simd(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  if      (n0==2 && n1==2 && n2==2)  return myMatMultTranspose_matfree<2,2,2>(RHS, x, y);
-  else if (n0==2 && n1==3 && n2==4)  return myMatMultTranspose_matfree<2,3,4>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  PetscInt dim;
+  VecGetSize(x, &dim);
+
+  /* Apply to all rows */
+  matfree_simd_mult(shellctx, xptr, yptr, 0, dim/2);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+/* Apply rows itlo <= it < ithi of RHS^T, see myMatMultTranspose_matfree_simd. itlo and ithi must be multiples of the last oscillator's number of levels. x and y are indexed by the global vector index it. */
+template <typename T>
+static void matfree_simd_multTranspose(MatShellCtx* shellctx, const T* xptr, T* yptr, const int itlo, const int ithi){
+
+  const int* n = shellctx->nlevels.data();
+
+  /* Evaluate coefficients */
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+  const double* diag = matfree_getDiag(shellctx);
+  int L  = nosc-1;
+  int nl = n[L];
+
+  /* Square roots of the level indices, and storage for the single-precision diagonal coefficients of one run */
+  int nmax = 0;
+  for (int k=0; k<nosc; k++) nmax = std::max(nmax, n[k]);
+  std::vector<T> sq(nmax+1), d(2*nl);
+  for (int m=0; m<=nmax; m++) sq[m] = sqrt(m);
+
+  /* Iterate over runs of the output vector y */
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int irunnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, irunnext, d)
+  for (int irun = itlo/nl; irun < ithi/nl; irun++) {
+    if (irun != irunnext) TensorSetIndex(nosc, n, irun * nl, i.data(), ip.data());
+    const T* xrun = xptr + 2 * irun * nl;
+    T* yrun       = yptr + 2 * irun * nl;
+
+    /* --- Diagonal part, conjugate of the diagonal of RHS, see matfree_getDiag() --- */
+    cvec_mult_conj(nl, matfree_diagRun(diag + 2 * irun * nl, d.data(), nl), xrun, yrun);
+
+    /* --- Offdiagonal coupling terms J_kl^T --- */
+    for (int ipair=0; ipair<c.jc_J.size(); ipair++){
+      int k = c.jc_k[ipair];
+      int l = c.jc_l[ipair];
+      double Jcos = c.jc_J[ipair] * c.jc_cos[ipair];
+      double Jsin = c.jc_J[ipair] * c.jc_sin[ipair];
+      if (l < L) {
+        // 1) \bar y_{E+k-l i, i'}
+        if (i[k] < n[k]-1 && i[l] > 0) 
+          cvec_axpy(nl, sq[i[l]]*sq[i[k]+1] * Jsin, sq[i[l]]*sq[i[k]+1] * Jcos, xrun + 2*c.jc_offi[ipair], yrun);
+        // 2) \bar y_{E-k+l i, i'}
+        if (i[k] > 0 && i[l] < n[l]-1) 
+          cvec_axpy(nl, - sq[i[k]]*sq[i[l]+1] * Jsin, sq[i[k]]*sq[i[l]+1] * Jcos, xrun + 2*c.jc_offim[ipair], yrun);
+      } else {
+        // same terms, il = j runs within the run. 1) needs j > 0, 2) needs j < nl-1.
+        if (i[k] < n[k]-1) 
+          cvec_axpy_scaled(nl-1, sq.data()+1, sq[i[k]+1] * Jsin, sq[i[k]+1] * Jcos, xrun + 2*(c.jc_offi[ipair]+1), yrun + 2);
+        if (i[k] > 0)
+          cvec_axpy_scaled(nl-1, sq.data()+1, - sq[i[k]] * Jsin, sq[i[k]] * Jcos, xrun + 2*c.jc_offim[ipair], yrun);
+      }
+      // 3) \bar y_{i, E+k-l i'}
+      if (ip[k] < n[k]-1 && ip[l] > 0)
+        cvec_axpy(nl, sq[ip[l]]*sq[ip[k]+1] * Jsin, - sq[ip[l]]*sq[ip[k]+1] * Jcos, xrun + 2*c.jc_offip[ipair], yrun);
+      // 4) \bar y_{i, E-k+l i'}
+      if (ip[k] > 0 && ip[l] < n[l]-1)
+        cvec_axpy(nl, - sq[ip[k]]*sq[ip[l]+1] * Jsin, - sq[ip[k]]*sq[ip[l]+1] * Jcos, xrun + 2*c.jc_offipm[ipair], yrun);
+    }
+
+    for (int k=0; k<nosc; k++){
+      double pt = c.pt[k];
+      double qt = c.qt[k];
+
+      /* --- Offdiagonal part of decay L1^T */
+      if (fabs(c.decay[k]) > 1e-12 && ip[k] > 0) {
+        if (k < L) {
+          if (i[k] > 0) cvec_axpy(nl, c.decay[k] * sq[i[k]]*sq[ip[k]], 0.0, xrun + 2*c.offdecaym[k], yrun);
+        } 
+        else cvec_axpy_scaled(nl-1, sq.data()+1, c.decay[k] * sq[ip[k]], 0.0, xrun + 2*(c.offdecaym[k]+1), yrun + 2);
+      }
+
+      /* --- Control hamiltonian  --- */
+      if (k < L) {
+        if (i[k] > 0)      cvec_axpy(nl,   sq[i[k]] * qt,     sq[i[k]] * pt,     xrun + 2*c.offim[k], yrun);
+        if (i[k] < n[k]-1) cvec_axpy(nl, - sq[i[k]+1] * qt,   sq[i[k]+1] * pt,   xrun + 2*c.offi[k], yrun);
+      } else {
+        cvec_axpy_scaled(nl-1, sq.data()+1,   qt, pt, xrun + 2*(c.offim[k]+1), yrun + 2);
+        cvec_axpy_scaled(nl-1, sq.data()+1, - qt, pt, xrun + 2*c.offi[k], yrun);
+      }
+      if (ip[k] > 0)      cvec_axpy(nl,   sq[ip[k]] * qt,   - sq[ip[k]] * pt,   xrun + 2*c.offipm[k], yrun);
+      if (ip[k] < n[k]-1) cvec_axpy(nl, - sq[ip[k]+1] * qt, - sq[ip[k]+1] * pt, xrun + 2*c.offip[k], yrun);
+    }
+
+    /* Advance the tensor index to the next run */
+    i[L] = nl-1;
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
+    irunnext = irun+1;
   }
 }
 
 
-/* --- 4 Oscillator cases --- */
-int myMatMult_matfree_4Osc(Mat RHS, Vec x, Vec y){
+/* Vectorized matrix-free solver for any number of oscillators: Define the action of RHS^T on a vector x */
+int myMatMultTranspose_matfree_simd(Mat RHS, Vec x, Vec y){
+
   /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  int n3 = shellctx->nlevels[3];
-  if      (n0==2 && n1==2 && n2==2 && n3 == 2) return myMatMult_matfree<2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+
+  /* Get access to x and y */
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  PetscInt dim;
+  VecGetSize(x, &dim);
+
+  /* Apply to all rows */
+  matfree_simd_multTranspose(shellctx, xptr, yptr, 0, dim/2);
+
+  /* Restore x and y */
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
+}
+
+
+/* Schroedinger's equation: y = -iH(t) x for the state vector x = psi, stored in double or single precision (T) and accumulated in double. 
+ * H(t) = Hd + sum_k p_k(t) (a_k + a_k^d) + i q_k(t) (a_k - a_k^d) + sum_kl J_kl [ cos(eta_kl t) (a_k^d a_l + a_k a_l^d) + i sin(eta_kl t) (a_k^d a_l - a_k a_l^d) ]
+ * This is the part of the Lindblad RHS that acts on the row index i of rho. */
+template <typename T>
+static void schroedinger_mult(MatShellCtx* shellctx, const T* xptr, T* yptr){
+
+  const int* n = shellctx->nlevels.data();
+
+  /* Evaluate coefficients */
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+
+  /* Iterate over the elements of psi. Each OpenMP thread sets the tensor index at the start of its block of iterations and increments it from there. */
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  int itnext = -1;
+  #pragma omp parallel for schedule(static) firstprivate(i, ip, itnext)
+  for (int it = 0; it < c.dim_rho; it++) {
+    if (it != itnext) TensorSetIndex(nosc, n, it, i.data(), ip.data());
+
+    /* Drift Hamiltonian: -i Hd psi */
+    double hd = 0.0;
+    for (int k = 0; k < nosc; k++) hd += c.detuning_freq[k] * i[k] - c.xi[k] / 2.0 * i[k] * (i[k] - 1);
+    for (int m = 0; m < c.zz_k.size(); m++) hd -= c.zz_xi[m] * i[c.zz_k[m]] * i[c.zz_l[m]];
+    double yre =  hd * xptr[2*it+1];
+    double yim = -hd * xptr[2*it];
+
+    /* Collapse operators of the quantum trajectories: -1/2 sum_k (L1_k^d L1_k + L2_k^d L2_k) psi */
+    double gam = 0.0;
+    for (int k = 0; k < nosc; k++) gam += c.decay[k] * i[k] + c.dephase[k] * i[k] * i[k];
+    yre -= gam / 2.0 * xptr[2*it];
+    yim -= gam / 2.0 * xptr[2*it+1];
+
+    /* Control terms: q_k (a_k - a_k^d) psi - i p_k (a_k + a_k^d) psi */
+    for (int k = 0; k < nosc; k++) {
+      double upre = 0.0, upim = 0.0, dnre = 0.0, dnim = 0.0;
+      if (i[k] < n[k]-1) {
+        double sq = sqrt(i[k] + 1);
+        upre = sq * xptr[2*(it + c.stridei[k])];
+        upim = sq * xptr[2*(it + c.stridei[k])+1];
+      }
+      if (i[k] > 0) {
+        double sq = sqrt(i[k]);
+        dnre = sq * xptr[2*(it - c.stridei[k])];
+        dnim = sq * xptr[2*(it - c.stridei[k])+1];
+      }
+      yre += c.qt[k] * (upre - dnre) + c.pt[k] * (upim + dnim);
+      yim += c.qt[k] * (upim - dnim) - c.pt[k] * (upre + dnre);
+    }
+
+    /* Jaynes-Cummings coupling: J_kl sin(eta_kl t) (a_k^d a_l - a_k a_l^d) psi - i J_kl cos(eta_kl t) (a_k^d a_l + a_k a_l^d) psi */
+    for (int m = 0; m < c.jc_k.size(); m++) {
+      int k = c.jc_k[m];
+      int l = c.jc_l[m];
+      double t1re = 0.0, t1im = 0.0, t2re = 0.0, t2im = 0.0;
+      if (i[k] > 0 && i[l] < n[l]-1) {
+        double sq = sqrt(i[k] * (i[l] + 1));
+        int itx = it - c.stridei[k] + c.stridei[l];
+        t1re = sq * xptr[2*itx];
+        t1im = sq * xptr[2*itx+1];
+      }
+      if (i[k] < n[k]-1 && i[l] > 0) {
+        double sq = sqrt((i[k] + 1) * i[l]);
+        int itx = it + c.stridei[k] - c.stridei[l];
+        t2re = sq * xptr[2*itx];
+        t2im = sq * xptr[2*itx+1];
+      }
+      double Js = c.jc_J[m] * c.jc_sin[m];
+      double Jc = c.jc_J[m] * c.jc_cos[m];
+      yre += Js * (t1re - t2re) + Jc * (t1im + t2im);
+      yim += Js * (t1im - t2im) - Jc * (t1re + t2re);
+    }
+
+    yptr[2*it]   = yre;
+    yptr[2*it+1] = yim;
+
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
+    itnext = it + 1;
+  }
+}
+
+
+/* Schroedinger's equation: y += 2D x with the diagonal collapse part D = -1/2 sum_k L_k^d L_k of the effective Hamiltonian */
+static void schroedinger_addCollapse(MatShellCtx* shellctx, Vec x, Vec y){
+
+  const int* n = shellctx->nlevels.data();
+  MatfreeCoeffs c;
+  matfree_getCoeffs(shellctx, &c);
+  int nosc = c.noscillators;
+
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  for (int it = 0; it < c.dim_rho; it++) {
+    double gam = 0.0;
+    for (int k = 0; k < nosc; k++) gam += c.decay[k] * i[k] + c.dephase[k] * i[k] * i[k];
+    yptr[2*it]   -= gam * xptr[2*it];
+    yptr[2*it+1] -= gam * xptr[2*it+1];
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
   }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+}
+
+
+/* Schroedinger's equation: Define the action of RHS = -iH(t) on a state vector x */
+int myMatMult_schroedinger(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
+  MatShellCtx *shellctx;
+  MatShellGetContext(RHS, (void**) &shellctx);
+
+  const double* xptr;
+  double* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+
+  schroedinger_mult(shellctx, xptr, yptr);
+
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(y, &yptr);
+
+  return 0;
 }
-int myMatMultTranspose_matfree_4Osc(Mat RHS, Vec x, Vec y){
- /* Get the shell context */
+
+
+/* Schroedinger's equation: Define the action of RHS^T on a state vector x. H is hermitian, so the real-valued RHS is anti-symmetric up to the diagonal collapse part D = -1/2 sum_k L_k^d L_k: RHS^T = -RHS + 2D. */
+int myMatMultTranspose_schroedinger(Mat RHS, Vec x, Vec y){
+
+  myMatMult_schroedinger(RHS, x, y);
+  VecScale(y, -1.0);
+
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
+  if (shellctx->addT1 || shellctx->addT2) schroedinger_addCollapse(shellctx, x, y);
 
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  int n3 = shellctx->nlevels[3];
-  if      (n0==2 && n1==2 && n2==2 && n3==2)  return myMatMultTranspose_matfree<2,2,2,2>(RHS, x, y);
-  else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+  return 0;
+}
+
+
+/* Schroedinger's equation: Contractions of xbar with the control terms applied to x, for the gradient, see sparsemat_dRHSdp. Here, A_k = a_k - a_k^d and B_k = -(a_k + a_k^d). */
+static void schroedinger_dRHSdp(MatShellCtx* shellctx, Vec x, Vec xbar, std::vector<double>& gA, std::vector<double>& gB){
+
+  int nosc = shellctx->nlevels.size();
+  const int* n = shellctx->nlevels.data();
+  gA.assign(nosc, 0.0);
+  gB.assign(nosc, 0.0);
+
+  const double* xptr;
+  const double* xbarptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArrayRead(xbar, &xbarptr);
+
+  int dim_rho = 1;
+  for (int k = 0; k < nosc; k++) dim_rho *= n[k];
+  std::vector<int> stride(nosc, 1);
+  for (int k = nosc-2; k >= 0; k--) stride[k] = stride[k+1] * n[k+1];
+
+  std::vector<int> i(nosc, 0), ip(nosc, 0);
+  for (int it = 0; it < dim_rho; it++) {
+    double ubar = xbarptr[2*it];
+    double vbar = xbarptr[2*it+1];
+    for (int k = 0; k < nosc; k++) {
+      double upre = 0.0, upim = 0.0, dnre = 0.0, dnim = 0.0;
+      if (i[k] < n[k]-1) {
+        double sq = sqrt(i[k] + 1);
+        upre = sq * xptr[2*(it + stride[k])];
+        upim = sq * xptr[2*(it + stride[k])+1];
+      }
+      if (i[k] > 0) {
+        double sq = sqrt(i[k]);
+        dnre = sq * xptr[2*(it - stride[k])];
+        dnim = sq * xptr[2*(it - stride[k])+1];
+      }
+      gA[k] += ubar * (upre - dnre) + vbar * (upim - dnim);
+      gB[k] += -vbar * (upre + dnre) + ubar * (upim + dnim);
+    }
+    TensorIncrementIndex(nosc, n, i.data(), ip.data());
+  }
+
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArrayRead(xbar, &xbarptr);
+}
+
+
+/* Apply RHS (or RHS^T) to a single-precision vector, for the mixed-precision linear solver. Serial Petsc only. */
+void MasterEq::applyRHS_single(const float* x, float* y, const bool transpose){
+
+  if (schroedinger) {
+    if (transpose && (addT1 || addT2)) {
+      printf("ERROR: The mixed-precision linear solver does not support the adjoint of the quantum trajectories.\n");
+      exit(1);
+    }
+    schroedinger_mult(&RHSctx, x, y);
+    if (transpose) for (int i = 0; i < 2*dim; i++) y[i] = -y[i];
+  } else if (hermitian_storage) {
+    matfree_packed_mult(&RHSctx, x, y, transpose);
+  } else if (usematfree) {
+    if (!transpose) matfree_simd_mult(&RHSctx, x, y, 0, dim);
+    else            matfree_simd_multTranspose(&RHSctx, x, y, 0, dim);
+  } else {
+    std::vector<double> zre, zim;
+    sparsemat_getCoeffs(&RHSctx, zre, zim);
+    if (transpose) for (int i = 0; i < zim.size(); i++) zim[i] = -zim[i];
+    if (!transpose) sparsemat_apply_rows(&RHSfused, &RHSkron, nlevels, 0, zre, zim, x, y);
+    else            sparsemat_apply_rows(&RHSfusedT, &RHSkronT, nlevels, 0, zre, zim, x, y);
   }
 }
 
 
-/* --- 5 Oscillator cases --- */
-int myMatMult_matfree_5Osc(Mat RHS, Vec x, Vec y){
+/* Gather the locally owned and the remote entries of x that are needed by the local rows into shellctx->xloc. 
+ * Returns a pointer that is indexed by the global vector index it for the local rows. Other entries are read at the remapped index haloIndex(it), or at it + haloOffset(offset) for the entry at offset it + offset. */
+static const double* fillHalo(MatShellCtx* shellctx, Vec x){
+
+  VecScatterBegin(*shellctx->halo, x, *shellctx->xhalo, INSERT_VALUES, SCATTER_FORWARD);
+
+  /* Copy the owned entries while the remote ones are on their way */
+  const double* xptr;
+  VecGetArrayRead(x, &xptr);
+  int nlocal = shellctx->iupp - shellctx->ilow;
+  double* xown = shellctx->xloc.data() + 2*shellctx->nbelow;
+  for (int i=0; i<2*nlocal; i++) xown[i] = xptr[i];
+  VecRestoreArrayRead(x, &xptr);
+
+  VecScatterEnd(*shellctx->halo, x, *shellctx->xhalo, INSERT_VALUES, SCATTER_FORWARD);
+
+  /* Copy the remote entries below and above the owned ones */
+  const double* hptr;
+  VecGetArrayRead(*shellctx->xhalo, &hptr);
+  int nbelow = shellctx->nbelow;
+  int nhalo = shellctx->halo_idx.size();
+  for (int i=0; i<2*nbelow; i++) shellctx->xloc[i] = hptr[i];
+  for (int i=2*nbelow; i<2*nhalo; i++) shellctx->xloc[2*nlocal + i] = hptr[i];
+  VecRestoreArrayRead(*shellctx->xhalo, &hptr);
+
+  return xown - 2*shellctx->ilow;
+}
+
+
+/* Index of the entry it of x in the pointer returned by fillHalo(). it must be owned, or one of the remote entries halo_idx. */
+static int haloIndex(const MatShellCtx* shellctx, const int it){
+  int nbefore = std::lower_bound(shellctx->halo_idx.begin(), shellctx->halo_idx.end(), it) - shellctx->halo_idx.begin();
+  nbefore += std::min(std::max(it - shellctx->ilow, 0), shellctx->iupp - shellctx->ilow);
+  return nbefore - shellctx->nbelow + shellctx->ilow;
+}
+
+
+/* Offset into the pointer returned by fillHalo() for reading x at it + offset from the local rows it. Since the local copy of x is sorted by global index, this is a constant 
+ * for all rows, as long as the whole shifted block of rows is held. Returns offset itself in serial. */
+static int haloOffset(const MatShellCtx* shellctx, const int offset){
+  if (shellctx->halo == NULL) return offset;
+  int it = std::max(shellctx->ilow, -offset);  // first local row with it + offset >= 0
+  if (it >= shellctx->iupp) return offset;
+  return haloIndex(shellctx, it + offset) - it;
+}
+
+
+/* Matrix-free solver for parallel Petsc: Define the action of RHS on a vector x. 
+ * Each process owns a contiguous slab of rows. It receives the remote x entries that its rows need, and then applies the vectorized kernel on its rows. 
+ * If the slab boundaries do not align with the last oscillator's levels, the kernel applies the whole runs at the boundaries into a buffer, from which the owned rows are copied. */
+int myMatMult_matfree_mpi(Mat RHS, Vec x, Vec y){
+
   /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  int n3 = shellctx->nlevels[3];
-  int n4 = shellctx->nlevels[4];
-  if      (n0==2 && n1==2 && n2==2 && n3 == 2 && n4 == 2) return myMatMult_matfree<2,2,2,2,2>(RHS, x, y);
+
+  /* Exchange the halo and get access to y */
+  const double* xptr = fillHalo(shellctx, x);
+  double* yptr;
+  VecGetArray(y, &yptr);
+
+  /* Apply local rows */
+  int ilow = shellctx->ilow;
+  int iupp = shellctx->iupp;
+  int nl = shellctx->nlevels[shellctx->nlevels.size()-1];
+  if (ilow % nl == 0 && iupp % nl == 0) matfree_simd_mult(shellctx, xptr, yptr - 2*ilow, ilow, iupp);
   else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+    int alow = ilow - ilow % nl;
+    int aupp = iupp + (nl - iupp % nl) % nl;
+    std::vector<double> yrun(2*(aupp - alow));
+    matfree_simd_mult(shellctx, xptr, yrun.data() - 2*alow, alow, aupp);
+    for (int i=0; i<2*(iupp-ilow); i++) yptr[i] = yrun[2*(ilow-alow) + i];
   }
+
+  /* Restore y */
+  VecRestoreArray(y, &yptr);
+
+  return 0;
 }
-int myMatMultTranspose_matfree_5Osc(Mat RHS, Vec x, Vec y){
- /* Get the shell context */
+
+
+/* Matrix-free solver for parallel Petsc: Define the action of RHS^T on a vector x */
+int myMatMultTranspose_matfree_mpi(Mat RHS, Vec x, Vec y){
+
+  /* Get the shell context */
   MatShellCtx *shellctx;
   MatShellGetContext(RHS, (void**) &shellctx);
 
-  int n0 = shellctx->nlevels[0];
-  int n1 = shellctx->nlevels[1];
-  int n2 = shellctx->nlevels[2];
-  int n3 = shellctx->nlevels[3];
-  int n4 = shellctx->nlevels[4];
-  if      (n0==2 && n1==2 && n2==2 && n3==2 && n4==2)  return myMatMultTranspose_matfree<2,2,2,2,2>(RHS, x, y);
+  /* Exchange the halo and get access to y */
+  const double* xptr = fillHalo(shellctx, x);
+  double* yptr;
+  VecGetArray(y, &yptr);
+
+  /* Apply local rows */
+  int ilow = shellctx->ilow;
+  int iupp = shellctx->iupp;
+  int nl = shellctx->nlevels[shellctx->nlevels.size()-1];
+  if (ilow % nl == 0 && iupp % nl == 0) matfree_simd_multTranspose(shellctx, xptr, yptr - 2*ilow, ilow, iupp);
   else {
-    printf("ERROR: In order to run this case, add a line at the end of mastereq.cpp with the corresponding number of levels!\n");
-    exit(1);
+    int alow = ilow - ilow % nl;
+    int aupp = iupp + (nl - iupp % nl) % nl;
+    std::vector<double> yrun(2*(aupp - alow));
+    matfree_simd_multTranspose(shellctx, xptr, yrun.data() - 2*alow, alow, aupp);
+    for (int i=0; i<2*(iupp-ilow); i++) yptr[i] = yrun[2*(ilow-alow) + i];
   }
+
+  /* Restore y */
+  VecRestoreArray(y, &yptr);
+
+  return 0;
 }
 
+
+/* Runtime dispatch to the compile-time specialized kernels for 2-5 oscillators, generated by the Makefile from the MATFREE_LEVELS list.
+ * Level combinations without specialization never reach it, the MasterEq constructor selects the vectorized runtime-strided kernel for them. */
+#include "matfree_dispatch.hpp"
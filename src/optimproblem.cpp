@@ -125,9 +125,13 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     printf("\n\n ERROR: Unknown objective function: %s\n", objective_str.c_str());
     exit(1);
   }
+  /* Quantum trajectories average the cost of each pure state, which equals the cost of the averaged rho only if it is linear in rho */
+  if (timestepper->mcwf_ntrajectories > 0 && objective_type == ObjectiveType::JFROBENIUS && mpirank_world == 0) {
+    printf("\n\n WARNING: With quantum trajectories (mcwf_ntrajectories > 0), Jfrobenius is averaged over the pure trajectory states, which overestimates it by (1 - Tr(rho^2))/2. Use Jhilbertschmidt or Jmeasure for the cost of rho.\n\n");
+  }
 
   /* Finally initialize the optimization target struct */
-  optim_target = new OptimTarget(timestepper->mastereq->getDim(), purestateID, target_type, objective_type, targetgate, target_filename);
+  optim_target = new OptimTarget(timestepper->mastereq->getDim(), purestateID, target_type, objective_type, targetgate, target_filename, timestepper->mastereq->schroedinger);
 
   /* Get weights for the objective function (weighting the different initial conditions */
   config.GetVecDoubleParam("optim_weights", obj_weights, 1.0);
@@ -162,6 +166,18 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     printf("\n\n ERROR: Wrong setting for initial condition.\n");
     exit(1);
   }
+  basis_symmetry = config.GetBoolParam("basis_symmetry", false);
+  /* Schroedinger's equation propagates pure states only. The low-rank solver also takes the ensemble state, as a factor of state vectors. */
+  if (timestepper->mastereq->schroedinger && (initcond_type == InitialConditionType::FROMFILE || 
+                                              (initcond_type == InitialConditionType::ENSEMBLE && timestepper->lowrank_maxrank == 0) || 
+                                              initcond_type == InitialConditionType::THREESTATES)) {
+    printf("\n\n ERROR: Schroedinger's equation needs initial conditions that are pure states: 'pure', 'diagonal', 'basis' or 'Nplus1' ('ensemble' with lowrank_maxrank > 0).\n");
+    exit(1);
+  }
+  if (initcond_type == InitialConditionType::ENSEMBLE && timestepper->lowrank_maxrank > 0 && target_type == TargetType::GATE) {
+    printf("\n\n ERROR: The low-rank solver needs a pure-state optimization target for the ensemble initial condition.\n");
+    exit(1);
+  }
 
   /* Allocate the initial condition vector */
   VecCreate(PETSC_COMM_WORLD, &rho_t0); 
@@ -192,8 +208,9 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
       }
       diag_id += initcond_IDs[k] * dim_postkron;
     }
-    int ndim = (int)sqrt(timestepper->mastereq->getDim());
+    int ndim = timestepper->mastereq->getDimRho();
     int vec_id = getIndexReal(getVecID( diag_id, diag_id, ndim )); // Real part of x
+    if (timestepper->mastereq->schroedinger) vec_id = getIndexReal(diag_id); // psi = e_m
     if (ilow <= vec_id && vec_id < iupp) VecSetValue(rho_t0, vec_id, 1.0, INSERT_VALUES);
   }
   else if (initcond_type == InitialConditionType::FROMFILE) { 
@@ -247,26 +264,52 @@ OptimProblem::OptimProblem(MapParam config, TimeStepper* timestepper_, MPI_Comm
     int dimrho = timestepper->mastereq->getDimRho();
     assert(dimsub == (int) ( dimrho / dimpre / dimpost) );
 
-    for (int i=0; i < dimsub; i++){
-      for (int j=i; j < dimsub; j++){
-        int ifull = i * dimpost;
-        int jfull = j * dimpost;
-        // printf(" i=%d j=%d ifull %d, jfull %d\n", i, j, ifull, jfull);
-        if (i == j) { // diagonal element: 1/N_sub
-          int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 1./dimsub, INSERT_VALUES);
-        } else {
-          // upper diagonal (0.5 + 0.5*i) / (N_sub^2)
-          int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
-          int elemid_im = getIndexImag(getVecID(ifull, jfull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 0.5/(dimsub*dimsub), INSERT_VALUES);
-          if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, 0.5/(dimsub*dimsub), INSERT_VALUES);
-          // lower diagonal (0.5 - 0.5*i) / (N_sub^2)
-          elemid_re = getIndexReal(getVecID(jfull, ifull, dimrho));
-          elemid_im = getIndexImag(getVecID(jfull, ifull, dimrho));
-          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re,  0.5/(dimsub*dimsub), INSERT_VALUES);
-          if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, -0.5/(dimsub*dimsub), INSERT_VALUES);
-        } 
+    if (timestepper->mastereq->schroedinger) {
+      /* Low-rank solver: factor the ensemble state rho_sub = U Lambda U^\dagger (set below for Lindblad's equation) into the state vectors sqrt(lambda_e) U_e */
+      std::vector<double> rhosub(2*dimsub*dimsub, 0.0), lambda;
+      for (int i=0; i < dimsub; i++){
+        for (int j=0; j < dimsub; j++){
+          rhosub[2*(i + j*dimsub)]   = (i == j) ? 1./dimsub : 0.5/(dimsub*dimsub);
+          rhosub[2*(i + j*dimsub)+1] = (i < j) ? 0.5/(dimsub*dimsub) : ((i > j) ? -0.5/(dimsub*dimsub) : 0.0);
+        }
+      }
+      getEigHermitian(dimsub, rhosub, lambda);
+      for (int e=0; e < dimsub; e++){
+        if (lambda[e] < 1e-14) continue;
+        Vec col;
+        VecDuplicate(rho_t0, &col);
+        for (int i=0; i < dimsub; i++){
+          int elemid_re = getIndexReal(i * dimpost);
+          int elemid_im = getIndexImag(i * dimpost);
+          if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(col, elemid_re, sqrt(lambda[e]) * rhosub[2*(i + e*dimsub)],   INSERT_VALUES);
+          if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(col, elemid_im, sqrt(lambda[e]) * rhosub[2*(i + e*dimsub)+1], INSERT_VALUES);
+        }
+        VecAssemblyBegin(col); VecAssemblyEnd(col);
+        factor_t0.push_back(col);
+      }
+    }
+    else {
+      for (int i=0; i < dimsub; i++){
+        for (int j=i; j < dimsub; j++){
+          int ifull = i * dimpost;
+          int jfull = j * dimpost;
+          // printf(" i=%d j=%d ifull %d, jfull %d\n", i, j, ifull, jfull);
+          if (i == j) { // diagonal element: 1/N_sub
+            int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
+            if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 1./dimsub, INSERT_VALUES);
+          } else {
+            // upper diagonal (0.5 + 0.5*i) / (N_sub^2)
+            int elemid_re = getIndexReal(getVecID(ifull, jfull, dimrho));
+            int elemid_im = getIndexImag(getVecID(ifull, jfull, dimrho));
+            if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re, 0.5/(dimsub*dimsub), INSERT_VALUES);
+            if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, 0.5/(dimsub*dimsub), INSERT_VALUES);
+            // lower diagonal (0.5 - 0.5*i) / (N_sub^2)
+            elemid_re = getIndexReal(getVecID(jfull, ifull, dimrho));
+            elemid_im = getIndexImag(getVecID(jfull, ifull, dimrho));
+            if (ilow <= elemid_re && elemid_re < iupp) VecSetValue(rho_t0, elemid_re,  0.5/(dimsub*dimsub), INSERT_VALUES);
+            if (ilow <= elemid_im && elemid_im < iupp) VecSetValue(rho_t0, elemid_im, -0.5/(dimsub*dimsub), INSERT_VALUES);
+          } 
+        }
       }
     }
   }
@@ -333,6 +376,7 @@ OptimProblem::~OptimProblem() {
   delete optim_target;
   VecDestroy(&rho_t0);
   VecDestroy(&rho_t0_bar);
+  for (int i = 0; i < factor_t0.size(); i++) VecDestroy(&factor_t0[i]);
 
   VecDestroy(&xlower);
   VecDestroy(&xupper);
@@ -359,36 +403,55 @@ double OptimProblem::evalF(const Vec x) {
   obj_penal = 0.0;
   fidelity = 0.0;
   double obj_cost_max = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
+  /* Basis initial conditions: reconstruct from the unit matrices E_kj, k<=j */
+  if (useBasisSymmetry()) evalBasisSymmetric(NULL);
+  /* Batched time stepping: propagate groups of initial conditions together */
+  else if (timestepper->mastereq->nbatch > 1 && ninit_local > 1) evalBatch(NULL);
+  else {
+    for (int iinit = 0; iinit < ninit_local; iinit++) {
       
-    /* Prepare the initial condition in [rank * ninit_local, ... , (rank+1) * ninit_local - 1] */
-    int iinit_global = mpirank_init * ninit_local + iinit;
-    int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
-    if (mpirank_braid == 0) printf("%d: Initial condition id=%d ...\n", mpirank_init, initid);
-
-    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepare(rho_t0);
-
-    /* Run forward with initial condition initid */
+      /* Prepare the initial condition in [rank * ninit_local, ... , (rank+1) * ninit_local - 1] */
+      int iinit_global = mpirank_init * ninit_local + iinit;
+      int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+      if (mpirank_braid == 0) printf("%d: Initial condition id=%d ...\n", mpirank_init, initid);
+
+      /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
+      optim_target->prepare(rho_t0);
+
+      double obj_iinit, fidelity_iinit;
+      if (timestepper->mcwf_ntrajectories > 0) {
+        /* Monte Carlo wavefunction method: final-time cost and fidelity are averages over the quantum trajectories */
+        timestepper->solveODE_mcwf(initid, rho_t0, &obj_iinit, &fidelity_iinit);
+      } else if (timestepper->lowrank_maxrank > 0) {
+        /* Low-rank solver: start from the pure state, or from the factor of the ensemble state */
+        std::vector<Vec> factor (1, rho_t0);
+        if (initcond_type == InitialConditionType::ENSEMBLE) factor = factor_t0;
+        timestepper->solveODE_lowrank(initid, factor, &obj_iinit, &fidelity_iinit);
+        if (mpirank_braid == 0) printf("%d: Low-rank factor: rank %d, truncation error %1.8e\n", mpirank_init, timestepper->lowrank_rank, timestepper->lowrank_truncerr);
+      } else {
+        /* Run forward with initial condition initid */
 #ifdef WITH_BRAID
-      primalbraidapp->PreProcess(initid, rho_t0, 0.0);
-      primalbraidapp->Drive();
-      finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
+        primalbraidapp->PreProcess(initid, rho_t0, 0.0);
+        primalbraidapp->Drive();
+        finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
 #else
-      finalstate = timestepper->solveODE(initid, rho_t0);
+        finalstate = timestepper->solveODE(initid, rho_t0);
 #endif
+        obj_iinit = optim_target->evalJ(finalstate);
+        fidelity_iinit = optim_target->evalFidelity(finalstate);
+      }
 
-    /* Add to integral penalty term */
-    obj_penal += gamma_penalty * timestepper->penalty_integral;
+      /* Add to integral penalty term */
+      obj_penal += gamma_penalty * timestepper->penalty_integral;
 
-    /* Evaluate J(finalstate) and add to final-time cost */
-    double obj_iinit = optim_target->evalJ(finalstate);
-    obj_cost +=  obj_weights[iinit] * obj_iinit;
-    obj_cost_max = std::max(obj_cost_max, obj_iinit);
-    // printf("%d, %d: iinit objective: %f * %1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit], obj_iinit);
+      /* Evaluate J(finalstate) and add to final-time cost */
+      obj_cost +=  obj_weights[iinit] * obj_iinit;
+      obj_cost_max = std::max(obj_cost_max, obj_iinit);
+      // printf("%d, %d: iinit objective: %f * %1.14e\n", mpirank_world, mpirank_init, obj_weights[iinit], obj_iinit);
 
-    /* Add to final-time fidelity */
-    fidelity += optim_target->evalFidelity(finalstate);
+      /* Add to final-time fidelity */
+      fidelity += fidelity_iinit;
+    }
   }
 
 #ifdef WITH_BRAID
@@ -449,58 +512,64 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
   obj_regul = 0.0;
   obj_penal = 0.0;
   fidelity = 0.0;
-  for (int iinit = 0; iinit < ninit_local; iinit++) {
+  /* Basis initial conditions: reconstruct from the unit matrices E_kj, k<=j */
+  if (useBasisSymmetry()) evalBasisSymmetric(G);
+  /* Batched time stepping: propagate groups of initial conditions together, forward and backward */
+  else if (timestepper->mastereq->nbatch > 1 && ninit_local > 1) evalBatch(G);
+  else {
+    for (int iinit = 0; iinit < ninit_local; iinit++) {
 
-    /* Prepare the initial condition */
-    int iinit_global = mpirank_init * ninit_local + iinit;
-    int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+      /* Prepare the initial condition */
+      int iinit_global = mpirank_init * ninit_local + iinit;
+      int initid = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
 
-    /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
-    optim_target->prepare(rho_t0);
+      /* If gate optimiztion, compute the target state rho^target = Vrho(0)V^dagger */
+      optim_target->prepare(rho_t0);
 
-    /* --- Solve primal --- */
-    // if (mpirank_braid == 0) printf("%d: %d FWD. ", mpirank_init, initid);
+      /* --- Solve primal --- */
+      // if (mpirank_braid == 0) printf("%d: %d FWD. ", mpirank_init, initid);
 
-    /* Run forward with initial condition rho_t0 */
+      /* Run forward with initial condition rho_t0 */
 #ifdef WITH_BRAID 
-      primalbraidapp->PreProcess(initid, rho_t0, 0.0);
-      primalbraidapp->Drive();
-      finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
+        primalbraidapp->PreProcess(initid, rho_t0, 0.0);
+        primalbraidapp->Drive();
+        finalstate = primalbraidapp->PostProcess(); // this return NULL for all but the last time processor
 #else 
-      finalstate = timestepper->solveODE(initid, rho_t0);
+        finalstate = timestepper->solveODE(initid, rho_t0);
 #endif
 
-    /* Add to integral penalty term */
-    obj_penal += gamma_penalty * timestepper->penalty_integral;
+      /* Add to integral penalty term */
+      obj_penal += gamma_penalty * timestepper->penalty_integral;
 
-    /* Evaluate J(finalstate) and add to final-time cost */
-    double obj_iinit = optim_target->evalJ(finalstate);
-    obj_cost += obj_weights[iinit] * obj_iinit;
-    // if (mpirank_braid == 0) printf("%d: iinit objective: %1.14e\n", mpirank_init, obj_iinit);
+      /* Evaluate J(finalstate) and add to final-time cost */
+      double obj_iinit = optim_target->evalJ(finalstate);
+      obj_cost += obj_weights[iinit] * obj_iinit;
+      // if (mpirank_braid == 0) printf("%d: iinit objective: %1.14e\n", mpirank_init, obj_iinit);
 
-    /* Add to final-time fidelity */
-    fidelity += optim_target->evalFidelity(finalstate);
+      /* Add to final-time fidelity */
+      fidelity += optim_target->evalFidelity(finalstate);
 
-    /* --- Solve adjoint --- */
-    // if (mpirank_braid == 0) printf("%d: %d BWD.", mpirank_init, initid);
+      /* --- Solve adjoint --- */
+      // if (mpirank_braid == 0) printf("%d: %d BWD.", mpirank_init, initid);
 
-    /* Reset adjoint */
-    VecZeroEntries(rho_t0_bar);
+      /* Reset adjoint */
+      VecZeroEntries(rho_t0_bar);
 
-    /* Derivative of final time objective J */
-    optim_target->evalJ_diff(finalstate, rho_t0_bar, 1.0 / ninit * obj_weights[iinit]);
+      /* Derivative of final time objective J */
+      optim_target->evalJ_diff(finalstate, rho_t0_bar, 1.0 / ninit * obj_weights[iinit]);
 
-    /* Derivative of time-stepping */
+      /* Derivative of time-stepping */
 #ifdef WITH_BRAID
-      adjointbraidapp->PreProcess(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
-      adjointbraidapp->Drive();
-      adjointbraidapp->PostProcess();
+        adjointbraidapp->PreProcess(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
+        adjointbraidapp->Drive();
+        adjointbraidapp->PostProcess();
 #else
-      timestepper->solveAdjointODE(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
+        timestepper->solveAdjointODE(initid, rho_t0_bar, 1.0 / ninit * gamma_penalty);
 #endif
 
-    /* Add to optimizers's gradient */
-    VecAXPY(G, 1.0, timestepper->redgrad);
+      /* Add to optimizers's gradient */
+      VecAXPY(G, 1.0, timestepper->redgrad);
+    }
   }
 
 #ifdef WITH_BRAID
@@ -556,6 +625,222 @@ void OptimProblem::evalGradF(const Vec x, Vec G){
 }
 
 
+bool OptimProblem::useBasisSymmetry() {
+  if (!basis_symmetry || initcond_type != InitialConditionType::BASIS) return false;
+#ifdef WITH_BRAID
+  return false;
+#endif
+  /* Unit matrices E_kj are not Hermitian, and are not pure states */
+  if (timestepper->mastereq->schroedinger || timestepper->mastereq->hermitian_storage) return false;
+  /* All basis elements on one serial processor */
+  if (mpisize_init > 1 || mpisize_space > 1) return false;
+  /* The integral penalty term is not linear in the trajectory */
+  if (gamma_penalty > 1e-13) return false;
+  /* Data files are reconstructed from the output time steps of the unit matrices, which must coincide */
+  if (timestepper->adaptive_tol > 0.0 && output->writeThisIter()) return false;
+
+  return true;
+}
+
+
+void OptimProblem::evalBasisSymmetric(Vec G) {
+  MasterEq* mastereq = timestepper->mastereq;
+  int dim_rho = mastereq->getDimRho();
+  int n = (int) sqrt(ninit);
+  Vec finalstate = NULL;
+  bool writeout = output->writeThisIter();
+
+  /* Basis elements are B_kk = E_kk, and for k<j: B_kj = D + 1/2(E_kj + E_jk), B_jk = D + i/2(E_kj - E_jk) with D = 1/2(E_kk + E_jj).
+   * Since the trajectory of E_jk is the adjoint of the trajectory Z of E_kj, the final states are D(T) + 1/2(Z + Z^\dagger) and D(T) + i/2(Z - Z^\dagger). */
+  Vec unit, rhoB, rhoB_bar, unit_bar;
+  VecDuplicate(rho_t0, &unit);
+  VecDuplicate(rho_t0, &rhoB);
+  VecDuplicate(rho_t0, &rhoB_bar);
+  VecDuplicate(rho_t0, &unit_bar);
+  std::vector<Vec> diag_T(n);      // Final states E_kk(T)
+  std::vector<Vec> diag_bar(n);    // Adjoint terminal conditions of E_kk
+  std::vector<std::vector<Vec> > diag_out(n);  // States of E_kk at the output time steps, if data files are written
+
+  /* Propagate the diagonal elements. Their adjoint terminal conditions are complete only after all pairs k<j are done. */
+  for (int k = 0; k < n; k++) {
+    int iinit = k * n + k;
+    int initid = mastereq->getRhoT0(iinit, ninit, initcond_type, initcond_IDs, rho_t0);
+    optim_target->prepare(rho_t0);
+    output->capture = writeout;
+    finalstate = timestepper->solveODE(initid, rho_t0);
+    output->capture = false;
+    diag_out[k].swap(output->captured_states);
+    output->captured_steps.clear();
+    output->captured_times.clear();
+    VecDuplicate(finalstate, &diag_T[k]);
+    VecCopy(finalstate, diag_T[k]);
+
+    obj_cost += obj_weights[iinit] * optim_target->evalJ(finalstate);
+    fidelity += optim_target->evalFidelity(finalstate);
+
+    if (G != NULL) {
+      VecDuplicate(rho_t0, &diag_bar[k]);
+      VecZeroEntries(diag_bar[k]);
+      optim_target->evalJ_diff(finalstate, diag_bar[k], 1.0 / ninit * obj_weights[iinit]);
+    }
+  }
+
+  /* Propagate E_kj for each pair k<j and reconstruct B_kj and B_jk */
+  for (int k = 0; k < n; k++) {
+    for (int j = k+1; j < n; j++) {
+      int iinit_re = j * n + k;
+      int iinit_im = k * n + j;
+
+      /* E_kj = (B_kj - D) - i (B_jk - D) */
+      VecZeroEntries(unit);
+      int initid = mastereq->getRhoT0(iinit_re, ninit, initcond_type, initcond_IDs, rho_t0);
+      VecAXPY(unit, 1.0, rho_t0);
+      mastereq->getRhoT0(iinit_im, ninit, initcond_type, initcond_IDs, rho_t0);
+      addMatrixAndAdjoint(unit, 0.0, -1.0, 0.0, 0.0, rho_t0, dim_rho);
+      mastereq->getRhoT0(k * n + k, ninit, initcond_type, initcond_IDs, rho_t0);
+      addMatrixAndAdjoint(unit, -0.5, 0.5, 0.0, 0.0, rho_t0, dim_rho);
+      mastereq->getRhoT0(j * n + j, ninit, initcond_type, initcond_IDs, rho_t0);
+      addMatrixAndAdjoint(unit, -0.5, 0.5, 0.0, 0.0, rho_t0, dim_rho);
+
+      /* Propagate E_kj without data files of its own, but keep its states at the output time steps */
+      output->capture = writeout;
+      output->nofiles = true;
+      finalstate = timestepper->solveODE(initid, unit);
+      output->capture = false;
+      output->nofiles = false;
+      if (G != NULL) VecZeroEntries(unit_bar);
+
+      for (int iB = 0; iB < 2; iB++) {
+        /* B(T) = D(T) + alpha Z + beta Z^\dagger */
+        int iinit = iB == 0 ? iinit_re : iinit_im;
+        double are = iB == 0 ? 0.5 : 0.0;
+        double aim = iB == 0 ? 0.0 : 0.5;
+        int initid_B = mastereq->getRhoT0(iinit, ninit, initcond_type, initcond_IDs, rho_t0);
+        optim_target->prepare(rho_t0);
+        VecZeroEntries(rhoB);
+        VecAXPY(rhoB, 0.5, diag_T[k]);
+        VecAXPY(rhoB, 0.5, diag_T[j]);
+        addMatrixAndAdjoint(rhoB, are, aim, are, -aim, finalstate, dim_rho);
+
+        obj_cost += obj_weights[iinit] * optim_target->evalJ(rhoB);
+        fidelity += optim_target->evalFidelity(rhoB);
+
+        if (G != NULL) {
+          /* Transpose of the reconstruction: Zbar += conj(alpha) Bbar + beta Bbar^\dagger, E_kk and E_jj get 1/2 Bbar each */
+          VecZeroEntries(rhoB_bar);
+          optim_target->evalJ_diff(rhoB, rhoB_bar, 1.0 / ninit * obj_weights[iinit]);
+          addMatrixAndAdjoint(unit_bar, are, -aim, are, -aim, rhoB_bar, dim_rho);
+          VecAXPY(diag_bar[k], 0.5, rhoB_bar);
+          VecAXPY(diag_bar[j], 0.5, rhoB_bar);
+        }
+
+        /* Data files of B, reconstructed in the same way at each output time step */
+        if (writeout) {
+          output->openDataFiles("rho", initid_B);
+          for (int m = 0; m < output->captured_states.size(); m++) {
+            VecZeroEntries(rhoB);
+            VecAXPY(rhoB, 0.5, diag_out[k][m]);
+            VecAXPY(rhoB, 0.5, diag_out[j][m]);
+            addMatrixAndAdjoint(rhoB, are, aim, are, -aim, output->captured_states[m], dim_rho);
+            output->writeDataFiles(output->captured_steps[m], output->captured_times[m], rhoB, mastereq);
+          }
+          output->closeDataFiles();
+        }
+      }
+      for (int m = 0; m < output->captured_states.size(); m++) VecDestroy(&output->captured_states[m]);
+      output->captured_states.clear();
+      output->captured_steps.clear();
+      output->captured_times.clear();
+
+      if (G != NULL) {
+        timestepper->solveAdjointODE(initid, unit_bar, 1.0 / ninit * gamma_penalty);
+        VecAXPY(G, 1.0, timestepper->redgrad);
+      }
+    }
+  }
+
+  /* Propagate the diagonal elements again for their adjoint solves. Their data files are written already. */
+  if (G != NULL) {
+    for (int k = 0; k < n; k++) {
+      int initid = mastereq->getRhoT0(k * n + k, ninit, initcond_type, initcond_IDs, rho_t0);
+      output->nofiles = true;
+      timestepper->solveODE(initid, rho_t0);
+      output->nofiles = false;
+      timestepper->solveAdjointODE(initid, diag_bar[k], 1.0 / ninit * gamma_penalty);
+      VecAXPY(G, 1.0, timestepper->redgrad);
+    }
+  }
+
+  for (int k = 0; k < n; k++) {
+    VecDestroy(&diag_T[k]);
+    if (G != NULL) VecDestroy(&diag_bar[k]);
+    for (int m = 0; m < diag_out[k].size(); m++) VecDestroy(&diag_out[k][m]);
+  }
+  VecDestroy(&unit);
+  VecDestroy(&rhoB);
+  VecDestroy(&rhoB_bar);
+  VecDestroy(&unit_bar);
+}
+
+
+void OptimProblem::evalBatch(Vec G) {
+  int nbatch = timestepper->mastereq->nbatch;
+  std::vector<Vec> rho0(nbatch), rhoT(nbatch), rhoT_bar;
+  for (int b = 0; b < nbatch; b++) {
+    VecDuplicate(rho_t0, &rho0[b]);
+    VecDuplicate(rho_t0, &rhoT[b]);
+  }
+
+  for (int ifirst = 0; ifirst < ninit_local; ifirst += nbatch) {
+
+    /* Prepare the initial conditions of this batch */
+    int nb = std::min(nbatch, ninit_local - ifirst);
+    std::vector<int> initids(nb);
+    for (int b = 0; b < nb; b++) {
+      int iinit_global = mpirank_init * ninit_local + ifirst + b;
+      initids[b] = timestepper->mastereq->getRhoT0(iinit_global, ninit, initcond_type, initcond_IDs, rho_t0);
+      VecCopy(rho_t0, rho0[b]);
+      printf("%d: Initial condition id=%d ...\n", mpirank_init, initids[b]);
+
+      /* If gate optimization, compute this member's target state and park it in its slot */
+      optim_target->prepare(rho0[b]);
+      optim_target->swapTargetState(b);
+    }
+
+    /* Run forward with all initial conditions of this batch */
+    timestepper->solveODE_batch(initids, rho0, rhoT);
+
+    /* Add to integral penalty term */
+    obj_penal += gamma_penalty * timestepper->penalty_integral;
+
+    /* Evaluate J(finalstate) and add to final-time cost and fidelity. If gradient, set the adjoint terminal condition to its derivative. */
+    if (G != NULL) rhoT_bar.resize(nb);
+    for (int b = 0; b < nb; b++) {
+      optim_target->swapTargetState(b);
+      obj_cost += obj_weights[ifirst + b] * optim_target->evalJ(rhoT[b]);
+      fidelity += optim_target->evalFidelity(rhoT[b]);
+      if (G != NULL) {
+        rhoT_bar[b] = rho0[b];   // rho0 is no longer needed, reuse its storage
+        VecZeroEntries(rhoT_bar[b]);
+        optim_target->evalJ_diff(rhoT[b], rhoT_bar[b], 1.0 / ninit * obj_weights[ifirst + b]);
+      }
+      optim_target->swapTargetState(b);
+    }
+
+    /* Solve adjoint with all initial conditions of this batch, and add to optimizer's gradient */
+    if (G != NULL) {
+      timestepper->solveAdjointODE_batch(rhoT_bar, 1.0 / ninit * gamma_penalty);
+      VecAXPY(G, 1.0, timestepper->redgrad);
+    }
+  }
+
+  for (int b = 0; b < nbatch; b++) {
+    VecDestroy(&rho0[b]);
+    VecDestroy(&rhoT[b]);
+  }
+}
+
+
 void OptimProblem::solve(Vec xinit) {
   TaoSetInitialVector(tao, xinit);
   TaoSolve(tao);
@@ -1,7 +1,7 @@
 #include "optimtarget.hpp"
 
 
-OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_){
+OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, ObjectiveType objective_type_, Gate* targetgate_, std::string target_filename_, bool schroedinger_){
 
   // initialize
   target_type = target_type_;
@@ -9,9 +9,30 @@ OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, Obj
   targetgate = targetgate_;
   purestateID = purestateID_;
   target_filename = target_filename_;
+  schroedinger = schroedinger_;
+
+  /* Schroedinger's equation: the target is a state vector phi, input dim is the dimension of the state vector: dim=N */
+  if (schroedinger) {
+    if (target_type == TargetType::FROMFILE) {
+      printf("ERROR: Schroedinger's equation needs a gate or a pure-state optimization target.\n");
+      exit(1);
+    }
+    VecCreate(PETSC_COMM_WORLD, &targetstate); 
+    VecSetSizes(targetstate,PETSC_DECIDE, 2*dim);
+    VecSetFromOptions(targetstate);
+    VecDuplicate(targetstate, &targetstate_i);
+    if (target_type == TargetType::PURE) { // phi = e_m
+      PetscInt ilow, iupp;
+      VecGetOwnershipRange(targetstate, &ilow, &iupp);
+      if (ilow <= getIndexReal(purestateID) && getIndexReal(purestateID) < iupp) VecSetValue(targetstate, getIndexReal(purestateID), 1.0, INSERT_VALUES);
+      if (ilow <= getIndexImag(purestateID) && getIndexImag(purestateID) < iupp) VecSetValue(targetstate_i, getIndexImag(purestateID), 1.0, INSERT_VALUES);
+      VecAssemblyBegin(targetstate); VecAssemblyEnd(targetstate);
+      VecAssemblyBegin(targetstate_i); VecAssemblyEnd(targetstate_i);
+    }
+  }
 
   /* Allocate target state, if it is read from file, of if target is a gate transformation VrhoV */
-  if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE) {
+  if (!schroedinger && (target_type == TargetType::GATE || target_type == TargetType::FROMFILE)) {
     VecCreate(PETSC_COMM_WORLD, &targetstate); 
     VecSetSizes(targetstate,PETSC_DECIDE, 2*dim);   // input dim is the dimension of the vectorized system: dim=N^2
     VecSetFromOptions(targetstate);
@@ -48,7 +69,14 @@ OptimTarget::OptimTarget(int dim, int purestateID_, TargetType target_type_, Obj
 
 OptimTarget::~OptimTarget(){
   if (objective_type == ObjectiveType::JFROBENIUS) VecDestroy(&aux);
-  if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE)  VecDestroy(&targetstate);
+  if (schroedinger) {
+    VecDestroy(&targetstate);
+    VecDestroy(&targetstate_i);
+  }
+  else if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE)  VecDestroy(&targetstate);
+  for (size_t i = 0; i < batchtargets.size(); i++) {
+    if (batchtargets[i] != NULL) VecDestroy(&batchtargets[i]);
+  }
 }
 
 double OptimTarget::FrobeniusDistance(const Vec state){
@@ -94,12 +122,58 @@ void OptimTarget::HilbertSchmidtOverlap_diff(const Vec state, Vec statebar, cons
 }
 
 
+double OptimTarget::Overlap(const Vec state) {
+  // phi^\dagger psi = (phi_re . psi) + i (phi_re . psi_im - phi_im . psi_re) = (phi . psi) + i ((i phi) . psi), with real dot products of the co-located vectors 
+  double cre, cim;
+  VecTDot(targetstate, state, &cre);
+  VecTDot(targetstate_i, state, &cim);
+  return cre*cre + cim*cim;
+}
+
+void OptimTarget::Overlap_diff(const Vec state, Vec statebar, const double Jbar) {
+  // Derivative of |c|^2 = cre^2 + cim^2: statebar += 2 Jbar (cre * phi + cim * i phi) 
+  double cre, cim;
+  VecTDot(targetstate, state, &cre);
+  VecTDot(targetstate_i, state, &cim);
+  VecAXPY(statebar, 2.0*Jbar*cre, targetstate);
+  VecAXPY(statebar, 2.0*Jbar*cim, targetstate_i);
+}
+
+
 void OptimTarget::prepare(const Vec rho_t0){
   // If gate optimization, apply the gate and store targetstate for later use. Else, do nothing.
   if (target_type == TargetType::GATE) targetgate->applyGate(rho_t0, targetstate);
+
+  // Schroedinger's equation: store i*phi for the overlaps
+  if (schroedinger && target_type == TargetType::GATE) {
+    const PetscScalar* phi;
+    PetscScalar* iphi;
+    PetscInt ilow, iupp;
+    VecGetOwnershipRange(targetstate, &ilow, &iupp);
+    VecGetArrayRead(targetstate, &phi);
+    VecGetArray(targetstate_i, &iphi);
+    for (int i = 0; i < (iupp-ilow)/2; i++) {
+      iphi[2*i]   = -phi[2*i+1];
+      iphi[2*i+1] =  phi[2*i];
+    }
+    VecRestoreArrayRead(targetstate, &phi);
+    VecRestoreArray(targetstate_i, &iphi);
+  }
 }
 
 
+void OptimTarget::swapTargetState(int slot){
+  if (target_type != TargetType::GATE) return;
+
+  if (batchtargets.size() < 2*(slot+1)) batchtargets.resize(2*(slot+1), NULL);
+  if (batchtargets[2*slot] == NULL) {
+    VecDuplicate(targetstate, &batchtargets[2*slot]);
+    if (schroedinger) VecDuplicate(targetstate_i, &batchtargets[2*slot+1]);
+  }
+  std::swap(targetstate, batchtargets[2*slot]);
+  if (schroedinger) std::swap(targetstate_i, batchtargets[2*slot+1]);
+}
+
 
 double OptimTarget::evalJ(const Vec state){
   double objective = 0.0;
@@ -109,7 +183,9 @@ double OptimTarget::evalJ(const Vec state){
 
   PetscInt dim;
   VecGetSize(state, &dim);
-  dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  if (schroedinger) dim = dim/2;              // dim = N with \psi \in C^N
+  else              dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  double normpsi, normphi;
 
 
   switch(objective_type) {
@@ -117,7 +193,13 @@ double OptimTarget::evalJ(const Vec state){
     /* J_Frob = 1/2 * || rho_target - rho(T)||^2_F  */
     case ObjectiveType::JFROBENIUS:
 
-      if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
+      if (schroedinger) {
+        // rho = psi psi^\dagger: J = 1/2 ( |phi|^4 + |psi|^4 - 2 |phi^\dagger psi|^2 )
+        VecNorm(state, NORM_2, &normpsi);
+        VecNorm(targetstate, NORM_2, &normphi);
+        objective = 0.5 * (pow(normphi, 4.0) + pow(normpsi, 4.0) - 2.0 * Overlap(state));
+      }
+      else if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
         // target state is already set. Either \rho_target = Vrho(0)V^\dagger or read from file. Just eval norm.
         objective = FrobeniusDistance(state) / 2.0;
       } 
@@ -139,7 +221,12 @@ double OptimTarget::evalJ(const Vec state){
     /* J_HS = 1 - 1/purity * Tr(rho_target^\dagger * rho(T)) */
     case ObjectiveType::JHS:
 
-      if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
+      if (schroedinger) {
+        // J = 1 - |phi^\dagger psi|^2 / |phi|^4
+        VecNorm(targetstate, NORM_2, &normphi);
+        objective = 1.0 - Overlap(state) / pow(normphi, 4.0);
+      }
+      else if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
         // target state is already set. Either \rho_target = Vrho(0)V^\dagger or read from file. Just eval Trace.
         objective = 1.0 - HilbertSchmidtOverlap(state, true);
       }
@@ -169,7 +256,13 @@ double OptimTarget::evalJ(const Vec state){
           diagID = getIndexReal(getVecID(i,i,dim));
           rhoii = 0.0;
           VecGetOwnershipRange(state, &ilo, &ihi);
-          if (ilo <= diagID && diagID < ihi) VecGetValues(state, 1, &diagID, &rhoii);
+          if (schroedinger) { // rho_ii = |psi_i|^2
+            PetscInt idx[2] = {getIndexReal(i), getIndexImag(i)};
+            double psii[2] = {0.0, 0.0};
+            if (ilo <= idx[0] && idx[1] < ihi) VecGetValues(state, 2, idx, psii);
+            rhoii = psii[0]*psii[0] + psii[1]*psii[1];
+          }
+          else if (ilo <= diagID && diagID < ihi) VecGetValues(state, 1, &diagID, &rhoii);
           lambdai = fabs(i - purestateID);
           sum += lambdai * rhoii;
         }
@@ -189,13 +282,21 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
 
   PetscInt dim;
   VecGetSize(state, &dim);
-  dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  if (schroedinger) dim = dim/2;              // dim = N with \psi \in C^N
+  else              dim = (int) sqrt(dim/2.0);  // dim = N with \rho \in C^{N\times N}
+  double normpsi, normphi;
 
   switch (objective_type) {
 
     case ObjectiveType::JFROBENIUS:
 
-      if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
+      if (schroedinger) {
+        // Derivative of 1/2 ( |phi|^4 + |psi|^4 - 2 |phi^\dagger psi|^2 ): statebar += Jbar * (2|psi|^2 psi - d|phi^\dagger psi|^2)
+        VecNorm(state, NORM_2, &normpsi);
+        VecAXPY(statebar, 2.0*Jbar*normpsi*normpsi, state);
+        Overlap_diff(state, statebar, -1.0*Jbar);
+      }
+      else if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
         FrobeniusDistance_diff(state, statebar, Jbar/ 2.0);
       } else {
         assert(target_type == TargetType::PURE);         
@@ -209,7 +310,11 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
       break; // case JFROBENIUS
 
     case ObjectiveType::JHS:
-      if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
+      if (schroedinger) {
+        VecNorm(targetstate, NORM_2, &normphi);
+        Overlap_diff(state, statebar, -1.0 * Jbar / pow(normphi, 4.0));
+      }
+      else if (target_type == TargetType::GATE || target_type == TargetType::FROMFILE ) {
           HilbertSchmidtOverlap_diff(state, statebar, -1.0 * Jbar, true);
       } else {
         assert(target_type == TargetType::PURE);         
@@ -232,7 +337,17 @@ void OptimTarget::evalJ_diff(const Vec state, Vec statebar, const double Jbar){
           diagID = getIndexReal(getVecID(i,i,dim));
           val = lambdai * Jbar;
           VecGetOwnershipRange(state, &ilo, &ihi);
-          if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, val, ADD_VALUES);
+          if (schroedinger) { // d|psi_i|^2 = 2 psi_i
+            PetscInt idx[2] = {getIndexReal(i), getIndexImag(i)};
+            double psii[2] = {0.0, 0.0};
+            if (ilo <= idx[0] && idx[1] < ihi) {
+              VecGetValues(state, 2, idx, psii);
+              psii[0] *= 2.0*val;
+              psii[1] *= 2.0*val;
+              VecSetValues(statebar, 2, idx, psii, ADD_VALUES);
+            }
+          }
+          else if (ilo <= diagID && diagID < ihi) VecSetValue(statebar, diagID, val, ADD_VALUES);
         }
       }
     break;
@@ -251,7 +366,10 @@ double OptimTarget::evalFidelity(const Vec state){
 
   /* Evaluate the Fidelity = Tr(targetstate^\dagger \rho) */
   double fidel = 0.0;
-  if (target_type == TargetType::PURE) {
+  if (schroedinger) {
+    fidel = Overlap(state);  // |phi^\dagger psi|^2
+  } 
+  else if (target_type == TargetType::PURE) {
     // if Pure target, then fidelity = rho(T)_mm
       vecID = getIndexReal(getVecID(purestateID, purestateID, dim));
       VecGetOwnershipRange(state, &ilo, &ihi);
@@ -266,4 +384,47 @@ double OptimTarget::evalFidelity(const Vec state){
 
   return fidel;
 
-}
\ No newline at end of file
+}
+
+
+double OptimTarget::evalJ_lowrank(const std::vector<Vec>& factor){
+  assert(schroedinger);
+  double objective = 0.0;
+  double overlap = 0.0, normphi, purity;
+  std::vector<double> G;
+
+  switch(objective_type) {
+
+    /* J_Frob = 1/2 ( |phi|^4 + Tr(rho^2) - 2 sum_c |phi^\dagger v_c|^2 ) with Tr(rho^2) = sum_cd |v_c^\dagger v_d|^2 */
+    case ObjectiveType::JFROBENIUS:
+      VecNorm(targetstate, NORM_2, &normphi);
+      getGramMatrix(factor, factor.size(), G);
+      purity = 0.0;
+      for (int i = 0; i < G.size(); i++) purity += G[i]*G[i];
+      for (int c = 0; c < factor.size(); c++) overlap += Overlap(factor[c]);
+      objective = 0.5 * (pow(normphi, 4.0) + purity - 2.0 * overlap);
+      break;
+
+    /* J_HS = 1 - sum_c |phi^\dagger v_c|^2 / |phi|^4 */
+    case ObjectiveType::JHS:
+      VecNorm(targetstate, NORM_2, &normphi);
+      for (int c = 0; c < factor.size(); c++) overlap += Overlap(factor[c]);
+      objective = 1.0 - overlap / pow(normphi, 4.0);
+      break;
+
+    /* J_T is linear in rho */
+    case ObjectiveType::JMEASURE:
+      for (int c = 0; c < factor.size(); c++) objective += evalJ(factor[c]);
+      break;
+  }
+
+  return objective;
+}
+
+
+double OptimTarget::evalFidelity_lowrank(const std::vector<Vec>& factor){
+  /* The fidelity is linear in rho */
+  double fidel = 0.0;
+  for (int c = 0; c < factor.size(); c++) fidel += evalFidelity(factor[c]);
+  return fidel;
+}
@@ -140,6 +140,8 @@ double Oscillator::expectedEnergy(const Vec x) {
   PetscInt dim;
   VecGetSize(x, &dim);
   int dimmat = (int) sqrt(dim/2);
+  bool isvector = (dim == 2 * dim_preOsc * nlevels * dim_postOsc);  // state vector psi of Schroedinger's equation
+  if (isvector) dimmat = dim/2;
 
   /* Get locally owned portion of x */
   PetscInt ilow, iupp;
@@ -152,10 +154,11 @@ double Oscillator::expectedEnergy(const Vec x) {
     /* Get diagonal element in number operator */
     int num_diag = i % (nlevels*dim_postOsc);
     num_diag = num_diag / dim_postOsc;
-    /* Get diagonal element in rho (real) */
+    /* Get diagonal element in rho (real), rho_ii = |psi_i|^2 for a state vector */
     PetscInt idx_diag = getIndexReal(getVecID(i,i,dimmat));
     double xdiag = 0.0;
-    if (ilow <= idx_diag && idx_diag < iupp) VecGetValues(x, 1, &idx_diag, &xdiag);
+    if (isvector) xdiag = getPopulation(x, i, ilow, iupp);
+    else if (ilow <= idx_diag && idx_diag < iupp) VecGetValues(x, 1, &idx_diag, &xdiag);
     expected += num_diag * xdiag;
   }
   
@@ -171,6 +174,8 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
   PetscInt dim;
   VecGetSize(x, &dim);
   int dimmat = (int) sqrt(dim/2);
+  bool isvector = (dim == 2 * dim_preOsc * nlevels * dim_postOsc);  // state vector psi of Schroedinger's equation
+  if (isvector) dimmat = dim/2;
   double num_diag;
 
   /* Get locally owned portion of x */
@@ -183,7 +188,8 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
     num_diag = num_diag / dim_postOsc;
     PetscInt idx_diag = getIndexReal(getVecID(i, i, dimmat));
     double val = num_diag * obj_bar;
-    if (ilow <= idx_diag && idx_diag < iupp) VecSetValues(x_bar, 1, &idx_diag, &val, ADD_VALUES);
+    if (isvector) getPopulation_diff(x, x_bar, i, ilow, iupp, val);
+    else if (ilow <= idx_diag && idx_diag < iupp) VecSetValues(x_bar, 1, &idx_diag, &val, ADD_VALUES);
   }
   VecAssemblyBegin(x_bar); VecAssemblyEnd(x_bar);
 
@@ -193,6 +199,9 @@ void Oscillator::expectedEnergy_diff(const Vec x, Vec x_bar, const double obj_ba
 void Oscillator::population(const Vec x, std::vector<double> &pop) {
 
   int dimN = dim_preOsc * nlevels * dim_postOsc;
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  bool isvector = (dim == 2 * dimN);  // state vector psi of Schroedinger's equation
 
   assert (pop.size() == nlevels);
 
@@ -215,7 +224,8 @@ void Oscillator::population(const Vec x, std::vector<double> &pop) {
         int rhoID = blockstartID + identitystartID + l; // Diagonal element of rho
         PetscInt diagID = getIndexReal(getVecID(rhoID, rhoID, dimN));  // Position in vectorized rho
         double val = 0.0;
-        if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
+        if (isvector) val = getPopulation(x, rhoID, ilow, iupp);
+        else if (ilow <= diagID && diagID < iupp)  VecGetValues(x, 1, &diagID, &val);
         sum += val;
       }
     }
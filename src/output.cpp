@@ -8,6 +8,9 @@ Output::Output(){
   optim_monitor_freq = 0;
   output_frequency = 0;
   optim_iter = 0;
+  writelowrank = false;
+  capture = false;
+  nofiles = false;
 }
 
 Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int noscillators) : Output() {
@@ -53,6 +56,7 @@ Output::Output(MapParam& config, MPI_Comm comm_petsc, MPI_Comm comm_init, int no
   /* Prepare data output files */
   ufile = NULL;
   vfile = NULL;
+  lowrankfile = NULL;
   for (int i=0; i< outputstr.size(); i++) expectedfile.push_back (NULL);
   for (int i=0; i< outputstr.size(); i++) populationfile.push_back (NULL);
 
@@ -147,12 +151,15 @@ void Output::writeControls(Vec params, MasterEq* mastereq, int ntime, double dt)
 }
 
 
+bool Output::writeThisIter(){
+  return optim_iter % optim_monitor_freq == 0;
+}
+
 void Output::openDataFiles(std::string prefix, int initid){
   char filename[255];
 
   /* Flag to determine of this optimization iteration will write data output */
-  bool write_this_iter = false;
-  if (optim_iter % optim_monitor_freq == 0) write_this_iter = true;
+  bool write_this_iter = writeThisIter() && !nofiles;
 
   /* Check if Xbraid is running in parallel and prepare output names if it is.*/
   char postchar[255];
@@ -167,6 +174,13 @@ void Output::openDataFiles(std::string prefix, int initid){
     vfile = fopen(filename, "w"); 
   }
 
+  /* Open file for the low-rank solver */
+  if (mpirank_petsc == 0 && writelowrank && write_this_iter) {
+    sprintf(filename, "%s/lowrank.iinit%04d%s.dat", datadir.c_str(), initid, postchar);
+    lowrankfile = fopen(filename, "w");
+    fprintf(lowrankfile, "# time      rank      truncation error\n");
+  }
+
   /* Open files for expected energy */
   if (mpirank_petsc == 0 && write_this_iter) {
     for (int i=0; i<outputstr.size(); i++) {
@@ -213,6 +227,37 @@ void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq
     }
 
     /* Write full state to file */
+    writeFullState(timestep, time, state, mastereq);
+
+    /* Keep a copy of the state */
+    if (capture) {
+      Vec copy;
+      VecDuplicate(state, &copy);
+      VecCopy(state, copy);
+      captured_steps.push_back(timestep);
+      captured_times.push_back(time);
+      captured_states.push_back(copy);
+    }
+  }
+}
+
+void Output::swapDataFiles(int slot){
+  if (batchfiles.size() <= slot) batchfiles.resize(slot+1);
+  std::vector<FILE *>& files = batchfiles[slot];
+  if (files.size() == 0) files.assign(3 + expectedfile.size() + populationfile.size(), NULL);
+
+  std::swap(ufile, files[0]);
+  std::swap(vfile, files[1]);
+  std::swap(lowrankfile, files[2]);
+  for (int i = 0; i < expectedfile.size(); i++) std::swap(expectedfile[i], files[3 + i]);
+  for (int i = 0; i < populationfile.size(); i++) std::swap(populationfile[i], files[3 + expectedfile.size() + i]);
+}
+
+void Output::writeFullState(int timestep, double time, const Vec state, MasterEq* mastereq){
+
+  /* Write output only every <num> time-steps */
+  if (timestep % output_frequency == 0) {
+
     if (writefullstate && mpisize_petsc == 1) {
 
       /* TODO: Make this work in parallel! */
@@ -243,6 +288,78 @@ void Output::writeDataFiles(int timestep, double time, const Vec state, MasterEq
   }
 }
 
+void Output::addToDataFiles(int timestep, const Vec state, MasterEq* mastereq, double weight){
+
+  /* Accumulate only every <num> time-steps */
+  if (timestep % output_frequency != 0) return;
+  int iout = timestep / output_frequency;
+
+  if (expected_sum.size() < expectedfile.size()) expected_sum.resize(expectedfile.size());
+  if (population_sum.size() < populationfile.size()) population_sum.resize(populationfile.size());
+
+  for (int iosc = 0; iosc < expectedfile.size(); iosc++) {
+    if (expected_sum[iosc].size() <= iout) expected_sum[iosc].resize(iout+1, 0.0);
+    expected_sum[iosc][iout] += weight * mastereq->getOscillator(iosc)->expectedEnergy(state);
+  }
+
+  for (int iosc = 0; iosc < populationfile.size(); iosc++) {
+    int nlevels = mastereq->getOscillator(iosc)->getNLevels();
+    std::vector<double> pop (nlevels, 0.0);
+    mastereq->getOscillator(iosc)->population(state, pop);
+    if (population_sum[iosc].size() < (iout+1) * nlevels) population_sum[iosc].resize((iout+1) * nlevels, 0.0);
+    for (int i = 0; i < nlevels; i++) population_sum[iosc][iout*nlevels + i] += weight * pop[i];
+  }
+}
+
+void Output::writeAveragedDataFiles(MasterEq* mastereq, int ntime, double dt, int ntraj, MPI_Comm comm){
+
+  /* Size the sums of all output time steps, also on processors that ran no trajectory */
+  int nout = ntime / output_frequency + 1;
+  expected_sum.resize(expectedfile.size());
+  population_sum.resize(populationfile.size());
+  for (int iosc = 0; iosc < expected_sum.size(); iosc++) expected_sum[iosc].resize(nout, 0.0);
+  for (int iosc = 0; iosc < population_sum.size(); iosc++) population_sum[iosc].resize(nout * mastereq->getOscillator(iosc)->getNLevels(), 0.0);
+
+  /* Sum up over the trajectories of all processors */
+  for (int iosc = 0; iosc < expected_sum.size(); iosc++) {
+    MPI_Allreduce(MPI_IN_PLACE, expected_sum[iosc].data(), expected_sum[iosc].size(), MPI_DOUBLE, MPI_SUM, comm);
+  }
+  for (int iosc = 0; iosc < population_sum.size(); iosc++) {
+    MPI_Allreduce(MPI_IN_PLACE, population_sum[iosc].data(), population_sum[iosc].size(), MPI_DOUBLE, MPI_SUM, comm);
+  }
+
+  /* Write averages to file */
+  for (int iosc = 0; iosc < expected_sum.size(); iosc++) {
+    if (expectedfile[iosc] == NULL) continue;
+    for (int iout = 0; iout < expected_sum[iosc].size(); iout++) {
+      fprintf(expectedfile[iosc], "%.8f %1.14e\n", iout*output_frequency*dt, expected_sum[iosc][iout] / ntraj);
+    }
+  }
+  for (int iosc = 0; iosc < population_sum.size(); iosc++) {
+    if (populationfile[iosc] == NULL) continue;
+    int nlevels = mastereq->getOscillator(iosc)->getNLevels();
+    for (int iout = 0; iout * nlevels < population_sum[iosc].size(); iout++) {
+      fprintf(populationfile[iosc], "%.8f ", iout*output_frequency*dt);
+      for (int i = 0; i < nlevels; i++) {
+        fprintf(populationfile[iosc], " %1.14e", population_sum[iosc][iout*nlevels + i] / ntraj);
+      }
+      fprintf(populationfile[iosc], "\n");
+    }
+  }
+
+  /* Reset for the next initial condition */
+  expected_sum.clear();
+  population_sum.clear();
+}
+
+void Output::writeLowRank(int timestep, double time, int rank, double truncerr){
+
+  /* Write output only every <num> time-steps */
+  if (timestep % output_frequency == 0 && lowrankfile != NULL) {
+    fprintf(lowrankfile, "%.8f %d %1.14e\n", time, rank, truncerr);
+  }
+}
+
 void Output::closeDataFiles(){
 
   /* Close output data files */
@@ -254,6 +371,10 @@ void Output::closeDataFiles(){
     fclose(vfile);
     vfile = NULL;
   }
+  if (lowrankfile != NULL) {
+    fclose(lowrankfile);
+    lowrankfile = NULL;
+  }
   for (int i=0; i< expectedfile.size(); i++) {
     if (expectedfile[i] != NULL) {
       fclose(expectedfile[i]);
@@ -1,18 +1,47 @@
 #include "timestepper.hpp"
 #include "petscvec.h"
+#include <random>
+#include <algorithm>
+#include <cfloat>
+
+/* Blas routines for the block GMRES solver */
+extern "C" void dgemm_(char* transa, char* transb, int* m, int* n, int* k, double* alpha, const double* a, int* lda, const double* b, int* ldb, double* beta, double* c, int* ldc);
+extern "C" void dgemv_(char* trans, int* m, int* n, double* alpha, const double* a, int* lda, const double* x, int* incx, double* beta, double* y, int* incy);
+extern "C" double dnrm2_(int* n, const double* x, int* incx);
+extern "C" void dscal_(int* n, double* alpha, double* x, int* incx);
+/* Lapack routine for the matrix exponential of the Krylov approximation */
+extern "C" void dgesv_(int* n, int* nrhs, double* a, int* lda, int* ipiv, double* b, int* ldb, int* info);
 
 TimeStepper::TimeStepper() {
   dim = 0;
   mastereq = NULL;
+  xfull = NULL;
+  xfull_bar = NULL;
+  xbatch = NULL;
+  xcol = NULL;
+  xstep = NULL;
+  xhalf = NULL;
+  xend = NULL;
+  order = 1;
+  adaptive_tol = 0.0;
+  adaptive_naccept = 0;
+  adaptive_nreject = 0;
   ntime = 0;
   total_time = 0.0;
   dt = 0.0;
   storeFWD = false;
+  mcwf_ntrajectories = 0;
+  comm_mcwf = MPI_COMM_SELF;
+  lowrank_maxrank = 0;
+  lowrank_tol = 0.0;
+  lowrank_rank = 0;
+  lowrank_truncerr = 0.0;
+  batch_blockgmres = false;
 }
 
 TimeStepper::TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_) : TimeStepper() {
   mastereq = mastereq_;
-  dim = 2*mastereq->getDim();
+  dim = 2*mastereq->getDimState();
   ntime = ntime_;
   total_time = total_time_;
   output = output_;
@@ -38,6 +67,29 @@ TimeStepper::TimeStepper(MasterEq* mastereq_, int ntime_, double total_time_, Ou
   VecSetFromOptions(x);
   VecZeroEntries(x);
 
+  /* With Hermitian storage, allocate the full density matrix for output and objective evaluations */
+  if (mastereq->hermitian_storage) {
+    VecCreate(PETSC_COMM_WORLD, &xfull);
+    VecSetSizes(xfull, PETSC_DECIDE, 2*mastereq->getDim());
+    VecSetFromOptions(xfull);
+    VecDuplicate(xfull, &xfull_bar);
+  }
+
+  /* Allocate the multi-vector for batched time stepping, and its storage */
+  if (mastereq->nbatch > 1) {
+    VecCreate(PETSC_COMM_WORLD, &xbatch);
+    VecSetSizes(xbatch, PETSC_DECIDE, dim * mastereq->nbatch);
+    VecSetFromOptions(xbatch);
+    VecDuplicate(x, &xcol);
+    if (storeFWD) {
+      for (int n = 0; n <= ntime; n++) {
+        Vec state;
+        VecDuplicate(xbatch, &state);
+        store_batch.push_back(state);
+      }
+    }
+  }
+
   /* Allocate the reduced gradient */
   int ndesign = 0;
   for (int ioscil = 0; ioscil < mastereq->getNOscillators(); ioscil++) {
@@ -56,6 +108,22 @@ TimeStepper::~TimeStepper() {
     VecDestroy(&(store_states[n]));
   }
   VecDestroy(&x);
+  if (xfull != NULL) {
+    VecDestroy(&xfull);
+    VecDestroy(&xfull_bar);
+  }
+  if (xbatch != NULL) {
+    VecDestroy(&xbatch);
+    VecDestroy(&xcol);
+  }
+  for (int n = 0; n < store_batch.size(); n++) {
+    VecDestroy(&(store_batch[n]));
+  }
+  if (xstep != NULL) {
+    VecDestroy(&xstep);
+    VecDestroy(&xhalf);
+    VecDestroy(&xend);
+  }
   VecDestroy(&redgrad);
 }
 
@@ -71,16 +139,39 @@ Vec TimeStepper::getState(int tindex){
   return store_states[tindex];
 }
 
+Vec TimeStepper::getBatchState(int tindex){
+  
+  if (tindex >= store_batch.size()) {
+    printf("ERROR: Time-stepper requested batched states at time index %d, but didn't store them.\n", tindex);
+    exit(1);
+  }
+
+  return store_batch[tindex];
+}
+
+Vec TimeStepper::getFullState(const Vec state){
+  if (!mastereq->hermitian_storage) return state;
+
+  mastereq->unpackHermitian(state, xfull);
+  return xfull;
+}
+
 Vec TimeStepper::solveODE(int initid, Vec rho_t0){
 
   /* Open output files */
   output->openDataFiles("rho", initid);
 
-  /* Set initial condition  */
-  VecCopy(rho_t0, x);
+  /* Set initial condition. With Hermitian storage, keep its upper triangle. */
+  if (mastereq->hermitian_storage) mastereq->packHermitian(rho_t0, x);
+  else VecCopy(rho_t0, x);
 
   /* --- Loop over time interval --- */
   penalty_integral = 0.0;
+  if (adaptive_tol > 0.0) {
+    solveODE_adaptive();
+    output->closeDataFiles();
+    return getFullState(x);
+  }
   for (int n = 0; n < ntime; n++){
 
     /* current time */
@@ -89,13 +180,13 @@ Vec TimeStepper::solveODE(int initid, Vec rho_t0){
 
     /* store and write current state. */
     if (storeFWD) VecCopy(x, store_states[n]);
-    output->writeDataFiles(n, tstart, x, mastereq);
+    output->writeDataFiles(n, tstart, getFullState(x), mastereq);
 
     /* Take one time step */
     evolveFWD(tstart, tstop, x);
 
     /* Add to penalty objective term */
-    if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tstop, x);
+    if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tstop, getFullState(x));
 
 #ifdef SANITY_CHECK
     SanityTests(x, tstart);
@@ -106,11 +197,441 @@ Vec TimeStepper::solveODE(int initid, Vec rho_t0){
   if (storeFWD) VecCopy(x, store_states[ntime]);
 
   /* Write last time step and close files */
-  output->writeDataFiles(ntime, ntime*dt, x, mastereq);
+  output->writeDataFiles(ntime, ntime*dt, getFullState(x), mastereq);
   output->closeDataFiles();
   
 
-  return x;
+  return getFullState(x);
+}
+
+
+void TimeStepper::solveODE_adaptive(){
+
+  if (xstep == NULL) {
+    VecDuplicate(x, &xstep);
+    VecDuplicate(x, &xhalf);
+    VecDuplicate(x, &xend);
+  }
+
+  /* The step sizes are dt times powers of two, halved on rejection and doubled if the error is small enough. The grid then doesn't change under small changes of the controls, so that 
+   * the gradient on the replayed grid is the derivative of the objective. During the loop, dt holds the accepted half step, which weights the penalty integral. */
+  double dt_uniform = dt;
+  double h = dt;
+  double hmin = 1e-12 * total_time;
+  double t = 0.0;
+  int n = 0;
+  tgrid.assign(1, 0.0);
+  if (storeFWD) VecCopy(x, store_states[0]);
+  output->writeDataFiles(0, 0.0, getFullState(x), mastereq);
+
+  while (t < total_time) {
+    bool last = (t + h >= total_time - hmin);
+    double hstep = last ? total_time - t : h;
+
+    /* One step of size hstep, and two steps of size hstep/2 */
+    VecCopy(x, xstep);
+    evolveFWD(t, t + hstep, xstep);
+    VecCopy(x, xhalf);
+    evolveFWD(t, t + hstep/2.0, xhalf);
+    VecCopy(xhalf, xend);
+    evolveFWD(t + hstep/2.0, t + hstep, xend);
+
+    /* Error estimate of the two half steps */
+    VecAXPY(xstep, -1.0, xend);
+    double err;
+    VecNorm(xstep, NORM_2, &err);
+    err /= pow(2.0, order) - 1.0;
+
+    bool accept = (err <= adaptive_tol || h <= hmin);
+    if (accept) adaptive_naccept++;
+    else adaptive_nreject++;
+    if (accept) {
+      /* Accept: record, store and write out the two half steps */
+      dt = hstep/2.0;
+      Vec xacc[2] = {xhalf, xend};
+      for (int i = 0; i < 2; i++) {
+        n++;
+        double tn = (i == 1 && last) ? total_time : t + (i+1) * hstep/2.0;
+        tgrid.push_back(tn);
+        if (storeFWD) {
+          if (n >= store_states.size()) {
+            Vec state;
+            VecDuplicate(x, &state);
+            store_states.push_back(state);
+          }
+          VecCopy(xacc[i], store_states[n]);
+        }
+        output->writeDataFiles(n, tn, getFullState(xacc[i]), mastereq);
+        if (gamma_penalty > 1e-13) penalty_integral += penaltyIntegral(tn, getFullState(xacc[i]));
+      }
+      VecCopy(xend, x);
+      t = tgrid[n];
+    }
+
+    /* Next step size. The error grows by 2^(order+1) when doubling the step. */
+    if (!accept) h /= 2.0;
+    else if (err * pow(2.0, order + 1) <= adaptive_tol) h *= 2.0;
+  }
+
+  dt = dt_uniform;
+}
+
+
+void TimeStepper::solveODE_batch(const std::vector<int>& initids, const std::vector<Vec>& rho_t0, std::vector<Vec>& rhoT){
+  int nbatch = mastereq->nbatch;
+  int nb = initids.size();
+
+  /* Open output files of each initial condition, and park them in its slot */
+  for (int b = 0; b < nb; b++) {
+    output->openDataFiles("rho", initids[b]);
+    output->swapDataFiles(b);
+  }
+
+  /* Set initial conditions. Unused states of a partial batch stay zero. */
+  VecZeroEntries(xbatch);
+  for (int b = 0; b < nb; b++) setBatchColumn(xbatch, nbatch, b, rho_t0[b]);
+
+  /* --- Loop over time interval --- */
+  penalty_integral = 0.0;
+  for (int n = 0; n < ntime; n++){
+
+    /* current time */
+    double tstart = n * dt;
+    double tstop  = (n+1) * dt;
+
+    /* store and write current states */
+    if (storeFWD) VecCopy(xbatch, store_batch[n]);
+    for (int b = 0; b < nb; b++) {
+      getBatchColumn(xbatch, nbatch, b, x);
+      output->swapDataFiles(b);
+      output->writeDataFiles(n, tstart, x, mastereq);
+      output->swapDataFiles(b);
+    }
+
+    /* Take one time step */
+    evolveFWD_batch(tstart, tstop, xbatch);
+
+    /* Add to penalty objective term */
+    if (gamma_penalty > 1e-13) {
+      for (int b = 0; b < nb; b++) {
+        getBatchColumn(xbatch, nbatch, b, x);
+        optim_target->swapTargetState(b);
+        penalty_integral += penaltyIntegral(tstop, x);
+        optim_target->swapTargetState(b);
+      }
+    }
+  }
+
+  /* Store last time step */
+  if (storeFWD) VecCopy(xbatch, store_batch[ntime]);
+
+  /* Get final states, write last time step and close files */
+  for (int b = 0; b < nb; b++) {
+    getBatchColumn(xbatch, nbatch, b, rhoT[b]);
+    output->swapDataFiles(b);
+    output->writeDataFiles(ntime, ntime*dt, rhoT[b], mastereq);
+    output->closeDataFiles();
+    output->swapDataFiles(b);
+  }
+}
+
+void TimeStepper::solveODE_mcwf(int initid, Vec psi_t0, double* objective, double* fidelity){
+
+  int mpirank_mcwf, mpisize_mcwf;
+  MPI_Comm_rank(comm_mcwf, &mpirank_mcwf);
+  MPI_Comm_size(comm_mcwf, &mpisize_mcwf);
+
+  /* Normalized copy of the trajectory state, and the state at the start of a time step */
+  Vec psi, xstart;
+  VecDuplicate(x, &psi);
+  VecDuplicate(x, &xstart);
+  double norm, norm_start;
+  std::vector<double> rates;
+
+  /* Open output files */
+  output->openDataFiles("rho", initid);
+
+  /* Loop over this processor's trajectories */
+  double obj = 0.0;
+  double fid = 0.0;
+  double penal = 0.0;
+  for (int itraj = mpirank_mcwf; itraj < mcwf_ntrajectories; itraj += mpisize_mcwf) {
+
+    /* Random numbers of this trajectory, independent of the processor distribution */
+    std::seed_seq seed {initid, itraj};
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+    /* Set initial condition. A jump occurs when the squared norm of x decays below r. */
+    VecCopy(psi_t0, x);
+    double r = unif(rng);
+
+    /* --- Loop over time interval --- */
+    penalty_integral = 0.0;
+    for (int n = 0; n < ntime; n++){
+
+      /* current time */
+      double tstart = n * dt;
+      double tstop  = (n+1) * dt;
+
+      /* Add current state to the averaged output. Write the full state of the first trajectory. */
+      VecNorm(x, NORM_2, &norm);
+      output->addToDataFiles(n, x, mastereq, 1.0 / (norm*norm));
+      if (itraj == 0) {
+        VecCopy(x, psi);
+        VecScale(psi, 1.0 / norm);
+        output->writeFullState(n, tstart, psi, mastereq);
+      }
+
+      /* Take one time step with the effective Hamiltonian. Whenever the squared norm decays below r within the step, redo the step up to the time 
+       * where it reaches r, interpolating its logarithm, jump there and continue from the jump time, until the squared norm stays above r through tstop. */
+      double tcur = tstart;
+      while (true) {
+        VecCopy(x, xstart);
+        VecNorm(x, NORM_2, &norm_start);
+        evolveFWD(tcur, tstop, x);
+        VecNorm(x, NORM_2, &norm);
+        if (norm*norm >= r) break;
+
+        double tjump = tcur + (tstop - tcur) * log(norm_start*norm_start / r) / log(norm_start*norm_start / (norm*norm));
+        VecCopy(xstart, x);
+        if (tjump > tcur) evolveFWD(tcur, tjump, x);
+
+        /* Quantum jump: pick a collapse operator with probability proportional to its rate */
+        mastereq->getCollapseRates(x, rates);
+        double ratesum = 0.0;
+        for (int j = 0; j < rates.size(); j++) ratesum += rates[j];
+        if (ratesum > 0.0) {
+          double s = unif(rng) * ratesum;
+          int j = 0;
+          double cumsum = rates[0];
+          while (cumsum <= s && j < rates.size()-1) cumsum += rates[++j];
+          mastereq->applyCollapse(x, j);
+        }
+        VecNorm(x, NORM_2, &norm);
+        VecScale(x, 1.0 / norm);
+        r = unif(rng);
+        tcur = tjump;
+      }
+
+      /* Add to penalty objective term */
+      if (gamma_penalty > 1e-13) {
+        VecNorm(x, NORM_2, &norm);
+        VecCopy(x, psi);
+        VecScale(psi, 1.0 / norm);
+        penalty_integral += penaltyIntegral(tstop, psi);
+      }
+    }
+
+    /* Final state of this trajectory */
+    VecNorm(x, NORM_2, &norm);
+    VecCopy(x, psi);
+    VecScale(psi, 1.0 / norm);
+    output->addToDataFiles(ntime, psi, mastereq, 1.0);
+    if (itraj == 0) output->writeFullState(ntime, ntime*dt, psi, mastereq);
+    obj += optim_target->evalJ(psi);
+    fid += optim_target->evalFidelity(psi);
+    penal += penalty_integral;
+  }
+
+  /* Write averages and close files */
+  output->writeAveragedDataFiles(mastereq, ntime, dt, mcwf_ntrajectories, comm_mcwf);
+  output->closeDataFiles();
+
+  /* Average cost, fidelity and penalty over all trajectories */
+  MPI_Allreduce(&obj, objective, 1, MPI_DOUBLE, MPI_SUM, comm_mcwf);
+  MPI_Allreduce(&fid, fidelity, 1, MPI_DOUBLE, MPI_SUM, comm_mcwf);
+  MPI_Allreduce(&penal, &penalty_integral, 1, MPI_DOUBLE, MPI_SUM, comm_mcwf);
+  *objective /= mcwf_ntrajectories;
+  *fidelity /= mcwf_ntrajectories;
+  penalty_integral /= mcwf_ntrajectories;
+
+  VecDestroy(&psi);
+  VecDestroy(&xstart);
+}
+
+
+void TimeStepper::solveODE_lowrank(int initid, const std::vector<Vec>& factor_t0, double* objective, double* fidelity){
+
+  /* Storage for the factor V, the truncated factors S and D of the single and double collapse terms, and the work space W for appending one block of at most lowrank_maxrank columns to a factor */
+  int nchannels = 2 * mastereq->getNOscillators();
+  std::vector<Vec> V(lowrank_maxrank), S(lowrank_maxrank), D(lowrank_maxrank), W(2*lowrank_maxrank);
+  for (int c = 0; c < lowrank_maxrank; c++) {
+    VecDuplicate(x, &V[c]);
+    VecDuplicate(x, &S[c]);
+    VecDuplicate(x, &D[c]);
+  }
+  for (int c = 0; c < W.size(); c++) VecDuplicate(x, &W[c]);
+  std::vector<double> rates, ratesum(nchannels);
+
+  /* Open output files */
+  output->openDataFiles("rho", initid);
+
+  /* Set initial condition, truncated to at most lowrank_maxrank columns */
+  int rank = 0;
+  lowrank_truncerr = 0.0;
+  for (int c0 = 0; c0 < factor_t0.size(); c0 += lowrank_maxrank) {
+    int nnew = std::min(lowrank_maxrank, (int) factor_t0.size() - c0);
+    for (int c = 0; c < nnew; c++) VecCopy(factor_t0[c0 + c], W[rank + c]);
+    rank = appendToFactor(V, rank, W, nnew, &lowrank_truncerr);
+  }
+
+  /* --- Loop over time interval --- */
+  penalty_integral = 0.0;
+  for (int n = 0; n < ntime; n++){
+
+    /* current time */
+    double tstart = n * dt;
+    double tmid   = (n+0.5) * dt;
+    double tstop  = (n+1) * dt;
+
+    /* Write expected energy levels and populations of rho, the dominant column of V, and the rank. */
+    for (int c = 0; c < rank; c++) output->addToDataFiles(n, V[c], mastereq, 1.0);
+    output->writeFullState(n, tstart, V[0], mastereq);
+    output->writeLowRank(n, tstart, rank, lowrank_truncerr);
+
+    /* Half step with the effective Hamiltonian */
+    for (int c = 0; c < rank; c++) evolveFWD(tstart, tmid, V[c]);
+
+    /* The collapse terms extend the factor such that [V, S, D] [V, S, D]^\dagger = exp(dt J) V V^\dagger up to O(dt^3) with J(rho) = sum_j L_j rho L_j^\dagger. 
+     * Single jumps: S S^\dagger = dt sum_k L_k V V^\dagger L_k^\dagger, appending sqrt(dt) L_k V to S for one channel k at a time. */
+    double trace = 0.0;
+    std::fill(ratesum.begin(), ratesum.end(), 0.0);
+    for (int c = 0; c < rank; c++) {
+      double norm;
+      VecNorm(V[c], NORM_2, &norm);
+      trace += norm * norm;
+      mastereq->getCollapseRates(V[c], rates);
+      for (int k = 0; k < nchannels; k++) ratesum[k] += rates[k];
+    }
+    int rankS = 0;
+    for (int k = 0; k < nchannels; k++) {
+      if (ratesum[k] <= 0.0) continue;
+      trace += dt * ratesum[k];
+      for (int c = 0; c < rank; c++) {
+        VecCopy(V[c], W[rankS + c]);
+        mastereq->applyCollapse(W[rankS + c], k);
+        VecScale(W[rankS + c], sqrt(dt));
+      }
+      rankS = appendToFactor(S, rankS, W, rank, &lowrank_truncerr);
+    }
+
+    /* Double jumps: D D^\dagger = dt/2 sum_j L_j S S^\dagger L_j^\dagger, one channel j at a time. They are only formed if their trace exceeds the truncation tolerance, otherwise their trace is added to the truncation error. */
+    double trace_double = 0.0;
+    std::fill(ratesum.begin(), ratesum.end(), 0.0);
+    for (int c = 0; c < rankS; c++) {
+      mastereq->getCollapseRates(S[c], rates);
+      for (int j = 0; j < nchannels; j++) ratesum[j] += rates[j];
+    }
+    for (int j = 0; j < nchannels; j++) trace_double += dt/2.0 * ratesum[j];
+    int rankD = 0;
+    if (trace_double > lowrank_tol * trace) {
+      for (int j = 0; j < nchannels; j++) {
+        if (ratesum[j] <= 0.0) continue;
+        for (int c = 0; c < rankS; c++) {
+          VecCopy(S[c], W[rankD + c]);
+          mastereq->applyCollapse(W[rankD + c], j);
+          VecScale(W[rankD + c], sqrt(dt/2.0));
+        }
+        rankD = appendToFactor(D, rankD, W, rankS, &lowrank_truncerr);
+      }
+    }
+    else lowrank_truncerr += trace_double;
+
+    /* Append S and D to V, and take the second half step */
+    for (int c = 0; c < rankS; c++) VecCopy(S[c], W[rank + c]);
+    rank = appendToFactor(V, rank, W, rankS, &lowrank_truncerr);
+    for (int c = 0; c < rankD; c++) VecCopy(D[c], W[rank + c]);
+    rank = appendToFactor(V, rank, W, rankD, &lowrank_truncerr);
+    for (int c = 0; c < rank; c++) evolveFWD(tmid, tstop, V[c]);
+
+    /* Add to penalty objective term */
+    if (gamma_penalty > 1e-13) {
+      std::vector<Vec> factor (V.begin(), V.begin() + rank);
+      penalty_integral += penaltyIntegral_lowrank(tstop, factor);
+    }
+  }
+
+  /* Write last time step and close files */
+  for (int c = 0; c < rank; c++) output->addToDataFiles(ntime, V[c], mastereq, 1.0);
+  output->writeFullState(ntime, ntime*dt, V[0], mastereq);
+  output->writeLowRank(ntime, ntime*dt, rank, lowrank_truncerr);
+  output->writeAveragedDataFiles(mastereq, ntime, dt, 1, MPI_COMM_SELF);
+  output->closeDataFiles();
+
+  /* Evaluate final-time cost and fidelity */
+  std::vector<Vec> factor (V.begin(), V.begin() + rank);
+  *objective = optim_target->evalJ_lowrank(factor);
+  *fidelity = optim_target->evalFidelity_lowrank(factor);
+  lowrank_rank = rank;
+
+  for (int c = 0; c < lowrank_maxrank; c++) {
+    VecDestroy(&V[c]);
+    VecDestroy(&S[c]);
+    VecDestroy(&D[c]);
+  }
+  for (int c = 0; c < W.size(); c++) VecDestroy(&W[c]);
+}
+
+
+int TimeStepper::appendToFactor(std::vector<Vec>& V, const int rank, std::vector<Vec>& W, const int nnew, double* truncerr){
+  if (nnew == 0) return rank;
+
+  for (int c = 0; c < rank; c++) VecCopy(V[c], W[c]);
+  double err;
+  int newrank = truncateFactor(W, rank + nnew, V, &err);
+  *truncerr += err;
+
+  return newrank;
+}
+
+
+int TimeStepper::truncateFactor(const std::vector<Vec>& W, const int ncols, std::vector<Vec>& V, double* truncerr){
+
+  /* W^\dagger W = U Lambda U^\dagger. The nonzero eigenvalues of rho = W W^\dagger are those in Lambda, with eigenvectors W U Lambda^{-1/2}. */
+  std::vector<double> U, lambda;
+  getGramMatrix(W, ncols, U);
+  int info = getEigHermitian(ncols, U, lambda);
+  if (info != 0) {
+    printf("ERROR: Eigen-decomposition for the low-rank truncation failed (info = %d).\n", info);
+    exit(1);
+  }
+
+  /* Keep the largest eigenvalues until the remaining ones sum up to at most lowrank_tol * Tr(rho). Lapack sorts them ascending. */
+  double trace = 0.0;
+  for (int e = 0; e < ncols; e++) trace += std::max(lambda[e], 0.0);
+  double kept = 0.0;
+  int rank = 0;
+  while (rank < ncols && rank < lowrank_maxrank && (rank == 0 || trace - kept > lowrank_tol * trace)) {
+    kept += std::max(lambda[ncols-1-rank], 0.0);
+    rank++;
+  }
+  *truncerr = trace - kept;
+
+  /* V = W U for the kept eigenvectors */
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(W[0], &ilow, &iupp);
+  int nlocal = (iupp - ilow) / 2;
+  std::vector<const PetscScalar*> wptr(ncols);
+  for (int c = 0; c < ncols; c++) VecGetArrayRead(W[c], &wptr[c]);
+  for (int k = 0; k < rank; k++) {
+    int e = ncols-1-k;
+    PetscScalar* vptr;
+    VecGetArray(V[k], &vptr);
+    for (int i = 0; i < 2*nlocal; i++) vptr[i] = 0.0;
+    for (int c = 0; c < ncols; c++) {
+      double ure = U[2*(c + e*ncols)];
+      double uim = U[2*(c + e*ncols)+1];
+      for (int i = 0; i < nlocal; i++) {
+        vptr[2*i]   += wptr[c][2*i] * ure - wptr[c][2*i+1] * uim;
+        vptr[2*i+1] += wptr[c][2*i] * uim + wptr[c][2*i+1] * ure;
+      }
+    }
+    VecRestoreArray(V[k], &vptr);
+  }
+  for (int c = 0; c < ncols; c++) VecRestoreArrayRead(W[c], &wptr[c]);
+
+  return rank;
 }
 
 
@@ -119,27 +640,75 @@ void TimeStepper::solveAdjointODE(int initid, Vec rho_t0_bar, double Jbar) {
   /* Reset gradient */
   VecZeroEntries(redgrad);
 
-  /* Set terminal condition */
-  VecCopy(rho_t0_bar, x);
+  /* Set terminal condition. With Hermitian storage, this is the derivative wrt the upper triangle. */
+  if (mastereq->hermitian_storage) {
+    VecZeroEntries(x);
+    mastereq->unpackHermitian_diff(rho_t0_bar, x);
+  }
+  else VecCopy(rho_t0_bar, x);
+
+  /* Loop over time interval. With adaptive time stepping, replay the grid of the forward solve. */
+  bool adaptive = (adaptive_tol > 0.0);
+  double dt_uniform = dt;
+  int nsteps = adaptive ? tgrid.size() - 1 : ntime;
+  for (int n = nsteps; n > 0; n--){
+    double tstop  = adaptive ? tgrid[n]   : n * dt;
+    double tstart = adaptive ? tgrid[n-1] : (n-1) * dt;
+    if (adaptive) dt = tstop - tstart;
+
+    /* Derivative of penalty objective term */
+    if (gamma_penalty > 1e-13 && mastereq->hermitian_storage) {
+      VecZeroEntries(xfull_bar);
+      penaltyIntegral_diff(tstop, getFullState(getState(n)), xfull_bar, Jbar);
+      mastereq->unpackHermitian_diff(xfull_bar, x);
+    }
+    else if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, getState(n), x, Jbar);
+
+    /* Take one time step backwards */
+    evolveBWD(tstop, tstart, getState(n-1), x, redgrad, true);
+
+  }
+  dt = dt_uniform;
+}
+
+
+void TimeStepper::solveAdjointODE_batch(const std::vector<Vec>& rho_t0_bar, double Jbar) {
+  int nbatch = mastereq->nbatch;
+  int nb = rho_t0_bar.size();
+
+  /* Reset gradient */
+  VecZeroEntries(redgrad);
+
+  /* Set terminal conditions. Unused states of a partial batch stay zero. */
+  VecZeroEntries(xbatch);
+  for (int b = 0; b < nb; b++) setBatchColumn(xbatch, nbatch, b, rho_t0_bar[b]);
 
   /* Loop over time interval */
   for (int n = ntime; n > 0; n--){
     double tstop  = n * dt;
     double tstart = (n-1) * dt;
 
-    /* Derivative of penalty objective term */
-    if (gamma_penalty > 1e-13) penaltyIntegral_diff(tstop, getState(n), x, Jbar);
+    /* Derivative of penalty objective term, with the target state of each initial condition */
+    if (gamma_penalty > 1e-13) {
+      for (int b = 0; b < nb; b++) {
+        getBatchColumn(getBatchState(n), nbatch, b, x);
+        getBatchColumn(xbatch, nbatch, b, xcol);
+        optim_target->swapTargetState(b);
+        penaltyIntegral_diff(tstop, x, xcol, Jbar);
+        optim_target->swapTargetState(b);
+        setBatchColumn(xbatch, nbatch, b, xcol);
+      }
+    }
 
     /* Take one time step backwards */
-    evolveBWD(tstop, tstart, getState(n-1), x, redgrad, true);
-
+    evolveBWD_batch(tstop, tstart, getBatchState(n-1), xbatch, redgrad);
   }
 }
 
 
 double TimeStepper::penaltyIntegral(double time, const Vec x){
   double penalty = 0.0;
-  int dim_rho = (int)sqrt(dim/2);  // dim = 2*N^2 vectorized system. dim_rho = N = dimension of matrix system
+  int dim_rho = mastereq->getDimRho();  // dim = 2*N^2 vectorized system (2*N for Schroedinger's equation). dim_rho = N = dimension of matrix system
   double x_re, x_im;
 
   /* weighted integral of the objective function */
@@ -157,6 +726,11 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
       for (int i=0; i<dim_rho; i++) {
         if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
           // printf("isGuard: %d / %d\n", i, dim_rho);
+          if (mastereq->schroedinger) { // rho_ii = |psi_i|^2
+            double pop = getPopulation(x, i, ilow, iupp);
+            penalty += dt * pop * pop;
+            continue;
+          }
           PetscInt vecID_re = getIndexReal(getVecID(i,i,dim_rho));
           PetscInt vecID_im = getIndexImag(getVecID(i,i,dim_rho));
           x_re = 0.0; x_im = 0.0;
@@ -172,8 +746,39 @@ double TimeStepper::penaltyIntegral(double time, const Vec x){
   return penalty;
 }
 
+double TimeStepper::penaltyIntegral_lowrank(double time, const std::vector<Vec>& factor){
+  double penalty = 0.0;
+  int dim_rho = mastereq->getDimRho();
+
+  /* weighted integral of the objective function */
+  if (penalty_param > 1e-13) {
+    double weight = 1./penalty_param * exp(- pow((time - total_time)/penalty_param, 2));
+    double obj = optim_target->evalJ_lowrank(factor);
+    penalty = weight * obj * dt;
+  }
+
+  /* If gate optimization: Add guard-level occupation rho_ii = sum_c |v_c,i|^2 */
+  if (optim_target->getType() == TargetType::GATE) { 
+    PetscInt ilow, iupp;
+    VecGetOwnershipRange(factor[0], &ilow, &iupp);
+    double guard = 0.0;
+    for (int i=0; i<dim_rho; i++) {
+      if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
+        double pop = 0.0;
+        for (int c = 0; c < factor.size(); c++) pop += getPopulation(factor[c], i, ilow, iupp);
+        guard += dt * pop * pop;
+      }
+    }
+    double mine = guard;
+    MPI_Allreduce(&mine, &guard, 1, MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+    penalty += guard;
+  }
+
+  return penalty;
+}
+
 void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, double penaltybar){
-  int dim_rho = (int)sqrt(dim/2);  // dim = 2*N^2 vectorized system. dim_rho = N = dimension of matrix system
+  int dim_rho = mastereq->getDimRho();  // dim = 2*N^2 vectorized system (2*N for Schroedinger's equation). dim_rho = N = dimension of matrix system
 
   /* Derivative of weighted integral of the objective function */
   if (penalty_param > 1e-13){
@@ -187,7 +792,11 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
     VecGetOwnershipRange(x, &ilow, &iupp);
     double x_re, x_im;
     for (int i=0; i<dim_rho; i++) {
-      if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
+      if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) && mastereq->schroedinger) {
+        double pop = getPopulation(x, i, ilow, iupp);
+        getPopulation_diff(x, xbar, i, ilow, iupp, 2.*pop*dt*penaltybar);
+      }
+      else if ( isGuardLevel(i, mastereq->nlevels, mastereq->nessential) ) {
         PetscInt vecID_re = getIndexReal(getVecID(i,i,dim_rho));
         PetscInt vecID_im = getIndexImag(getVecID(i,i,dim_rho));
         x_re = 0.0; x_im = 0.0;
@@ -205,7 +814,18 @@ void TimeStepper::penaltyIntegral_diff(double time, const Vec x, Vec xbar, doubl
 
 void TimeStepper::evolveBWD(const double tstart, const double tstop, const Vec x_stop, Vec x_adj, Vec grad, bool compute_gradient){}
 
+void TimeStepper::evolveFWD_batch(const double /*tstart*/, const double /*tstop*/, Vec /*X*/){
+  printf("ERROR: Batched time stepping is not implemented for this time stepper.\n");
+  exit(1);
+}
+
+void TimeStepper::evolveBWD_batch(const double /*tstop*/, const double /*tstart*/, const Vec /*X*/, Vec /*X_adj*/, Vec /*grad*/){
+  printf("ERROR: Batched time stepping is not implemented for this time stepper.\n");
+  exit(1);
+}
+
 ExplEuler::ExplEuler(MasterEq* mastereq_, int ntime_, double total_time_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+  order = 1;
   MatCreateVecs(mastereq->getRHS(), &stage, NULL);
   VecZeroEntries(stage);
 }
@@ -244,7 +864,23 @@ void ExplEuler::evolveBWD(const double tstop,const  double tstart,const  Vec x,
 
 }
 
-ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+/* PCSHELL operations of ImplMidpoint's diagonal preconditioner */
+static PetscErrorCode ImplMidpoint_precondApply(PC pc, Vec r, Vec z){
+  ImplMidpoint* ctx;
+  PCShellGetContext(pc, (void**) &ctx);
+  ctx->applyPrecond(r, z, false);
+  return 0;
+}
+
+static PetscErrorCode ImplMidpoint_precondApplyTranspose(PC pc, Vec r, Vec z){
+  ImplMidpoint* ctx;
+  PCShellGetContext(pc, (void**) &ctx);
+  ctx->applyPrecond(r, z, true);
+  return 0;
+}
+
+ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, LinearSolverType linsolve_type_, int linsolve_maxiter_, int linsolve_maxrefine_, bool linsolve_precond_, InitialGuessType linsolve_initguess_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+  order = 2;
 
   /* Create and reset the intermediate vectors */
   MatCreateVecs(mastereq->getRHS(), &stage, NULL);
@@ -262,22 +898,86 @@ ImplMidpoint::ImplMidpoint(MasterEq* mastereq_, int ntime_, double total_time_,
   linsolve_iterstaken_avg = 0;
   linsolve_counter = 0;
   linsolve_error_avg = 0.0;
+  linsolve_precond = linsolve_precond_ && linsolve_type == LinearSolverType::GMRES;
+  stage_alpha = 0.0;
+  precond_alpha = 0.0;
+  linsolve_initguess = linsolve_type == LinearSolverType::GMRES ? linsolve_initguess_ : InitialGuessType::ZERO;
+  guess_n[0] = 0;
+  guess_n[1] = 0;
 
   if (linsolve_type == LinearSolverType::GMRES) {
     /* Create Petsc's linear solver */
     KSPCreate(PETSC_COMM_WORLD, &ksp);
     KSPGetPC(ksp, &preconditioner);
-    PCSetType(preconditioner, PCNONE);
+    if (linsolve_precond) {
+      /* Right preconditioning, so that the stopping criterion is on the unpreconditioned residual */
+      diag = mastereq->getDiagonal();
+      PetscInt m;
+      VecGetLocalSize(stage, &m);
+      precond_inv.resize(m);
+      PCSetType(preconditioner, PCSHELL);
+      PCShellSetContext(preconditioner, (void*) this);
+      PCShellSetApply(preconditioner, ImplMidpoint_precondApply);
+      PCShellSetApplyTranspose(preconditioner, ImplMidpoint_precondApplyTranspose);
+      PCShellSetName(preconditioner, "diagonal");
+      KSPSetPCSide(ksp, PC_RIGHT);
+    } else {
+      PCSetType(preconditioner, PCNONE);
+    }
     KSPSetTolerances(ksp, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
     KSPSetType(ksp, KSPGMRES);
     KSPSetOperators(ksp, mastereq->getRHS(), mastereq->getRHS());
     KSPSetFromOptions(ksp);
+
+    /* Start GMRES from the stages of the previous time steps */
+    if (linsolve_initguess != InitialGuessType::ZERO) {
+      for (int dir = 0; dir < 2; dir++) {
+        VecDuplicate(stage, &guess_hist[dir][0]);
+        VecDuplicate(stage, &guess_hist[dir][1]);
+      }
+      KSPSetInitialGuessNonzero(ksp, PETSC_TRUE);
+    }
   }
   else {
     /* For Neumann iterations, allocate a temporary vector */
     MatCreateVecs(mastereq->getRHS(), &tmp, NULL);
     MatCreateVecs(mastereq->getRHS(), &err, NULL);
   }
+
+  /* Batched time stepping: stage variables and GMRES for all states at once */
+  stage_batch = NULL;
+  rhs_batch = NULL;
+  if (mastereq->nbatch > 1) {
+    if (linsolve_type != LinearSolverType::GMRES) {
+      printf("ERROR: Batched time stepping requires the GMRES linear solver (linearsolver_type = gmres).\n");
+      exit(1);
+    }
+    MatCreateVecs(mastereq->getRHS_batch(), &stage_batch, NULL);
+    VecDuplicate(stage_batch, &rhs_batch);
+    VecDuplicate(stage_batch, &stage_adj_batch);
+    KSPCreate(PETSC_COMM_WORLD, &ksp_batch);
+    PC pc_batch;
+    KSPGetPC(ksp_batch, &pc_batch);
+    PCSetType(pc_batch, PCNONE);
+    KSPSetTolerances(ksp_batch, linsolve_reltol, linsolve_abstol, PETSC_DEFAULT, linsolve_maxiter);
+    KSPSetType(ksp_batch, KSPGMRES);
+    KSPSetOperators(ksp_batch, mastereq->getRHS_batch(), mastereq->getRHS_batch());
+    KSPSetFromOptions(ksp_batch);
+  }
+
+  if (linsolve_type == LinearSolverType::NEUMANN_MIXED) {
+    /* The single-precision operator apply needs the full state on each process */
+    int mpisize_petsc;
+    MPI_Comm_size(PETSC_COMM_WORLD, &mpisize_petsc);
+    if (mpisize_petsc > 1) {
+      printf("ERROR: The mixed-precision Neumann solver is not implemented for parallel Petsc (np_petsc > 1).\n");
+      exit(1);
+    }
+    linsolve_maxrefine = linsolve_maxrefine_;
+    rf.resize(2*mastereq->getDimState());
+    yf.resize(2*mastereq->getDimState());
+    tmpf.resize(2*mastereq->getDimState());
+  }
 }
 
 
@@ -293,11 +993,28 @@ ImplMidpoint::~ImplMidpoint(){
   /* Free up Petsc's linear solver */
   if (linsolve_type == LinearSolverType::GMRES) {
     KSPDestroy(&ksp);
+    if (linsolve_initguess != InitialGuessType::ZERO) {
+      for (int dir = 0; dir < 2; dir++) {
+        VecDestroy(&guess_hist[dir][0]);
+        VecDestroy(&guess_hist[dir][1]);
+      }
+    }
   } else {
     VecDestroy(&tmp);
     VecDestroy(&err);
   }
 
+  if (stage_batch != NULL) {
+    KSPDestroy(&ksp_batch);
+    if (!krylov_batch.empty()) {
+      VecDestroy(&krylov_in);
+      VecDestroy(&krylov_out);
+    }
+    VecDestroy(&stage_batch);
+    VecDestroy(&rhs_batch);
+    VecDestroy(&stage_adj_batch);
+  }
+
   /* Free up intermediate vectors */
   VecDestroy(&stage_adj);
   VecDestroy(&stage);
@@ -319,12 +1036,15 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
   MatMult(A, x, rhs);
 
   /* Solve for the stage variable (I-dt/2 A) k1 = Ax */
+  stage_alpha = dt / 2.0;
   switch (linsolve_type) {
     case LinearSolverType::GMRES:
       /* Set up I-dt/2 A, then solve */
       MatScale(A, - dt/2.0);
       MatShift(A, 1.0);  
+      if (linsolve_initguess != InitialGuessType::ZERO) setInitialGuess(0, tstart, (tstart + tstop) / 2.0, stage);
       KSPSolve(ksp, rhs, stage);
+      if (linsolve_initguess != InitialGuessType::ZERO) storeInitialGuess(0, tstop, (tstart + tstop) / 2.0, stage);
 
       /* Monitor error */
       double rnorm;
@@ -343,6 +1063,10 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
     case LinearSolverType::NEUMANN:
       linsolve_iterstaken_avg += NeumannSolve(A, rhs, stage, dt/2.0, false);
       break;
+
+    case LinearSolverType::NEUMANN_MIXED:
+      linsolve_iterstaken_avg += NeumannSolveMixed(A, rhs, stage, dt/2.0, false);
+      break;
   }
   linsolve_counter++;
 
@@ -350,6 +1074,95 @@ void ImplMidpoint::evolveFWD(const double tstart,const  double tstop, Vec x) {
   VecAXPY(x, dt, stage);
 }
 
+void ImplMidpoint::evolveFWD_batch(const double tstart, const double tstop, Vec X) {
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart);
+
+  /* Compute A(t_n+h/2), shared by all states */
+  mastereq->assemble_RHS( (tstart + tstop) / 2.0);
+  Mat A = mastereq->getRHS_batch();
+
+  /* Compute rhs = A X */
+  MatMult(A, X, rhs_batch);
+
+  /* Solve for the stage variables (I-dt/2 A) K = AX */
+  if (batch_blockgmres) {
+    linsolve_iterstaken_avg += BlockGMRESSolve(A, rhs_batch, stage_batch, dt/2.0, false);
+  } else {
+    MatScale(A, - dt/2.0);
+    MatShift(A, 1.0);
+    KSPSolve(ksp_batch, rhs_batch, stage_batch);
+
+    /* Monitor error */
+    double rnorm;
+    PetscInt iters_taken;
+    KSPGetResidualNorm(ksp_batch, &rnorm);
+    KSPGetIterationNumber(ksp_batch, &iters_taken);
+    linsolve_iterstaken_avg += iters_taken;
+    linsolve_error_avg += rnorm;
+
+    /* Revert the scaling and shifting */
+    MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);
+  }
+  linsolve_counter++;
+
+  /* --- Update states X += dt * K --- */
+  VecAXPY(X, dt, stage_batch);
+}
+
+void ImplMidpoint::evolveBWD_batch(const double tstop, const double tstart, const Vec X, Vec X_adj, Vec grad){
+  int nbatch = mastereq->nbatch;
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart);
+  double thalf = (tstart + tstop) / 2.0;
+
+  /* Assemble RHS(t_1/2), shared by all states */
+  mastereq->assemble_RHS(thalf);
+  Mat A = mastereq->getRHS_batch();
+
+  /* Get A X_n for use in gradient */
+  MatMult(A, X, rhs_batch);
+
+  /* Solve for the adjoint stage variables (I-dt/2 A)^T K_bar = X_adj, and recompute the stage variables (I-dt/2 A) K = A X_n */
+  if (batch_blockgmres) {
+    linsolve_iterstaken_avg += BlockGMRESSolve(A, X_adj, stage_adj_batch, dt/2.0, true);
+    BlockGMRESSolve(A, rhs_batch, stage_batch, dt/2.0, false);
+  } else {
+    MatScale(A, - dt/2.0);
+    MatShift(A, 1.0);
+    KSPSolveTranspose(ksp_batch, X_adj, stage_adj_batch);
+    double rnorm;
+    PetscInt iters_taken;
+    KSPGetResidualNorm(ksp_batch, &rnorm);
+    KSPGetIterationNumber(ksp_batch, &iters_taken);
+    linsolve_iterstaken_avg += iters_taken;
+    linsolve_error_avg += rnorm;
+    KSPSolve(ksp_batch, rhs_batch, stage_batch);
+
+    /* Revert the scaling and shifting */
+    MatAssemblyBegin(A, MAT_FINAL_ASSEMBLY);
+    MatAssemblyEnd(A, MAT_FINAL_ASSEMBLY);
+  }
+  linsolve_counter++;
+
+  // k_bar = h*k_bar 
+  VecScale(stage_adj_batch, dt);
+
+  /* Add to reduced gradient, one state at a time */
+  VecAYPX(stage_batch, dt / 2.0, X);
+  for (int b = 0; b < nbatch; b++) {
+    getBatchColumn(stage_batch, nbatch, b, stage);
+    getBatchColumn(stage_adj_batch, nbatch, b, stage_adj);
+    mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
+  }
+
+  /* Update adjoint states X_adj += dt * A^T K_bar --- */
+  MatMultTransposeAdd(A, stage_adj_batch, X_adj, X_adj);
+}
+
 void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
   Mat A;
 
@@ -367,11 +1180,14 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
   }
 
   /* Solve for adjoint stage variable */
+  stage_alpha = dt / 2.0;
   switch (linsolve_type) {
     case LinearSolverType::GMRES:
       MatScale(A, - dt/2.0);
       MatShift(A, 1.0);  // WARNING: this can be very slow if some diagonal elements are missing.
+      if (linsolve_initguess != InitialGuessType::ZERO) setInitialGuess(1, tstop, thalf, stage_adj);
       KSPSolveTranspose(ksp, x_adj, stage_adj);
+      if (linsolve_initguess != InitialGuessType::ZERO) storeInitialGuess(1, tstart, thalf, stage_adj);
       double rnorm;
       KSPGetResidualNorm(ksp, &rnorm);
       if (rnorm > 1e-3)  printf("Residual norm: %1.5e\n", rnorm);
@@ -380,6 +1196,10 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
     case LinearSolverType::NEUMANN: 
       NeumannSolve(A, x_adj, stage_adj, dt/2.0, true);
       break;
+
+    case LinearSolverType::NEUMANN_MIXED: 
+      NeumannSolveMixed(A, x_adj, stage_adj, dt/2.0, true);
+      break;
   }
 
   // k_bar = h*k_bar 
@@ -389,11 +1209,15 @@ void ImplMidpoint::evolveBWD(const double tstop, const double tstart, const Vec
   if (compute_gradient) {
     switch (linsolve_type) {
       case LinearSolverType::GMRES: 
+        if (linsolve_initguess != InitialGuessType::ZERO) VecZeroEntries(stage);
         KSPSolve(ksp, rhs, stage);
         break;
       case LinearSolverType::NEUMANN:
         NeumannSolve(A, rhs, stage, dt/2.0, false);
         break;
+      case LinearSolverType::NEUMANN_MIXED:
+        NeumannSolveMixed(A, rhs, stage, dt/2.0, false);
+        break;
     }
     VecAYPX(stage, dt / 2.0, x);
     mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
@@ -444,6 +1268,778 @@ int ImplMidpoint::NeumannSolve(Mat A, Vec b, Vec y, double alpha, bool transpose
   return iter;
 }
 
+int ImplMidpoint::NeumannSolveMixed(Mat A, Vec b, Vec y, double alpha, bool transpose){
+
+  int n = rf.size();
+  double resnorm = 0.0;
+
+  // Initialize y = 0, so that the first residual is b
+  VecZeroEntries(y);
+  VecCopy(b, err);
+  VecNorm(err, NORM_2, &resnorm);
+
+  int iters = 0;
+  for (int iref = 0; iref < linsolve_maxrefine && resnorm >= linsolve_abstol; iref++) {
+
+    /* Correction in single precision: Neumann iterations for (I - alpha A) d = err/||err||, starting from d = err/||err||. 
+     * Stop when the update drops below what single precision resolves, or below what the absolute tolerance still requires of this correction. 
+     * Entries below 1e-20 are flushed to zero, as they are irrelevant for the correction and would otherwise produce denormal floats, which are very slow. */
+    double dtol = std::max(10.0 * FLT_EPSILON, linsolve_abstol / resnorm);
+    const double* errptr;
+    VecGetArrayRead(err, &errptr);
+    for (int i = 0; i < n; i++) {
+      rf[i] = fabs(errptr[i]) < 1e-20 * resnorm ? 0.0 : errptr[i] / resnorm;
+      yf[i] = rf[i];
+    }
+    VecRestoreArrayRead(err, &errptr);
+    for (int iter = 0; iter < linsolve_maxiter; iter++) {
+      mastereq->applyRHS_single(yf.data(), tmpf.data(), transpose);
+      double dnorm = 0.0;
+      for (int i = 0; i < n; i++) {
+        float ynew = rf[i] + alpha * tmpf[i];
+        if (fabs(ynew) < 1e-20) ynew = 0.0;
+        dnorm += (ynew - yf[i]) * (double)(ynew - yf[i]);
+        yf[i] = ynew;
+      }
+      iters++;
+      if (sqrt(dnorm) < dtol) break;
+    }
+
+    /* Update in double precision: y += ||err|| d */
+    double* yptr;
+    VecGetArray(y, &yptr);
+    for (int i = 0; i < n; i++) yptr[i] += resnorm * yf[i];
+    VecRestoreArray(y, &yptr);
+
+    /* Residual of the updated y in double precision: err = b - (I - alpha A) y */
+    if (!transpose) MatMult(A, y, tmp);
+    else            MatMultTranspose(A, y, tmp);
+    VecWAXPY(err, -1.0, y, b);
+    VecAXPY(err, alpha, tmp);
+    VecNorm(err, NORM_2, &resnorm);
+  }
+
+  linsolve_error_avg += resnorm;
+
+  return iters;
+}
+
+void ImplMidpoint::applyPrecond(const Vec r, Vec z, const bool transpose){
+
+  /* Precompute 1 / (1 - alpha (ld + i dh)) for this step size */
+  int nelems = precond_inv.size() / 2;
+  if (stage_alpha != precond_alpha) {
+    for (int i = 0; i < nelems; i++) {
+      double are = 1.0 - stage_alpha * diag[2*i];
+      double aim = - stage_alpha * diag[2*i+1];
+      double denom = are * are + aim * aim;
+      precond_inv[2*i]   =   are / denom;
+      precond_inv[2*i+1] = - aim / denom;
+    }
+    precond_alpha = stage_alpha;
+  }
+
+  /* z = (I - alpha D)^{-1} r, or its transpose (the complex conjugate) */
+  const double sign = transpose ? -1.0 : 1.0;
+  const PetscScalar* rptr;
+  PetscScalar* zptr;
+  VecGetArrayRead(r, &rptr);
+  VecGetArray(z, &zptr);
+  for (int i = 0; i < nelems; i++) {
+    double pr = precond_inv[2*i], pi = sign * precond_inv[2*i+1];
+    double rre = rptr[2*i], rim = rptr[2*i+1];
+    zptr[2*i]   = pr * rre - pi * rim;
+    zptr[2*i+1] = pi * rre + pr * rim;
+  }
+  VecRestoreArrayRead(r, &rptr);
+  VecRestoreArray(z, &zptr);
+}
+
+void ImplMidpoint::setInitialGuess(const int dir, const double tfrom, const double tmid, Vec guess){
+
+  /* Only continue the history if the previous time step ended where this one starts */
+  if (guess_n[dir] > 0 && fabs(tfrom - guess_tend[dir]) > 1e-12 * std::max(1.0, fabs(tfrom))) guess_n[dir] = 0;
+
+  if (guess_n[dir] == 0) {
+    VecZeroEntries(guess);
+  } else if (guess_n[dir] == 1 || linsolve_initguess == InitialGuessType::PREVIOUS) {
+    VecCopy(guess_hist[dir][0], guess);
+  } else {
+    /* guess = k_0 + (tmid - t_0) / (t_0 - t_1) (k_0 - k_1) */
+    double w = (tmid - guess_time[dir][0]) / (guess_time[dir][0] - guess_time[dir][1]);
+    VecAXPBYPCZ(guess, 1.0 + w, -w, 0.0, guess_hist[dir][0], guess_hist[dir][1]);
+  }
+}
+
+void ImplMidpoint::storeInitialGuess(const int dir, const double tto, const double tmid, const Vec stage_){
+
+  /* Shift the history, reusing the vector of the oldest stage */
+  Vec oldest = guess_hist[dir][1];
+  guess_hist[dir][1] = guess_hist[dir][0];
+  guess_hist[dir][0] = oldest;
+  guess_time[dir][1] = guess_time[dir][0];
+
+  VecCopy(stage_, guess_hist[dir][0]);
+  guess_time[dir][0] = tmid;
+  guess_tend[dir] = tto;
+  guess_n[dir] = std::min(guess_n[dir] + 1, 2);
+}
+
+/* Block GMRES: The batched multi-vectors are dense (nrows x s) matrices in row-major order, with nrows = 2N^2 real rows and one column per state, see setBatchColumn. 
+ * The Krylov basis is kept column-major instead, so that the orthogonalization runs on contiguous columns. */
+
+/* Copy the batched multi-vector x into the column-major block V (nrows x s), or back */
+static void batch_unpack(const int nrows, const int s, const double* x, double* V){
+  for (int q = 0; q < nrows; q++) {
+    for (int b = 0; b < s; b++) V[b*nrows + q] = x[q*s+b];
+  }
+}
+static void batch_pack(const int nrows, const int s, const double* V, double* x){
+  for (int q = 0; q < nrows; q++) {
+    for (int b = 0; b < s; b++) x[q*s+b] = V[b*nrows + q];
+  }
+}
+
+/* Orthogonalize w against the ncols orthonormal columns of V (column-major, nrows x ncols) by classical Gram-Schmidt, applied twice for stability. Adds the coefficients to d. */
+static void orthogonalize(int nrows, int ncols, const double* V, double* w, double* d){
+  if (ncols == 0) return;
+  double one = 1.0, mone = -1.0, zero = 0.0;
+  int inc = 1;
+  char N = 'N', T = 'T';
+  std::vector<double> h(ncols);
+  for (int pass = 0; pass < 2; pass++) {
+    dgemv_(&T, &nrows, &ncols, &one, V, &nrows, w, &inc, &zero, h.data(), &inc);
+    dgemv_(&N, &nrows, &ncols, &mone, V, &nrows, h.data(), &inc, &one, w, &inc);
+    for (int c = 0; c < ncols; c++) d[c] += h[c];
+  }
+}
+
+/* QR factorization of the block of s columns that starts at column c0 of V (column-major), by Gram-Schmidt over its columns. The block is overwritten by Q, R is (s x s, column-major) upper triangular. 
+ * The block must be orthogonal to the c0 previous columns already. A column that is numerically dependent gets zero diagonal in R, and is replaced by a random unit vector orthogonal to all 
+ * previous columns, so that the block Krylov basis keeps full rank. */
+static void block_qr(int nrows, int s, int c0, double* V, double* R){
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<double> unif(-1.0, 1.0);
+  std::vector<double> d(c0 + s);
+  int inc = 1;
+  for (int ab = 0; ab < s*s; ab++) R[ab] = 0.0;
+  for (int a = 0; a < s; a++) {
+    double* w = V + (c0+a)*nrows;
+    double norm0 = dnrm2_(&nrows, w, &inc);
+    orthogonalize(nrows, a, V + c0*nrows, w, &R[a*s]);
+    double norm = dnrm2_(&nrows, w, &inc);
+    if (norm > 1e-12 * norm0 && norm > 1e-300) R[a*s+a] = norm;
+    else {
+      for (int q = 0; q < nrows; q++) w[q] = unif(rng);
+      orthogonalize(nrows, c0+a, V, w, d.data());
+      norm = dnrm2_(&nrows, w, &inc);
+    }
+    double scale = norm > 1e-300 ? 1.0 / norm : 0.0;
+    dscal_(&nrows, &scale, w, &inc);
+  }
+}
+
+int ImplMidpoint::BlockGMRESSolve(Mat A, Vec B, Vec X, double alpha, bool transpose){
+
+  int s = mastereq->nbatch;
+  PetscInt len;
+  VecGetSize(B, &len);
+  int nrows = len / s;
+  int m = 30;   // Block iterations per restart
+  if (krylov_batch.empty()) {
+    krylov_batch.resize((m+1) * nrows*s);
+    VecDuplicate(B, &krylov_in);
+    VecDuplicate(B, &krylov_out);
+  }
+  double* V = krylov_batch.data();
+  double one = 1.0, mone = -1.0, zero = 0.0;
+  char N = 'N', T = 'T';
+
+  /* Block Hessenberg matrix H ((m+1)s x ms), right hand side G ((m+1)s x s) of the least squares problem, both column-major, and the Givens rotations that triangularize H, s per column */
+  int ldh = (m+1)*s;
+  std::vector<double> H(ldh * m*s), G(ldh * s), rot_c(m*s*s), rot_s(m*s*s);
+  std::vector<double> R(s*s), Y(m*s * s), Xc(nrows*s);
+
+  VecZeroEntries(X);
+  int iters = 0;
+  double rnorm = 0.0, rnorm0 = -1.0;
+  while (true) {
+
+    /* Residual V_0 = B - (I - alpha A) X, and its QR factorization V_0 R */
+    if (transpose) MatMultTranspose(A, X, krylov_out);
+    else MatMult(A, X, krylov_out);
+    VecAYPX(krylov_out, alpha, B);
+    VecAXPY(krylov_out, -1.0, X);
+    const double* wptr;
+    VecGetArrayRead(krylov_out, &wptr);
+    batch_unpack(nrows, s, wptr, V);
+    VecRestoreArrayRead(krylov_out, &wptr);
+    block_qr(nrows, s, 0, V, R.data());
+    for (int i = 0; i < ldh*s; i++) G[i] = 0.0;
+    rnorm = 0.0;
+    for (int b = 0; b < s; b++) {
+      double colnorm = 0.0;
+      for (int a = 0; a <= b; a++) {
+        G[b*ldh + a] = R[b*s+a];
+        colnorm += R[b*s+a] * R[b*s+a];
+      }
+      rnorm = std::max(rnorm, sqrt(colnorm));
+    }
+    if (rnorm0 < 0.0) rnorm0 = rnorm;
+    if (rnorm < linsolve_abstol || rnorm / rnorm0 < linsolve_reltol || iters >= linsolve_maxiter) break;
+
+    /* Block Arnoldi */
+    int j;
+    bool converged = false;
+    for (j = 0; j < m && !converged && iters < linsolve_maxiter; j++) {
+      iters++;
+
+      /* V_{j+1} = (I - alpha A) V_j */
+      double* xptr;
+      VecGetArray(krylov_in, &xptr);
+      batch_pack(nrows, s, V + j*s*nrows, xptr);
+      VecRestoreArray(krylov_in, &xptr);
+      if (transpose) MatMultTranspose(A, krylov_in, krylov_out);
+      else MatMult(A, krylov_in, krylov_out);
+      VecAYPX(krylov_out, -alpha, krylov_in);
+      double* W = V + (j+1)*s*nrows;
+      VecGetArrayRead(krylov_out, &wptr);
+      batch_unpack(nrows, s, wptr, W);
+      VecRestoreArrayRead(krylov_out, &wptr);
+
+      /* Orthogonalize against all previous blocks at once (classical block Gram-Schmidt, twice), then within the block */
+      int k = (j+1)*s;
+      double* h = &H[j*s*ldh];
+      for (int i = 0; i < ldh*s; i++) h[i] = 0.0;
+      for (int pass = 0; pass < 2; pass++) {
+        dgemm_(&T, &N, &k, &s, &nrows, &one, V, &nrows, W, &nrows, &zero, Y.data(), &k);
+        dgemm_(&N, &N, &nrows, &s, &k, &mone, V, &nrows, Y.data(), &k, &one, W, &nrows);
+        for (int b = 0; b < s; b++) {
+          for (int r = 0; r < k; r++) h[b*ldh + r] += Y[b*k + r];
+        }
+      }
+      block_qr(nrows, s, k, V, R.data());
+      for (int b = 0; b < s; b++) {
+        for (int a = 0; a <= b; a++) h[b*ldh + k+a] = R[b*s+a];
+      }
+
+      /* Triangularize the new columns: apply the previous rotations, then eliminate the s subdiagonal entries from the bottom up */
+      for (int c = j*s; c < (j+1)*s; c++) {
+        double* hc = &H[c*ldh];
+        for (int cp = 0; cp < c; cp++) {
+          for (int kk = 0; kk < s; kk++) {
+            int r = cp + s - kk;
+            double cs = rot_c[cp*s+kk], sn = rot_s[cp*s+kk];
+            double h1 = hc[r-1], h2 = hc[r];
+            hc[r-1] =   cs * h1 + sn * h2;
+            hc[r]   = - sn * h1 + cs * h2;
+          }
+        }
+        for (int kk = 0; kk < s; kk++) {
+          int r = c + s - kk;
+          double denom = sqrt(hc[r-1]*hc[r-1] + hc[r]*hc[r]);
+          double cs = denom > 0.0 ? hc[r-1] / denom : 1.0;
+          double sn = denom > 0.0 ? hc[r] / denom : 0.0;
+          rot_c[c*s+kk] = cs;
+          rot_s[c*s+kk] = sn;
+          hc[r-1] = denom;
+          hc[r]   = 0.0;
+          for (int b = 0; b < s; b++) {
+            double g1 = G[b*ldh + r-1], g2 = G[b*ldh + r];
+            G[b*ldh + r-1] =   cs * g1 + sn * g2;
+            G[b*ldh + r]   = - sn * g1 + cs * g2;
+          }
+        }
+      }
+
+      /* Residual norm of each column */
+      rnorm = 0.0;
+      for (int b = 0; b < s; b++) {
+        double colnorm = 0.0;
+        for (int r = (j+1)*s; r < (j+2)*s; r++) colnorm += G[b*ldh + r] * G[b*ldh + r];
+        rnorm = std::max(rnorm, sqrt(colnorm));
+      }
+      if (rnorm < linsolve_abstol || rnorm / rnorm0 < linsolve_reltol) converged = true;
+    }
+
+    /* Solve the triangular system for Y (js x s, column-major), and update X += [V_0 ... V_{j-1}] Y */
+    int n = j*s;
+    for (int b = 0; b < s; b++) {
+      for (int r = n-1; r >= 0; r--) {
+        double sum = G[b*ldh + r];
+        for (int c = r+1; c < n; c++) sum -= H[c*ldh + r] * Y[b*n + c];
+        Y[b*n + r] = fabs(H[r*ldh + r]) > 1e-300 ? sum / H[r*ldh + r] : 0.0;
+      }
+    }
+    if (n > 0) {
+      dgemm_(&N, &N, &nrows, &s, &n, &one, V, &nrows, Y.data(), &n, &zero, Xc.data(), &nrows);
+      double* xptr;
+      VecGetArray(X, &xptr);
+      for (int q = 0; q < nrows; q++) {
+        for (int b = 0; b < s; b++) xptr[q*s+b] += Xc[b*nrows + q];
+      }
+      VecRestoreArray(X, &xptr);
+    }
+
+    if (converged || iters >= linsolve_maxiter) break;
+  }
+
+  linsolve_error_avg += rnorm;
+
+  return iters;
+}
+
+/* Matrix exponential E = exp(A) of a small dense matrix A (n x n, column-major, overwritten), by the diagonal Pade approximation of degree 6 with scaling and squaring, as in Expokit */
+static void expm(int n, std::vector<double>& A, std::vector<double>& E){
+  int nn = n*n;
+  double one = 1.0, zero = 0.0;
+  char N = 'N';
+
+  /* Scale A by 2^-s such that its infinity norm is at most 1/2 */
+  double norm = 0.0;
+  for (int r = 0; r < n; r++) {
+    double rowsum = 0.0;
+    for (int c = 0; c < n; c++) rowsum += fabs(A[c*n + r]);
+    norm = std::max(norm, rowsum);
+  }
+  int s = norm > 0.5 ? (int) ceil(log2(norm / 0.5)) : 0;
+  double scale = pow(2.0, -s);
+  for (int i = 0; i < nn; i++) A[i] *= scale;
+
+  /* Pade coefficients */
+  const int p = 6;
+  double c[p+1];
+  c[0] = 1.0;
+  for (int k = 1; k <= p; k++) c[k] = c[k-1] * (p + 1 - k) / (k * (2*p + 1 - k));
+
+  /* Odd part U = A (c1 I + c3 A^2 + c5 A^4), even part V = c0 I + c2 A^2 + c4 A^4 + c6 A^6, by Horner's scheme in A^2 */
+  std::vector<double> A2(nn), U(nn), V(nn), T(nn);
+  dgemm_(&N, &N, &n, &n, &n, &one, A.data(), &n, A.data(), &n, &zero, A2.data(), &n);
+  for (int i = 0; i < nn; i++) { U[i] = c[5] * A2[i]; V[i] = c[6] * A2[i]; }
+  for (int i = 0; i < n; i++)  { U[i*n+i] += c[3]; V[i*n+i] += c[4]; }
+  dgemm_(&N, &N, &n, &n, &n, &one, U.data(), &n, A2.data(), &n, &zero, T.data(), &n);
+  for (int i = 0; i < n; i++)  T[i*n+i] += c[1];
+  dgemm_(&N, &N, &n, &n, &n, &one, A.data(), &n, T.data(), &n, &zero, U.data(), &n);
+  dgemm_(&N, &N, &n, &n, &n, &one, V.data(), &n, A2.data(), &n, &zero, T.data(), &n);
+  for (int i = 0; i < n; i++)  T[i*n+i] += c[2];
+  dgemm_(&N, &N, &n, &n, &n, &one, T.data(), &n, A2.data(), &n, &zero, V.data(), &n);
+  for (int i = 0; i < n; i++)  V[i*n+i] += c[0];
+
+  /* Solve (V - U) E = V + U */
+  E.resize(nn);
+  for (int i = 0; i < nn; i++) {
+    E[i] = V[i] + U[i];
+    T[i] = V[i] - U[i];
+  }
+  std::vector<int> ipiv(n);
+  int info;
+  dgesv_(&n, &n, T.data(), &n, ipiv.data(), E.data(), &n, &info);
+  if (info != 0) {
+    printf("ERROR: Pade approximation of the matrix exponential failed, dgesv info = %d\n", info);
+    exit(1);
+  }
+
+  /* Undo the scaling by squaring */
+  for (int k = 0; k < s; k++) {
+    dgemm_(&N, &N, &n, &n, &n, &one, E.data(), &n, E.data(), &n, &zero, T.data(), &n);
+    E.swap(T);
+  }
+}
+
+/* Gauss points and weights of the commutator-free Magnus integrator, see CFMagnus4 */
+static const double cfm_g1 = 0.5 - sqrt(3.0) / 6.0;
+static const double cfm_g2 = 0.5 + sqrt(3.0) / 6.0;
+static const double cfm_a1 = 0.25 + sqrt(3.0) / 6.0;
+static const double cfm_a2 = 0.25 - sqrt(3.0) / 6.0;
+
+CFMagnus4::CFMagnus4(MasterEq* mastereq_, int ntime_, double total_time_, int krylov_maxdim_, double krylov_tol_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+  order = 4;
+  krylov_maxdim = krylov_maxdim_;
+  krylov_tol = krylov_tol_;
+  combined = false;
+  t1 = 0.0; c1 = 0.0;
+  t2 = 0.0; c2 = 0.0;
+  tau_sub = dt;
+  expv_counter = 0;
+  expv_applies = 0;
+
+  /* Allocate the Krylov basis and auxiliary vectors */
+  krylov.resize(krylov_maxdim + 1);
+  for (int j = 0; j <= krylov_maxdim; j++) MatCreateVecs(mastereq->getRHS(), &krylov[j], NULL);
+  hessenberg.resize((krylov_maxdim + 1) * krylov_maxdim);
+  MatCreateVecs(mastereq->getRHS(), &xmid, NULL);
+  VecDuplicate(xmid, &tmp);
+  for (int i = 0; i < 4; i++) VecDuplicate(xmid, &gauss_states[i]);
+  VecDuplicate(xmid, &lambda1);
+  VecDuplicate(xmid, &lambda2);
+}
+
+CFMagnus4::~CFMagnus4(){
+  for (int j = 0; j <= krylov_maxdim; j++) VecDestroy(&krylov[j]);
+  VecDestroy(&xmid);
+  VecDestroy(&tmp);
+  for (int i = 0; i < 4; i++) VecDestroy(&gauss_states[i]);
+  VecDestroy(&lambda1);
+  VecDestroy(&lambda2);
+}
+
+void CFMagnus4::setExponent(const double t1_, const double c1_, const double t2_, const double c2_){
+  t1 = t1_; c1 = c1_;
+  t2 = t2_; c2 = c2_;
+
+  /* If possible, set up the RHS as the combination once, so that each apply needs one RHS apply */
+  combined = mastereq->assemble_RHS_mean(t1, c1, t2, c2);
+}
+
+void CFMagnus4::applyExponent(const Vec x, Vec y, const bool transpose){
+  Mat A = mastereq->getRHS();
+
+  if (combined) {
+    if (transpose) MatMultTranspose(A, x, y);
+    else MatMult(A, x, y);
+    VecScale(y, c1 + c2);
+  } else {
+    mastereq->assemble_RHS(t1);
+    if (transpose) MatMultTranspose(A, x, y);
+    else MatMult(A, x, y);
+    VecScale(y, c1);
+    mastereq->assemble_RHS(t2);
+    if (transpose) MatMultTranspose(A, x, tmp);
+    else MatMult(A, x, tmp);
+    VecAXPY(y, c2, tmp);
+  }
+}
+
+/* Krylov approximation of exp(h H_k) e_1, with the upper left k x k block of the Hessenberg matrix H (column-major, leading dimension ldh). Returns the error estimate beta h h_{k+1,k} |e_k^T exp(h H_k) e_1| (Saad 1992). */
+static double expv_small(const int k, const int ldh, const double* H, const double h, const double beta, std::vector<double>& E){
+  std::vector<double> Hk(k*k);
+  for (int c = 0; c < k; c++) {
+    for (int r = 0; r < k; r++) Hk[c*k + r] = h * H[c*ldh + r];
+  }
+  expm(k, Hk, E);
+  return beta * h * H[(k-1)*ldh + k] * fabs(E[k-1]);
+}
+
+int CFMagnus4::expv(const double tau, const Vec x, Vec y, const bool transpose){
+
+  int ldh = krylov_maxdim + 1;
+  double* H = hessenberg.data();
+  int applies = 0;
+
+  double beta;
+  VecNorm(x, NORM_2, &beta);
+  if (y != x) VecCopy(x, y);
+  if (beta == 0.0 || tau == 0.0) return 0;
+
+  /* The local error of each substep h is kept below tol * h / tau, which sums up to tol over tau */
+  double tol = krylov_tol * beta;
+  double t = 0.0;
+  double h = tau_sub;
+  std::vector<double> E, dots(krylov_maxdim + 1), coeffs(krylov_maxdim + 1);
+  while (t < tau) {
+    double htry = h;
+    if (h > tau - t) h = tau - t;
+
+    /* Arnoldi process with y / beta as first vector, until the error estimate for the substep h is below tolerance. Orthogonalization by classical Gram-Schmidt, applied twice for stability. */
+    VecCopy(y, krylov[0]);
+    VecScale(krylov[0], 1.0 / beta);
+    for (int i = 0; i < ldh * krylov_maxdim; i++) H[i] = 0.0;
+    int k = 0;
+    double err = 0.0;
+    bool converged = false;
+    for (int j = 0; j < krylov_maxdim && !converged; j++) {
+      applyExponent(krylov[j], krylov[j+1], transpose);
+      applies++;
+      double norm0, norm;
+      VecNorm(krylov[j+1], NORM_2, &norm0);
+      for (int pass = 0; pass < 2; pass++) {
+        VecMDot(krylov[j+1], j+1, krylov.data(), dots.data());
+        for (int i = 0; i <= j; i++) {
+          H[j*ldh + i] += dots[i];
+          dots[i] = -dots[i];
+        }
+        VecMAXPY(krylov[j+1], j+1, dots.data(), krylov.data());
+      }
+      VecNorm(krylov[j+1], NORM_2, &norm);
+      k = j+1;
+      /* Happy breakdown: the Krylov space is invariant, and the approximation exact */
+      if (norm <= 1e-12 * norm0) norm = 0.0;
+      H[j*ldh + k] = norm;
+      err = expv_small(k, ldh, H, h, beta, E);
+      converged = (err <= tol * h / tau);
+      if (norm > 0.0) VecScale(krylov[k], 1.0 / norm);
+    }
+
+    /* At maximum dimension, shrink the substep instead. The Krylov space doesn't depend on h, only the small exponential is recomputed. */
+    int nreject = 0;
+    while (!converged && nreject < 20) {
+      h *= std::max(0.2, 0.9 * pow(tol * h / tau / err, 1.0 / k));
+      nreject++;
+      err = expv_small(k, ldh, H, h, beta, E);
+      converged = (err <= tol * h / tau);
+    }
+    if (!converged) {
+      int myrank;
+      MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+      if (myrank == 0) printf("WARNING: Krylov exponential missed its tolerance after %d substep reductions (error estimate %1.4e > %1.4e). Increase expv_krylovdim.\n", nreject, err, tol * h / tau);
+    }
+
+    /* y = beta V_k exp(h H_k) e_1 */
+    for (int i = 0; i < k; i++) coeffs[i] = beta * E[i];
+    VecZeroEntries(y);
+    VecMAXPY(y, k, coeffs.data(), krylov.data());
+    VecNorm(y, NORM_2, &beta);
+    t = (h >= tau - t) ? tau : t + h;
+    if (beta == 0.0) break;
+
+    /* Next substep. A substep that was only cut to end at tau doesn't limit the next one. */
+    h = (nreject == 0) ? 2.0 * std::max(h, htry) : h;
+    tau_sub = h;
+  }
+
+  expv_counter++;
+  expv_applies += applies;
+
+  return applies;
+}
+
+void CFMagnus4::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards!
+  double tg1 = tstart + cfm_g1 * (tstop - tstart);
+  double tg2 = tstart + cfm_g2 * (tstop - tstart);
+
+  /* x = exp(dt (a2 A1 + a1 A2)) exp(dt (a1 A1 + a2 A2)) x */
+  setExponent(tg1, cfm_a1, tg2, cfm_a2);
+  expv(dt, x, x, false);
+  setExponent(tg1, cfm_a2, tg2, cfm_a1);
+  expv(dt, x, x, false);
+}
+
+void CFMagnus4::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards!
+  double tg1 = tstart + cfm_g1 * (tstop - tstart);
+  double tg2 = tstart + cfm_g2 * (tstop - tstart);
+
+  if (!compute_gradient) {
+    /* x_adj = exp(dt (a1 A1 + a2 A2))^T exp(dt (a2 A1 + a1 A2))^T x_adj */
+    setExponent(tg1, cfm_a2, tg2, cfm_a1);
+    expv(dt, x_adj, x_adj, true);
+    setExponent(tg1, cfm_a1, tg2, cfm_a2);
+    expv(dt, x_adj, x_adj, true);
+    return;
+  }
+
+  /* The derivative of x_adj^T exp(dt M) x wrt the parameters is dt int_0^1 lambda(s)^T dM/dp w(s) ds, with w(s) = exp(s dt M) x and lambda(s) = exp((1-s) dt M^T) x_adj. 
+   * It is evaluated by Gauss quadrature at s = g1, g2, with weights 1/2. The quadrature error is O(dt^4) per unit time, so the gradient is not the exact discrete adjoint, and agrees with finite differences of the discrete objective only up to that error. */
+
+  /* Recompute the states at the Gauss points of the first exponential, and the state xmid after it. Then the states at the Gauss points of the second exponential. */
+  setExponent(tg1, cfm_a1, tg2, cfm_a2);
+  expv(cfm_g1 * dt, x, gauss_states[0], false);
+  expv((cfm_g2 - cfm_g1) * dt, gauss_states[0], gauss_states[1], false);
+  expv(cfm_g1 * dt, gauss_states[1], xmid, false);
+  setExponent(tg1, cfm_a2, tg2, cfm_a1);
+  expv(cfm_g1 * dt, xmid, gauss_states[2], false);
+  expv((cfm_g2 - cfm_g1) * dt, gauss_states[2], gauss_states[3], false);
+
+  /* Adjoint of both exponentials, starting with the second one */
+  for (int iexp = 1; iexp >= 0; iexp--) {
+    if (iexp == 0) setExponent(tg1, cfm_a1, tg2, cfm_a2);
+    Vec w1 = gauss_states[2*iexp];
+    Vec w2 = gauss_states[2*iexp+1];
+
+    /* Adjoints at the Gauss points, and x_adj = exp(dt M)^T x_adj */
+    expv(cfm_g1 * dt, x_adj, lambda2, true);
+    expv((cfm_g2 - cfm_g1) * dt, lambda2, lambda1, true);
+    expv(cfm_g1 * dt, lambda1, x_adj, true);
+
+    /* Add to reduced gradient, dM/dp = c1 dA(t1)/dp + c2 dA(t2)/dp */
+    mastereq->computedRHSdp(t1, w1, lambda1, dt / 2.0 * c1, grad);
+    mastereq->computedRHSdp(t2, w1, lambda1, dt / 2.0 * c2, grad);
+    mastereq->computedRHSdp(t1, w2, lambda2, dt / 2.0 * c1, grad);
+    mastereq->computedRHSdp(t2, w2, lambda2, dt / 2.0 * c2, grad);
+  }
+}
+
+/* MatShell operations of LawsonMidpoint: I - alpha N, and its transpose */
+static PetscErrorCode LawsonMidpoint_mult(Mat M, Vec x, Vec y){
+  LawsonMidpoint* ctx;
+  MatShellGetContext(M, (void**) &ctx);
+  ctx->applyRemainder(x, y, false, 1.0, -ctx->alpha);
+  return 0;
+}
+
+static PetscErrorCode LawsonMidpoint_multTranspose(Mat M, Vec x, Vec y){
+  LawsonMidpoint* ctx;
+  MatShellGetContext(M, (void**) &ctx);
+  ctx->applyRemainder(x, y, true, 1.0, -ctx->alpha);
+  return 0;
+}
+
+LawsonMidpoint::LawsonMidpoint(MasterEq* mastereq_, int ntime_, double total_time_, int linsolve_maxiter_, Output* output_, bool storeFWD_) : TimeStepper(mastereq_, ntime_, total_time_, output_, storeFWD_) {
+  order = 2;
+  alpha = 0.0;
+  expdiag_h = 0.0;
+  linsolve_iterstaken_avg = 0;
+  linsolve_counter = 0;
+
+  /* Diagonal of the RHS, and its exponential for the default step size */
+  diag = mastereq->getDiagonal();
+  PetscInt m, n;
+  MatGetLocalSize(mastereq->getRHS(), &m, &n);
+  expdiag.resize(m);
+
+  /* Create and reset the intermediate vectors */
+  MatCreateVecs(mastereq->getRHS(), &stage, NULL);
+  VecDuplicate(stage, &stage_adj);
+  VecDuplicate(stage, &rhs);
+  VecDuplicate(stage, &y);
+  VecZeroEntries(stage);
+  VecZeroEntries(stage_adj);
+
+  /* Operator I - alpha N for the linear solver */
+  MatCreateShell(PETSC_COMM_WORLD, m, n, PETSC_DETERMINE, PETSC_DETERMINE, (void*) this, &Nop);
+  MatShellSetOperation(Nop, MATOP_MULT, (void(*)(void)) LawsonMidpoint_mult);
+  MatShellSetOperation(Nop, MATOP_MULT_TRANSPOSE, (void(*)(void)) LawsonMidpoint_multTranspose);
+
+  /* Create Petsc's linear solver */
+  PC preconditioner;
+  KSPCreate(PETSC_COMM_WORLD, &ksp);
+  KSPGetPC(ksp, &preconditioner);
+  PCSetType(preconditioner, PCNONE);
+  KSPSetTolerances(ksp, 1.e-20, 1.e-10, PETSC_DEFAULT, linsolve_maxiter_);
+  KSPSetType(ksp, KSPGMRES);
+  KSPSetOperators(ksp, Nop, Nop);
+  KSPSetFromOptions(ksp);
+}
+
+LawsonMidpoint::~LawsonMidpoint(){
+  KSPDestroy(&ksp);
+  MatDestroy(&Nop);
+  VecDestroy(&stage);
+  VecDestroy(&stage_adj);
+  VecDestroy(&rhs);
+  VecDestroy(&y);
+}
+
+void LawsonMidpoint::applyRemainder(const Vec x, Vec yout, const bool transpose, const double shift, const double scale){
+  Mat A = mastereq->getRHS();
+
+  /* yout = A x, or A^T x */
+  if (transpose) MatMultTranspose(A, x, yout);
+  else MatMult(A, x, yout);
+
+  /* yout = shift x + scale (yout - D x). The transpose of the complex diagonal is its conjugate. */
+  const double sign = transpose ? -1.0 : 1.0;
+  const PetscScalar* xptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(yout, &yptr);
+  int nelems = expdiag.size() / 2;
+  for (int i = 0; i < nelems; i++) {
+    double ld = diag[2*i], dh = sign * diag[2*i+1];
+    double xre = xptr[2*i], xim = xptr[2*i+1];
+    yptr[2*i]   = shift * xre + scale * (yptr[2*i]   - (ld * xre - dh * xim));
+    yptr[2*i+1] = shift * xim + scale * (yptr[2*i+1] - (dh * xre + ld * xim));
+  }
+  VecRestoreArrayRead(x, &xptr);
+  VecRestoreArray(yout, &yptr);
+}
+
+void LawsonMidpoint::applyExpDiag(const double h, Vec x, const bool transpose){
+
+  /* Precompute exp(h (ld + i dh)) = exp(h ld) (cos(h dh) + i sin(h dh)) for this step size */
+  int nelems = expdiag.size() / 2;
+  if (h != expdiag_h) {
+    for (int i = 0; i < nelems; i++) {
+      double e = exp(h * diag[2*i]);
+      expdiag[2*i]   = e * cos(h * diag[2*i+1]);
+      expdiag[2*i+1] = e * sin(h * diag[2*i+1]);
+    }
+    expdiag_h = h;
+  }
+
+  /* x = exp(h D) x, or its transpose (the complex conjugate) */
+  const double sign = transpose ? -1.0 : 1.0;
+  PetscScalar* xptr;
+  VecGetArray(x, &xptr);
+  for (int i = 0; i < nelems; i++) {
+    double er = expdiag[2*i], ei = sign * expdiag[2*i+1];
+    double xre = xptr[2*i], xim = xptr[2*i+1];
+    xptr[2*i]   = er * xre - ei * xim;
+    xptr[2*i+1] = ei * xre + er * xim;
+  }
+  VecRestoreArray(x, &xptr);
+}
+
+void LawsonMidpoint::evolveFWD(const double tstart, const double tstop, Vec x) {
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards!
+
+  /* First half step of the diagonal */
+  applyExpDiag(dt / 2.0, x, false);
+
+  /* Compute N(t_n+h/2) x */
+  mastereq->assemble_RHS( (tstart + tstop) / 2.0);
+  applyRemainder(x, rhs, false, 0.0, 1.0);
+
+  /* Solve for the stage variable (I-dt/2 N) k1 = N x */
+  alpha = dt / 2.0;
+  KSPSolve(ksp, rhs, stage);
+  PetscInt iters_taken;
+  KSPGetIterationNumber(ksp, &iters_taken);
+  linsolve_iterstaken_avg += iters_taken;
+  linsolve_counter++;
+
+  /* Update x += dt * stage, then the second half step of the diagonal */
+  VecAXPY(x, dt, stage);
+  applyExpDiag(dt / 2.0, x, false);
+}
+
+void LawsonMidpoint::evolveBWD(const double tstop, const double tstart, const Vec x, Vec x_adj, Vec grad, bool compute_gradient){
+
+  /* Compute time step size */
+  double dt = fabs(tstop - tstart); // absolute values needed in case this runs backwards!
+  double thalf = (tstart + tstop) / 2.0;
+
+  /* Assemble RHS(t_1/2) */
+  mastereq->assemble_RHS(thalf);
+  alpha = dt / 2.0;
+
+  /* Adjoint of the second half step of the diagonal */
+  applyExpDiag(dt / 2.0, x_adj, true);
+
+  /* Solve for adjoint stage variable (I-dt/2 N^T) k_bar = x_adj, and k_bar = h * k_bar */
+  KSPSolveTranspose(ksp, x_adj, stage_adj);
+  double rnorm;
+  KSPGetResidualNorm(ksp, &rnorm);
+  if (rnorm > 1e-3) {
+    int myrank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    if (myrank == 0) printf("Residual norm: %1.5e\n", rnorm);
+  }
+  VecScale(stage_adj, dt);
+
+  /* Add to reduced gradient. D doesn't depend on the parameters, so dN/dp = dA/dp at the midpoint state y + dt/2 k1, with y = exp(dt/2 D) x. */
+  if (compute_gradient) {
+    VecCopy(x, y);
+    applyExpDiag(dt / 2.0, y, false);
+    applyRemainder(y, rhs, false, 0.0, 1.0);
+    KSPSolve(ksp, rhs, stage);
+    VecAYPX(stage, dt / 2.0, y);
+    mastereq->computedRHSdp(thalf, stage, stage_adj, 1.0, grad);
+  }
+
+  /* Update adjoint state x_adj += N^T k_bar, then the adjoint of the first half step of the diagonal */
+  applyRemainder(stage_adj, rhs, true, 0.0, 1.0);
+  VecAXPY(x_adj, 1.0, rhs);
+  applyExpDiag(dt / 2.0, x_adj, true);
+}
+
 PetscErrorCode RHSJacobian(TS ts,PetscReal t,Vec u,Mat M,Mat P,void *ctx){
 
   /* Cast ctx to equation pointer */
@@ -1,5 +1,8 @@
 #include "util.hpp"
 
+/* Lapack's eigensolver for complex Hermitian matrices */
+extern "C" void zheev_(char* jobz, char* uplo, int* n, double* a, int* lda, double* w, double* work, int* lwork, double* rwork, int* info);
+
 int getIndexReal(const int i) {
   return 2*i;
 }
@@ -95,6 +98,123 @@ void projectToEss(Vec state,const std::vector<int> &nlevels, const std::vector<i
 
 }
 
+double getPopulation(const Vec x, const int i, const PetscInt ilow, const PetscInt iupp) {
+  PetscInt id_re = getIndexReal(i);
+  PetscInt id_im = getIndexImag(i);
+  double xre = 0.0, xim = 0.0;
+  if (ilow <= id_re && id_re < iupp) VecGetValues(x, 1, &id_re, &xre);
+  if (ilow <= id_im && id_im < iupp) VecGetValues(x, 1, &id_im, &xim);
+  return xre*xre + xim*xim;
+}
+
+void getPopulation_diff(const Vec x, Vec xbar, const int i, const PetscInt ilow, const PetscInt iupp, const double popbar) {
+  PetscInt id_re = getIndexReal(i);
+  PetscInt id_im = getIndexImag(i);
+  double xre = 0.0, xim = 0.0;
+  if (ilow <= id_re && id_re < iupp) {
+    VecGetValues(x, 1, &id_re, &xre);
+    double val = 2.0 * xre * popbar;
+    VecSetValues(xbar, 1, &id_re, &val, ADD_VALUES);
+  }
+  if (ilow <= id_im && id_im < iupp) {
+    VecGetValues(x, 1, &id_im, &xim);
+    double val = 2.0 * xim * popbar;
+    VecSetValues(xbar, 1, &id_im, &val, ADD_VALUES);
+  }
+}
+
+void addMatrixAndAdjoint(Vec y, const double are, const double aim, const double bre, const double bim, const Vec x, const int dim) {
+  const PetscScalar* xptr;
+  PetscScalar* yptr;
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(y, &yptr);
+  for (int col = 0; col < dim; col++) {
+    for (int row = 0; row < dim; row++) {
+      /* X(row,col) and X(col,row) */
+      int id  = getVecID(row, col, dim);
+      int idT = getVecID(col, row, dim);
+      double xre  = xptr[getIndexReal(id)],  xim  = xptr[getIndexImag(id)];
+      double xreT = xptr[getIndexReal(idT)], ximT = -xptr[getIndexImag(idT)];
+      yptr[getIndexReal(id)] += are * xre - aim * xim + bre * xreT - bim * ximT;
+      yptr[getIndexImag(id)] += are * xim + aim * xre + bre * ximT + bim * xreT;
+    }
+  }
+  VecRestoreArray(y, &yptr);
+  VecRestoreArrayRead(x, &xptr);
+}
+
+void setBatchColumn(Vec X, const int nbatch, const int b, const Vec x) {
+  const PetscScalar* xptr;
+  PetscScalar* Xptr;
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  VecGetArrayRead(x, &xptr);
+  VecGetArray(X, &Xptr);
+  for (int i = 0; i < dim/2; i++) {
+    Xptr[2*i*nbatch + b]          = xptr[2*i];
+    Xptr[2*i*nbatch + nbatch + b] = xptr[2*i+1];
+  }
+  VecRestoreArray(X, &Xptr);
+  VecRestoreArrayRead(x, &xptr);
+}
+
+void getBatchColumn(const Vec X, const int nbatch, const int b, Vec x) {
+  const PetscScalar* Xptr;
+  PetscScalar* xptr;
+  PetscInt dim;
+  VecGetSize(x, &dim);
+  VecGetArrayRead(X, &Xptr);
+  VecGetArray(x, &xptr);
+  for (int i = 0; i < dim/2; i++) {
+    xptr[2*i]   = Xptr[2*i*nbatch + b];
+    xptr[2*i+1] = Xptr[2*i*nbatch + nbatch + b];
+  }
+  VecRestoreArray(x, &xptr);
+  VecRestoreArrayRead(X, &Xptr);
+}
+
+void getGramMatrix(const std::vector<Vec>& V, const int ncols, std::vector<double>& G) {
+  G.assign(2*ncols*ncols, 0.0);
+
+  /* Local part of v_c^\dagger v_d for c <= d */
+  PetscInt ilow, iupp;
+  VecGetOwnershipRange(V[0], &ilow, &iupp);
+  int nlocal = (iupp - ilow) / 2;
+  std::vector<const PetscScalar*> vptr(ncols);
+  for (int c = 0; c < ncols; c++) VecGetArrayRead(V[c], &vptr[c]);
+  for (int d = 0; d < ncols; d++) {
+    for (int c = 0; c <= d; c++) {
+      double gre = 0.0, gim = 0.0;
+      for (int i = 0; i < nlocal; i++) {
+        gre += vptr[c][2*i] * vptr[d][2*i]   + vptr[c][2*i+1] * vptr[d][2*i+1];
+        gim += vptr[c][2*i] * vptr[d][2*i+1] - vptr[c][2*i+1] * vptr[d][2*i];
+      }
+      G[2*(c + d*ncols)]   = gre;
+      G[2*(c + d*ncols)+1] = gim;
+    }
+  }
+  for (int c = 0; c < ncols; c++) VecRestoreArrayRead(V[c], &vptr[c]);
+  MPI_Allreduce(MPI_IN_PLACE, G.data(), G.size(), MPI_DOUBLE, MPI_SUM, PETSC_COMM_WORLD);
+
+  /* Lower triangle: G_dc = conj(G_cd) */
+  for (int d = 0; d < ncols; d++) {
+    for (int c = d+1; c < ncols; c++) {
+      G[2*(c + d*ncols)]   =  G[2*(d + c*ncols)];
+      G[2*(c + d*ncols)+1] = -G[2*(d + c*ncols)+1];
+    }
+  }
+}
+
+int getEigHermitian(const int n, std::vector<double>& A, std::vector<double>& eigvals) {
+  char jobz = 'V', uplo = 'U';
+  int N = n, lda = n, info = 0;
+  int lwork = 2*n;
+  std::vector<double> work(2*lwork), rwork(3*n > 2 ? 3*n-2 : 1);
+  eigvals.resize(n);
+  zheev_(&jobz, &uplo, &N, A.data(), &lda, eigvals.data(), work.data(), &lwork, rwork.data(), &info);
+  return info;
+}
+
 int isEssential(const int i, const std::vector<int> &nlevels, const std::vector<int> &nessential) {
 
   int isEss = 1;
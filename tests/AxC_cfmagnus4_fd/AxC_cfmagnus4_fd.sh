@@ -0,0 +1,11 @@
+NUM_PARALLEL_PROCESSORS=0
+TOLERANCE=1.0e-6
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/AxC_cfmagnus4_fd
+    $QUANDARY AxC_cfmagnus4_fd.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,11 @@
+NUM_PARALLEL_PROCESSORS=0
+COMPARE_STATES=true
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/AxC_lawson
+    $QUANDARY AxC_lawson.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+TOLERANCE=2.0e-2
+COMPARE_STATES=true
+testNames=(primal)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/AxC_lowrank
+    $QUANDARY AxC_lowrank.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,11 @@
+NUM_PARALLEL_PROCESSORS=2
+TOLERANCE=1.0e-5
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_parallel
+    $QUANDARY cnot_parallel.cfg 
+    cd ${DIR}
+    ;;
+esac
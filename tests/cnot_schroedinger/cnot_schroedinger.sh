@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+TOLERANCE=1.0e-5
+COMPARE_STATES=true
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_schroedinger
+    $QUANDARY cnot_schroedinger.cfg 
+    cd ${DIR}
+    ;;
+esac
@@ -0,0 +1,12 @@
+NUM_PARALLEL_PROCESSORS=0
+COMPARE_STATES=true
+TOLERANCE=1.0e-5
+testNames=(adjoint)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/cnot_sparse
+    $QUANDARY cnot_sparse.cfg 
+    cd ${DIR}
+    ;;
+esac
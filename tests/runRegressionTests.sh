@@ -160,8 +160,10 @@ do
 			subTestNum=0
 			parallel=false
 			NUM_PARALLEL_PROCESSORS=0
+			TOLERANCE=""
+			COMPARE_STATES=false
 
-			# Get test names
+			# Get test names, and the test's own tolerance and state comparison if it sets them
 			. "$script"
 
 			while true;
@@ -272,7 +274,7 @@ do
               if [[ "$testName" == "primal" ]] && [[ "$fileName" == "rho"*".dat" ]]; then
                 mv "${simulation}/data_out/$fileName" "${simulation}/base/$fileName"
               fi
-              if [[ "$simulation" == "AxC" ]] || [[ "$simulation" == "pipulse" ]] || [[ "$simulation" == "cnot" ]] || [[ "$simulation" == "xgate" ]]; then
+              if [[ "$simulation" == "AxC" ]] || [[ "$simulation" == "pipulse" ]] || [[ "$simulation" == "cnot" ]] || [[ "$simulation" == "xgate" ]] || [[ "$COMPARE_STATES" == "true" ]]; then
                 if [[ "$fileName" == "rho"*".dat" ]] || [[ "$fileName" == "population"*".dat" ]]; then
                   mv "${simulation}/data_out/$fileName" "${simulation}/base/$fileName"
                 fi
@@ -286,18 +288,18 @@ do
               if [[ "$fileName" == "grad.dat" ]] || [[ "$fileName" == "optim_history.dat" ]]; then
                 cd ${DIR}
                 echo "- comparing $fileName" 
-                python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $tolerance $isBitWise
+                python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" ${TOLERANCE:-$tolerance} $isBitWise
                 if [[ $? -eq 1 ]]; then
                   echo "The $baseOutput files are different from the baseline." >> $simulationLogFile 2>&1
                   testFailed=true
                   continue 1
                 fi
               fi
-              if [[ "${simulation}" == "AxC" ]] || [[ "${simulation}" == "pipulse" ]] || [[ "${simulation}" == "cnot" ]] || [[ "${simulation}" == "xgate" ]]; then
+              if [[ "${simulation}" == "AxC" ]] || [[ "${simulation}" == "pipulse" ]] || [[ "${simulation}" == "cnot" ]] || [[ "${simulation}" == "xgate" ]] || [[ "$COMPARE_STATES" == "true" ]]; then
                 if [[ "$fileName" == "rho"*".dat" ]] || [[ "$fileName" == "population"*".dat" ]]; then
                   cd ${DIR}
                   echo "- comparing $fileName" 
-                  python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" $tolerance $isBitWise
+                  python3 compare_two_files.py "${simulation}/base/$fileName" "${simulation}/data_out/$fileName" ${TOLERANCE:-$tolerance} $isBitWise
                   if [[ $? -eq 1 ]]; then
                     echo "The $baseOutput files are different from the baseline." >> $simulationLogFile 2>&1
                     testFailed=true
@@ -0,0 +1,10 @@
+NUM_PARALLEL_PROCESSORS=0
+testNames=(primal)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/xgate_batch_penalty
+    $QUANDARY xgate_batch_penalty.cfg 
+    cd ${DIR}
+    ;;
+esac
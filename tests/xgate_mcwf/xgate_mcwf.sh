@@ -0,0 +1,11 @@
+NUM_PARALLEL_PROCESSORS=0
+COMPARE_STATES=true
+testNames=(primal)
+case $subTestNum in
+  1)
+    rm -rf data_out
+    cd ${DIR}/xgate_mcwf
+    $QUANDARY xgate_mcwf.cfg 
+    cd ${DIR}
+    ;;
+esac
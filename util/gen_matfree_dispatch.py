@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+#
+# Generates the compile-time specializations of the matrix-free RHS kernels
+# (myMatMult_matfree<n0,n1,...>, myMatMultTranspose_matfree<n0,n1,...>) and the runtime
+# dispatch for 2, 3, 4, and 5 oscillators. The output is included at the end of src/mastereq.cpp.
+# Level combinations that are not listed here use the runtime-strided kernel, which the MasterEq
+# constructor selects through matfree_isSpecialized(), so the dispatch itself has no fallback.
+#
+# Usage: python gen_matfree_dispatch.py <outfile> <levelset> <levelset> ...
+#        where each levelset is a comma-separated list of number of levels per oscillator, e.g.
+#        python gen_matfree_dispatch.py build/matfree_dispatch.hpp 3,20 2,2 2,3,4 2,2,2,2,2
+# The output file is only rewritten if its content changes, so that changing the level sets
+# recompiles mastereq.cpp, but rerunning make with the same level sets does not.
+
+import sys
+import os
+
+def parse_levelsets(args):
+    levelsets = {2: [], 3: [], 4: [], 5: []}
+    for arg in args:
+        try:
+            nlevels = [int(n) for n in arg.split(',') if n.strip() != '']
+        except ValueError:
+            sys.exit("ERROR in matfree level set '%s': expected comma-separated integers, e.g. 3,20" % arg)
+        if len(nlevels) not in levelsets:
+            sys.exit("ERROR in matfree level set '%s': compile-time kernels exist for 2, 3, 4, or 5 oscillators only." % arg)
+        if min(nlevels) < 1:
+            sys.exit("ERROR in matfree level set '%s': number of levels must be positive." % arg)
+        if nlevels not in levelsets[len(nlevels)]:
+            levelsets[len(nlevels)].append(nlevels)
+    return levelsets
+
+def dispatch(name, nosc, levelsets):
+    lines = []
+    if levelsets:
+        lines.append("int %s_%dOsc(Mat RHS, Vec x, Vec y){" % (name, nosc))
+    else:
+        lines.append("int %s_%dOsc(Mat /*RHS*/, Vec /*x*/, Vec /*y*/){" % (name, nosc))
+    if levelsets:
+        lines.append("  /* Get the shell context */")
+        lines.append("  MatShellCtx *shellctx;")
+        lines.append("  MatShellGetContext(RHS, (void**) &shellctx);")
+        for k in range(nosc):
+            lines.append("  int n%d = shellctx->nlevels[%d];" % (k, k))
+    for i, nlevels in enumerate(levelsets):
+        cond = " && ".join("n%d==%d" % (k, n) for k, n in enumerate(nlevels))
+        tmpl = ",".join(str(n) for n in nlevels)
+        lines.append("  %s (%s) return %s<%s>(RHS, x, y);" % ("if     " if i == 0 else "else if", cond, name, tmpl))
+    # Unlisted levels never get here: MasterEq picks the runtime-strided kernel for them, see matfree_isSpecialized()
+    lines.append("  printf(\"ERROR: No compile-time matrix-free kernel for these levels, see MATFREE_LEVELS in the Makefile.\\n\");")
+    lines.append("  exit(1);")
+    lines.append("}")
+    return lines
+
+def specialized(levelsets):
+    lines = []
+    lines.append("bool matfree_isSpecialized(const std::vector<int>& nlevels){")
+    for nosc in sorted(levelsets):
+        for nlevels in levelsets[nosc]:
+            cond = " && ".join("nlevels[%d]==%d" % (k, n) for k, n in enumerate(nlevels))
+            lines.append("  if (nlevels.size()==%d && %s) return true;" % (nosc, cond))
+    lines.append("  return false;")
+    lines.append("}")
+    return lines
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit("Usage: python gen_matfree_dispatch.py <outfile> <levelset> <levelset> ...")
+    outfile = sys.argv[1]
+    levelsets = parse_levelsets(sys.argv[2:])
+
+    lines = []
+    lines.append("/* Generated by util/gen_matfree_dispatch.py from the MATFREE_LEVELS list in the Makefile. Do not edit. */")
+    lines.append("")
+    for nosc in sorted(levelsets):
+        lines.append("/* --- %d Oscillator cases --- */" % nosc)
+        lines += dispatch("myMatMult_matfree", nosc, levelsets[nosc])
+        lines += dispatch("myMatMultTranspose_matfree", nosc, levelsets[nosc])
+        lines.append("")
+    lines += specialized(levelsets)
+    content = "\n".join(lines) + "\n"
+
+    # Only touch the file if the level sets changed
+    if os.path.exists(outfile) and open(outfile).read() == content:
+        return
+    outdir = os.path.dirname(outfile)
+    if outdir != '' and not os.path.exists(outdir):
+        os.makedirs(outdir)
+    f = open(outfile, 'w')
+    f.write(content)
+    f.close()
+
+if __name__ == "__main__":
+    main()